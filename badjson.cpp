@@ -220,6 +220,7 @@ namespace badjson
 
                     if (results.error)
                     {
+                        delete front; // and all it links to. The caller only gets the error.
                         results.i += i; // atw fixme???
                         return results;
                     }
@@ -275,7 +276,7 @@ namespace badjson
             i += runeLength;
             if (str + i < endP)
             {
-                runeLength = utf8::DecodeRuneLengthInString((const unsigned char *)(str + i), endP - str);
+                runeLength = utf8::DecodeRuneLengthInString((const unsigned char *)(str + i), endP - (str + i));
                 if (runeLength == 1)
                     r = str[i];
                 else
@@ -332,6 +333,10 @@ namespace badjson
             {
                 // We don't care for the case when it's [ contents ] but not { contents }
                 // so we'll just change it to return the contents
+                // and free the parent. Only a Parent has children so the cast is safe.
+                Parent *parent = static_cast<Parent *>(results.segment);
+                parent->children = nullptr;
+                delete parent;
                 results.segment = children;
             }
         }
@@ -0,0 +1,180 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// The miniBroker as a program, to point clients and benchmarks at.
+// g++ -O2 -std=c++17 -I.. ../*.cpp broker_main.cpp -o minibroker
+// ./minibroker [port] [unix socket path] [-uring] [-shards n] [-trace file] [-capture file]
+// It prints the rates every 5 seconds.
+// -uring runs it on io_uring. Build with -DMQTT5NANO_IO_URING for that.
+// -shards n runs it on n threads with a shardedBroker. 0 is one per core.
+// -trace file writes the packet timelines there as Chrome trace json when it quits.
+// Build with -DMQTT5NANO_TRACE for that.
+// -capture file records every packet that comes in, for replay. See replay/replay_main.cpp.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shardedBroker.h"
+#include "trace.h"
+
+using namespace knotfree;
+
+volatile bool quit = false;
+
+void onSignal(int)
+{
+    quit = true;
+}
+
+void report(brokerStats &s, brokerStats &last, double secs)
+{
+    printf("in %.0f msg/s out %.0f msg/s %.1f MB/s in %.1f MB/s out queued %llu dropped %llu conns %llu\n",
+           (s.publishesIn - last.publishesIn) / secs, (s.publishesOut - last.publishesOut) / secs,
+           (s.bytesIn - last.bytesIn) / secs / 1e6, (s.bytesOut - last.bytesOut) / secs / 1e6,
+           s.queued, s.dropped, s.connects - s.disconnects);
+    last = s;
+}
+
+void writeTrace(const char *path)
+{
+#if defined(MQTT5NANO_TRACE)
+    if (path && dumpTrace(path))
+    {
+        printf("can't write %s\n", path);
+    }
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    bool uring = false;
+    int shards = -1; // -1 is the plain miniBroker on this thread.
+    int port = 1883;
+    const char *path = "/tmp/minibroker.sock";
+    const char *tracePath = 0;
+    const char *capturePath = 0;
+    int positional = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-uring"))
+            uring = true;
+        else if (!strcmp(argv[i], "-shards") && i + 1 < argc)
+            shards = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-trace") && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (!strcmp(argv[i], "-capture") && i + 1 < argc)
+            capturePath = argv[++i];
+        else if (positional++ == 0)
+            port = atoi(argv[i]);
+        else
+            path = argv[i];
+    }
+#if !defined(MQTT5NANO_TRACE)
+    if (tracePath)
+    {
+        printf("built without MQTT5NANO_TRACE\n");
+        return 1;
+    }
+#endif
+    captureFile capture;
+    if (capturePath && capture.open(capturePath))
+    {
+        printf("can't write %s\n", capturePath);
+        return 1;
+    }
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    if (shards >= 0)
+    {
+        shardedBroker *sharded = new shardedBroker(shards);
+        if (sharded->listenTCP(port) || sharded->listenUnix(path))
+        {
+            printf("can't listen on port %d or %s\n", port, path);
+            return 1;
+        }
+        for (int i = 0; capturePath && i < sharded->count; i++)
+        {
+            sharded->shards[i]->broker->capture = &capture;
+        }
+        sharded->start();
+        printf("minibroker with %d shards on 127.0.0.1:%d and %s\n", sharded->count, sharded->tcpPort, path);
+        brokerStats last = sharded->totals();
+        while (!quit)
+        {
+            sleep(5);
+            brokerStats now = sharded->totals();
+            report(now, last, 5);
+        }
+        delete sharded;
+        writeTrace(tracePath);
+        return 0;
+    }
+
+    ioLoop *loop = 0;
+    if (uring)
+    {
+#if defined(MQTT5NANO_IO_URING)
+        uringLoop *u = new uringLoop;
+        if (u->setup(4096, 0, 0))
+        {
+            printf("can't set up io_uring\n");
+            return 1;
+        }
+        loop = u;
+#else
+        printf("built without MQTT5NANO_IO_URING\n");
+        return 1;
+#endif
+    }
+    miniBroker *broker = new miniBroker(loop);
+    if (broker->listenTCP(port))
+    {
+        printf("can't listen on port %d\n", port);
+        return 1;
+    }
+    if (broker->listenUnix(path))
+    {
+        printf("can't listen on %s\n", path);
+        return 1;
+    }
+    if (capturePath)
+    {
+        broker->capture = &capture;
+    }
+    printf("minibroker on 127.0.0.1:%d and %s\n", broker->tcpPort, path);
+
+    brokerStats last = broker->stats;
+    time_t lastTime = time(0);
+    while (!quit)
+    {
+        broker->pollOnce(100);
+        time_t now = time(0);
+        if (now - lastTime < 5)
+        {
+            continue;
+        }
+        report(broker->stats, last, double(now - lastTime));
+        lastTime = now;
+    }
+    delete broker;
+    delete loop;
+    writeTrace(tracePath);
+    return 0;
+}
@@ -0,0 +1,231 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "capture.h"
+
+#if !defined(ARDUINO)
+
+#include <string.h>
+#include <time.h>
+
+namespace knotfree
+{
+    static const char captureMagic[captureHeaderSize] = {'m', 'q', '5', 'c', 'a', 'p', 1, 0};
+
+    captureFile::captureFile()
+    {
+        f = 0;
+        packets = 0;
+        bytes = 0;
+    }
+
+    captureFile::~captureFile()
+    {
+        close();
+    }
+
+    bool captureFile::open(const char *path)
+    {
+        bool fail = false;
+        close();
+        f = fopen(path, "wb");
+        if (f == 0 || fwrite(captureMagic, 1, captureHeaderSize, f) != captureHeaderSize)
+        {
+            fail = true;
+        }
+        return fail;
+    }
+
+    bool captureFile::close()
+    {
+        bool fail = false;
+        if (f)
+        {
+            fail = fclose(f) != 0;
+            f = 0;
+        }
+        return fail;
+    }
+
+    static void putLittle(unsigned char *p, unsigned long long val, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            p[i] = val >> (i * 8);
+        }
+    }
+
+    static unsigned long long getLittle(const char *p, int n)
+    {
+        unsigned long long val = 0;
+        for (int i = 0; i < n; i++)
+        {
+            val |= (unsigned long long)(unsigned char)p[i] << (i * 8);
+        }
+        return val;
+    }
+
+    bool captureFile::record(slice packet, unsigned char direction)
+    {
+        bool fail = false;
+        if (f == 0)
+        {
+            fail = true;
+            return fail;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        unsigned char header[captureRecordHeaderSize] = {0};
+        putLittle(header, ts.tv_sec * 1000000000ULL + ts.tv_nsec, 8);
+        putLittle(header + 8, packet.size(), 4);
+        header[12] = direction;
+        // the lock keeps the header and the packet together when the shards share a file.
+        flockfile(f);
+        fail |= fwrite(header, 1, sizeof(header), f) != sizeof(header);
+        fail |= (int)fwrite(packet.base + packet.start, 1, packet.size(), f) != packet.size();
+        packets++;
+        bytes += packet.size();
+        funlockfile(f);
+        return fail;
+    }
+
+    captureDrain::captureDrain(drain *next, captureFile *file, char *buffer, int size)
+        : next(next), file(file), pending(buffer, size)
+    {
+        skipped = 0;
+        have = 0;
+        skip = 0;
+    }
+
+    bool captureDrain::writeByte(char c)
+    {
+        take(slice(&c, 0, 1));
+        return next->writeByte(c);
+    }
+
+    bool captureDrain::write(slice s)
+    {
+        take(s);
+        return next->write(s);
+    }
+
+    // packetLength is the whole length of the packet at the front of s. It's 0 if the
+    // remaining length isn't all there and -1 if it's malformed.
+    static long long packetLength(const char *s, int len)
+    {
+        unsigned int body = 0;
+        for (int i = 1; i < len; i++)
+        {
+            unsigned char c = s[i];
+            body |= (unsigned int)(c & 0x7F) << ((i - 1) * 7);
+            if (c < 128)
+            {
+                return i + 1 + (long long)body;
+            }
+            if (i == 4)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // take adds s to what's pending and records the packets that are whole.
+    void captureDrain::take(slice s)
+    {
+        while (s.empty() == false)
+        {
+            if (skip)
+            {
+                int amt = (unsigned int)s.size() < skip ? s.size() : skip;
+                skip -= amt;
+                s.start += amt;
+                continue;
+            }
+            int amt = s.size();
+            if (amt > pending.end - have)
+            {
+                amt = pending.end - have;
+            }
+            memcpy(pending.base + have, s.base + s.start, amt);
+            have += amt;
+            s.start += amt;
+            while (have)
+            {
+                long long len = packetLength(pending.base, have);
+                if (len < 0)
+                {
+                    have = 0; // not mqtt. Give up on what's here.
+                    break;
+                }
+                if (len == 0 || len > have)
+                {
+                    if (len > pending.end)
+                    { // too big. Drop it and pass over the rest.
+                        skipped++;
+                        skip = len - have;
+                        have = 0;
+                    }
+                    break;
+                }
+                if (file)
+                {
+                    file->record(slice(pending.base, 0, len), captureOut);
+                }
+                memmove(pending.base, pending.base + len, have - len);
+                have -= len;
+            }
+            if (have == pending.end)
+            {
+                have = 0; // a buffer too small for even the length.
+            }
+        }
+    }
+
+    bool captureReader::start(const char *data, long long len)
+    {
+        bool fail = false;
+        base = data;
+        size = len;
+        pos = captureHeaderSize;
+        if (len < captureHeaderSize || memcmp(data, captureMagic, captureHeaderSize) != 0)
+        {
+            fail = true;
+        }
+        return fail;
+    }
+
+    bool captureReader::next(slice &packet, unsigned long long &ns, unsigned char &direction)
+    {
+        if (size - pos < captureRecordHeaderSize)
+        {
+            return false;
+        }
+        const char *h = base + pos;
+        unsigned long long len = getLittle(h + 8, 4);
+        if (len > 65535 || (unsigned long long)(size - pos - captureRecordHeaderSize) < len)
+        {
+            return false; // our slices stop at 64k
+        }
+        ns = getLittle(h, 8);
+        direction = h[12];
+        packet = slice(h + captureRecordHeaderSize, 0, (int)len);
+        pos += captureRecordHeaderSize + len;
+        return true;
+    }
+
+} // namespace knotfree
+
+#endif
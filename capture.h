@@ -0,0 +1,100 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "slices.h"
+
+// A capture is a file of whole mqtt packets as they were on the wire, each with when it was
+// seen and which way it went, so real traffic can be run through the parser again offline.
+// See replay/replay_main.cpp.
+//
+// The file is an 8 byte header, mq5cap, the version 1 and a 0, and then the records.
+// A record is a 16 byte header and the packet:
+//   8 bytes  the time in ns since 1970, little endian
+//   4 bytes  the packet length, little endian
+//   1 byte   the direction: captureOut or captureIn
+//   3 bytes  0
+//   the packet, the first byte and the remaining length included.
+
+#if !defined(ARDUINO)
+
+#include <stdio.h>
+
+namespace knotfree
+{
+    const int captureHeaderSize = 8;
+    const int captureRecordHeaderSize = 16;
+    const unsigned char captureOut = 0;
+    const unsigned char captureIn = 1;
+
+    // captureFile writes the records. record may be called from many threads.
+    // All return true if failed.
+    struct captureFile
+    {
+        FILE *f;
+        unsigned long long packets;
+        unsigned long long bytes;
+
+        captureFile();
+        ~captureFile();
+
+        bool open(const char *path);
+        bool close();
+
+        // record writes one whole packet. For what comes in call it with what getPacket popped,
+        // from the first byte to the end of the body.
+        bool record(slice packet, unsigned char direction);
+    };
+
+    // captureDrain passes what's written on to next and records every whole packet in file.
+    // The output functions write a packet in pieces so they're put together in buffer,
+    // which is the caller's. Packets bigger than it go through but aren't recorded.
+    struct captureDrain : drain
+    {
+        drain *next;
+        captureFile *file;
+        unsigned long long skipped; // packets too big to record
+
+        captureDrain(drain *next, captureFile *file, char *buffer, int size);
+
+        bool writeByte(char c) override;
+        using drain::write;
+        bool write(slice s) override;
+
+    private:
+        sink pending;
+        int have;
+        unsigned int skip; // bytes left of a packet that's too big
+        void take(slice s);
+    };
+
+    // captureReader walks the records of a capture that's in memory, eg. mmapped.
+    struct captureReader
+    {
+        const char *base;
+        long long size;
+        long long pos;
+
+        // start checks the header. Returns true if failed.
+        bool start(const char *data, long long len);
+
+        // next gets the next record. Returns false at the end or if the rest is broken.
+        bool next(slice &packet, unsigned long long &ns, unsigned char &direction);
+    };
+
+} // namespace knotfree
+
+#endif
@@ -15,12 +15,14 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "commandLine.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <string.h> // has strcmp
 
 namespace knotfree
 {
-    Command *head = 0;
+    Command *head = 0; // every Command. Only the constructors write it.
 
     Command::Command(const char *name, const char *decription) : name(name), description(decription)
     {
@@ -40,6 +42,8 @@ namespace knotfree
 
     void process(badjson::Segment *words, drain &out)
     {
+        MQTT5NANO_METRICS_DISPATCH();
+        MQTT5NANO_TRACE_SCOPE(traceDispatch, 0);
         char wordBuffer[64];
         char *cP = &wordBuffer[0];
         int amt = sizeof(wordBuffer);
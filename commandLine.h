@@ -19,7 +19,11 @@
 
 namespace knotfree
 {
-    struct Command // the virtual base class. Aka the interface.
+    // Command is the virtual base class. Aka the interface.
+    // A Command puts itself on one global list when it's constructed, so make them
+    // globals. They are then all registered before main or setup and the list is only read after.
+    // Constructing one later, while another thread is in process, is not safe.
+    struct Command
     {
         Command *next;
         const char *name = "";
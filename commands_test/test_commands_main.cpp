@@ -18,7 +18,7 @@
 //#include <vector>
 //#include <stdio.h>
 #include <string>
-//#include <string.h> // has strcmp
+#include <string.h> // has strcmp and strlen
 
 #include "commandLine.h"
 
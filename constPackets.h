@@ -0,0 +1,207 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "mqtt5nano.h"
+
+#if __cplusplus >= 201402L
+
+namespace knotfree
+{
+    // constPacket is a packet that the compiler encoded. Declare it static constexpr and
+    // the bytes are in rodata (flash on the esp32), with nothing to build at run time and
+    // no assembly buffer on the stack. Use it for the packets that never change:
+    //
+    //   static constexpr auto ping = pingReqPacket();
+    //   static constexpr auto hello = connectPacket("dev1", "user", "secret", 60);
+    //   static constexpr auto sub = subscribePacket("dev1/cmd/#", 1, 1);
+    //   ping.writeTo(&out);
+    //
+    // The strings must be literals so their lengths are known. They're encoded the same
+    // as outputConnect, outputSubscribe and outputPubOrSub would with no properties.
+    // It needs C++14.
+    template <int N>
+    struct constPacket
+    {
+        char bytes[N];
+
+        constexpr int length() const
+        {
+            return N;
+        }
+        slice asSlice() const
+        {
+            return slice(bytes, 0, N);
+        }
+        bool writeTo(drain *destination) const
+        {
+            return destination->write(asSlice());
+        }
+    };
+
+    namespace constBuild
+    {
+        constexpr int varLenBytes(int n)
+        {
+            return n < 128 ? 1 : n < 16384 ? 2 : n < 2097152 ? 3 : 4;
+        }
+        // total is the whole packet for this remaining length.
+        constexpr int total(int remaining)
+        {
+            return 1 + varLenBytes(remaining) + remaining;
+        }
+        constexpr int connectRemaining(int client, int user, int pass)
+        {
+            // protocol name, version, flags, keep alive, no props and then the strings.
+            return 6 + 1 + 1 + 2 + 1 + 2 + client + (user >= 0 ? 2 + user : 0) + (pass >= 0 ? 2 + pass : 0);
+        }
+        constexpr int subscribeRemaining(int filter)
+        {
+            return 2 + 1 + 2 + filter + 1;
+        }
+        constexpr int publishRemaining(int topic, int payload)
+        {
+            return 2 + topic + 1 + payload;
+        }
+
+        template <int N>
+        constexpr int putByte(constPacket<N> &p, int at, int b)
+        {
+            p.bytes[at] = char(b);
+            return at + 1;
+        }
+        template <int N>
+        constexpr int putTwo(constPacket<N> &p, int at, int val)
+        {
+            p.bytes[at] = char(val >> 8);
+            p.bytes[at + 1] = char(val);
+            return at + 2;
+        }
+        template <int N>
+        constexpr int putVarLen(constPacket<N> &p, int at, int val)
+        {
+            do
+            {
+                int b = val & 0x7F;
+                val >>= 7;
+                p.bytes[at++] = char(val ? b | 0x80 : b);
+            } while (val);
+            return at;
+        }
+        template <int N>
+        constexpr int putBytes(constPacket<N> &p, int at, const char *s, int len)
+        {
+            for (int i = 0; i < len; i++)
+            {
+                p.bytes[at++] = s[i];
+            }
+            return at;
+        }
+        template <int N>
+        constexpr int putString(constPacket<N> &p, int at, const char *s, int len)
+        {
+            return putBytes(p, putTwo(p, at, len), s, len);
+        }
+
+        template <int N>
+        constexpr constPacket<N> connect(const char *client, int clientLen, const char *user, int userLen,
+                                         const char *pass, int passLen, unsigned short keepAlive, bool cleanStart)
+        {
+            constPacket<N> p{};
+            int at = putByte(p, 0, CtrlConn * 16);
+            at = putVarLen(p, at, connectRemaining(clientLen, userLen, passLen));
+            at = putString(p, at, "MQTT", 4);
+            at = putByte(p, at, 5);
+            at = putByte(p, at, (userLen >= 0 ? 0x80 : 0) | (passLen >= 0 ? 0x40 : 0) | (cleanStart ? 0x02 : 0));
+            at = putTwo(p, at, keepAlive);
+            at = putByte(p, at, 0); // no props
+            at = putString(p, at, client, clientLen);
+            if (userLen >= 0)
+            {
+                at = putString(p, at, user, userLen);
+            }
+            if (passLen >= 0)
+            {
+                at = putString(p, at, pass, passLen);
+            }
+            return p;
+        }
+    } // namespace constBuild
+
+    constexpr constPacket<2> pingReqPacket()
+    {
+        return constPacket<2>{{char(CtrlPingReq * 16), 0}};
+    }
+
+    // disconnectPacket is the normal disconnect, reason 0 and no props.
+    constexpr constPacket<2> disconnectPacket()
+    {
+        return constPacket<2>{{char(CtrlDisConn * 16), 0}};
+    }
+
+    // connectPacket with no user name or password.
+    template <int C>
+    constexpr constPacket<constBuild::total(constBuild::connectRemaining(C - 1, -1, -1))>
+    connectPacket(const char (&clientID)[C], unsigned short keepAlive = 60, bool cleanStart = true)
+    {
+        return constBuild::connect<constBuild::total(constBuild::connectRemaining(C - 1, -1, -1))>(
+            clientID, C - 1, "", -1, "", -1, keepAlive, cleanStart);
+    }
+
+    // connectPacket with fixed credentials, eg. from the config.
+    template <int C, int U, int P>
+    constexpr constPacket<constBuild::total(constBuild::connectRemaining(C - 1, U - 1, P - 1))>
+    connectPacket(const char (&clientID)[C], const char (&userName)[U], const char (&password)[P],
+                  unsigned short keepAlive = 60, bool cleanStart = true)
+    {
+        return constBuild::connect<constBuild::total(constBuild::connectRemaining(C - 1, U - 1, P - 1))>(
+            clientID, C - 1, userName, U - 1, password, P - 1, keepAlive, cleanStart);
+    }
+
+    // subscribePacket is a Subscribe for one filter.
+    template <int F>
+    constexpr constPacket<constBuild::total(constBuild::subscribeRemaining(F - 1))>
+    subscribePacket(const char (&filter)[F], unsigned short packetID, char qos = 0)
+    {
+        using namespace constBuild;
+        constPacket<total(subscribeRemaining(F - 1))> p{};
+        int at = putByte(p, 0, CtrlSubscribe * 16 + 2);
+        at = putVarLen(p, at, subscribeRemaining(F - 1));
+        at = putTwo(p, at, packetID);
+        at = putByte(p, at, 0); // no props
+        at = putString(p, at, filter, F - 1);
+        putByte(p, at, qos);
+        return p;
+    }
+
+    // publishPacket is a qos 0 Publish that never changes, eg. an online message.
+    template <int T, int P>
+    constexpr constPacket<constBuild::total(constBuild::publishRemaining(T - 1, P - 1))>
+    publishPacket(const char (&topic)[T], const char (&payload)[P], bool retain = false)
+    {
+        using namespace constBuild;
+        constPacket<total(publishRemaining(T - 1, P - 1))> p{};
+        int at = putByte(p, 0, CtrlPublish * 16 + (retain ? 1 : 0));
+        at = putVarLen(p, at, publishRemaining(T - 1, P - 1));
+        at = putString(p, at, topic, T - 1);
+        at = putByte(p, at, 0); // no props
+        putBytes(p, at, payload, P - 1);
+        return p;
+    }
+
+} // namespace knotfree
+
+#endif
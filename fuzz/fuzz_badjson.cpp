@@ -0,0 +1,50 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// fuzz_badjson feeds anything to badjson::Chop and walks what it makes.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "badjson.h"
+
+using namespace badjson;
+
+static void walk(Segment *s, sink &out, int depth)
+{
+    for (; s != nullptr && depth < 100; s = s->Next())
+    {
+        s->Raw(out);
+        walk(s->GetChildren(), out, depth + 1);
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > 65535)
+    {
+        return 0;
+    }
+    char *text = new char[size ? size : 1];
+    memcpy(text, data, size);
+    ResultsTriplette res = Chop(text, (int)size);
+    char tmp[1024];
+    sink out(tmp, sizeof(tmp));
+    walk(res.segment, out, 0);
+    delete res.segment;
+    delete[] text;
+    return 0;
+}
@@ -0,0 +1,56 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// fuzz_base64 feeds anything to base64::decodeAll and hex::decode, and checks that
+// base64 and hex decode what they encode.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "knotbase64.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > 4096)
+    {
+        return 0;
+    }
+    int max = (int)size * 2 + 8;
+    char *dest = new char[max];
+    char *back = new char[max];
+    base64::decodeAll(data, (int)size, dest, (int)size);
+    hex::decode(data, (int)size, dest, (int)size / 2 + 1);
+
+    int n = base64::encode(data, (int)size, dest, max);
+    int m = base64::decode((const unsigned char *)dest, n, back, max);
+    if (m != (int)size || memcmp(back, data, size) != 0)
+    {
+        printf("base64 round trip of %d bytes came back as %d\n", (int)size, m);
+        abort();
+    }
+    n = hex::encode(data, (int)size, dest, max);
+    m = hex::decode((const unsigned char *)dest, n, back, max);
+    if (m != (int)size || memcmp(back, data, size) != 0)
+    {
+        printf("hex round trip of %d bytes came back as %d\n", (int)size, m);
+        abort();
+    }
+    delete[] dest;
+    delete[] back;
+    return 0;
+}
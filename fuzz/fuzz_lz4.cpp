@@ -0,0 +1,68 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// fuzz_lz4 feeds anything to lz4Decompress and checks that it decodes what lz4Compress
+// encodes, with a small and a big match table.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "payloadCodec.h"
+
+using namespace knotfree;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > 16384)
+    {
+        return 0;
+    }
+    // copies that are exactly the size so reading or writing past them is caught.
+    char *in = new char[size ? size : 1];
+    memcpy(in, data, size);
+    slice src(in, 0, (int)size);
+    int max = (int)size * 2 + 16;
+    char *dest = new char[max];
+    sink d(dest, max);
+    lz4Decompress(src, d);
+
+    static unsigned short table[1 << 12];
+    int bound = (int)size + (int)size / 255 + 16;
+    char *block = new char[bound];
+    for (int bits = 8; bits <= 12; bits += 4)
+    {
+        sink c(block, bound);
+        if (lz4Compress(src, c, table, bits))
+        {
+            printf("lz4 compress of %d bytes didn't fit %d\n", (int)size, bound);
+            abort();
+        }
+        char *back = new char[size ? size : 1];
+        sink b(back, (int)size);
+        if (lz4Decompress(slice(block, 0, c.start), b) || b.start != size || memcmp(back, data, size) != 0)
+        {
+            printf("lz4 round trip of %d bytes with %d bits came back as %d\n", (int)size, bits, (int)b.start);
+            abort();
+        }
+        delete[] back;
+    }
+    delete[] block;
+    delete[] dest;
+    delete[] in;
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// The fuzz targets are libFuzzer style. With clang they build as fuzzers:
+//   clang++ -g -O1 -fsanitize=fuzzer,address,undefined -std=c++17 -I.. ../*.cpp fuzz_parse.cpp -o fuzz_parse
+//   ./fuzz_parse corpus/
+// Without libFuzzer, eg. with g++ or afl-g++, link them with this main instead:
+//   g++ -g -O1 -fsanitize=address,undefined -std=c++17 -I.. ../*.cpp fuzz_parse.cpp fuzz_main.cpp -o fuzz_parse
+//   ./fuzz_parse [files]     runs each file once, which is what afl wants.
+//   ./fuzz_parse -n 1000000  runs a million random mutations of some good packets, json and base64.
+// The same goes for fuzz_badjson.cpp, fuzz_base64.cpp and fuzz_lz4.cpp.
+// roundtrip_main.cpp is the encode, parse and compare test.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// some good inputs to start from.
+#define SEED(s) {s, sizeof(s) - 1}
+static const struct
+{
+    const char *bytes;
+    int size;
+} seeds[] = {
+    // a qos 1 publish with a response topic and a user prop
+    SEED("\x32\x1d\x00\x03\x61\x2f\x62\x01\x2c\x0b\x08\x00\x01\x72\x26\x00\x01\x6b\x00\x01\x76\x01\x02\x03\x68\x65\x6c\x6c\x6f\x21\x21"),
+    // connect
+    SEED("\x10\x11\x00\x04MQTT\x05\x02\x00\x1e\x00\x00\x04\x64\x65\x76\x31"),
+    // subscribe
+    SEED("\x82\x0b\x00\x07\x02\x0b\x05\x00\x03\x61\x2f\x23\x01"),
+    // suback, puback, connack
+    SEED("\x90\x04\x00\x07\x00\x01\x40\x02\x00\x05\x20\x06\x00\x00\x03\x21\x00\x0a"),
+    SEED("get time {\"a\":[1,2,\"three\"],b:'4'} 5"),
+    SEED("SGVsbG8gd29ybGQgZnJvbSBiYXNlNjQ="),
+    SEED("0123456789abcdef0123456789abcdef0123456789abcdef0123"),
+    // an lz4 block of 20 a's: a literal, a match 1 back and the last 5 literals.
+    SEED("\x1a\x61\x01\x00\x50\x61\x61\x61\x61\x61"),
+};
+
+static uint64_t rnd = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next()
+{
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    return rnd;
+}
+
+static int mutate(uint8_t *data, int size, int max)
+{
+    int count = 1 + next() % 8;
+    for (int i = 0; i < count; i++)
+    {
+        int at = size ? next() % size : 0;
+        switch (next() % 5)
+        {
+        case 0: // flip a bit
+            if (size)
+                data[at] ^= 1 << (next() % 8);
+            break;
+        case 1: // a random byte
+            if (size)
+                data[at] = next();
+            break;
+        case 2: // insert one
+            if (size < max)
+            {
+                memmove(data + at + 1, data + at, size - at);
+                data[at] = next();
+                size++;
+            }
+            break;
+        case 3: // cut the end off
+            size = size ? next() % size : 0;
+            break;
+        case 4: // an interesting byte
+        {
+            static const uint8_t interesting[] = {0, 1, 0x7F, 0x80, 0xFF, '"', '{', '[', '='};
+            if (size)
+                data[at] = interesting[next() % sizeof(interesting)];
+            break;
+        }
+        }
+    }
+    return size;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && !strcmp(argv[1], "-n"))
+    {
+        long n = atol(argv[2]);
+        static uint8_t data[4096];
+        clock_t start = clock();
+        for (long i = 0; i < n; i++)
+        {
+            int which = next() % (sizeof(seeds) / sizeof(seeds[0]));
+            int size = seeds[which].size;
+            memcpy(data, seeds[which].bytes, size);
+            size = mutate(data, size, sizeof(data));
+            LLVMFuzzerTestOneInput(data, size);
+        }
+        printf("%ld runs in %.1f s\n", n, double(clock() - start) / CLOCKS_PER_SEC);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *f = fopen(argv[i], "rb");
+        if (f == 0)
+        {
+            printf("can't open %s\n", argv[i]);
+            return 1;
+        }
+        static uint8_t data[1 << 16];
+        size_t size = fread(data, 1, sizeof(data), f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    return 0;
+}
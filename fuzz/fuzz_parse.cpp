@@ -0,0 +1,88 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// fuzz_parse feeds anything to the framer, mqttPacketPieces::parse, getProperty, userPropertyView,
+// findMessageExpiry and connectOptions::parse.
+// The sanitizers are what find the bugs. See fuzz_main.cpp for how to build it.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "mqtt5nano.h"
+
+using namespace knotfree;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > 65535)
+    {
+        return 0;
+    }
+    // a copy that's exactly the size so reading past it is caught.
+    char *buffer = new char[size ? size : 1];
+    memcpy(buffer, data, size);
+    slice pos(buffer, 0, (int)size);
+
+    mqttPacketPieces pieces;
+    unsigned char firstByte;
+    slice body;
+    while (getPacket(pos, firstByte, body) == frameOk)
+    {
+        if ((firstByte >> 4) == CtrlConn)
+        {
+            connectOptions options;
+            options.parse(body);
+            continue;
+        }
+        if (pieces.parse(body, firstByte, body.size()))
+        {
+            continue;
+        }
+        if (pieces.packetType == CtrlSubscribe || pieces.packetType == CtrlUnSub)
+        {
+            subscribeFilter filters[4];
+            pieces.getFilters(filters, 4);
+        }
+        slice props = pieces.props;
+        int key;
+        slice value;
+        while (getProperty(props, key, value) == false)
+        {
+            propertyInt(key, value);
+        }
+        slice pairs[2 * 8];
+        unsigned short index[16];
+        userPropertyView view(pairs, 8, index, 16);
+        if (view.load(pieces.props) == false && view.count)
+        {
+            view.find(view.key(view.count - 1));
+            view.find("k");
+        }
+        pieces.findKey("k");
+        slice expiry = findMessageExpiry(pieces.props);
+        if (expiry.base)
+        {
+            propertyInt(propKeyMessageExpiryInterval, expiry);
+        }
+    }
+    // and the whole thing as one body with every type.
+    for (int type = 0; type < 16; type++)
+    {
+        pieces.parse(slice(buffer, 0, (int)size), (unsigned char)(type << 4) | (size ? buffer[0] & 15 : 0), (int)size);
+    }
+    delete[] buffer;
+    return 0;
+}
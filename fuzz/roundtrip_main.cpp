@@ -0,0 +1,471 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// roundtrip makes random packets with the library's encoders and checks three things:
+// the bytes are the same as a plain reference encoder written straight from the mqtt 5 spec,
+// parse gets back every field, and encoding what was parsed gives the same bytes again.
+// It's the proof that a faster encoder or parser is byte exact before it goes in.
+//   g++ -O2 -std=c++17 -I.. ../*.cpp roundtrip_main.cpp -o roundtrip -lpthread
+//   ./roundtrip [cases] [seed]
+// It prints FAIL and the case on a mismatch and the rate at the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+#include "mqtt5nano.h"
+
+using namespace knotfree;
+using std::string;
+
+static unsigned long long rnd;
+
+static unsigned next(unsigned n)
+{
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    return (unsigned)(rnd >> 16) % n;
+}
+
+static string randomString(int maxLen, bool binary)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789/_-";
+    string s;
+    int len = next(maxLen + 1);
+    for (int i = 0; i < len; i++)
+    {
+        s += binary ? char(next(256)) : chars[next(sizeof(chars) - 1)];
+    }
+    return s;
+}
+
+static slice sl(const string &s)
+{
+    return slice(s.data(), 0, (int)s.size());
+}
+
+static string str(slice s)
+{
+    return s.base ? string(s.base + s.start, s.size()) : string();
+}
+
+// the reference encoder. Slow and obvious on purpose.
+
+static void refVarInt(string &out, unsigned val)
+{
+    do
+    {
+        unsigned char b = val & 0x7F;
+        val >>= 7;
+        out += char(val ? b | 0x80 : b);
+    } while (val);
+}
+
+static void refInt2(string &out, unsigned val)
+{
+    out += char(val >> 8);
+    out += char(val);
+}
+
+static void refStr(string &out, const string &s)
+{
+    refInt2(out, s.size());
+    out += s;
+}
+
+static string refPacket(unsigned char first, const string &body)
+{
+    string out(1, char(first));
+    refVarInt(out, body.size());
+    return out + body;
+}
+
+struct testCase
+{
+    string topic;
+    string payload;
+    string respTopic;
+    string correlation;
+    string keyVal[8];
+    int pairs;
+    int qos;
+    int id;
+    bool retain;
+    bool dup;
+    unsigned expiry;
+};
+
+static unsigned long long failures = 0;
+
+static void fail(const char *what, unsigned long long n)
+{
+    failures++;
+    if (failures < 20)
+    {
+        printf("FAIL %s in case %llu\n", what, n);
+    }
+}
+
+static char assembly[4096];
+static char wire[4096];
+static char wire2[4096];
+
+static void publishCase(unsigned long long n)
+{
+    testCase t;
+    t.topic = randomString(40, false);
+    if (t.topic.empty())
+    {
+        t.topic = "t";
+    }
+    t.payload = randomString(next(4) ? 32 : 1000, true);
+    t.respTopic = next(2) ? randomString(20, false) : "";
+    t.correlation = next(2) ? randomString(16, true) : "";
+    t.pairs = next(5);
+    for (int i = 0; i < t.pairs * 2; i += 2)
+    {
+        t.keyVal[i] = "k" + randomString(10, false);
+        t.keyVal[i + 1] = randomString(10, true);
+    }
+    t.qos = next(3);
+    t.id = t.qos ? 1 + next(65535) : 0;
+    t.retain = next(2);
+    t.dup = t.qos && next(2);
+    t.expiry = next(2) ? 0 : (next(0x10000) << 16 | next(0x10000)) >> next(32);
+
+    mqttPacketPieces p;
+    p.reset();
+    p.packetType = CtrlPublish;
+    p.QoS = t.qos;
+    p.PacketID = t.id;
+    p.Retain = t.retain;
+    p.Dup = t.dup;
+    p.MessageExpiry = t.expiry;
+    p.TopicName = sl(t.topic);
+    p.Payload = sl(t.payload);
+    if (!t.respTopic.empty())
+    {
+        p.RespTopic = sl(t.respTopic);
+    }
+    if (!t.correlation.empty())
+    {
+        p.CorrelationData = sl(t.correlation);
+    }
+    for (int i = 0; i < t.pairs * 2; i++)
+    {
+        p.UserKeyVal[i] = sl(t.keyVal[i]);
+    }
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    if (p.outputPubOrSub(sink(assembly, sizeof(assembly)), &out))
+    {
+        fail("publish encode", n);
+        return;
+    }
+    slice encoded = out.dest.getWritten();
+    if (p.outputSize() != encoded.size())
+    {
+        fail("publish outputSize", n);
+    }
+
+    string props;
+    if (t.expiry)
+    {
+        props += char(propKeyMessageExpiryInterval);
+        refInt2(props, t.expiry >> 16);
+        refInt2(props, t.expiry & 0xFFFF);
+    }
+    if (!t.respTopic.empty())
+    {
+        props += char(propKeyRespTopic);
+        refStr(props, t.respTopic);
+    }
+    if (!t.correlation.empty())
+    {
+        props += char(propKeyCorrelationData);
+        refStr(props, t.correlation);
+    }
+    for (int i = 0; i < t.pairs * 2; i += 2)
+    {
+        props += char(propKeyUserProps);
+        refStr(props, t.keyVal[i]);
+        refStr(props, t.keyVal[i + 1]);
+    }
+    string body;
+    refStr(body, t.topic);
+    if (t.qos)
+    {
+        refInt2(body, t.id);
+    }
+    refVarInt(body, props.size());
+    body += props + t.payload;
+    if (str(encoded) != refPacket(0x30 | (t.dup ? 8 : 0) | (t.qos << 1) | (t.retain ? 1 : 0), body))
+    {
+        fail("publish bytes differ from the reference", n);
+        return;
+    }
+
+    slice pos = encoded;
+    unsigned char firstByte;
+    slice packetBody;
+    mqttPacketPieces q;
+    if (getPacket(pos, firstByte, packetBody) != frameOk || pos.size() != 0 ||
+        q.parse(packetBody, firstByte, packetBody.size()))
+    {
+        fail("publish parse", n);
+        return;
+    }
+    if (str(q.TopicName) != t.topic || str(q.Payload) != t.payload || q.QoS != t.qos || q.PacketID != t.id ||
+        q.Retain != t.retain || q.Dup != t.dup || q.MessageExpiry != t.expiry ||
+        str(q.RespTopic) != t.respTopic || str(q.CorrelationData) != t.correlation)
+    {
+        fail("publish fields", n);
+        return;
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        if (str(q.UserKeyVal[i]) != t.keyVal[i])
+        {
+            fail("publish user props", n);
+            return;
+        }
+    }
+    // again from what was parsed.
+    sinkDrain again;
+    again.dest = sink(wire2, sizeof(wire2));
+    q.packetType = CtrlPublish;
+    if (q.outputPubOrSub(sink(assembly, sizeof(assembly)), &again) || str(again.dest.getWritten()) != str(encoded))
+    {
+        fail("publish encode of parse", n);
+    }
+}
+
+static void subscribeCase(unsigned long long n)
+{
+    string filters[4];
+    subscribeFilter f[4];
+    int count = 1 + next(4);
+    bool sub = next(2);
+    for (int i = 0; i < count; i++)
+    {
+        filters[i] = randomString(30, false) + (next(4) ? "" : "/#");
+        f[i].Filter = sl(filters[i]);
+        f[i].QoS = next(3);
+        f[i].NoLocal = next(2);
+        f[i].RetainAsPublished = next(2);
+        f[i].RetainHandling = next(3);
+    }
+    int subID = next(2) ? 1 + next(2000000) : 0;
+    int id = 1 + next(65535);
+
+    mqttPacketPieces p;
+    p.reset();
+    p.PacketID = id;
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    bool failed = sub ? p.outputSubscribe(sink(assembly, sizeof(assembly)), &out, f, count, subID)
+                      : p.outputUnsubscribe(sink(assembly, sizeof(assembly)), &out, f, count);
+    if (failed)
+    {
+        fail("subscribe encode", n);
+        return;
+    }
+    slice encoded = out.dest.getWritten();
+
+    string props;
+    if (sub && subID)
+    {
+        props += char(propKeySubID);
+        refVarInt(props, subID);
+    }
+    string body;
+    refInt2(body, id);
+    refVarInt(body, props.size());
+    body += props;
+    for (int i = 0; i < count; i++)
+    {
+        refStr(body, filters[i]);
+        if (sub)
+        {
+            body += char(f[i].QoS | (f[i].NoLocal ? 4 : 0) | (f[i].RetainAsPublished ? 8 : 0) | (f[i].RetainHandling << 4));
+        }
+    }
+    if (str(encoded) != refPacket(sub ? 0x82 : 0xA2, body))
+    {
+        fail(sub ? "subscribe bytes differ from the reference" : "unsubscribe bytes differ from the reference", n);
+        return;
+    }
+
+    slice pos = encoded;
+    unsigned char firstByte;
+    slice packetBody;
+    mqttPacketPieces q;
+    subscribeFilter got[4];
+    if (getPacket(pos, firstByte, packetBody) != frameOk || q.parse(packetBody, firstByte, packetBody.size()) ||
+        q.PacketID != id || q.getFilters(got, 4) != count)
+    {
+        fail("subscribe parse", n);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (str(got[i].Filter) != filters[i] ||
+            (sub && (got[i].QoS != f[i].QoS || got[i].NoLocal != f[i].NoLocal ||
+                     got[i].RetainAsPublished != f[i].RetainAsPublished || got[i].RetainHandling != f[i].RetainHandling)))
+        {
+            fail("subscribe filters", n);
+            return;
+        }
+    }
+    slice qprops = q.props;
+    int key;
+    slice value;
+    unsigned gotID = 0;
+    while (getProperty(qprops, key, value) == false)
+    {
+        if (key == propKeySubID)
+        {
+            gotID = propertyInt(key, value);
+        }
+    }
+    if (gotID != (unsigned)(sub ? subID : 0))
+    {
+        fail("subscribe id", n);
+    }
+}
+
+static void ackCase(unsigned long long n)
+{
+    unsigned char type = CtrlPubAck + next(4);
+    int id = next(65536);
+    unsigned char reason = next(2) ? reasonSuccess : 0x80 + next(32);
+    mqttPacketPieces p;
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    p.outputAck(sink(assembly, sizeof(assembly)), &out, type, id, reason);
+    string body;
+    refInt2(body, id);
+    if (reason != reasonSuccess)
+    {
+        body += char(reason);
+    }
+    if (str(out.dest.getWritten()) != refPacket(type << 4 | (type == CtrlPubRel ? 2 : 0), body))
+    {
+        fail("ack bytes differ from the reference", n);
+        return;
+    }
+    slice pos = out.dest.getWritten();
+    unsigned char firstByte;
+    slice packetBody;
+    mqttPacketPieces q;
+    if (getPacket(pos, firstByte, packetBody) != frameOk || q.parse(packetBody, firstByte, packetBody.size()) ||
+        q.packetType != type || q.PacketID != id || (reason != reasonSuccess && q.ReasonCode != reason))
+    {
+        fail("ack parse", n);
+    }
+}
+
+static void connectCase(unsigned long long n)
+{
+    string id = randomString(23, false);
+    string user = randomString(12, false);
+    string pass = randomString(12, true);
+    string willTopic = "w" + randomString(20, false);
+    string willPayload = randomString(40, true);
+    connectOptions o;
+    o.ClientID = sl(id);
+    if (next(2))
+    {
+        o.UserName = sl(user);
+        o.Password = sl(pass);
+    }
+    o.KeepAlive = next(65536);
+    o.CleanStart = next(2);
+    o.SessionExpiry = next(2) ? next(100000) : 0;
+    bool will = next(2);
+    if (will)
+    {
+        o.WillTopic = sl(willTopic);
+        o.WillPayload = sl(willPayload);
+        o.WillQoS = next(3);
+        o.WillRetain = next(2);
+    }
+    mqttPacketPieces p;
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    if (p.outputConnect(sink(assembly, sizeof(assembly)), &out, o))
+    {
+        fail("connect encode", n);
+        return;
+    }
+    slice pos = out.dest.getWritten();
+    unsigned char firstByte;
+    slice packetBody;
+    connectOptions q;
+    if (getPacket(pos, firstByte, packetBody) != frameOk || firstByte != 0x10 || q.parse(packetBody))
+    {
+        fail("connect parse", n);
+        return;
+    }
+    if (str(q.ClientID) != id || str(q.UserName) != str(o.UserName) || str(q.Password) != str(o.Password) ||
+        q.KeepAlive != o.KeepAlive || q.CleanStart != o.CleanStart || q.SessionExpiry != o.SessionExpiry ||
+        str(q.WillTopic) != str(o.WillTopic) || str(q.WillPayload) != str(o.WillPayload) ||
+        (will && (q.WillQoS != o.WillQoS || q.WillRetain != o.WillRetain)))
+    {
+        fail("connect fields", n);
+        return;
+    }
+    sinkDrain again;
+    again.dest = sink(wire2, sizeof(wire2));
+    if (p.outputConnect(sink(assembly, sizeof(assembly)), &again, q) ||
+        str(again.dest.getWritten()) != str(out.dest.getWritten()))
+    {
+        fail("connect encode of parse", n);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long cases = argc > 1 ? atoll(argv[1]) : 1000000;
+    rnd = argc > 2 ? atoll(argv[2]) : time(0);
+    rnd |= 1;
+    printf("roundtrip %llu cases with seed %llu\n", cases, rnd);
+    clock_t start = clock();
+    for (unsigned long long n = 0; n < cases; n++)
+    {
+        switch (n & 3)
+        {
+        case 0:
+            publishCase(n);
+            break;
+        case 1:
+            subscribeCase(n);
+            break;
+        case 2:
+            ackCase(n);
+            break;
+        case 3:
+            connectCase(n);
+            break;
+        }
+    }
+    double secs = double(clock() - start) / CLOCKS_PER_SEC;
+    printf("%llu failures. %.0f cases a minute\n", failures, secs > 0 ? cases / secs * 60 : 0);
+    return failures != 0;
+}
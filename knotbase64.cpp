@@ -30,28 +30,27 @@ namespace base64
     const unsigned char *encodeURL = (unsigned char *)("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_");
     //                   encodeStd =                    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-    unsigned char decodeTable[256];
-
-    void initdecodetable()
-    {
-        if (decodeTable['E'] == (unsigned char)4)
-        {
-            return;
-        }
-        for (int i = 0; i < 256; i++)
-        {
-            decodeTable[i] = char(-1);
-        }
-        for (int i = 0; i < 64; i++)
-        {
-            int c = encodeURL[i];
-            c = c & 0xFF;
-            *(decodeTable + c) = (unsigned char)(i);
-        }
-        // also, decode the other older crappy type:
-        decodeTable['-'] = 62;
-        decodeTable['/'] = 63;
-    }
+    // decodeTable is the value of every char, 0xFF if it's not base64.
+    // It's the url alphabet and also '/' for the older kind. It's const and not built
+    // on the first decode so threads can share it and it stays in flash.
+    static const unsigned char decodeTable[256] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0x3F,
+        0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+        0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0x3F,
+        0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    };
 
     // encode the bytes from src[0] to src[srcLen] into dest.
     // dest has a size of dest_max which must be greater than src_len*4/3
@@ -112,7 +111,6 @@ namespace base64
     // GIGO.
     int decode(const unsigned char *src, int srcLen, char *dest, int destMax)
     {
-        initdecodetable();
 
         int srci = 0;
         int dsti = 0;
@@ -298,7 +296,6 @@ namespace base64
     int decodeAll(const unsigned char *src, int srcLen, char *dest, int destMax)
     {
         int destPos = 0; // return this
-        initdecodetable();
         int max1 = 0;
         int max2 = 0;
         bool washex = false;
@@ -391,32 +388,32 @@ namespace utf8
         {
             return 2;
         }
-        if (s[0] == 0xE0 // excluding overlongs
+        if (len >= 3 && s[0] == 0xE0 // excluding overlongs
             && s[1] >= 0xA0 && s[1] <= 0xBF && s[2] >= 0x80 && s[2] <= 0xBF)
         {
             return 3;
         }
-        if (((0xE1 <= s[0] && s[0] <= 0xEC) || s[0] == 0xEE || s[0] == 0xEF) // straight 3-byte
+        if (len >= 3 && ((0xE1 <= s[0] && s[0] <= 0xEC) || s[0] == 0xEE || s[0] == 0xEF) // straight 3-byte
             && s[1] >= 0x80 && s[1] <= 0xBF && s[2] >= 0x80 && s[2] <= 0xBF)
         {
             return 3;
         }
-        if (s[0] == 0xED // excluding surrogates
+        if (len >= 3 && s[0] == 0xED // excluding surrogates
             && s[1] >= 0x80 && s[1] <= 0x9F && s[2] >= 0x80 && s[2] <= 0xBF)
         {
             return 3;
         }
-        if (s[0] == 0xF0 // planes 1-3
+        if (len >= 4 && s[0] == 0xF0 // planes 1-3
             && s[1] >= 0x90 && s[1] <= 0xBF && s[2] >= 0x80 && s[2] <= 0xBF && s[3] >= 0x80 && s[3] <= 0xBF)
         {
             return 4;
         }
-        if (s[0] >= 0xF1 && s[0] <= 0xF3 // planes 4-15
+        if (len >= 4 && s[0] >= 0xF1 && s[0] <= 0xF3 // planes 4-15
             && s[1] >= 0x80 && s[1] <= 0xBF && s[2] >= 0x80 && s[2] <= 0xBF && s[3] >= 0x80 && s[3] <= 0xBF)
         {
             return 4;
         }
-        if (s[0] == 0xF4 // plane 16
+        if (len >= 4 && s[0] == 0xF4 // plane 16
             && s[1] >= 0x80 && s[1] <= 0x8F && s[2] >= 0x80 && s[2] <= 0xBF && s[3] >= 0x80 && s[3] <= 0xBF)
         {
             return 4;
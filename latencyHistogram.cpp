@@ -0,0 +1,125 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "latencyHistogram.h"
+
+namespace knotfree
+{
+    static int highBit(unsigned long long v)
+    {
+        int bit = 0;
+        while (v >>= 1)
+        {
+            bit++;
+        }
+        return bit;
+    }
+
+    static int bucketOf(unsigned long long value)
+    {
+        if (value < latencySubBuckets)
+        {
+            return int(value);
+        }
+        int bit = highBit(value); // 5 or more
+        int sub = int(value >> (bit - 5)) & (latencySubBuckets - 1);
+        int i = (bit - 4) * latencySubBuckets + sub;
+        return i < latencyBuckets ? i : latencyBuckets - 1;
+    }
+
+    // the middle of the bucket.
+    static unsigned long long valueOf(int i)
+    {
+        if (i < latencySubBuckets)
+        {
+            return i;
+        }
+        int bit = i / latencySubBuckets + 4;
+        unsigned long long low = (unsigned long long)(latencySubBuckets + i % latencySubBuckets) << (bit - 5);
+        unsigned long long width = 1ULL << (bit - 5);
+        return low + width / 2;
+    }
+
+    void latencyHistogram::reset()
+    {
+        for (int i = 0; i < latencyBuckets; i++)
+        {
+            counts[i] = 0;
+        }
+        total = 0;
+        sum = 0;
+        min = ~0ULL;
+        max = 0;
+    }
+
+    void latencyHistogram::record(unsigned long long value)
+    {
+        counts[bucketOf(value)]++;
+        total++;
+        sum += value;
+        if (value < min)
+        {
+            min = value;
+        }
+        if (value > max)
+        {
+            max = value;
+        }
+    }
+
+    void latencyHistogram::merge(const latencyHistogram &other)
+    {
+        for (int i = 0; i < latencyBuckets; i++)
+        {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        if (other.min < min)
+        {
+            min = other.min;
+        }
+        if (other.max > max)
+        {
+            max = other.max;
+        }
+    }
+
+    unsigned long long latencyHistogram::percentile(double p)
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        unsigned long long want = (unsigned long long)(total * p / 100.0 + 0.5);
+        if (want == 0)
+        {
+            want = 1;
+        }
+        unsigned long long seen = 0;
+        for (int i = 0; i < latencyBuckets; i++)
+        {
+            seen += counts[i];
+            if (seen >= want)
+            {
+                unsigned long long v = valueOf(i);
+                // don't go outside what we actually saw.
+                return v < min ? min : v > max ? max : v;
+            }
+        }
+        return max;
+    }
+
+} // namespace knotfree
@@ -0,0 +1,52 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+namespace knotfree
+{
+    // Values under 32 get their own bucket. After that every power of two
+    // is cut into 32 buckets so a bucket is never more than about 3% wide.
+    const int latencySubBuckets = 32;
+    const int latencyBuckets = 60 * latencySubBuckets;
+
+    // latencyHistogram counts values, eg. nanoseconds, so we can get the percentiles
+    // without keeping the values. It's all fixed size and record is a few instructions.
+    struct latencyHistogram
+    {
+        unsigned long long counts[latencyBuckets];
+        unsigned long long total;
+        unsigned long long sum;
+        unsigned long long min;
+        unsigned long long max;
+
+        latencyHistogram()
+        {
+            reset();
+        }
+        void reset();
+        void record(unsigned long long value);
+        // merge adds in the counts from another one, eg. from another thread.
+        void merge(const latencyHistogram &other);
+        // percentile is the value that p percent (0 to 100) of the values are at or under.
+        // It's the middle of the bucket so it's close but not exact.
+        unsigned long long percentile(double p);
+        unsigned long long mean()
+        {
+            return total ? sum / total : 0;
+        }
+    };
+
+} // namespace knotfree
@@ -0,0 +1,501 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// loadgen opens a lot of connections to a broker, publishes on some and subscribes on the rest,
+// and reports the throughput and the latency percentiles.
+// Everything on the wire goes through outputConnect, outputPubOrSub and parse so it's
+// a benchmark of the library as much as of the broker.
+//
+// g++ -O2 -std=c++17 -I.. ../*.cpp loadgen_main.cpp -o loadgen -lpthread
+// ./loadgen -broker -c 200 -p 100 -t 10 -r 50000 -s 64 -q 1 -d 10
+//
+//  -c n       connections (100)
+//  -p n       how many of them publish (half). The rest subscribe.
+//  -t n       topics (10). Subscriber i takes topic i % n so the fan out is subscribers / topics.
+//  -r n       publishes per second in total. 0 is as fast as it will go. (10000)
+//  -s n       payload bytes, at least 8 for the timestamp. (64)
+//  -q n       qos for publish and subscribe. (0)
+//  -d n       seconds to run. (10)
+//  -port n    the broker on 127.0.0.1 (1883)
+//  -unix path the broker on a unix socket instead.
+//  -broker    start a miniBroker in this process and use that.
+//  -shards n  with -broker, run it on n threads with a shardedBroker. (1)
+//  -uring     drive the connections with io_uring instead of epoll. Build with -DMQTT5NANO_IO_URING.
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#include "latencyHistogram.h"
+#include "mqtt5nano.h"
+#include "shardedBroker.h"
+#include "socketIO.h"
+
+using namespace knotfree;
+
+const int loadBufferSize = 16 * 1024;
+
+struct loadConn
+{
+    socketConn sock;
+    bool publisher;
+    bool ready; // ConnAck and, for subscribers, the SubAck are in.
+    int topic;
+    unsigned short nextID;
+    sendWindow window;
+    char in[loadBufferSize];
+    char out[loadBufferSize];
+
+    loadConn() : sock(in, loadBufferSize, out, loadBufferSize)
+    {
+    }
+};
+
+struct loadConfig
+{
+    int connections = 100;
+    int publishers = -1;
+    int topics = 10;
+    int rate = 10000;
+    int size = 64;
+    int qos = 0;
+    int seconds = 10;
+    int port = 1883;
+    const char *unixPath = 0;
+    bool broker = false;
+    int shards = 1;
+    bool uring = false;
+};
+
+loadConfig config;
+loadConn *conns; // one block so io_uring can register it.
+ioLoop *loop;
+bool closed;
+char assembly[1024];
+char topicNames[1000][32];
+char payload[16 * 1024];
+latencyHistogram latency;
+unsigned long long sent, received, blocked, bytesOut, bytesIn;
+
+unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int openSocket()
+{
+    int fd;
+    if (config.unixPath)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, config.unixPath, sizeof(addr.sun_path) - 1);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+void ack(loadConn &c, unsigned char type, unsigned short packetID)
+{
+    mqttPacketPieces p;
+    p.outputAck(sink(assembly, sizeof(assembly)), &c.sock.out, type, packetID, reasonSuccess);
+}
+
+void onPacket(loadConn &c, mqttPacketPieces &p)
+{
+    switch (p.packetType)
+    {
+    case CtrlConnAck:
+        c.window.limits.load(p);
+        if (c.publisher)
+        {
+            c.ready = true;
+        }
+        else
+        {
+            subscribeFilter filter(topicNames[c.topic], config.qos);
+            p.PacketID = 1;
+            p.outputSubscribe(sink(assembly, sizeof(assembly)), &c.sock.out, &filter, 1, 0);
+        }
+        break;
+    case CtrlSubAck:
+        c.ready = true;
+        break;
+    case CtrlPublish:
+    {
+        unsigned long long then = 0;
+        if (p.Payload.size() >= 8)
+        {
+            memcpy(&then, p.Payload.charPointer(), 8);
+        }
+        latency.record(nowNs() - then);
+        received++;
+        if (p.QoS == 1)
+        {
+            ack(c, CtrlPubAck, p.PacketID);
+        }
+        else if (p.QoS == 2)
+        {
+            ack(c, CtrlPubRecv, p.PacketID);
+        }
+        break;
+    }
+    case CtrlPubRel:
+        ack(c, CtrlPubComp, p.PacketID);
+        break;
+    case CtrlPubRecv:
+        ack(c, CtrlPubRel, p.PacketID);
+        c.window.onPacket(p);
+        break;
+    case CtrlPubAck:
+    case CtrlPubComp:
+        c.window.onPacket(p);
+        break;
+    case CtrlDisConn:
+        printf("disconnected with reason %x\n", p.ReasonCode);
+        break;
+    default:
+        break;
+    }
+}
+
+struct loadHandler : ioHandler
+{
+    void onData(socketConn &sock) override
+    {
+        loadConn &c = *(loadConn *)sock.user;
+        slice pos = sock.in.buffered();
+        int was = pos.start;
+        unsigned char firstByte;
+        slice body;
+        mqttPacketPieces p;
+        frameResult got;
+        while ((got = getPacket(pos, firstByte, body)) == frameOk)
+        {
+            if (p.parse(body, firstByte, body.size()))
+            {
+                got = frameBad;
+                break;
+            }
+            onPacket(c, p);
+        }
+        bytesIn += pos.start - was;
+        sock.in.consume(pos.start - was);
+        if (got == frameBad)
+        {
+            loop->remove(&sock);
+        }
+    }
+    void onClose(socketConn &sock) override
+    {
+        printf("connection %d closed\n", int((loadConn *)sock.user - conns));
+        closed = true;
+    }
+};
+
+// publish one from connection i. Returns true if it couldn't.
+bool publish(int i)
+{
+    bool fail = false;
+    loadConn &c = conns[i];
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.QoS = config.qos;
+    pub.PacketID = c.nextID;
+    pub.TopicName = topicNames[c.topic];
+    unsigned long long now = nowNs();
+    memcpy(payload, &now, 8);
+    pub.Payload = slice(payload, 0, config.size);
+    // straight into the socket's buffer. Only whole packets, the loop sends it all at once.
+    if (pub.outputSize() > c.sock.out.room())
+    {
+        fail = true;
+        return fail;
+    }
+    if (c.window.publish(pub, sink(assembly, sizeof(assembly)), &c.sock.out) != reasonSuccess)
+    {
+        fail = true;
+        return fail;
+    }
+    c.nextID++;
+    if (c.nextID == 0)
+    {
+        c.nextID = 1;
+    }
+    sent++;
+    return fail;
+}
+
+void usage()
+{
+    printf("loadgen [-c conns] [-p publishers] [-t topics] [-r rate] [-s size] [-q qos] [-d seconds] [-port n | -unix path] [-broker] [-shards n] [-uring]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : "0";
+        if (!strcmp(a, "-broker"))
+        {
+            config.broker = true;
+            continue;
+        }
+        if (!strcmp(a, "-uring"))
+        {
+            config.uring = true;
+            continue;
+        }
+        i++;
+        if (!strcmp(a, "-c"))
+            config.connections = atoi(v);
+        else if (!strcmp(a, "-p"))
+            config.publishers = atoi(v);
+        else if (!strcmp(a, "-t"))
+            config.topics = atoi(v);
+        else if (!strcmp(a, "-r"))
+            config.rate = atoi(v);
+        else if (!strcmp(a, "-s"))
+            config.size = atoi(v);
+        else if (!strcmp(a, "-q"))
+            config.qos = atoi(v);
+        else if (!strcmp(a, "-d"))
+            config.seconds = atoi(v);
+        else if (!strcmp(a, "-port"))
+            config.port = atoi(v);
+        else if (!strcmp(a, "-unix"))
+            config.unixPath = v;
+        else if (!strcmp(a, "-shards"))
+            config.shards = atoi(v);
+        else
+            usage();
+    }
+    if (config.publishers < 0)
+    {
+        config.publishers = config.connections / 2;
+    }
+    if (config.size < 8 || config.size > int(sizeof(payload)) || config.topics < 1 || config.topics > 1000 ||
+        config.qos < 0 || config.qos > 2 || config.publishers > config.connections)
+    {
+        usage();
+    }
+    for (int t = 0; t < config.topics; t++)
+    {
+        snprintf(topicNames[t], sizeof(topicNames[t]), "load/%d", t);
+    }
+    memset(payload, 'p', sizeof(payload));
+
+    shardedBroker *broker = 0;
+    if (config.broker)
+    {
+        broker = new shardedBroker(config.shards);
+        if (config.unixPath ? broker->listenUnix(config.unixPath) : broker->listenTCP(0))
+        {
+            printf("can't start the broker\n");
+            return 1;
+        }
+        config.port = broker->tcpPort;
+        broker->start();
+    }
+
+    conns = new loadConn[config.connections];
+    loadHandler handler;
+    if (config.uring)
+    {
+#if defined(MQTT5NANO_IO_URING)
+        uringLoop *u = new uringLoop;
+        if (u->setup(4096, (char *)conns, config.connections * sizeof(loadConn)))
+        {
+            printf("can't set up io_uring\n");
+            return 1;
+        }
+        loop = u;
+#else
+        printf("built without MQTT5NANO_IO_URING\n");
+        return 1;
+#endif
+    }
+    else
+    {
+        loop = new epollLoop;
+    }
+    loop->handler = &handler;
+    for (int i = 0; i < config.connections; i++)
+    {
+        loadConn &c = conns[i];
+        int fd = openSocket();
+        if (fd < 0)
+        {
+            printf("connection %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+        c.sock.setFd(fd);
+        c.sock.user = &c;
+        c.publisher = i < config.publishers;
+        c.ready = false;
+        c.topic = (c.publisher ? i : i - config.publishers) % config.topics;
+        c.nextID = 1;
+        loop->add(&c.sock);
+
+        char id[32];
+        snprintf(id, sizeof(id), "load-%d", i);
+        connectOptions options;
+        options.ClientID = id;
+        options.KeepAlive = 0;
+        mqttPacketPieces p;
+        p.outputConnect(sink(assembly, sizeof(assembly)), &c.sock.out, options);
+    }
+
+    bool started = false;
+    unsigned long long start = nowNs();
+    unsigned long long lastReport = start;
+    unsigned long long lastSent = 0, lastReceived = 0;
+    int next = 0; // the next publisher, round robin.
+    while (true)
+    {
+        unsigned long long now = nowNs();
+        if (!started)
+        {
+            int ready = 0;
+            for (int i = 0; i < config.connections; i++)
+            {
+                ready += conns[i].ready;
+            }
+            if (ready == config.connections)
+            {
+                started = true;
+                start = now;
+                lastReport = now;
+                printf("%d connections ready. %d publishers, %d subscribers, %d topics\n",
+                       config.connections, config.publishers, config.connections - config.publishers, config.topics);
+            }
+            else if (now - start > 10000000000ULL)
+            {
+                printf("only %d of %d connections came up\n", ready, config.connections);
+                return 1;
+            }
+        }
+        if (started && now - start >= config.seconds * 1000000000ULL)
+        {
+            break;
+        }
+        if (started && config.publishers)
+        {
+            // how many are due. With no rate it's whatever fits.
+            long long due = config.rate ? (long long)((now - start) * (double)config.rate / 1e9) - (long long)sent : 1 << 20;
+            int tries = 0;
+            while (due > 0 && tries < config.publishers)
+            {
+                if (publish(next))
+                {
+                    blocked++;
+                    tries++;
+                }
+                else
+                {
+                    due--;
+                    tries = 0;
+                }
+                next = (next + 1) % config.publishers;
+            }
+        }
+        // one poll sends everything that was published and reads the replies.
+        if (loop->poll(config.rate ? 1 : 0) || closed)
+        {
+            return 1;
+        }
+        if (started && now - lastReport >= 1000000000ULL)
+        {
+            double secs = (now - lastReport) / 1e9;
+            printf("sent %.0f/s received %.0f/s p50 %.1fus p99 %.1fus\n", (sent - lastSent) / secs,
+                   (received - lastReceived) / secs, latency.percentile(50) / 1e3, latency.percentile(99) / 1e3);
+            lastReport = now;
+            lastSent = sent;
+            lastReceived = received;
+        }
+    }
+
+    double secs = (nowNs() - start) / 1e9;
+    // publishers take turns so each one's topic counts the same.
+    int subscribers[1000] = {0};
+    for (int i = config.publishers; i < config.connections; i++)
+    {
+        subscribers[conns[i].topic]++;
+    }
+    double fanout = 0;
+    for (int i = 0; i < config.publishers; i++)
+    {
+        fanout += double(subscribers[conns[i].topic]) / config.publishers;
+    }
+    for (int i = 0; i < config.connections; i++)
+    {
+        bytesOut += conns[i].sock.out.totalSent;
+    }
+    printf("\n%d connections, qos %d, %d byte payloads, fan out %.1f\n", config.connections, config.qos, config.size, fanout);
+    printf("sent     %llu (%.0f msg/s)\n", sent, sent / secs);
+    printf("received %llu (%.0f msg/s) of about %.0f\n", received, received / secs, sent * fanout);
+    printf("wire     %.1f MB/s out %.1f MB/s in\n", bytesOut / secs / 1e6, bytesIn / secs / 1e6);
+    printf("blocked  %llu (window or buffer full)\n", blocked);
+    printf("latency  p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus mean %.1fus\n",
+           latency.percentile(50) / 1e3, latency.percentile(99) / 1e3, latency.percentile(99.9) / 1e3,
+           latency.max / 1e3, latency.mean() / 1e3);
+
+    for (int i = 0; i < config.connections; i++)
+    {
+        close(conns[i].sock.fd);
+    }
+    if (broker)
+    {
+        broker->stop();
+        brokerStats stats = broker->totals();
+        printf("broker   %d shards in %llu out %llu queued %llu dropped %llu\n", broker->count, stats.publishesIn,
+               stats.publishesOut, stats.queued, stats.dropped);
+        delete broker;
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "metrics.h"
+
+#if defined(MQTT5NANO_METRICS) && !defined(ARDUINO)
+
+#include <stdio.h>
+#include <string.h>
+
+#include "commandLine.h"
+
+namespace knotfree
+{
+    static std::atomic<threadMetrics *> metricsList(0);
+
+    threadMetrics *addThreadMetrics()
+    {
+        threadMetrics *m = new threadMetrics;
+        m->next = metricsList.load();
+        while (!metricsList.compare_exchange_weak(m->next, m))
+        {
+        }
+        return m;
+    }
+
+    void resetMetrics()
+    {
+        threadMetrics &m = myMetrics();
+        for (int i = 0; i < 16; i++)
+        {
+            m.parsed[i].value.store(0);
+        }
+        m.parseFailures.value.store(0);
+        m.unknownProps.value.store(0);
+        m.skippedProps.value.store(0);
+        m.encoded.value.store(0);
+        m.bytesEncoded.value.store(0);
+        m.writeFailures.value.store(0);
+        m.dispatched.value.store(0);
+        m.parseTime.reset();
+        m.encodeTime.reset();
+        m.dispatchTime.reset();
+    }
+
+    void metricsSnapshot::take()
+    {
+        memset(parsed, 0, sizeof(parsed));
+        parseFailures = unknownProps = skippedProps = 0;
+        encoded = bytesEncoded = writeFailures = dispatched = 0;
+        threads = 0;
+        parseTime.reset();
+        encodeTime.reset();
+        dispatchTime.reset();
+        for (threadMetrics *m = metricsList.load(); m; m = m->next)
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                parsed[i] += m->parsed[i].get();
+            }
+            parseFailures += m->parseFailures.get();
+            unknownProps += m->unknownProps.get();
+            skippedProps += m->skippedProps.get();
+            encoded += m->encoded.get();
+            bytesEncoded += m->bytesEncoded.get();
+            writeFailures += m->writeFailures.get();
+            dispatched += m->dispatched.get();
+            parseTime.merge(m->parseTime);
+            encodeTime.merge(m->encodeTime);
+            dispatchTime.merge(m->dispatchTime);
+            threads++;
+        }
+    }
+
+    static const char *packetNames[16] = {"Reserved", "Connect", "ConnAck", "Publish", "PubAck", "PubRec",
+                                          "PubRel", "PubComp", "Subscribe", "SubAck", "Unsubscribe", "UnsubAck",
+                                          "PingReq", "PingResp", "Disconnect", "Auth"};
+
+    static bool writeHistogram(drain &out, const char *name, latencyHistogram &h)
+    {
+        char tmp[256];
+        snprintf(tmp, sizeof(tmp), ",\"%s\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"mean\":%llu}",
+                 name, h.total, h.percentile(50), h.percentile(99), h.percentile(99.9), h.max, h.mean());
+        return out.write(slice(tmp));
+    }
+
+    bool metricsSnapshot::writeJson(drain &out)
+    {
+        bool fail = false;
+        char tmp[256];
+        fail |= out.write(slice("{\"parsed\":{"));
+        bool first = true;
+        for (int i = 0; i < 16; i++)
+        {
+            if (parsed[i] == 0)
+            {
+                continue;
+            }
+            snprintf(tmp, sizeof(tmp), "%s\"%s\":%llu", first ? "" : ",", packetNames[i], parsed[i]);
+            fail |= out.write(slice(tmp));
+            first = false;
+        }
+        snprintf(tmp, sizeof(tmp),
+                 "},\"parseFailures\":%llu,\"unknownProps\":%llu,\"skippedProps\":%llu,\"encoded\":%llu,"
+                 "\"bytesEncoded\":%llu,\"writeFailures\":%llu,\"dispatched\":%llu,\"threads\":%d",
+                 parseFailures, unknownProps, skippedProps, encoded, bytesEncoded, writeFailures, dispatched, threads);
+        fail |= out.write(slice(tmp));
+        fail |= writeHistogram(out, "parseNs", parseTime);
+        fail |= writeHistogram(out, "encodeNs", encodeTime);
+        fail |= writeHistogram(out, "dispatchNs", dispatchTime);
+        fail |= out.write(slice("}"));
+        return fail;
+    }
+
+    // metricsCommand answers "metrics" with a snapshot as json.
+    struct metricsCommand : Command
+    {
+        metricsCommand() : Command("metrics", "metrics returns the parse, encode and dispatch counts and times as json")
+        {
+        }
+        void execute(badjson::Segment *words, drain &out) override
+        {
+            metricsSnapshot *snap = new metricsSnapshot; // 45k of histograms, not for the stack.
+            snap->take();
+            snap->writeJson(out);
+            delete snap;
+        }
+    };
+
+    metricsCommand theMetricsCommand;
+
+} // namespace knotfree
+
+#endif
@@ -0,0 +1,184 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "slices.h"
+
+// Build with -DMQTT5NANO_METRICS to count what the library does. Without it the
+// MQTT5NANO_METRICS_ macros are empty and there's nothing in the code at all.
+// It's for hosts. On the esp it's always off.
+
+#if defined(MQTT5NANO_METRICS) && !defined(ARDUINO)
+
+#include <atomic>
+#include <time.h>
+
+#include "latencyHistogram.h"
+
+namespace knotfree
+{
+    // metricCounter is only written by the thread it belongs to, so adding is a plain
+    // load and store with no lock, and any thread can read it.
+    struct metricCounter
+    {
+        std::atomic<unsigned long long> value;
+
+        metricCounter()
+        {
+            value.store(0, std::memory_order_relaxed);
+        }
+        void add(unsigned long long n)
+        {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        unsigned long long get() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    // threadMetrics are the counts for one thread. They're made the first time the thread counts
+    // something and go on a list that snapshots read. They're never freed so nothing is lost when a thread ends.
+    struct threadMetrics
+    {
+        metricCounter parsed[16]; // by packet type
+        metricCounter parseFailures;
+        metricCounter unknownProps;  // a property key parse doesn't know. The packet is dropped.
+        metricCounter skippedProps;  // properties parse passed over
+        metricCounter encoded;       // packets
+        metricCounter bytesEncoded;
+        metricCounter writeFailures; // the drain said no
+        metricCounter dispatched;    // commands run by process
+        latencyHistogram parseTime;  // ns
+        latencyHistogram encodeTime;
+        latencyHistogram dispatchTime;
+        threadMetrics *next;
+    };
+
+    threadMetrics *addThreadMetrics();
+
+    inline threadMetrics &myMetrics()
+    {
+        thread_local threadMetrics *mine = 0;
+        if (mine == 0)
+        {
+            mine = addThreadMetrics();
+        }
+        return *mine;
+    }
+
+    inline unsigned long long metricsNow()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // metricsTimer records how long it was alive.
+    struct metricsTimer
+    {
+        latencyHistogram &histogram;
+        unsigned long long start;
+
+        metricsTimer(latencyHistogram &h) : histogram(h), start(metricsNow())
+        {
+        }
+        ~metricsTimer()
+        {
+            histogram.record(metricsNow() - start);
+        }
+    };
+
+    // parseMeter times a parse and counts it by type, or as a failure, by how it ends.
+    struct parseMeter
+    {
+        bool &fail;
+        unsigned char &type;
+        unsigned long long start;
+
+        parseMeter(bool &fail, unsigned char &type) : fail(fail), type(type), start(metricsNow())
+        {
+        }
+        ~parseMeter()
+        {
+            threadMetrics &m = myMetrics();
+            m.parseTime.record(metricsNow() - start);
+            if (fail)
+            {
+                m.parseFailures.add(1);
+            }
+            else
+            {
+                m.parsed[type & 15].add(1);
+            }
+        }
+    };
+
+    inline void countEncoded(bool fail, int bytes)
+    {
+        threadMetrics &m = myMetrics();
+        if (fail)
+        {
+            m.writeFailures.add(1);
+            return;
+        }
+        m.encoded.add(1);
+        m.bytesEncoded.add(bytes);
+    }
+
+    // metricsSnapshot is the sum over every thread. The histograms are copied without a
+    // lock so while threads are running it may be off by the samples that were in flight.
+    struct metricsSnapshot
+    {
+        unsigned long long parsed[16];
+        unsigned long long parseFailures;
+        unsigned long long unknownProps;
+        unsigned long long skippedProps;
+        unsigned long long encoded;
+        unsigned long long bytesEncoded;
+        unsigned long long writeFailures;
+        unsigned long long dispatched;
+        int threads;
+        latencyHistogram parseTime;
+        latencyHistogram encodeTime;
+        latencyHistogram dispatchTime;
+
+        void take();
+        // writeJson writes it as one json object.
+        bool writeJson(drain &out);
+    };
+
+    // resetMetrics zeroes the calling thread's counts. It's for tests.
+    void resetMetrics();
+
+} // namespace knotfree
+
+#define MQTT5NANO_METRICS_PARSE(fail, type) knotfree::parseMeter metricsParseMeter(fail, type)
+#define MQTT5NANO_METRICS_ENCODE() knotfree::metricsTimer metricsEncodeTimer(knotfree::myMetrics().encodeTime)
+#define MQTT5NANO_METRICS_ENCODED(fail, bytes) knotfree::countEncoded(fail, bytes)
+#define MQTT5NANO_METRICS_DISPATCH() knotfree::metricsTimer metricsDispatchTimer(knotfree::myMetrics().dispatchTime); \
+    knotfree::myMetrics().dispatched.add(1)
+#define MQTT5NANO_METRICS_COUNT(field) knotfree::myMetrics().field.add(1)
+
+#else
+
+#define MQTT5NANO_METRICS_PARSE(fail, type)
+#define MQTT5NANO_METRICS_ENCODE()
+#define MQTT5NANO_METRICS_ENCODED(fail, bytes)
+#define MQTT5NANO_METRICS_DISPATCH()
+#define MQTT5NANO_METRICS_COUNT(field)
+
+#endif
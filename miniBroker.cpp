@@ -0,0 +1,992 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "miniBroker.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace knotfree
+{
+    static unsigned long nowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // nowSeconds is the clock for message expiry in the queues and the retained cache.
+    static unsigned int nowSeconds()
+    {
+        return nowMs() / 1000;
+    }
+
+    // fnv-1a
+    static int bucketOf(slice s)
+    {
+        unsigned int h = 2166136261u;
+        for (int i = s.start; i < s.end; i++)
+        {
+            h ^= (unsigned char)s.base[i];
+            h *= 16777619u;
+        }
+        return h % brokerBuckets;
+    }
+
+    // validFilter checks that + is a whole level and # is the whole last level.
+    static bool validFilter(slice filter)
+    {
+        if (filter.empty() || filter.size() >= brokerMaxFilter)
+        {
+            return false;
+        }
+        for (int i = filter.start; i < filter.end; i++)
+        {
+            char c = filter.base[i];
+            if (c != '+' && c != '#')
+            {
+                continue;
+            }
+            bool levelStart = i == filter.start || filter.base[i - 1] == '/';
+            bool levelEnd = i + 1 == filter.end || filter.base[i + 1] == '/';
+            if (!levelStart || !levelEnd)
+            {
+                return false;
+            }
+            if (c == '#' && i + 1 != filter.end)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // splitRest cuts what follows the packet id of a publish into the props and the payload.
+    // Returns true if failed, eg. the props length runs past the end or a property is broken.
+    static bool splitRest(slice rest, slice &props, slice &payload)
+    {
+        bool fail = false;
+        int propLen = rest.getLittleEndianVarLenInt();
+        if (propLen < 0 || propLen > rest.size())
+        {
+            fail = true;
+            return fail;
+        }
+        props = slice(rest.base, rest.start, rest.start + propLen);
+        payload = slice(rest.base, props.end, rest.end);
+        slice walk = props;
+        int key;
+        slice value;
+        while (walk.empty() == false)
+        {
+            if (getProperty(walk, key, value))
+            {
+                fail = true;
+                return fail;
+            }
+        }
+        return fail;
+    }
+
+    miniBroker::miniBroker(ioLoop *givenLoop)
+        : dedupe(dedupeEntries, brokerDedupe),
+          retained(retainedNodes, brokerRetainedNodes, retainedBuckets, brokerRetainedBuckets,
+                   retainedArena, brokerRetainedArena),
+          timers(nowMs())
+    {
+        memset(&stats, 0, sizeof(stats));
+        tcpPort = 0;
+        stopping = false;
+        forwarder = 0;
+        capture = 0;
+        loop = givenLoop ? givenLoop : &ownLoop;
+        loop->handler = this;
+        tcpFd = -1;
+        unixFd = -1;
+        unixPath[0] = 0;
+        matchCounter = 0;
+        assignCounter = 0;
+        for (int i = 0; i < brokerMaxConnections; i++)
+        {
+            conns[i] = 0;
+        }
+        for (int s = 0; s < brokerMaxSessions; s++)
+        {
+            sessions[s].expiryTimer.handler = this;
+            sessions[s].expiryTimer.id = brokerMaxConnections + s;
+        }
+        for (int i = 0; i < brokerMaxSubscriptions; i++)
+        {
+            subs[i].inUse = false;
+        }
+        for (int i = 0; i < brokerBuckets; i++)
+        {
+            buckets[i] = -1;
+        }
+        wildcards = -1;
+    }
+
+    miniBroker::~miniBroker()
+    {
+        for (int i = 0; i < brokerMaxConnections; i++)
+        {
+            if (conns[i])
+            {
+                if (conns[i]->open)
+                {
+                    ::close(conns[i]->sock.fd);
+                }
+                delete conns[i];
+            }
+        }
+        if (tcpFd >= 0)
+        {
+            ::close(tcpFd);
+        }
+        if (unixFd >= 0)
+        {
+            ::close(unixFd);
+            unlink(unixPath);
+        }
+    }
+
+    bool miniBroker::listenTCP(int port)
+    {
+        bool fail = false;
+        tcpFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (tcpFd < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        int one = 1;
+        setsockopt(tcpFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(tcpFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(tcpFd, 128) < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(tcpFd, (struct sockaddr *)&addr, &len);
+        tcpPort = ntohs(addr.sin_port);
+        return loop->listen(tcpFd);
+    }
+
+    bool miniBroker::listenUnix(const char *path)
+    {
+        bool fail = false;
+        struct sockaddr_un addr;
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+            fail = true;
+            return fail;
+        }
+        unixFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (unixFd < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        strcpy(unixPath, path);
+        unlink(path);
+        if (bind(unixFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(unixFd, 128) < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        return loop->listen(unixFd);
+    }
+
+    void miniBroker::run()
+    {
+        while (!stopping)
+        {
+            pollOnce(100);
+        }
+    }
+
+    bool miniBroker::pollOnce(int timeoutMs)
+    {
+        bool fail = loop->poll(timeoutMs);
+        timers.advance(nowMs());
+        return fail;
+    }
+
+    void miniBroker::onAccept(int listenFd, int fd)
+    {
+        if (listenFd == tcpFd)
+        {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        adopt(fd);
+    }
+
+    bool miniBroker::adopt(int fd)
+    {
+        bool fail = false;
+        int c = 0;
+        while (c < brokerMaxConnections && conns[c] && conns[c]->open)
+        {
+            c++;
+        }
+        if (c == brokerMaxConnections)
+        {
+            ::close(fd);
+            stats.dropped++;
+            fail = true;
+            return fail;
+        }
+        if (conns[c] == 0)
+        {
+            conns[c] = new brokerConnection;
+        }
+        brokerConnection &conn = *conns[c];
+        conn.index = c;
+        conn.open = true;
+        conn.connected = false;
+        conn.session = -1;
+        conn.keepAlive = 10; // until the Connect comes
+        conn.lastHeard = nowMs();
+        conn.keepAliveTimer.handler = this;
+        conn.keepAliveTimer.id = c;
+        timers.add(conn.keepAliveTimer, conn.lastHeard + conn.keepAlive * 1500UL + 1);
+        conn.sock.setFd(fd);
+        conn.sock.user = &conn;
+        if (loop->add(&conn.sock))
+        {
+            ::close(fd);
+            conn.open = false;
+            timers.cancel(conn.keepAliveTimer);
+            fail = true;
+        }
+        return fail;
+    }
+
+    void miniBroker::onData(socketConn &sock)
+    {
+        brokerConnection &conn = *(brokerConnection *)sock.user;
+        int c = conn.index;
+        conn.lastHeard = nowMs();
+        slice pos = sock.in.buffered();
+        int was = pos.start;
+        while (!sock.closing)
+        {
+            unsigned char first;
+            slice body;
+            int packetStart = pos.start;
+            frameResult got = getPacket(pos, first, body);
+            if (got == framePartial)
+            {
+                break;
+            }
+            if (capture && got == frameOk)
+            {
+                capture->record(slice(pos.base, packetStart, pos.start), captureIn);
+            }
+            if (got == frameBad || handle(c, first, body))
+            {
+                stats.bad++;
+                close(c, reasonMalformed);
+                return;
+            }
+        }
+        stats.bytesIn += pos.start - was;
+        sock.in.consume(pos.start - was);
+        if (!sock.closing && sock.in.room() == 0)
+        {
+            stats.bad++;
+            close(c, reasonPacketTooLarge);
+        }
+    }
+
+    bool miniBroker::append(int c, slice s)
+    {
+        stats.bytesOut += s.size();
+        return conns[c]->sock.out.write(s);
+    }
+
+    void miniBroker::onDrained(socketConn &sock)
+    {
+        // refill from whatever backed up in the session queue.
+        brokerConnection &conn = *(brokerConnection *)sock.user;
+        if (conn.session < 0)
+        {
+            return;
+        }
+        publishQueue &queue = sessions[conn.session].queue;
+        if (queue.empty() == false)
+        {
+            int was = sock.out.pending();
+            stats.publishesOut += queue.drainTo(&sock.out, sock.out.room(), nowSeconds());
+            stats.bytesOut += sock.out.pending() - was;
+        }
+    }
+
+    void miniBroker::close(int c, unsigned char reason)
+    {
+        brokerConnection &conn = *conns[c];
+        if (conn.sock.closing)
+        {
+            return;
+        }
+        if (reason && conn.connected)
+        {
+            char disconnect[3] = {char(CtrlDisConn * 16), 1, char(reason)};
+            conn.sock.out.len = conn.sock.out.inFlight; // whatever was waiting is lost anyway.
+            append(c, slice(disconnect, 0, 3));
+            conn.sock.out.flush();
+        }
+        loop->remove(&conn.sock);
+        detach(conn); // now, so a session taken over is free for the new one.
+    }
+
+    void miniBroker::onClose(socketConn &sock)
+    {
+        // every way out comes through here, ours and the peer's.
+        brokerConnection &conn = *(brokerConnection *)sock.user;
+        stats.disconnects++;
+        detach(conn);
+        timers.cancel(conn.keepAliveTimer);
+        conn.open = false;
+    }
+
+    void miniBroker::detach(brokerConnection &conn)
+    {
+        if (conn.session >= 0)
+        {
+            brokerSession &sess = sessions[conn.session];
+            sess.conn = -1;
+            if (sess.expiry == 0)
+            {
+                endSession(conn.session);
+            }
+            else if (sess.expiry != 0xFFFFFFFF)
+            {
+                timers.add(sess.expiryTimer, nowMs() + sess.expiry * 1000UL + 1);
+            }
+            conn.session = -1;
+        }
+    }
+
+    void miniBroker::onTimer(timer &t)
+    {
+        if (t.id >= brokerMaxConnections)
+        {
+            int s = t.id - brokerMaxConnections;
+            if (sessions[s].inUse && sessions[s].conn < 0)
+            {
+                endSession(s);
+            }
+            return;
+        }
+        brokerConnection &conn = *conns[t.id];
+        if (!conn.open || conn.sock.closing || conn.keepAlive == 0)
+        {
+            return;
+        }
+        // the spec gives them one and a half keep alives. Whatever came in since
+        // this was set just pushes it out, so nothing has to touch the wheel per packet.
+        unsigned long limit = conn.keepAlive * 1500UL;
+        if (nowMs() - conn.lastHeard > limit)
+        {
+            close(t.id, reasonKeepAliveTimeout);
+            return;
+        }
+        timers.add(t, conn.lastHeard + limit + 1);
+    }
+
+    bool miniBroker::handle(int c, unsigned char firstByte, slice body)
+    {
+        bool fail = false;
+        brokerConnection &conn = *conns[c];
+        stats.packetsIn++;
+        int type = (unsigned char)firstByte >> 4;
+        if (!conn.connected)
+        {
+            if (type != CtrlConn)
+            {
+                fail = true;
+                return fail;
+            }
+            return onConnect(c, body);
+        }
+        if (type == CtrlPublish)
+        {
+            return onPublish(c, firstByte, body);
+        }
+        mqttPacketPieces packet;
+        if (packet.parse(body, firstByte, body.size()))
+        {
+            fail = true;
+            return fail;
+        }
+        sinkDrain out;
+        char buffer[16];
+        out.dest = sink(buffer, sizeof(buffer));
+        brokerSession &sess = sessions[conn.session];
+        switch (type)
+        {
+        case CtrlPubAck:
+        case CtrlPubComp:
+            break; // nothing is kept for resending.
+        case CtrlPubRecv:
+            packet.outputAck(sink(assembly, sizeof(assembly)), &out, CtrlPubRel, packet.PacketID, reasonSuccess);
+            break;
+        case CtrlPubRel:
+            for (int i = 0; i < sess.qos2Count; i++)
+            {
+                if (sess.qos2[i] == packet.PacketID)
+                {
+                    sess.qos2[i] = sess.qos2[--sess.qos2Count];
+                    break;
+                }
+            }
+            packet.outputAck(sink(assembly, sizeof(assembly)), &out, CtrlPubComp, packet.PacketID, reasonSuccess);
+            break;
+        case CtrlSubscribe:
+            return onSubscribe(c, packet);
+        case CtrlUnSub:
+            return onUnsubscribe(c, packet);
+        case CtrlPingReq:
+            out.dest.writeByte(char(CtrlPingResp * 16));
+            out.dest.writeByte(0);
+            break;
+        case CtrlDisConn:
+            close(c, 0);
+            return fail;
+        default:
+            fail = true;
+            return fail;
+        }
+        append(c, slice(out.dest));
+        return fail;
+    }
+
+    int miniBroker::findSession(slice clientID)
+    {
+        for (int s = 0; s < brokerMaxSessions; s++)
+        {
+            if (sessions[s].inUse && clientID.equals(slice(sessions[s].clientID, 0, sessions[s].clientIDLen)))
+            {
+                return s;
+            }
+        }
+        return -1;
+    }
+
+    void miniBroker::endSession(int s)
+    {
+        dedupe.forget(s);
+        for (int i = 0; i < brokerMaxSubscriptions; i++)
+        {
+            if (subs[i].inUse && subs[i].session == s)
+            {
+                removeSubscription(i);
+            }
+        }
+        sessions[s].inUse = false;
+        timers.cancel(sessions[s].expiryTimer);
+    }
+
+    bool miniBroker::onConnect(int c, slice body)
+    {
+        bool fail = false;
+        brokerConnection &conn = *conns[c];
+        connectOptions options;
+        if (options.parse(body))
+        {
+            fail = true;
+            return fail;
+        }
+        slice id = options.ClientID;
+        slice assigned;
+        char assignedBuffer[32];
+        if (id.empty())
+        {
+            snprintf(assignedBuffer, sizeof(assignedBuffer), "mini-%u", ++assignCounter);
+            id = slice(assignedBuffer);
+            assigned = id;
+        }
+        if (id.size() >= int(sizeof(sessions[0].clientID)))
+        {
+            fail = true;
+            return fail;
+        }
+        int s = findSession(id);
+        if (s >= 0 && sessions[s].conn >= 0)
+        {
+            close(sessions[s].conn, reasonSessionTakenOver);
+            s = findSession(id); // it might be gone now.
+        }
+        if (s >= 0 && options.CleanStart)
+        {
+            endSession(s);
+            s = -1;
+        }
+        bool present = s >= 0;
+        if (s < 0)
+        {
+            s = 0;
+            while (s < brokerMaxSessions && sessions[s].inUse)
+            {
+                s++;
+            }
+            if (s == brokerMaxSessions)
+            {
+                fail = true;
+                return fail;
+            }
+            brokerSession &sess = sessions[s];
+            sess.inUse = true;
+            memcpy(sess.clientID, id.base + id.start, id.size());
+            sess.clientIDLen = id.size();
+            sess.nextID = 1;
+            sess.qos2Count = 0;
+            sess.matchStamp = 0;
+            sess.queue = publishQueue(sess.queueBuffer, brokerQueueSize, dropNewest);
+        }
+        brokerSession &sess = sessions[s];
+        sess.conn = c;
+        sess.expiry = options.SessionExpiry;
+        conn.session = s;
+        conn.connected = true;
+        conn.keepAlive = options.KeepAlive;
+        timers.cancel(sess.expiryTimer);
+        if (conn.keepAlive)
+        {
+            timers.add(conn.keepAliveTimer, conn.lastHeard + conn.keepAlive * 1500UL + 1);
+        }
+        else
+        {
+            timers.cancel(conn.keepAliveTimer);
+        }
+        stats.connects++;
+
+        serverLimits limits;
+        limits.MaximumPacketSize = brokerInSize;
+        limits.ReceiveMaximum = brokerMaxQoS2; // so they don't send more qos 2 than we can track.
+        mqttPacketPieces ack;
+        sinkDrain out;
+        char buffer[128];
+        out.dest = sink(buffer, sizeof(buffer));
+        fail = ack.outputConnAck(sink(assembly, sizeof(assembly)), &out, present, reasonSuccess, limits, assigned);
+        fail |= append(c, slice(out.dest));
+        return fail;
+    }
+
+    bool miniBroker::onPublish(int c, unsigned char firstByte, slice body)
+    {
+        bool fail = false;
+        brokerConnection &conn = *conns[c];
+        stats.publishesIn++;
+        char qos = (firstByte >> 1) & 3;
+        bool retain = firstByte & 1;
+        slice pos = body;
+        if (qos == 3 || pos.size() < 2)
+        {
+            fail = true;
+            return fail;
+        }
+        slice topicField = pos; // the topic with its length in front
+        slice topic = pos.getBigFixedLenString();
+        topicField.end = pos.start;
+        slice declared = topicField;
+        if (topic.empty() || declared.getBigFixLenInt() != topic.size() || hasWildcard(topic))
+        {
+            fail = true;
+            return fail;
+        }
+        unsigned short packetID = 0;
+        if (qos)
+        {
+            if (pos.size() < 2)
+            {
+                fail = true;
+                return fail;
+            }
+            packetID = pos.getBigFixLenInt();
+        }
+        slice rest = pos; // the props and the payload go through untouched.
+        slice props;
+        slice payload;
+        if (splitRest(rest, props, payload))
+        {
+            fail = true; // so it's closed as malformed and no one gets it.
+            return fail;
+        }
+
+        int sender = conn.session;
+        brokerSession &from = sessions[sender];
+        sinkDrain out;
+        char buffer[8];
+        out.dest = sink(buffer, sizeof(buffer));
+        mqttPacketPieces ack;
+        if (qos == 1)
+        {
+            ack.outputAck(sink(assembly, sizeof(assembly)), &out, CtrlPubAck, packetID, reasonSuccess);
+            if (dedupe.isDuplicate(sender, packetID, (firstByte & 8) != 0, dedupeTable::fingerprint(topic, payload)))
+            {
+                append(c, slice(out.dest));
+                return fail; // it went out the first time.
+            }
+        }
+        else if (qos == 2)
+        {
+            bool seen = false;
+            for (int i = 0; i < from.qos2Count; i++)
+            {
+                seen |= from.qos2[i] == packetID;
+            }
+            unsigned char reason = reasonSuccess;
+            if (!seen && from.qos2Count == brokerMaxQoS2)
+            {
+                reason = reasonQuotaExceeded;
+            }
+            ack.outputAck(sink(assembly, sizeof(assembly)), &out, CtrlPubRecv, packetID, reason);
+            append(c, slice(out.dest));
+            if (seen || reason != reasonSuccess)
+            {
+                return fail; // it went out the first time.
+            }
+            from.qos2[from.qos2Count++] = packetID;
+            out.dest = sink(buffer, sizeof(buffer));
+        }
+        append(c, slice(out.dest));
+
+        route(sender, qos, retain, topicField, topic, rest);
+        if (forwarder)
+        {
+            forwarder->forward(qos, retain, topicField, rest);
+        }
+        return fail;
+    }
+
+    void miniBroker::inject(char qos, bool retain, slice topicField, slice rest)
+    {
+        slice pos = topicField;
+        slice topic = pos.getBigFixedLenString();
+        route(-1, qos, retain, topicField, topic, rest);
+    }
+
+    // route keeps it if it's retained and gives it to every session that's subscribed.
+    void miniBroker::route(int sender, char qos, bool retain, slice topicField, slice topic, slice rest)
+    {
+        if (retain)
+        {
+            keepRetained(qos, topicField, rest);
+        }
+
+        // Find who wants it. A session gets one copy at the highest qos of its matching subscriptions.
+        unsigned int stamp = ++matchCounter;
+        int matched[brokerMaxSessions];
+        int count = 0;
+        int lists[2] = {buckets[bucketOf(topic)], wildcards};
+        for (int l = 0; l < 2; l++)
+        {
+            for (int i = lists[l]; i != -1; i = subs[i].next)
+            {
+                brokerSubscription &sub = subs[i];
+                if (l == 0 ? !topic.equals(sub.getFilter()) : !topicMatches(sub.getFilter(), topic))
+                {
+                    continue;
+                }
+                if (sub.NoLocal && sub.session == sender)
+                {
+                    continue;
+                }
+                brokerSession &sess = sessions[sub.session];
+                if (sess.matchStamp != stamp)
+                {
+                    sess.matchStamp = stamp;
+                    sess.matchQoS = 0;
+                    sess.matchRetain = false;
+                    matched[count++] = sub.session;
+                }
+                if (sub.QoS > sess.matchQoS)
+                {
+                    sess.matchQoS = sub.QoS;
+                }
+                sess.matchRetain |= retain && sub.RetainAsPublished;
+            }
+        }
+        for (int i = 0; i < count; i++)
+        {
+            brokerSession &sess = sessions[matched[i]];
+            deliver(matched[i], topicField, rest, qos < sess.matchQoS ? qos : sess.matchQoS, sess.matchRetain);
+        }
+    }
+
+    void miniBroker::deliver(int s, slice topicField, slice rest, char qos, bool retain)
+    {
+        brokerSession &sess = sessions[s];
+        char id[2] = {0, 0};
+        slice idField(id, 0, qos ? 2 : 0);
+        if (qos)
+        {
+            id[0] = sess.nextID >> 8;
+            id[1] = sess.nextID;
+            sess.nextID++;
+            if (sess.nextID == 0)
+            {
+                sess.nextID = 1;
+            }
+        }
+        char header[8];
+        sink h(header, sizeof(header));
+        h.writeByte(char(CtrlPublish * 16 + qos * 2 + (retain ? 1 : 0)));
+        h.writeLittleEndianVarLenInt(topicField.size() + idField.size() + rest.size());
+        slice headerField(h);
+        int total = headerField.size() + topicField.size() + idField.size() + rest.size();
+
+        // The fast way is straight into the out buffer. If that's backed up or we're
+        // offline it goes in the queue behind the others so the order is kept.
+        if (sess.conn >= 0 && sess.queue.empty() && conns[sess.conn]->sock.out.room() >= total)
+        {
+            append(sess.conn, headerField);
+            append(sess.conn, topicField);
+            append(sess.conn, idField);
+            append(sess.conn, rest);
+            stats.publishesOut++;
+            return;
+        }
+        if (sess.conn < 0 && qos == 0)
+        {
+            stats.dropped++; // qos 0 isn't kept for offline sessions.
+            return;
+        }
+        sink packet(packetBuffer, sizeof(packetBuffer));
+        packet.writeBytes(headerField.charPointer(), headerField.size());
+        packet.writeBytes(topicField.charPointer(), topicField.size());
+        packet.writeBytes(id, idField.size());
+        packet.writeBytes(rest.charPointer(), rest.size());
+        if (packet.start != total || sess.queue.pushEncoded(slice(packet), nowSeconds()))
+        {
+            stats.dropped++;
+            return;
+        }
+        stats.queued++;
+        if (sess.conn >= 0)
+        {
+            loop->queue(&conns[sess.conn]->sock); // so onDrained comes.
+        }
+    }
+
+    void miniBroker::keepRetained(char qos, slice topicField, slice rest)
+    {
+        slice topic = topicField;
+        topic.start += 2;
+        slice props;
+        slice payload;
+        if (splitRest(rest, props, payload))
+        {
+            stats.dropped++;
+            return;
+        }
+        // an empty payload clears it.
+        if (retained.put(topic, qos, props, payload, nowSeconds()))
+        {
+            stats.dropped++;
+        }
+    }
+
+    void miniBroker::sendRetained(int s, slice filter, char qos)
+    {
+        retainedMatch it = retained.match(filter, nowSeconds());
+        retainedMessage m;
+        while (it.next(m))
+        {
+            deliver(s, m.topicField, m.rest, m.qos < qos ? m.qos : qos, true);
+        }
+    }
+
+    int miniBroker::addSubscription(int session, subscribeFilter &f, bool &existed)
+    {
+        existed = false;
+        int slot = -1;
+        for (int i = 0; i < brokerMaxSubscriptions; i++)
+        {
+            if (!subs[i].inUse)
+            {
+                slot = slot < 0 ? i : slot;
+                continue;
+            }
+            if (subs[i].session == session && f.Filter.equals(subs[i].getFilter()))
+            {
+                slot = i;
+                existed = true;
+                break;
+            }
+        }
+        if (slot < 0)
+        {
+            return slot;
+        }
+        brokerSubscription &sub = subs[slot];
+        sub.QoS = f.QoS;
+        sub.NoLocal = f.NoLocal;
+        sub.RetainAsPublished = f.RetainAsPublished;
+        if (existed)
+        {
+            return slot;
+        }
+        sub.inUse = true;
+        sub.session = session;
+        memcpy(sub.filter, f.Filter.charPointer(), f.Filter.size());
+        sub.filterLen = f.Filter.size();
+        int *list = hasWildcard(f.Filter) ? &wildcards : &buckets[bucketOf(f.Filter)];
+        sub.next = *list;
+        *list = slot;
+        return slot;
+    }
+
+    void miniBroker::removeSubscription(int index)
+    {
+        brokerSubscription &sub = subs[index];
+        slice filter = sub.getFilter();
+        int *link = hasWildcard(filter) ? &wildcards : &buckets[bucketOf(filter)];
+        while (*link != -1)
+        {
+            if (*link == index)
+            {
+                *link = sub.next;
+                break;
+            }
+            link = &subs[*link].next;
+        }
+        sub.inUse = false;
+    }
+
+    // countFilters checks every filter in a Subscribe or Unsubscribe. Returns how many or -1 if it's malformed.
+    static int countFilters(mqttPacketPieces &packet)
+    {
+        slice pos = packet.Payload;
+        subscribeFilter f;
+        int count = 0;
+        while (pos.empty() == false)
+        {
+            if (packet.nextFilter(pos, f))
+            {
+                return -1;
+            }
+            count++;
+        }
+        return count;
+    }
+
+    bool miniBroker::onSubscribe(int c, mqttPacketPieces &packet)
+    {
+        bool fail = false;
+        int s = conns[c]->session;
+        int count = countFilters(packet);
+        if (count <= 0 || count > brokerMaxFilters)
+        {
+            fail = true;
+            return fail;
+        }
+        slice pos = packet.Payload;
+        subscribeFilter f;
+        for (int i = 0; i < count; i++)
+        {
+            packet.nextFilter(pos, f);
+            ackExisted[i] = false;
+            if (!validFilter(f.Filter) || f.QoS > 2)
+            {
+                ackCodes[i] = reasonTopicFilterInvalid;
+            }
+            else if (addSubscription(s, f, ackExisted[i]) < 0)
+            {
+                ackCodes[i] = reasonQuotaExceeded;
+            }
+            else
+            {
+                ackCodes[i] = f.QoS;
+            }
+        }
+        sinkDrain out;
+        out.dest = sink(packetBuffer, sizeof(packetBuffer));
+        fail = packet.outputSubAck(sink(assembly, sizeof(assembly)), &out, CtrlSubAck, slice(ackCodes, 0, count));
+        fail |= append(c, slice(out.dest));
+        // the retained ones come after the SubAck.
+        pos = packet.Payload;
+        for (int i = 0; i < count; i++)
+        {
+            packet.nextFilter(pos, f);
+            if ((unsigned char)ackCodes[i] >= reasonUnspecified)
+            {
+                continue;
+            }
+            if (f.RetainHandling == 0 || (f.RetainHandling == 1 && !ackExisted[i]))
+            {
+                sendRetained(s, f.Filter, f.QoS);
+            }
+        }
+        return fail;
+    }
+
+    bool miniBroker::onUnsubscribe(int c, mqttPacketPieces &packet)
+    {
+        bool fail = false;
+        int s = conns[c]->session;
+        int count = countFilters(packet);
+        if (count <= 0 || count > brokerMaxFilters)
+        {
+            fail = true;
+            return fail;
+        }
+        slice pos = packet.Payload;
+        subscribeFilter f;
+        for (int i = 0; i < count; i++)
+        {
+            packet.nextFilter(pos, f);
+            ackCodes[i] = reasonNoSubExisted;
+            for (int j = 0; j < brokerMaxSubscriptions; j++)
+            {
+                if (subs[j].inUse && subs[j].session == s && f.Filter.equals(subs[j].getFilter()))
+                {
+                    removeSubscription(j);
+                    ackCodes[i] = reasonSuccess;
+                    break;
+                }
+            }
+        }
+        sinkDrain out;
+        out.dest = sink(packetBuffer, sizeof(packetBuffer));
+        fail = packet.outputSubAck(sink(assembly, sizeof(assembly)), &out, CtrlUnSubAck, slice(ackCodes, 0, count));
+        fail |= append(c, slice(out.dest));
+        return fail;
+    }
+
+} // namespace knotfree
+
+#endif
@@ -0,0 +1,219 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "mqtt5nano.h"
+#include "capture.h"
+#include "publishQueue.h"
+#include "retainedCache.h"
+#include "socketIO.h"
+#include "timerWheel.h"
+
+#include <atomic>
+
+#if defined(__linux__)
+
+namespace knotfree
+{
+    // miniBroker is a small MQTT 5 broker so we can test and benchmark the library
+    // against itself over localhost without a real broker or the network.
+    // It is one thread with an ioLoop (epoll, or io_uring), TCP on 127.0.0.1 and a unix socket.
+    // It does Connect, Subscribe, Unsubscribe, Publish qos 0, 1 and 2, retained messages,
+    // ping, disconnect and sessions that outlive the connection.
+    // It does not do wills, topic aliases, auth or resending unacked publishes.
+    // The tables are all fixed size so allocate the broker once, eg. with new.
+
+    const int brokerMaxConnections = 1024;
+    const int brokerMaxSessions = 1024;
+    const int brokerMaxSubscriptions = 4096;
+    const int brokerRetainedNodes = 2048; // a node per topic level
+    const int brokerRetainedBuckets = 1024;
+    const int brokerRetainedArena = 256 * 1024;
+    const int brokerBuckets = 256; // for the exact topic filters.
+    const int brokerInSize = 16 * 1024; // also the max packet size
+    const int brokerOutSize = 32 * 1024; // slices stop at 64k
+    const int brokerQueueSize = 16 * 1024; // per session, for when the out buffer is full or we're offline.
+    const int brokerMaxFilter = 128;
+    const int brokerMaxFilters = brokerInSize / 3; // in one Subscribe. 3 bytes is the least a filter takes.
+    const int brokerMaxQoS2 = 32; // inbound qos 2 ids waiting for a PubRel
+    const int brokerDedupe = 4096; // recent inbound qos 1 ids, to drop the resends
+
+    struct brokerStats
+    {
+        unsigned long long connects;
+        unsigned long long disconnects;
+        unsigned long long packetsIn;
+        unsigned long long publishesIn;
+        unsigned long long publishesOut;
+        unsigned long long bytesIn;
+        unsigned long long bytesOut;
+        unsigned long long queued;  // publishes that went into a session queue
+        unsigned long long dropped; // publishes that didn't fit anywhere
+        unsigned long long bad;     // connections closed for a protocol error
+    };
+
+    struct brokerSession
+    {
+        bool inUse;
+        int conn; // -1 when offline
+        char clientID[64];
+        int clientIDLen;
+        unsigned int expiry;      // seconds to keep us after the connection goes
+        timer expiryTimer;        // on the wheel while offline
+        unsigned short nextID;
+        unsigned short qos2[brokerMaxQoS2]; // inbound ids that got a PubRec
+        int qos2Count;
+        unsigned int matchStamp; // see publish
+        char matchQoS;
+        bool matchRetain;
+        char queueBuffer[brokerQueueSize];
+        publishQueue queue;
+
+        brokerSession() : queue(queueBuffer, brokerQueueSize, dropNewest)
+        {
+            inUse = false;
+        }
+    };
+
+    struct brokerSubscription
+    {
+        bool inUse;
+        int session;
+        char filter[brokerMaxFilter];
+        int filterLen;
+        char QoS;
+        bool NoLocal;
+        bool RetainAsPublished;
+        int next; // in the bucket or the wildcard list. -1 is the end.
+
+        slice getFilter()
+        {
+            return slice(filter, 0, filterLen);
+        }
+    };
+
+    struct brokerConnection
+    {
+        socketConn sock;
+        int index;
+        bool open;      // until the loop's onClose
+        bool connected; // we have the Connect
+        int session;
+        unsigned int keepAlive;  // seconds
+        unsigned long lastHeard; // ms
+        timer keepAliveTimer;    // fires at the earliest it could be late, and checks lastHeard then
+        char in[brokerInSize];
+        char out[brokerOutSize];
+
+        brokerConnection() : sock(in, brokerInSize, out, brokerOutSize)
+        {
+            open = false;
+        }
+    };
+
+    // brokerForwarder is told about every publish that comes in on a connection, after
+    // it's been delivered here. The topicField is the topic with its 2 byte length and rest is
+    // the props and the payload as they came in. See shardedBroker.
+    struct brokerForwarder
+    {
+        virtual void forward(char qos, bool retain, slice topicField, slice rest) = 0;
+    };
+
+    struct miniBroker : ioHandler, timerHandler
+    {
+        brokerStats stats;
+        int tcpPort; // after listenTCP. If we asked for 0 this is the port we got.
+        std::atomic<bool> stopping; // stop may come from another thread.
+        brokerForwarder *forwarder; // 0 for none
+        captureFile *capture;       // 0 for none. Every packet that comes in is recorded.
+
+        // loop is what drives the sockets. 0 means an epollLoop of our own.
+        miniBroker(ioLoop *loop = 0);
+        ~miniBroker();
+
+        // listenTCP listens on 127.0.0.1. Port 0 picks a free one.
+        bool listenTCP(int port);
+        bool listenUnix(const char *path);
+
+        // pollOnce waits for and handles one batch of events.
+        bool pollOnce(int timeoutMs);
+        // run calls pollOnce until stop.
+        void run();
+        void stop()
+        {
+            stopping = true;
+        }
+
+        // adopt takes a connected socket that was accepted somewhere else.
+        // Returns true if failed and then the fd is closed.
+        bool adopt(int fd);
+        // inject delivers a publish from outside, eg. another shard, like one from a connection
+        // except that no one acks it and it isn't forwarded.
+        void inject(char qos, bool retain, slice topicField, slice rest);
+
+        void onAccept(int listenFd, int fd) override;
+        void onData(socketConn &c) override;
+        void onDrained(socketConn &c) override;
+        void onClose(socketConn &c) override;
+        void onTimer(timer &t) override;
+
+    private:
+        epollLoop ownLoop;
+        ioLoop *loop;
+        int tcpFd;
+        int unixFd;
+        char unixPath[108];
+        unsigned int matchCounter;
+        unsigned int assignCounter;
+        char assembly[1024];
+        char packetBuffer[brokerInSize + 8];
+        char ackCodes[brokerMaxFilters]; // for the SubAck and UnSubAck
+        bool ackExisted[brokerMaxFilters];
+
+        brokerConnection *conns[brokerMaxConnections];
+        brokerSession sessions[brokerMaxSessions];
+        brokerSubscription subs[brokerMaxSubscriptions];
+        int buckets[brokerBuckets];
+        int wildcards;
+        dedupeEntry dedupeEntries[brokerDedupe];
+        dedupeTable dedupe;
+        retainedNode retainedNodes[brokerRetainedNodes];
+        int retainedBuckets[brokerRetainedBuckets];
+        char retainedArena[brokerRetainedArena];
+        retainedCache retained;
+        timerWheel timers; // keep alives are ids 0 up and session expiry brokerMaxConnections up
+
+        void close(int c, unsigned char reason);
+        void detach(brokerConnection &conn);
+        bool handle(int c, unsigned char firstByte, slice body);
+        bool onConnect(int c, slice body);
+        bool onPublish(int c, unsigned char firstByte, slice body);
+        bool onSubscribe(int c, mqttPacketPieces &packet);
+        bool onUnsubscribe(int c, mqttPacketPieces &packet);
+        void route(int sender, char qos, bool retain, slice topicField, slice topic, slice rest);
+        void deliver(int session, slice topicField, slice rest, char qos, bool retain);
+        void sendRetained(int session, slice filter, char qos);
+        void keepRetained(char qos, slice topicField, slice rest);
+        bool append(int c, slice s);
+        void endSession(int s);
+        int findSession(slice clientID);
+        int addSubscription(int session, subscribeFilter &f, bool &existed);
+        void removeSubscription(int index);
+    };
+
+} // namespace knotfree
+
+#endif
@@ -0,0 +1,141 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "mpscPublishQueue.h"
+
+#ifndef ARDUINO
+
+namespace knotfree
+{
+    mpscPublishQueue::mpscPublishQueue(mpscSlot *slots, int count) : slots(slots), mask(count - 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueuePos.store(0);
+        signalled.store(false);
+        dequeuePos = 0;
+        holding = false;
+        nextID = 1;
+    }
+
+    bool mpscPublishQueue::push(const publishDesc &desc)
+    {
+        bool fail = false;
+        unsigned pos = enqueuePos.load(std::memory_order_relaxed);
+        mpscSlot *slot;
+        while (true)
+        {
+            slot = &slots[pos & mask];
+            unsigned seq = slot->sequence.load(std::memory_order_acquire);
+            int diff = int(seq - pos);
+            if (diff == 0)
+            {
+                // the slot is free. Claim it unless another producer got there first.
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                fail = true; // full. The consumer hasn't come round to this one yet.
+                return fail;
+            }
+            else
+            {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->desc = desc;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return fail;
+    }
+
+    bool mpscPublishQueue::pop(publishDesc &desc)
+    {
+        mpscSlot *slot = &slots[dequeuePos & mask];
+        unsigned seq = slot->sequence.load(std::memory_order_acquire);
+        if (seq != dequeuePos + 1)
+        {
+            return false; // empty, or a producer has claimed it and isn't done.
+        }
+        desc = slot->desc;
+        slot->sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+
+    int mpscPublishQueue::encodeBatch(drain *destination, sink assemblyBuffer, sendWindow &window, int max,
+                                      publishReleaser *releaser, unsigned int now)
+    {
+        // anything pushed from now on needs a new wake up.
+        signalled.store(false);
+        int count = 0;
+        mqttPacketPieces pub;
+        while (count < max)
+        {
+            if (!holding)
+            {
+                if (!pop(held))
+                {
+                    break;
+                }
+                holding = true;
+            }
+            unsigned int waited = now - held.since;
+            if (held.expiry && waited >= held.expiry)
+            {
+                holding = false;
+                if (releaser)
+                {
+                    releaser->released(held, reasonExpired);
+                }
+                continue;
+            }
+            pub.reset();
+            pub.packetType = CtrlPublish;
+            pub.TopicName = held.topic;
+            pub.Payload = held.payload;
+            pub.QoS = held.qos;
+            pub.Retain = held.retain;
+            pub.MessageExpiry = held.expiry ? held.expiry - waited : 0;
+            pub.PacketID = held.qos ? nextID : 0;
+            unsigned char reason = window.publish(pub, assemblyBuffer, destination);
+            if (reason == reasonQuotaExceeded || reason == reasonUnspecified)
+            {
+                break; // wait for an ack or for room.
+            }
+            holding = false;
+            if (reason == reasonSuccess)
+            {
+                count++;
+                if (held.qos)
+                {
+                    nextID = nextID == 0xFFFF ? 1 : nextID + 1;
+                }
+            }
+            if (releaser)
+            {
+                releaser->released(held, reason);
+            }
+        }
+        return count;
+    }
+
+} // namespace knotfree
+
+#endif
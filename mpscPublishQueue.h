@@ -0,0 +1,114 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "mqtt5nano.h"
+
+#ifndef ARDUINO
+
+#include <atomic>
+
+namespace knotfree
+{
+    // publishDesc is a publish waiting in an mpscPublishQueue. The queue keeps the slices
+    // and not the bytes so the topic and the payload must stay put until it's released.
+    struct publishDesc
+    {
+        slice topic;
+        slice payload;
+        char qos;
+        bool retain;
+        unsigned int expiry; // seconds it's good for, 0 is forever
+        unsigned int since;  // when the expiry started, on the clock that encodeBatch gets
+        void *tag;           // the producer's. It comes back in released.
+
+        publishDesc()
+        {
+            qos = 0;
+            retain = false;
+            expiry = 0;
+            since = 0;
+            tag = 0;
+        }
+    };
+
+    // reasonExpired is what a publishReleaser gets for a publish that ran out while it
+    // was in the queue. It's ours and never goes on the wire.
+    const unsigned char reasonExpired = 0xFF;
+
+    // publishReleaser hears, on the consumer's thread, when a publish has been encoded
+    // or will never be (reason is from sendWindow::check, or reasonExpired) so its bytes are free again.
+    struct publishReleaser
+    {
+        virtual void released(publishDesc &desc, unsigned char reason) = 0;
+    };
+
+    struct mpscSlot
+    {
+        std::atomic<unsigned> sequence;
+        publishDesc desc;
+    };
+
+    // mpscPublishQueue lets any number of threads publish on one connection without a lock.
+    // A producer only copies a descriptor into a slot. The connection's own thread pops them
+    // in a batch and encodes them straight into its drain, eg. a socketDrain, so the encoding
+    // and the send happen on one thread and a whole batch goes out in one syscall.
+    // It's the bounded ring with a sequence number in each slot (Vyukov's). The slots are
+    // the caller's and the count must be a power of 2.
+    struct mpscPublishQueue
+    {
+        mpscPublishQueue(mpscSlot *slots, int count);
+
+        // push is for any thread. Returns true if the queue is full.
+        bool push(const publishDesc &desc);
+
+        // shouldWake is for a producer after a push. It's true for only the first
+        // push since the consumer last started a batch, so a burst costs one wake up, eg. an eventfd write.
+        bool shouldWake()
+        {
+            return !signalled.exchange(true);
+        }
+
+        // The rest is for the consumer's thread only.
+
+        // pop takes the oldest one. Returns true if there was one.
+        bool pop(publishDesc &desc);
+
+        // encodeBatch pops up to max publishes and writes them to destination through window,
+        // with the packet ids from nextID. A publish the window holds back, or that the
+        // destination has no room for, is kept and goes first next time. The destination
+        // must take a whole packet or nothing, like socketDrain does.
+        // now is in seconds for the expiry. One that has run out is released and not sent
+        // and the rest go with what's left of theirs.
+        // Returns how many were written.
+        int encodeBatch(drain *destination, sink assemblyBuffer, sendWindow &window, int max,
+                        publishReleaser *releaser, unsigned int now = 0);
+
+        unsigned short nextID;
+
+    private:
+        mpscSlot *slots;
+        unsigned mask;
+        alignas(64) std::atomic<unsigned> enqueuePos;
+        alignas(64) std::atomic<bool> signalled;
+        alignas(64) unsigned dequeuePos;
+        bool holding; // held is popped but didn't go yet.
+        publishDesc held;
+    };
+
+} // namespace knotfree
+
+#endif
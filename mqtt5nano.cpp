@@ -15,17 +15,43 @@
 
 #include "mqtt5nano.h"
 #include "knotbase64.h"
+#include "metrics.h"
+#include "trace.h"
 
 namespace knotfree
 {
 
+    // getProps pops the properties length and then the properties into props.
+    static bool getProps(slice &pos, slice &props)
+    {
+        bool fail = false;
+        int propLen = pos.getLittleEndianVarLenInt();
+        if (propLen < 0 || propLen > pos.size())
+        {
+            fail = true;
+            return fail;
+        }
+        props.base = pos.base;
+        props.start = pos.start;
+        props.end = props.start + propLen;
+        pos.start = props.end;
+        return fail;
+    }
+
     bool mqttPacketPieces::parse(const slice body, const unsigned char _packetType, const int len)
     {
         bool fail = false;
+        MQTT5NANO_METRICS_PARSE(fail, packetType);
+        MQTT5NANO_TRACE_SCOPE(traceParse, len);
         reset();
 
         packetType = (_packetType >> 4);
         QoS = (_packetType >> 1) & 3;
+        if (packetType == CtrlPublish)
+        {
+            Retain = (_packetType & 1) != 0;
+            Dup = (_packetType & 8) != 0;
+        }
 
         if (packetType < CtrlConn || packetType > CtrlAuth)
         {
@@ -34,6 +60,10 @@ namespace knotfree
         }
 
         slice pos = body;
+        if (pos.base && len >= 0 && body.start + len < pos.end)
+        {
+            pos.end = body.start + len;
+        }
         // pos.printhex();
         if (packetType == CtrlPublish)
         {
@@ -42,15 +72,14 @@ namespace knotfree
             // TopicName.printstr();
             // pos.printhex();
             if (QoS)
+            { // big endian, like every two byte int in mqtt.
+                PacketID = pos.getBigFixLenInt();
+            }
+            if (getProps(pos, props))
             {
-               PacketID = pos.getBigFixLenInt();// this might be wrong endian FIXME:
+                fail = true;
+                return fail;
             }
-            int propLen = pos.getBigEndianVarLenInt();
-
-            props.base = pos.base;
-            props.start = pos.start;
-            props.end = props.start + propLen;
-            pos.start = props.end;
 
             // props.printhex();
             if (props.size())
@@ -72,6 +101,16 @@ namespace knotfree
                         CorrelationData = ptmp.getBigFixedLenString();
                         // RespTopic.printstr("corr");
                     }
+                    else if (key == propKeyMessageExpiryInterval)
+                    {
+                        if (ptmp.size() < 4)
+                        {
+                            fail = true;
+                            return fail;
+                        }
+                        MessageExpiry = propertyInt(key, slice(ptmp.base, ptmp.start, ptmp.start + 4));
+                        ptmp.start += 4;
+                    }
                     else if (key == propKeyUserProps)
                     {
                         slice k = ptmp.getBigFixedLenString();
@@ -89,16 +128,23 @@ namespace knotfree
                     {
                         // what happens now?
                         char code = getPropertyLenCode(key);
+                        MQTT5NANO_METRICS_COUNT(skippedProps);
+                        if (code == char(0xFF) || code == 0)
+                        {
+                            MQTT5NANO_METRICS_COUNT(unknownProps);
+                            fail = true;
+                            return fail; // we're done and broken.
+                        }
                         if (code & 0x0F)
                         {
-                            if (code == char(0xFF))
+                            if (code == 0x0F)
                             {
-                                fail = true;
-                                return fail; // we're done and broken.
+                                int dummy = ptmp.getLittleEndianVarLenInt();
                             }
-                            if (code == 0x0F)
+                            else if (code > ptmp.size())
                             {
-                                int dummy = ptmp.getBigEndianVarLenInt();
+                                fail = true;
+                                return fail;
                             }
                             else
                             { // pass 'code' bytes.
@@ -119,9 +165,60 @@ namespace knotfree
             }
 
             Payload = pos;
-            Payload.end = body.start + len;
             // and we're done.
         }
+        else if (packetType == CtrlSubAck || packetType == CtrlUnSubAck)
+        {
+            PacketID = pos.getBigFixLenInt();
+            if (getProps(pos, props))
+            {
+                fail = true;
+                return fail;
+            }
+            // the rest is one reason code per filter.
+            Payload = pos;
+        }
+        else if (packetType == CtrlSubscribe || packetType == CtrlUnSub)
+        {
+            PacketID = pos.getBigFixLenInt();
+            if (getProps(pos, props))
+            {
+                fail = true;
+                return fail;
+            }
+            Payload = pos; // the filters
+        }
+        else if (packetType >= CtrlPubAck && packetType <= CtrlPubComp)
+        {
+            PacketID = pos.getBigFixLenInt();
+            // may stop here which means success and no props.
+            if (pos.empty() == false)
+            {
+                ReasonCode = pos.readByte();
+            }
+            if (pos.empty() == false && getProps(pos, props))
+            {
+                fail = true;
+                return fail;
+            }
+        }
+        else if (packetType == CtrlConnAck || packetType == CtrlAuth || packetType == CtrlDisConn)
+        {
+            if (packetType == CtrlConnAck)
+            {
+                SessionPresent = pos.readByte() & 1;
+            }
+            // Auth and DisConn may stop anywhere after here which means success and no props.
+            if (pos.empty() == false)
+            {
+                ReasonCode = pos.readByte();
+            }
+            if (pos.empty() == false && getProps(pos, props))
+            {
+                fail = true;
+                return fail;
+            }
+        }
         else
         {
             // worry about the body of the other packets later. TODO:
@@ -143,10 +240,83 @@ namespace knotfree
         RespTopic.base = 0;
         CorrelationData.base = 0;
         QoS = 0;
+        Retain = false;
+        Dup = false;
+        MessageExpiry = 0;
+        PacketID = 0; // a qos 0 publish has none
+        ReasonCode = 0;
+        SessionPresent = false;
+    }
+
+    unsigned char mqttPacketPieces::fixedHeaderByte()
+    {
+        if (packetType == CtrlPublish)
+        {
+            return CtrlPublish * 16 + (Dup ? 8 : 0) + QoS * 2 + (Retain ? 1 : 0);
+        }
+        return packetType * 16 + QoS * 2;
     }
 
     bool mqttPacketPieces::outputConnect(sink assemblyBuffer, drain *destination,
                                          slice clientID, slice user, slice pass)
+    {
+        // user, pass and clean start with a 60 second keep alive.
+        connectOptions options;
+        options.ClientID = clientID;
+        options.UserName = user.base ? user : slice("");
+        options.Password = pass.base ? pass : slice("");
+        return outputConnect(assemblyBuffer, destination, options);
+    };
+
+    static void writeTwoBytes(sink &s, unsigned int val)
+    {
+        s.writeByte(val >> 8);
+        s.writeByte(val);
+    }
+
+    static void writeFourBytes(sink &s, unsigned int val)
+    {
+        s.writeByte(val >> 24);
+        s.writeByte(val >> 16);
+        s.writeByte(val >> 8);
+        s.writeByte(val);
+    }
+
+    // writeStrProp writes the key and the string if the slice has a base.
+    static void writeStrProp(sink &s, char key, slice str)
+    {
+        if (str.base)
+        {
+            s.writeByte(key);
+            s.writeFixedLenStr(str);
+        }
+    }
+
+    static void writeUserProps(sink &s, slice *keyVal, int len)
+    {
+        for (int i = 0; i < len; i += 2)
+        {
+            if (keyVal[i].empty() == false)
+            {
+                s.writeByte(propKeyUserProps);
+                s.writeFixedLenStr(keyVal[i]);
+                s.writeFixedLenStr(keyVal[i + 1]);
+            }
+        }
+    }
+
+    // putLengthAtEnd writes a var len int at the tail of part and extends part to include it.
+    // There must be 4 bytes of space after the part.
+    static void putLengthAtEnd(sink &part, int len)
+    {
+        sink tmp = part;
+        tmp.start = part.end;
+        tmp.end = tmp.start + 4;
+        tmp.writeLittleEndianVarLenInt(len);
+        part.end = tmp.start;
+    }
+
+    bool mqttPacketPieces::outputConnect(sink assemblyBuffer, drain *destination, connectOptions &o)
     {
         // We're filling a buffer. We'll actually generate an array
         // of slices that are in the buffer that may have small gaps between them.
@@ -154,11 +324,34 @@ namespace knotfree
         // what it is until we output and then go back and patch it.
         // Since the var len can be as long as 3 bytes we have to leave
         // some space at the beginning of each segment.
+        MQTT5NANO_METRICS_ENCODE();
 
-        //  setby caller:
         packetType = CtrlConn;
         QoS = 0;
 
+        bool hasWill = o.WillTopic.base != 0;
+        char flags = 0;
+        if (o.UserName.base)
+        {
+            flags |= 0x80;
+        }
+        if (o.Password.base)
+        {
+            flags |= 0x40;
+        }
+        if (hasWill)
+        {
+            flags |= 0x04 | ((o.WillQoS & 3) << 3);
+            if (o.WillRetain)
+            {
+                flags |= 0x20;
+            }
+        }
+        if (o.CleanStart)
+        {
+            flags |= 0x02;
+        }
+
         sink fixedHeader = assemblyBuffer;
         assemblyBuffer.writeByte(char(packetType * 16) + (QoS * 2));
         fixedHeader.end = assemblyBuffer.start;
@@ -173,40 +366,118 @@ namespace knotfree
         assemblyBuffer.writeByte('T');
         assemblyBuffer.writeByte('T');
         assemblyBuffer.writeByte(5);
-        assemblyBuffer.writeByte(0xC2); // c2 -- connect flags. user, pass, and clean start
-        assemblyBuffer.writeByte(0);    // msb keep alive
-        assemblyBuffer.writeByte(0x3C); // lsb keep alive
-        //
-        assemblyBuffer.writeByte(0); // length of props
-                                     // we could have props here. see outputPubOrSub
+        assemblyBuffer.writeByte(flags);
+        writeTwoBytes(assemblyBuffer, o.KeepAlive);
         varHeader.end = assemblyBuffer.start;
         //
         assemblyBuffer.start += 4; // leave some space
         //
+        sink props = assemblyBuffer;
+        if (o.SessionExpiry)
+        {
+            assemblyBuffer.writeByte(propKeySessionExpiryInterval);
+            writeFourBytes(assemblyBuffer, o.SessionExpiry);
+        }
+        if (o.ReceiveMaximum)
+        {
+            assemblyBuffer.writeByte(propKeyMaxRecv);
+            writeTwoBytes(assemblyBuffer, o.ReceiveMaximum);
+        }
+        if (o.MaximumPacketSize)
+        {
+            assemblyBuffer.writeByte(propKeyMaxPacketSize);
+            writeFourBytes(assemblyBuffer, o.MaximumPacketSize);
+        }
+        if (o.TopicAliasMaximum)
+        {
+            assemblyBuffer.writeByte(propKeyMaxTopicAlias);
+            writeTwoBytes(assemblyBuffer, o.TopicAliasMaximum);
+        }
+        if (o.RequestResponseInfo)
+        {
+            assemblyBuffer.writeByte(propKeyReqRespInfo);
+            assemblyBuffer.writeByte(1);
+        }
+        if (o.RequestProblemInfo == false)
+        {
+            assemblyBuffer.writeByte(propKeyReqProblemInfo);
+            assemblyBuffer.writeByte(0);
+        }
+        writeUserProps(assemblyBuffer, o.UserKeyVal, sizeof(o.UserKeyVal) / sizeof(slice));
+        writeStrProp(assemblyBuffer, propKeyAuthMethod, o.AuthMethod);
+        writeStrProp(assemblyBuffer, propKeyAuthData, o.AuthData);
+        props.end = assemblyBuffer.start;
+        //
+        assemblyBuffer.start += 4; // leave some space
+        //
         sink payload = assemblyBuffer;
-        assemblyBuffer.writeFixedLenStr(clientID);
-        assemblyBuffer.writeFixedLenStr(user);
-        assemblyBuffer.writeFixedLenStr(pass);
+        assemblyBuffer.writeFixedLenStr(o.ClientID);
         payload.end = assemblyBuffer.start;
+        //
+        assemblyBuffer.start += 4; // leave some space
+        //
+        sink willProps = assemblyBuffer;
+        if (hasWill)
+        {
+            if (o.WillDelay)
+            {
+                assemblyBuffer.writeByte(propKeyWillDelayInterval);
+                writeFourBytes(assemblyBuffer, o.WillDelay);
+            }
+            if (o.WillPayloadIsUtf8)
+            {
+                assemblyBuffer.writeByte(propKeyPayloadFormatIndicator);
+                assemblyBuffer.writeByte(1);
+            }
+            if (o.WillMessageExpiry)
+            {
+                assemblyBuffer.writeByte(propKeyMessageExpiryInterval);
+                writeFourBytes(assemblyBuffer, o.WillMessageExpiry);
+            }
+            writeStrProp(assemblyBuffer, propKeyContentType, o.WillContentType);
+            writeStrProp(assemblyBuffer, propKeyRespTopic, o.WillRespTopic);
+            writeStrProp(assemblyBuffer, propKeyCorrelationData, o.WillCorrelationData);
+            writeUserProps(assemblyBuffer, o.WillUserKeyVal, sizeof(o.WillUserKeyVal) / sizeof(slice));
+        }
+        willProps.end = assemblyBuffer.start;
+        sink payload2 = assemblyBuffer;
+        if (hasWill)
+        {
+            assemblyBuffer.writeFixedLenStr(o.WillTopic);
+            assemblyBuffer.writeFixedLenStr(o.WillPayload);
+        }
+        if (o.UserName.base)
+        {
+            assemblyBuffer.writeFixedLenStr(o.UserName);
+        }
+        if (o.Password.base)
+        {
+            assemblyBuffer.writeFixedLenStr(o.Password);
+        }
+        payload2.end = assemblyBuffer.start;
 
-        // now the body length
-        // at the tail of fixedHeader
-        int bodylen = varHeader.size() + payload.size();
-        sink tmp = fixedHeader;
-        tmp.start = fixedHeader.end;
-        tmp.end = tmp.start + 4;
-        tmp.writeLittleEndianVarLenInt(bodylen);
-        fixedHeader.end = tmp.start;
+        // now the lengths
+        putLengthAtEnd(varHeader, props.size());
+        if (hasWill)
+        {
+            putLengthAtEnd(payload, willProps.size());
+        }
+        int bodylen = varHeader.size() + props.size() + payload.size() + willProps.size() + payload2.size();
+        putLengthAtEnd(fixedHeader, bodylen);
 
         if (assemblyBuffer.empty() == true)
         {
             return true; // failed
         }
-        // now, write out fixedHeader,varHeader, payload
+        // now, write out fixedHeader,varHeader, props, payload
         bool fail = false;
         fail |= destination->write(fixedHeader);
         fail |= destination->write(varHeader);
+        fail |= destination->write(props);
         fail |= destination->write(payload);
+        fail |= destination->write(willProps);
+        fail |= destination->write(payload2);
+        MQTT5NANO_METRICS_ENCODED(fail, fixedHeader.size() + bodylen);
 
         return fail;
     };
@@ -216,61 +487,60 @@ namespace knotfree
     // we don't have to buffer payload.
     // NOTE: when generating Subscribe packets the topic must be in the TopicName.
 
-    bool mqttPacketPieces::outputPubOrSub(sink assemblyBuffer, drain *destination)
+    // assemblePubOrSub puts the fixed header, the var header and the props of a Publish or
+    // Subscribe into assemblyBuffer with room for the lengths, which it patches in when
+    // they're known. payloadSize is what will follow them. Returns true if failed.
+    static bool assemblePubOrSub(mqttPacketPieces &p, sink &assemblyBuffer, unsigned int payloadSize,
+                                 sink &fixedHeader, sink &varHeader, sink &props)
     {
-        // We're filling a buffer. We'll actually generate an array
-        // of slices that are in the buffer that may have small gaps between them.
-
-        // setby caller:  packetType = CtrlSubscribe;
-
-        if (packetType == CtrlSubscribe)
-        {
-            Payload = TopicName;
-            TopicName.base = 0;
-        }
-
-        sink fixedHeader = assemblyBuffer;
+        fixedHeader = assemblyBuffer;
 
-        assemblyBuffer.writeByte(char(packetType * 16) + (QoS * 2));
+        assemblyBuffer.writeByte(p.fixedHeaderByte());
         fixedHeader.end = assemblyBuffer.start;
         //
         assemblyBuffer.start += 4; // leave some space
         //
-        sink varHeader = assemblyBuffer;
-        if (packetType == CtrlPublish)
+        varHeader = assemblyBuffer;
+        if (p.packetType == CtrlPublish)
         {
-            assemblyBuffer.writeFixedLenStr(TopicName);
+            assemblyBuffer.writeFixedLenStr(p.TopicName);
+        }
+        if (p.packetType != CtrlPublish || p.QoS)
+        { // a qos 0 publish has no packet id
+            assemblyBuffer.writeByte(p.PacketID >> 8);
+            assemblyBuffer.writeByte(p.PacketID);
         }
-        assemblyBuffer.writeByte(PacketID / 16); //  .
-        assemblyBuffer.writeByte(PacketID);
         varHeader.end = assemblyBuffer.start;
         //
         assemblyBuffer.start += 4; // leave some space
         //
-        sink props = assemblyBuffer;
-        if (RespTopic.empty() == false)
+        props = assemblyBuffer;
+        if (p.packetType == CtrlPublish && p.MessageExpiry)
+        {
+            assemblyBuffer.writeByte(propKeyMessageExpiryInterval);
+            writeFourBytes(assemblyBuffer, p.MessageExpiry);
+        }
+        if (p.RespTopic.empty() == false)
         {
             assemblyBuffer.writeByte(propKeyRespTopic);
-            assemblyBuffer.writeFixedLenStr(RespTopic);
+            assemblyBuffer.writeFixedLenStr(p.RespTopic);
         }
-        for (int i = 0; i < UserKeyVal_len(); i += 2)
+        if (p.CorrelationData.empty() == false)
         {
-            if (UserKeyVal[i].empty() == false)
+            assemblyBuffer.writeByte(propKeyCorrelationData);
+            assemblyBuffer.writeFixedLenStr(p.CorrelationData);
+        }
+        for (int i = 0; i < p.UserKeyVal_len(); i += 2)
+        {
+            if (p.UserKeyVal[i].empty() == false)
             {
                 assemblyBuffer.writeByte(propKeyUserProps);
-                assemblyBuffer.writeFixedLenStr(UserKeyVal[i]);
-                assemblyBuffer.writeFixedLenStr(UserKeyVal[i + 1]);
+                assemblyBuffer.writeFixedLenStr(p.UserKeyVal[i]);
+                assemblyBuffer.writeFixedLenStr(p.UserKeyVal[i + 1]);
             }
         }
         props.end = assemblyBuffer.start;
 
-        // don't buffer the payload.
-        int payloadSize = Payload.size();
-        if (packetType == CtrlSubscribe)
-        {
-            payloadSize += 2; // for it's length bytes
-            payloadSize += 1; // because subscribe adds the qos
-        }
         // put the lengths in.
         // put the props len at the tail of varHeader
         int propslen = props.size();
@@ -282,18 +552,44 @@ namespace knotfree
 
         // now the body length
         // at the tail of fixedHeader
-        int bodylen = varHeader.size() + props.size() + payloadSize;
+        unsigned int bodylen = varHeader.size() + props.size() + payloadSize;
         tmp = fixedHeader;
         tmp.start = fixedHeader.end;
         tmp.end = tmp.start + 4;
         tmp.writeLittleEndianVarLenInt(bodylen);
         fixedHeader.end = tmp.start;
 
-        if (assemblyBuffer.empty() == true)
+        return assemblyBuffer.empty(); // failed if it's full
+    }
+
+    bool mqttPacketPieces::outputPubOrSub(sink assemblyBuffer, drain *destination)
+    {
+        // We're filling a buffer. We'll actually generate an array
+        // of slices that are in the buffer that may have small gaps between them.
+        MQTT5NANO_METRICS_ENCODE();
+
+        // setby caller:  packetType = CtrlSubscribe;
+
+        if (packetType == CtrlSubscribe)
         {
-            return true; // failed
+            Payload = TopicName;
+            TopicName.base = 0;
         }
 
+        // don't buffer the payload.
+        int payloadSize = Payload.size();
+        if (packetType == CtrlSubscribe)
+        {
+            payloadSize += 2; // for it's length bytes
+            payloadSize += 1; // because subscribe adds the qos
+        }
+        sink fixedHeader;
+        sink varHeader;
+        sink props;
+        if (assemblePubOrSub(*this, assemblyBuffer, payloadSize, fixedHeader, varHeader, props))
+        {
+            return true; // failed
+        }
         // now, write out fixedHeader,varHeader, props, payload
         bool fail = false;
         fail |= destination->write(fixedHeader);
@@ -309,67 +605,1229 @@ namespace knotfree
         { // packetType == CtrlPublish
             fail |= destination->write(Payload);
         }
+        MQTT5NANO_METRICS_ENCODED(fail, fixedHeader.size() + varHeader.size() + props.size() + payloadSize);
         return fail;
     };
 
-    // return a value if key found else return a 'done' slice.
-    slice mqttPacketPieces::findKey(const char *key)
+    bool mqttPacketPieces::outputPublishStream(sink assemblyBuffer, drain *destination,
+                                               fount &payload, unsigned int payloadLen, sink chunk)
     {
-        int size = UserKeyVal_len();
-        for (int i = 0; i < size; i += 2)
+        MQTT5NANO_METRICS_ENCODE();
+        packetType = CtrlPublish;
+        bool fail = false;
+        sink fixedHeader;
+        sink varHeader;
+        sink props;
+        if (payloadLen > maxStreamPayload ||
+            assemblePubOrSub(*this, assemblyBuffer, payloadLen, fixedHeader, varHeader, props) ||
+            chunk.size() <= 0)
+        {
+            fail = true;
+            return fail;
+        }
+        fail |= destination->write(fixedHeader);
+        fail |= destination->write(varHeader);
+        fail |= destination->write(props);
+        unsigned int left = payloadLen;
+        while (left && fail == false)
         {
-            slice s = UserKeyVal[i];
-            if (s.equals(key))
+            sink part = chunk;
+            if ((unsigned int)part.size() > left)
             {
-                return s;
+                part.end = part.start + left;
             }
+            int amt = payload.read(part);
+            if (amt <= 0)
+            {
+                fail = true; // the fount ran dry and the packet is broken. Close the connection.
+                break;
+            }
+            fail |= destination->write(slice(chunk.base, chunk.start, chunk.start + amt));
+            left -= amt;
         }
-        slice bads;
-        bads.base = 0;
-        return bads;
-    };
-
-    // PropKeyConsumes is to look up a code for every prop key. The code will be how many bytes to pass, in the lower
-    // nibble or else how many strings to pass in the upper nibble.
-    char PropKeyConsumes[43];
-
-    void init()
-    {
-        PropKeyConsumes[propKeyPayloadFormatIndicator] = 0x01; // byte, Packet: Will, Publish
-        PropKeyConsumes[propKeyMessageExpiryInterval] = 0x04;  // Uint (4 bytes), Packet: Will, Publish
-        PropKeyConsumes[propKeyContentType] = 0x10;            // utf-8, Packet: Will, Publish
-        PropKeyConsumes[propKeyRespTopic] = 0x10;              // utf-8, Packet: Will, Publish
-        PropKeyConsumes[propKeyCorrelationData] = 0x10;        // binary data, Packet: Will, Publish
-        PropKeyConsumes[propKeySubID] = 0x0F;                  // uint (variable bytes), Packet: Publish, Subscribe
-        PropKeyConsumes[propKeySessionExpiryInterval] = 0x04;  // uint (4 bytes), Packet: Connect, ConnAck, DisConn
-        PropKeyConsumes[propKeyAssignedClientID] = 0x10;       // utf-8, Packet: ConnAck
-        PropKeyConsumes[propKeyServerKeepalive] = 0x02;        // uint (2 bytes), Packet: ConnAck
-        PropKeyConsumes[propKeyAuthMethod] = 0x10;             // utf-8, Packet: Connect, ConnAck, Auth
-        PropKeyConsumes[propKeyAuthData] = 0x10;               // binary data, Packet: Connect, ConnAck, Auth
-        PropKeyConsumes[propKeyReqProblemInfo] = 0x01;         // byte, Packet: Connect
-        PropKeyConsumes[propKeyWillDelayInterval] = 0x04;      // uint (4 bytes), Packet: Will
-        PropKeyConsumes[propKeyReqRespInfo] = 0x01;            // byte, Packet: Connect
-        PropKeyConsumes[propKeyRespInfo] = 0x10;               // utf-8, Packet: ConnAck
-        PropKeyConsumes[propKeyServerRef] = 0x10;              // utf-8, Packet: ConnAck, DisConn
-        PropKeyConsumes[propKeyReasonString] = 0x10;           // utf-8, Packet: ConnAck, PubAck, PubRecv, PubRel, PubComp, SubAck, UnSubAck, DisConn, Auth
-        PropKeyConsumes[propKeyMaxRecv] = 0x02;                // uint (2 bytes), Packet: Connect, ConnAck
-        PropKeyConsumes[propKeyMaxTopicAlias] = 0x02;          // uint (2 bytes), Packet: Connect, ConnAck
-        PropKeyConsumes[propKeyTopicAlias] = 0x02;             // uint (2 bytes), Packet: Publish
-        PropKeyConsumes[propKeyMaxQos] = 0x01;                 // byte, Packet: ConnAck
-        PropKeyConsumes[propKeyRetainAvail] = 0x01;            // byte, Packet: ConnAck
-        PropKeyConsumes[propKeyUserProps] = 0x20;              // utf-8 string pair, Packet: Connect, ConnAck, Publish, Will, PubAck, PubRecv, PubRel, PubComp, Subscribe, SubAck, UnSub, UnSubAck, DisConn, Auth
-        PropKeyConsumes[propKeyMaxPacketSize] = 0x04;          // uint (4 bytes), Packet: Connect, ConnAck
-        PropKeyConsumes[propKeyWildcardSubAvail] = 0x01;       // byte, Packet: ConnAck
-        PropKeyConsumes[propKeySharedSubAvail] = 0x01;         // byte, Packet: ConnAck
+        MQTT5NANO_METRICS_ENCODED(fail, fixedHeader.size() + varHeader.size() + props.size() + payloadLen);
+        return fail;
     }
 
-    unsigned char getPropertyLenCode(int i)
+    // outputSubOrUnsub assembles the headers and props of a Subscribe or Unsubscribe
+    // and then writes the filters straight to the destination. Like outputPubOrSub.
+    static bool outputSubOrUnsub(mqttPacketPieces &p, sink assemblyBuffer, drain *destination,
+                                 subscribeFilter *filters, int count, int subID)
     {
-        if (PropKeyConsumes[0] == 0)
+        MQTT5NANO_METRICS_ENCODE();
+        bool isSub = p.packetType == CtrlSubscribe;
+        sink fixedHeader = assemblyBuffer;
+        // the reserved flags must be 0010
+        assemblyBuffer.writeByte(char(p.packetType * 16) + 2);
+        fixedHeader.end = assemblyBuffer.start;
+        //
+        assemblyBuffer.start += 4; // leave some space
+        //
+        sink varHeader = assemblyBuffer;
+        assemblyBuffer.writeByte(p.PacketID >> 8);
+        assemblyBuffer.writeByte(p.PacketID);
+        varHeader.end = assemblyBuffer.start;
+        //
+        assemblyBuffer.start += 4; // leave some space
+        //
+        sink props = assemblyBuffer;
+        if (isSub && subID > 0)
+        {
+            assemblyBuffer.writeByte(propKeySubID);
+            assemblyBuffer.writeLittleEndianVarLenInt(subID);
+        }
+        writeUserProps(assemblyBuffer, p.UserKeyVal, p.UserKeyVal_len());
+        props.end = assemblyBuffer.start;
+
+        // don't buffer the payload.
+        int payloadSize = 0;
+        for (int i = 0; i < count; i++)
+        {
+            payloadSize += 2 + filters[i].Filter.size();
+            if (isSub)
+            {
+                payloadSize += 1; // the options byte
+            }
+        }
+        putLengthAtEnd(varHeader, props.size());
+        int bodylen = varHeader.size() + props.size() + payloadSize;
+        putLengthAtEnd(fixedHeader, bodylen);
+
+        if (assemblyBuffer.empty() == true || count <= 0)
+        {
+            return true; // failed
+        }
+
+        bool fail = false;
+        fail |= destination->write(fixedHeader);
+        fail |= destination->write(varHeader);
+        fail |= destination->write(props);
+        for (int i = 0; i < count && !fail; i++)
         {
-            init();
+            subscribeFilter &f = filters[i];
+            fail |= destination->writeFixedLenStr(f.Filter);
+            if (isSub)
+            {
+                char options = (f.QoS & 3) | ((f.RetainHandling & 3) << 4);
+                if (f.NoLocal)
+                {
+                    options |= 0x04;
+                }
+                if (f.RetainAsPublished)
+                {
+                    options |= 0x08;
+                }
+                fail |= destination->writeByte(options);
+            }
         }
-        if (i <= sizeof(PropKeyConsumes))
+        MQTT5NANO_METRICS_ENCODED(fail, fixedHeader.size() + bodylen);
+        return fail;
+    }
+
+    bool mqttPacketPieces::outputSubscribe(sink assemblyBuffer, drain *destination,
+                                           subscribeFilter *filters, int count, int subID)
+    {
+        packetType = CtrlSubscribe;
+        QoS = 1;
+        return outputSubOrUnsub(*this, assemblyBuffer, destination, filters, count, subID);
+    }
+
+    bool mqttPacketPieces::outputUnsubscribe(sink assemblyBuffer, drain *destination,
+                                             subscribeFilter *filters, int count)
+    {
+        packetType = CtrlUnSub;
+        QoS = 1;
+        return outputSubOrUnsub(*this, assemblyBuffer, destination, filters, count, 0);
+    }
+
+    bool mqttPacketPieces::applySubAck(subscribeFilter *filters, int count)
+    {
+        bool fail = false;
+        if (packetType != CtrlSubAck && packetType != CtrlUnSubAck)
+        {
+            fail = true;
+            return fail;
+        }
+        slice codes = Payload;
+        if (codes.size() != count)
+        {
+            fail = true;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (codes.empty())
+            {
+                filters[i].ReasonCode = reasonUnspecified;
+            }
+            else
+            {
+                filters[i].ReasonCode = codes.readByte();
+            }
+        }
+        return fail;
+    }
+
+    bool mqttPacketPieces::outputAuth(sink assemblyBuffer, drain *destination,
+                                      unsigned char reasonCode, slice method, slice data)
+    {
+        MQTT5NANO_METRICS_ENCODE();
+        packetType = CtrlAuth;
+        QoS = 0;
+
+        sink fixedHeader = assemblyBuffer;
+        assemblyBuffer.writeByte(char(packetType * 16));
+        fixedHeader.end = assemblyBuffer.start;
+        //
+        assemblyBuffer.start += 4; // leave some space
+        //
+        sink varHeader = assemblyBuffer;
+        assemblyBuffer.writeByte(reasonCode);
+        varHeader.end = assemblyBuffer.start;
+        //
+        assemblyBuffer.start += 4; // leave some space
+        //
+        sink props = assemblyBuffer;
+        writeStrProp(assemblyBuffer, propKeyAuthMethod, method);
+        writeStrProp(assemblyBuffer, propKeyAuthData, data);
+        writeUserProps(assemblyBuffer, UserKeyVal, UserKeyVal_len());
+        props.end = assemblyBuffer.start;
+
+        putLengthAtEnd(varHeader, props.size());
+        putLengthAtEnd(fixedHeader, varHeader.size() + props.size());
+
+        if (assemblyBuffer.empty() == true)
+        {
+            return true; // failed
+        }
+        bool fail = false;
+        fail |= destination->write(fixedHeader);
+        fail |= destination->write(varHeader);
+        fail |= destination->write(props);
+        MQTT5NANO_METRICS_ENCODED(fail, fixedHeader.size() + varHeader.size() + props.size());
+        return fail;
+    }
+
+    bool authExchange::start(connectOptions &options)
+    {
+        bool fail = false;
+        dataBuffer.reset();
+        options.AuthMethod = handler->method();
+        sink data = dataBuffer;
+        fail = handler->initial(data);
+        if (data.start > 0)
+        {
+            options.AuthData = slice(data.base, 0, data.start);
+        }
+        state = fail ? authFailed : authInProgress;
+        return fail;
+    }
+
+    bool authExchange::reauthenticate(sink assemblyBuffer, drain *destination)
+    {
+        dataBuffer.reset();
+        sink data = dataBuffer;
+        if (handler->initial(data))
+        {
+            state = authFailed;
+            return true;
+        }
+        state = authInProgress;
+        mqttPacketPieces auth;
+        auth.reset();
+        return auth.outputAuth(assemblyBuffer, destination, reasonReAuth, handler->method(),
+                               slice(data.base, 0, data.start));
+    }
+
+    authState authExchange::onPacket(mqttPacketPieces &packet, sink assemblyBuffer, drain *destination)
+    {
+        if (state != authInProgress)
+        {
+            return state;
+        }
+        slice method = packet.findProperty(propKeyAuthMethod);
+        slice serverData = packet.findProperty(propKeyAuthData);
+        if (method.base == 0 || !method.equals(handler->method()))
+        {
+            state = authFailed;
+            return state;
+        }
+        bool isAuth = packet.packetType == CtrlAuth;
+        if (isAuth && packet.ReasonCode == reasonContinueAuth)
+        {
+            dataBuffer.reset();
+            sink data = dataBuffer;
+            mqttPacketPieces reply;
+            reply.reset();
+            if (handler->challenge(serverData, data) ||
+                reply.outputAuth(assemblyBuffer, destination, reasonContinueAuth, method,
+                                 slice(data.base, 0, data.start)))
+            {
+                state = authFailed;
+            }
+            return state;
+        }
+        if ((isAuth || packet.packetType == CtrlConnAck) && packet.ReasonCode == reasonSuccess)
+        {
+            state = handler->finish(serverData) ? authFailed : authSucceeded;
+            return state;
+        }
+        state = authFailed;
+        return state;
+    }
+
+    // varLenSize is how many bytes writeLittleEndianVarLenInt will use.
+    static int varLenSize(int val)
+    {
+        int n = 1;
+        while (val >= 128)
+        {
+            val = val >> 7;
+            n++;
+        }
+        return n;
+    }
+
+    int mqttPacketPieces::outputSize()
+    {
+        int varHeaderSize = 2 + TopicName.size() + (QoS ? 2 : 0);
+        int propsSize = 0;
+        if (MessageExpiry)
+        {
+            propsSize += 1 + 4;
+        }
+        if (RespTopic.empty() == false)
+        {
+            propsSize += 1 + 2 + RespTopic.size();
+        }
+        if (CorrelationData.empty() == false)
+        {
+            propsSize += 1 + 2 + CorrelationData.size();
+        }
+        for (int i = 0; i < UserKeyVal_len(); i += 2)
+        {
+            if (UserKeyVal[i].empty() == false)
+            {
+                propsSize += 1 + 2 + UserKeyVal[i].size() + 2 + UserKeyVal[i + 1].size();
+            }
+        }
+        int bodylen = varHeaderSize + varLenSize(propsSize) + propsSize + Payload.size();
+        return 1 + varLenSize(bodylen) + bodylen;
+    }
+
+    bool serverLimits::load(mqttPacketPieces &connAck)
+    {
+        bool fail = false;
+        if (connAck.packetType != CtrlConnAck)
+        {
+            fail = true;
+            return fail;
+        }
+        slice tmp = connAck.props;
+        int key;
+        slice value;
+        while (tmp.empty() == false)
+        {
+            if (getProperty(tmp, key, value))
+            {
+                fail = true;
+                return fail;
+            }
+            unsigned int val = 0;
+            if (key != propKeyUserProps && getPropertyLenCode(key) < 0x10)
+            {
+                val = propertyInt(key, value);
+            }
+            switch (key)
+            {
+            case propKeyMaxRecv:
+                ReceiveMaximum = val;
+                break;
+            case propKeyMaxPacketSize:
+                MaximumPacketSize = val;
+                break;
+            case propKeyMaxQos:
+                MaximumQoS = val;
+                break;
+            case propKeyRetainAvail:
+                RetainAvailable = val != 0;
+                break;
+            case propKeyServerKeepalive:
+                ServerKeepAlive = val;
+                break;
+            case propKeyMaxTopicAlias:
+                TopicAliasMaximum = val;
+                break;
+            default:
+                break;
+            }
+        }
+        if (ReceiveMaximum == 0)
+        {
+            ReceiveMaximum = 65535; // zero is a protocol error. Be forgiving.
+        }
+        return fail;
+    }
+
+    unsigned char sendWindow::check(mqttPacketPieces &pub)
+    {
+        if (pub.QoS > limits.MaximumQoS)
+        {
+            return reasonQoSNotSupported;
+        }
+        if (pub.Retain && !limits.RetainAvailable)
+        {
+            return reasonRetainNotSupported;
+        }
+        if (limits.MaximumPacketSize && (unsigned int)pub.outputSize() > limits.MaximumPacketSize)
+        {
+            return reasonPacketTooLarge;
+        }
+        if (pub.QoS && inFlight >= limits.ReceiveMaximum)
+        {
+            return reasonQuotaExceeded;
+        }
+        return reasonSuccess;
+    }
+
+    unsigned char sendWindow::publish(mqttPacketPieces &pub, sink assemblyBuffer, drain *destination)
+    {
+        pub.packetType = CtrlPublish;
+        unsigned char reason = check(pub);
+        if (reason != reasonSuccess)
+        {
+            return reason;
+        }
+        if (pub.outputPubOrSub(assemblyBuffer, destination))
+        {
+            return reasonUnspecified;
+        }
+        if (pub.QoS)
+        {
+            inFlight++;
+        }
+        return reasonSuccess;
+    }
+
+    void sendWindow::onPacket(mqttPacketPieces &packet)
+    {
+        bool done = packet.packetType == CtrlPubAck || packet.packetType == CtrlPubComp;
+        if (packet.packetType == CtrlPubRecv && packet.ReasonCode >= reasonUnspecified)
+        {
+            done = true; // there will be no PubComp.
+        }
+        if (done && inFlight > 0)
+        {
+            inFlight--;
+        }
+    }
+
+    bool mqttPacketPieces::nextFilter(slice &pos, subscribeFilter &f)
+    {
+        bool fail = false;
+        if (pos.size() < 2)
+        {
+            fail = true;
+            return fail;
+        }
+        f.Filter = pos.getBigFixedLenString();
+        if (packetType == CtrlSubscribe)
+        {
+            if (pos.empty())
+            {
+                fail = true;
+                return fail;
+            }
+            unsigned char options = pos.readByte();
+            f.QoS = options & 3;
+            f.NoLocal = (options & 0x04) != 0;
+            f.RetainAsPublished = (options & 0x08) != 0;
+            f.RetainHandling = (options >> 4) & 3;
+        }
+        return fail;
+    }
+
+    int mqttPacketPieces::getFilters(subscribeFilter *filters, int max)
+    {
+        slice pos = Payload;
+        int count = 0;
+        while (pos.empty() == false)
+        {
+            subscribeFilter f;
+            if (nextFilter(pos, f))
+            {
+                return -1;
+            }
+            if (count < max)
+            {
+                filters[count] = f;
+                count++;
+            }
+        }
+        return count;
+    }
+
+    bool connectOptions::parse(slice body)
+    {
+        bool fail = false;
+        slice pos = body;
+        slice name = pos.getBigFixedLenString();
+        int version = pos.readByte();
+        if (!name.equals("MQTT") || version != 5 || pos.size() < 3)
+        {
+            fail = true;
+            return fail;
+        }
+        unsigned char flags = pos.readByte();
+        KeepAlive = pos.getBigFixLenInt();
+        CleanStart = (flags & 0x02) != 0;
+
+        slice props;
+        if (getProps(pos, props))
+        {
+            fail = true;
+            return fail;
+        }
+        int userIndex = 0;
+        int key;
+        slice value;
+        while (props.empty() == false)
+        {
+            if (getProperty(props, key, value))
+            {
+                fail = true;
+                return fail;
+            }
+            switch (key)
+            {
+            case propKeySessionExpiryInterval:
+                SessionExpiry = propertyInt(key, value);
+                break;
+            case propKeyMaxRecv:
+                ReceiveMaximum = propertyInt(key, value);
+                break;
+            case propKeyMaxPacketSize:
+                MaximumPacketSize = propertyInt(key, value);
+                break;
+            case propKeyMaxTopicAlias:
+                TopicAliasMaximum = propertyInt(key, value);
+                break;
+            case propKeyReqRespInfo:
+                RequestResponseInfo = propertyInt(key, value) != 0;
+                break;
+            case propKeyReqProblemInfo:
+                RequestProblemInfo = propertyInt(key, value) != 0;
+                break;
+            case propKeyAuthMethod:
+                AuthMethod = value;
+                break;
+            case propKeyAuthData:
+                AuthData = value;
+                break;
+            case propKeyUserProps:
+                if (userIndex < int(sizeof(UserKeyVal) / sizeof(slice)))
+                {
+                    UserKeyVal[userIndex++] = value.getBigFixedLenString();
+                    UserKeyVal[userIndex++] = value.getBigFixedLenString();
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        ClientID = pos.getBigFixedLenString();
+        if (flags & 0x04)
+        {
+            WillQoS = (flags >> 3) & 3;
+            WillRetain = (flags & 0x20) != 0;
+            slice willProps;
+            if (getProps(pos, willProps))
+            {
+                fail = true;
+                return fail;
+            }
+            userIndex = 0;
+            while (willProps.empty() == false)
+            {
+                if (getProperty(willProps, key, value))
+                {
+                    fail = true;
+                    return fail;
+                }
+                switch (key)
+                {
+                case propKeyWillDelayInterval:
+                    WillDelay = propertyInt(key, value);
+                    break;
+                case propKeyPayloadFormatIndicator:
+                    WillPayloadIsUtf8 = propertyInt(key, value) != 0;
+                    break;
+                case propKeyMessageExpiryInterval:
+                    WillMessageExpiry = propertyInt(key, value);
+                    break;
+                case propKeyContentType:
+                    WillContentType = value;
+                    break;
+                case propKeyRespTopic:
+                    WillRespTopic = value;
+                    break;
+                case propKeyCorrelationData:
+                    WillCorrelationData = value;
+                    break;
+                case propKeyUserProps:
+                    if (userIndex < int(sizeof(WillUserKeyVal) / sizeof(slice)))
+                    {
+                        WillUserKeyVal[userIndex++] = value.getBigFixedLenString();
+                        WillUserKeyVal[userIndex++] = value.getBigFixedLenString();
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+            WillTopic = pos.getBigFixedLenString();
+            WillPayload = pos.getBigFixedLenString();
+        }
+        if (flags & 0x80)
+        {
+            UserName = pos.getBigFixedLenString();
+        }
+        if (flags & 0x40)
+        {
+            Password = pos.getBigFixedLenString();
+        }
+        return fail;
+    }
+
+    bool mqttPacketPieces::outputConnAck(sink assemblyBuffer, drain *destination, bool sessionPresent,
+                                         unsigned char reasonCode, serverLimits &limits, slice assignedClientID)
+    {
+        MQTT5NANO_METRICS_ENCODE();
+        packetType = CtrlConnAck;
+        QoS = 0;
+        serverLimits defaults;
+
+        sink fixedHeader = assemblyBuffer;
+        assemblyBuffer.writeByte(char(packetType * 16));
+        fixedHeader.end = assemblyBuffer.start;
+        //
+        assemblyBuffer.start += 4; // leave some space
+        //
+        sink varHeader = assemblyBuffer;
+        assemblyBuffer.writeByte(sessionPresent ? 1 : 0);
+        assemblyBuffer.writeByte(reasonCode);
+        varHeader.end = assemblyBuffer.start;
+        //
+        assemblyBuffer.start += 4; // leave some space
+        //
+        sink props = assemblyBuffer;
+        if (limits.ReceiveMaximum != defaults.ReceiveMaximum)
+        {
+            assemblyBuffer.writeByte(propKeyMaxRecv);
+            writeTwoBytes(assemblyBuffer, limits.ReceiveMaximum);
+        }
+        if (limits.MaximumPacketSize)
+        {
+            assemblyBuffer.writeByte(propKeyMaxPacketSize);
+            writeFourBytes(assemblyBuffer, limits.MaximumPacketSize);
+        }
+        if (limits.MaximumQoS != defaults.MaximumQoS)
+        {
+            assemblyBuffer.writeByte(propKeyMaxQos);
+            assemblyBuffer.writeByte(limits.MaximumQoS);
+        }
+        if (limits.RetainAvailable == false)
+        {
+            assemblyBuffer.writeByte(propKeyRetainAvail);
+            assemblyBuffer.writeByte(0);
+        }
+        if (limits.ServerKeepAlive)
+        {
+            assemblyBuffer.writeByte(propKeyServerKeepalive);
+            writeTwoBytes(assemblyBuffer, limits.ServerKeepAlive);
+        }
+        if (limits.TopicAliasMaximum)
+        {
+            assemblyBuffer.writeByte(propKeyMaxTopicAlias);
+            writeTwoBytes(assemblyBuffer, limits.TopicAliasMaximum);
+        }
+        writeStrProp(assemblyBuffer, propKeyAssignedClientID, assignedClientID);
+        writeUserProps(assemblyBuffer, UserKeyVal, UserKeyVal_len());
+        props.end = assemblyBuffer.start;
+
+        putLengthAtEnd(varHeader, props.size());
+        putLengthAtEnd(fixedHeader, varHeader.size() + props.size());
+
+        if (assemblyBuffer.empty() == true)
+        {
+            return true; // failed
+        }
+        bool fail = false;
+        fail |= destination->write(fixedHeader);
+        fail |= destination->write(varHeader);
+        fail |= destination->write(props);
+        MQTT5NANO_METRICS_ENCODED(fail, fixedHeader.size() + varHeader.size() + props.size());
+        return fail;
+    }
+
+    bool mqttPacketPieces::outputAck(sink assemblyBuffer, drain *destination, unsigned char ackType,
+                                     unsigned short packetID, unsigned char reasonCode)
+    {
+        MQTT5NANO_METRICS_ENCODE();
+        bool fail = false;
+        // these are small enough to go straight to the destination.
+        // PubRel has the reserved flags 0010.
+        char first = char(ackType * 16) + (ackType == CtrlPubRel ? 2 : 0);
+        fail |= destination->writeByte(first);
+        if (reasonCode == reasonSuccess)
+        { // the reason and the props can be left off.
+            fail |= destination->writeByte(2);
+            fail |= destination->writeByte(packetID >> 8);
+            fail |= destination->writeByte(packetID);
+            MQTT5NANO_METRICS_ENCODED(fail, 4);
+            return fail;
+        }
+        fail |= destination->writeByte(3);
+        fail |= destination->writeByte(packetID >> 8);
+        fail |= destination->writeByte(packetID);
+        fail |= destination->writeByte(reasonCode);
+        MQTT5NANO_METRICS_ENCODED(fail, 5);
+        return fail;
+    }
+
+    bool mqttPacketPieces::outputSubAck(sink assemblyBuffer, drain *destination, unsigned char ackType, slice reasonCodes)
+    {
+        MQTT5NANO_METRICS_ENCODE();
+        packetType = ackType;
+        bool fail = false;
+        sink fixedHeader = assemblyBuffer;
+        assemblyBuffer.writeByte(char(packetType * 16));
+        fixedHeader.end = assemblyBuffer.start;
+        int bodylen = 2 + 1 + reasonCodes.size(); // id, no props, codes
+        putLengthAtEnd(fixedHeader, bodylen);
+        fail |= destination->write(fixedHeader);
+        fail |= destination->writeByte(PacketID >> 8);
+        fail |= destination->writeByte(PacketID);
+        fail |= destination->writeByte(0);
+        fail |= destination->write(reasonCodes);
+        MQTT5NANO_METRICS_ENCODED(fail, fixedHeader.size() + bodylen);
+        return fail;
+    }
+
+    dedupeTable::dedupeTable(dedupeEntry *entries, int count) : entries(entries), mask(count - 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            entries[i].inUse = false;
+        }
+    }
+
+    bool dedupeTable::isDuplicate(unsigned int client, unsigned short packetID, bool dup, unsigned int fingerprint)
+    {
+        unsigned int h = (client * 2654435761u) ^ (packetID * 40503u);
+        dedupeEntry &e = entries[(h ^ (h >> 15)) & mask];
+        bool seen = e.inUse && e.client == client && e.packetID == packetID && e.fingerprint == fingerprint;
+        if (dup && seen)
+        {
+            return true;
+        }
+        e.inUse = true;
+        e.client = client;
+        e.packetID = packetID;
+        e.fingerprint = fingerprint;
+        return false;
+    }
+
+    // fnv-1a over both
+    unsigned int dedupeTable::fingerprint(slice topic, slice payload)
+    {
+        unsigned int h = 2166136261u;
+        slice parts[2] = {topic, payload};
+        for (slice &s : parts)
+        {
+            for (int i = s.start; s.base && i < s.end; i++)
+            {
+                h = (h ^ (unsigned char)s.base[i]) * 16777619u;
+            }
+            h = (h ^ 0xFF) * 16777619u; // so moving bytes from the topic to the payload changes it.
+        }
+        return h;
+    }
+
+    void dedupeTable::forget(unsigned int client)
+    {
+        for (int i = 0; i <= mask; i++)
+        {
+            if (entries[i].client == client)
+            {
+                entries[i].inUse = false;
+            }
+        }
+    }
+
+    bool hasWildcard(slice filter)
+    {
+        for (int i = filter.start; i < filter.end; i++)
+        {
+            if (filter.base[i] == '+' || filter.base[i] == '#')
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool topicMatches(slice filter, slice topic)
+    {
+        int f = filter.start;
+        int t = topic.start;
+        const char *fb = filter.base;
+        const char *tb = topic.base;
+        if (filter.empty() || topic.empty())
+        {
+            return false;
+        }
+        if (tb[t] == '$' && (fb[f] == '+' || fb[f] == '#'))
+        {
+            return false;
+        }
+        while (f < filter.end)
+        {
+            if (fb[f] == '#')
+            {
+                return true; // the rest, whatever it is.
+            }
+            if (fb[f] == '+')
+            {
+                // an empty level matches too, eg. a/+ and a/
+                while (t < topic.end && tb[t] != '/')
+                {
+                    t++; // pass one level
+                }
+                f++;
+            }
+            else
+            {
+                // match literally to the end of the level
+                while (f < filter.end && fb[f] != '/')
+                {
+                    if (t >= topic.end || tb[t] != fb[f])
+                    {
+                        return false;
+                    }
+                    f++;
+                    t++;
+                }
+                if (t < topic.end && tb[t] != '/')
+                {
+                    return false;
+                }
+            }
+            // now both are at a / or the end.
+            if (f >= filter.end)
+            {
+                return t >= topic.end;
+            }
+            f++; // pass the / in the filter
+            if (t >= topic.end)
+            {
+                // the topic is done. Only a trailing # can still match. eg. a/# and a
+                return f < filter.end && fb[f] == '#' && f + 1 == filter.end;
+            }
+            t++; // pass the / in the topic
+        }
+        return t >= topic.end;
+    }
+
+    // findKey looks in UserKeyVal first. When that's full there may be more in props.
+    slice mqttPacketPieces::findKey(const char *key)
+    {
+        int size = UserKeyVal_len();
+        int stored = 0;
+        for (int i = 0; i < size; i += 2)
+        {
+            if (UserKeyVal[i].base == 0)
+            {
+                continue;
+            }
+            stored++;
+            if (UserKeyVal[i].equals(key))
+            {
+                return UserKeyVal[i + 1];
+            }
+        }
+        if (stored == size / 2 && props.base)
+        {
+            slice ptmp = props;
+            int k;
+            slice value;
+            int seen = 0;
+            while (ptmp.empty() == false && getProperty(ptmp, k, value) == false)
+            {
+                if (k != propKeyUserProps || seen++ < stored)
+                {
+                    continue;
+                }
+                if (value.getBigFixedLenString().equals(key))
+                {
+                    return value.getBigFixedLenString();
+                }
+            }
+        }
+        slice bads;
+        bads.base = 0;
+        return bads;
+    }
+
+    userPropertyView::userPropertyView(slice *pairs, int maxPairs, unsigned short *index, int indexSize)
+        : pairs(pairs), maxPairs(maxPairs), index(index), indexSize(indexSize)
+    {
+        count = 0;
+        indexed = false;
+        truncated = false;
+    }
+
+    bool userPropertyView::load(slice props)
+    {
+        bool fail = false;
+        count = 0;
+        indexed = false;
+        truncated = false;
+        int propKey;
+        slice value;
+        while (props.empty() == false)
+        {
+            if (getProperty(props, propKey, value))
+            {
+                fail = true;
+                return fail;
+            }
+            if (propKey != propKeyUserProps)
+            {
+                continue;
+            }
+            if (count >= maxPairs)
+            {
+                truncated = true;
+                continue;
+            }
+            pairs[count * 2] = value.getBigFixedLenString();
+            pairs[count * 2 + 1] = value.getBigFixedLenString();
+            count++;
+        }
+        return fail;
+    }
+
+    // userKeyHash is fnv-1a.
+    static unsigned int userKeyHash(slice key)
+    {
+        unsigned int h = 2166136261u;
+        for (int i = key.start; i < key.end; i++)
+        {
+            h = (h ^ (unsigned char)key.base[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    // buildIndex puts the first pair of every key in the table. A repeated key
+    // finds the first one and stops there so the later ones aren't added.
+    void userPropertyView::buildIndex()
+    {
+        int mask = indexSize - 1;
+        for (int i = 0; i < indexSize; i++)
+        {
+            index[i] = 0;
+        }
+        for (int p = 0; p < count; p++)
+        {
+            slice k = key(p);
+            int i = userKeyHash(k) & mask;
+            while (index[i] && key(index[i] - 1).equals(k) == false)
+            {
+                i = (i + 1) & mask;
+            }
+            if (index[i] == 0)
+            {
+                index[i] = p + 1;
+            }
+        }
+        indexed = true;
+    }
+
+    slice userPropertyView::find(slice k)
+    {
+        if (indexed == false)
+        {
+            buildIndex();
+        }
+        int mask = indexSize - 1;
+        int i = userKeyHash(k) & mask;
+        while (index[i])
+        {
+            int p = index[i] - 1;
+            if (key(p).equals(k))
+            {
+                return value(p);
+            }
+            i = (i + 1) & mask;
+        }
+        slice bads;
+        bads.base = 0;
+        return bads;
+    }
+
+    int userPropertyView::findNext(int i)
+    {
+        slice k = key(i);
+        for (int p = i + 1; p < count; p++)
+        {
+            if (key(p).equals(k))
+            {
+                return p;
+            }
+        }
+        return -1;
+    }
+
+    frameResult getPacket(slice &pos, unsigned char &firstByte, slice &body)
+    {
+        if (pos.size() < 2)
+        {
+            return framePartial;
+        }
+        slice tmp = pos;
+        unsigned char first = tmp.readByte();
+        // the remaining length is little-endian 7 bits at a time.
+        // Our slices top out at 64k so 3 bytes is plenty.
+        int len = 0;
+        int i = 0;
+        unsigned char c;
+        do
+        {
+            if (tmp.empty())
+            {
+                return framePartial;
+            }
+            if (i == 3)
+            {
+                return frameBad;
+            }
+            c = tmp.readByte();
+            len |= int(c & 0x7F) << (i * 7);
+            i++;
+        } while (c >= 128);
+
+        if (len > 0xFFFF)
+        {
+            return frameBad; // no slice can hold it, so more bytes won't help.
+        }
+        if (len > tmp.size())
+        {
+            return framePartial;
+        }
+        firstByte = first;
+        body = tmp;
+        body.end = tmp.start + len;
+        pos.start = body.end;
+        MQTT5NANO_TRACE_MARK(traceFrame, first, -1);
+        return frameOk;
+    }
+
+    intResult parseBatch(slice buffer, mqttPacketPieces *pieces, int maxPieces, slice &remainder)
+    {
+        intResult result;
+        result.i = 0;
+        slice pos = buffer;
+        while (result.i < maxPieces)
+        {
+            slice before = pos;
+            unsigned char firstByte;
+            slice body;
+            frameResult fr = getPacket(pos, firstByte, body);
+            if (fr == framePartial)
+            {
+                break;
+            }
+            if (fr == frameBad || pieces[result.i].parse(body, firstByte, body.size()))
+            {
+                pos = before;
+                result.error = 1;
+                break;
+            }
+            result.i++;
+        }
+        remainder = pos;
+        return result;
+    }
+
+    slice mqttPacketPieces::findProperty(int key)
+    {
+        slice tmp = props;
+        int k;
+        slice value;
+        while (getProperty(tmp, k, value) == false)
+        {
+            if (k == key)
+            {
+                return value;
+            }
+        }
+        slice bads;
+        bads.base = 0;
+        return bads;
+    }
+
+    slice findMessageExpiry(slice props)
+    {
+        int key;
+        slice value;
+        while (getProperty(props, key, value) == false)
+        {
+            if (key == propKeyMessageExpiryInterval)
+            {
+                return value;
+            }
+        }
+        slice none;
+        none.base = 0;
+        return none;
+    }
+
+    // stringFits is true if the 2 byte length and the string after it are all in s.
+    static bool stringFits(slice s)
+    {
+        if (s.size() < 2)
+        {
+            return false;
+        }
+        int len = ((unsigned char)s.base[s.start] << 8) | (unsigned char)s.base[s.start + 1];
+        return s.size() >= 2 + len;
+    }
+
+    bool getProperty(slice &props, int &key, slice &value)
+    {
+        bool fail = false;
+        if (props.empty())
+        {
+            fail = true;
+            return fail;
+        }
+        key = props.readByte();
+        unsigned char code = getPropertyLenCode(key);
+        if (code == 0xFF || code == 0)
+        {
+            fail = true;
+            return fail;
+        }
+        value = props;
+        if (code == 0x0F)
+        { // a var len int
+            if (props.getLittleEndianVarLenInt() < 0)
+            {
+                fail = true;
+                return fail;
+            }
+        }
+        else if (code & 0x0F)
+        { // pass 'code' bytes.
+            if (props.size() < code)
+            {
+                fail = true;
+                return fail;
+            }
+            props.start += code;
+        }
+        else if (code == 0x10)
+        {
+            if (stringFits(props) == false)
+            {
+                fail = true;
+                return fail;
+            }
+            value = props.getBigFixedLenString();
+            return fail;
+        }
+        else
+        { // pass 'code' strings.
+            for (int i = 0; i < code / 16; i++)
+            {
+                if (stringFits(props) == false)
+                {
+                    fail = true;
+                    return fail;
+                }
+                props.getBigFixedLenString();
+            }
+        }
+        value.end = props.start;
+        return fail;
+    }
+
+    unsigned int propertyInt(int key, slice value)
+    {
+        if (getPropertyLenCode(key) == 0x0F)
+        {
+            return value.getLittleEndianVarLenInt();
+        }
+        unsigned int val = 0;
+        while (value.empty() == false)
+        {
+            val = (val << 8) | value.readByte();
+        }
+        return val;
+    }
+
+    // PropKeyConsumes is to look up a code for every prop key. The code will be how many bytes to pass, in the lower
+    // nibble or else how many strings to pass in the upper nibble. 0 is not a key.
+    // It's const so it's never written and any number of threads can read it. See the prop keys in mqtt5nano.h.
+    static const unsigned char PropKeyConsumes[43] = {
+        0x00, // 0
+        0x01, // 1 propKeyPayloadFormatIndicator
+        0x04, // 2 propKeyMessageExpiryInterval
+        0x10, // 3 propKeyContentType
+        0x00, // 4
+        0x00, // 5
+        0x00, // 6
+        0x00, // 7
+        0x10, // 8 propKeyRespTopic
+        0x10, // 9 propKeyCorrelationData
+        0x00, // 10
+        0x0F, // 11 propKeySubID
+        0x00, // 12
+        0x00, // 13
+        0x00, // 14
+        0x00, // 15
+        0x00, // 16
+        0x04, // 17 propKeySessionExpiryInterval
+        0x10, // 18 propKeyAssignedClientID
+        0x02, // 19 propKeyServerKeepalive
+        0x00, // 20
+        0x10, // 21 propKeyAuthMethod
+        0x10, // 22 propKeyAuthData
+        0x01, // 23 propKeyReqProblemInfo
+        0x04, // 24 propKeyWillDelayInterval
+        0x01, // 25 propKeyReqRespInfo
+        0x10, // 26 propKeyRespInfo
+        0x00, // 27
+        0x10, // 28 propKeyServerRef
+        0x00, // 29
+        0x00, // 30
+        0x10, // 31 propKeyReasonString
+        0x00, // 32
+        0x02, // 33 propKeyMaxRecv
+        0x02, // 34 propKeyMaxTopicAlias
+        0x02, // 35 propKeyTopicAlias
+        0x01, // 36 propKeyMaxQos
+        0x01, // 37 propKeyRetainAvail
+        0x20, // 38 propKeyUserProps
+        0x04, // 39 propKeyMaxPacketSize
+        0x01, // 40 propKeyWildcardSubAvail
+        0x01, // 41 propKeySubIDAvail
+        0x01, // 42 propKeySharedSubAvail
+    };
+
+    unsigned char getPropertyLenCode(int i)
+    {
+        if (i >= 0 && i < (int)sizeof(PropKeyConsumes))
         {
             return PropKeyConsumes[i];
         }
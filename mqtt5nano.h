@@ -20,6 +20,93 @@
 namespace knotfree
 {
 
+    // subscribeFilter is one topic filter of a Subscribe or Unsubscribe packet.
+    // The options are ignored for Unsubscribe.
+    struct subscribeFilter
+    {
+        slice Filter;
+        char QoS;                 // the max qos we want. 0, 1 or 2
+        bool NoLocal;             // don't send us our own publishes.
+        bool RetainAsPublished;   // keep the retain flag as it was published.
+        char RetainHandling;      // 0 send retained, 1 only if the sub is new, 2 never.
+        unsigned char ReasonCode; // set by applySubAck. 0x80 and over is a failure.
+
+        subscribeFilter()
+        {
+            QoS = 0;
+            NoLocal = false;
+            RetainAsPublished = false;
+            RetainHandling = 0;
+            ReasonCode = 0;
+        }
+        subscribeFilter(slice filter, char qos) : subscribeFilter()
+        {
+            Filter = filter;
+            QoS = qos;
+        }
+    };
+
+    // connectOptions is everything that can go into a Connect packet.
+    // The numbers are only sent when they differ from the mqtt defaults
+    // and slices with a null base are left out.
+    struct connectOptions
+    {
+        slice ClientID;
+        slice UserName; // left out when the base is null. slice("") is sent as empty.
+        slice Password; // same
+        bool CleanStart;
+        unsigned short KeepAlive; // seconds
+
+        unsigned int SessionExpiry;      // seconds. 0 ends with the connection.
+        unsigned short ReceiveMaximum;   // qos 1 and 2 in flight to us. 0 means 65535
+        unsigned int MaximumPacketSize;  // the biggest packet we will take. 0 means no limit.
+        unsigned short TopicAliasMaximum;
+        bool RequestResponseInfo;
+        bool RequestProblemInfo;         // defaults to true
+        slice UserKeyVal[8];             // user props. 4 pair max.
+        slice AuthMethod;                // enhanced auth. See outputAuth
+        slice AuthData;
+
+        slice WillTopic; // no will unless this is set.
+        slice WillPayload;
+        char WillQoS;
+        bool WillRetain;
+        unsigned int WillDelay;         // seconds
+        bool WillPayloadIsUtf8;         // the payload format indicator
+        unsigned int WillMessageExpiry; // seconds. 0 is never.
+        slice WillContentType;
+        slice WillRespTopic;
+        slice WillCorrelationData;
+        slice WillUserKeyVal[4]; // 2 pair max.
+
+        connectOptions()
+        {
+            CleanStart = true;
+            KeepAlive = 60;
+            SessionExpiry = 0;
+            ReceiveMaximum = 0;
+            MaximumPacketSize = 0;
+            TopicAliasMaximum = 0;
+            RequestResponseInfo = false;
+            RequestProblemInfo = true;
+            WillQoS = 0;
+            WillRetain = false;
+            WillDelay = 0;
+            WillPayloadIsUtf8 = false;
+            WillMessageExpiry = 0;
+        }
+
+        // parse fills these in from the body of a Connect. This is the broker's end.
+        // The slices point into body. Returns true if failed.
+        bool parse(slice body);
+    };
+
+    // maxStreamPayload is the biggest payload outputPublishStream will send. It leaves
+    // room for the headers under mqtt's limit of 268435455 for the remaining length.
+    const unsigned int maxStreamPayload = 255 * 1024 * 1024;
+
+    struct serverLimits; // below
+
     // After we parse a Pub/Sub packet we'll end up with a collection
     // of slices for the various parts.
     // Since publish is a superset of the other packets we can use this struct.
@@ -29,40 +116,354 @@ namespace knotfree
     struct mqttPacketPieces
     {
         slice TopicName;
-        slice Payload;
+        slice Payload; // for SubAck and UnSubAck these are the reason codes. See getFilters for Subscribe.
 
         slice RespTopic;     // one prop
         slice CorrelationData;
-        slice UserKeyVal[8]; // user props. 4 pair max. no hash table here.
+        slice UserKeyVal[8]; // the first 4 user props. See findKey and userPropertyView for the rest.
         // ignoring the rest of the props.
 
         unsigned short int PacketID; // not a nonce
         char QoS;                    // used by sub, parsed
+        bool Retain;                 // publish only. Parsed and sent.
+        bool Dup;                    // publish only. It's being sent again.
+        unsigned int MessageExpiry;  // publish only. Seconds it's good for, 0 is forever. Parsed and sent.
         unsigned char packetType;
+        unsigned char ReasonCode; // parsed from ConnAck, Auth and DisConn
+        bool SessionPresent;      // parsed from ConnAck
 
         slice props; // the whole properties block.
 
+        // the encoders read every flag so a new one starts out reset.
+        mqttPacketPieces()
+        {
+            packetType = 0;
+            reset();
+        }
+
         // zero the slices before parse
         void reset();
 
+        // fixedHeaderByte is the type and the flags, the first byte on the wire.
+        unsigned char fixedHeaderByte();
+
         // This is the entry point.
         bool parse(slice body, unsigned char packetType, int len);
 
         // uses outputBuffer for assembly and then writes it to destination.
         bool outputPubOrSub(sink assemblyBuffer, drain *destination);
 
+        // outputPublishStream writes a Publish whose payload is payloadLen bytes from a fount,
+        // eg. a file or flash, and not a slice, so it can be bigger than 64k and never has to
+        // be in memory at once. It's read into chunk and written a chunk at a time.
+        // If the fount runs dry first the packet is broken and it fails. Close the connection then.
+        bool outputPublishStream(sink assemblyBuffer, drain *destination,
+                                 fount &payload, unsigned int payloadLen, sink chunk);
+
+        // outputSize is how many bytes outputPubOrSub will write for a Publish.
+        // Nothing is encoded.
+        int outputSize();
+
         bool outputConnect(sink assemblyBuffer, drain *destination,
                            slice clientID, slice user, slice pass);
 
-        // return a value if key found else return a 'done' slice.
+        // outputConnect with all the options. See connectOptions.
+        bool outputConnect(sink assemblyBuffer, drain *destination, connectOptions &options);
+
+        // outputSubscribe packs all the filters into one Subscribe packet.
+        // Uses PacketID and UserKeyVal. subID is the subscription identifier or 0 for none.
+        bool outputSubscribe(sink assemblyBuffer, drain *destination,
+                             subscribeFilter *filters, int count, int subID);
+
+        // outputUnsubscribe packs all the filters into one Unsubscribe packet.
+        // Uses PacketID and UserKeyVal.
+        bool outputUnsubscribe(sink assemblyBuffer, drain *destination,
+                               subscribeFilter *filters, int count);
+
+        // applySubAck copies the reason codes of a parsed SubAck or UnSubAck
+        // into the filters that were sent. They are in the same order.
+        // Returns true if failed, eg. the count doesn't match.
+        bool applySubAck(subscribeFilter *filters, int count);
+
+        // getFilters decodes the Payload of a parsed Subscribe or Unsubscribe.
+        // Returns how many filters there were, at most max, or -1 if it's malformed.
+        int getFilters(subscribeFilter *filters, int max);
+
+        // nextFilter pops one filter off pos, which starts as the Payload of a parsed Subscribe
+        // or Unsubscribe. It's for walking all of them when there could be more than fit an array.
+        // Returns true if failed, eg. it's malformed.
+        bool nextFilter(slice &pos, subscribeFilter &f);
+
+        // These are the broker's end.
+
+        // outputConnAck writes a ConnAck with the limits that differ from the defaults.
+        // assignedClientID is sent if it has a base.
+        bool outputConnAck(sink assemblyBuffer, drain *destination, bool sessionPresent,
+                           unsigned char reasonCode, serverLimits &limits, slice assignedClientID);
+
+        // outputAck writes a PubAck, PubRecv, PubRel or PubComp for packetID.
+        bool outputAck(sink assemblyBuffer, drain *destination, unsigned char ackType,
+                       unsigned short packetID, unsigned char reasonCode);
+
+        // outputSubAck writes a SubAck or UnSubAck for PacketID with one reason code per filter.
+        bool outputSubAck(sink assemblyBuffer, drain *destination, unsigned char ackType, slice reasonCodes);
+
+        // outputAuth writes an Auth packet with the method and data as props.
+        // reasonCode is reasonContinueAuth or reasonReAuth from the client.
+        bool outputAuth(sink assemblyBuffer, drain *destination,
+                        unsigned char reasonCode, slice method, slice data);
+
+        // findKey returns the value of the first user prop with key, or an empty slice
+        // with a null base. It looks past the 4 pairs in UserKeyVal into props.
+        // For lots of lookups use a userPropertyView.
         slice findKey(const char *key);
 
+        // findProperty returns the value of the first property with key from props.
+        // See getProperty. Returns an empty slice with a null base if it's not there.
+        slice findProperty(int key);
+
         int UserKeyVal_len()
         {
             return *(&UserKeyVal + 1) - UserKeyVal;
         }
     };
 
+    // getProperty pops one property off the front of props.
+    // key gets the property id and value gets the bytes of the value. For strings and binary
+    // data that's without the 2 length bytes. For user props it's both strings with their lengths.
+    // Returns true if failed, eg. props is empty or the key is unknown.
+    bool getProperty(slice &props, int &key, slice &value);
+
+    // propertyInt returns the number in the value of an int property.
+    unsigned int propertyInt(int key, slice value);
+
+    // findMessageExpiry returns the 4 bytes of the message expiry interval in the props
+    // of a publish, so a queue can count it down in place, or an empty slice with a null
+    // base if there isn't one.
+    slice findMessageExpiry(slice props);
+
+    // userPropertyView reads all the user props of a props block, not just the
+    // first 4 pairs that mqttPacketPieces keeps. The caller owns the arrays:
+    // pairs has 2 slices per prop and index is the hash table for find, which is
+    // built the first time find is called. indexSize must be a power of two and
+    // bigger than maxPairs. Props past maxPairs are left out and truncated is set.
+    // The slices point into the props, like the ones in mqttPacketPieces.
+    struct userPropertyView
+    {
+        slice *pairs;
+        int maxPairs;
+        unsigned short *index; // pair + 1, 0 is empty
+        int indexSize;
+        int count;
+        bool indexed;
+        bool truncated;
+
+        userPropertyView(slice *pairs, int maxPairs, unsigned short *index, int indexSize);
+
+        // load takes the user props out of props, eg. mqttPacketPieces::props.
+        // Returns true if failed, eg. the props are malformed.
+        bool load(slice props);
+
+        slice key(int i)
+        {
+            return pairs[i * 2];
+        }
+        slice value(int i)
+        {
+            return pairs[i * 2 + 1];
+        }
+
+        // find returns the value of the first prop with key.
+        // Returns an empty slice with a null base if it's not there.
+        slice find(slice key);
+        slice find(const char *key)
+        {
+            return find(slice(key));
+        }
+        // findNext is the next prop after pair i with the same key, or -1. Keys can repeat.
+        int findNext(int i);
+
+    private:
+        void buildIndex();
+    };
+
+    // authHandler is the client side of an enhanced authentication exchange (the Auth packet).
+    // Implementations keep their state in themselves and write into the sinks they
+    // are handed so there is no allocation.
+    // Return true from any of these to abort.
+    struct authHandler
+    {
+        // method is the name of the auth method. eg. "SCRAM-SHA-1"
+        virtual slice method() = 0;
+        // initial writes the auth data for the Connect packet, if any.
+        virtual bool initial(sink &data) = 0;
+        // challenge gets the auth data of each Auth from the server with
+        // reasonContinueAuth and writes the data for our reply.
+        virtual bool challenge(slice serverData, sink &response) = 0;
+        // finish gets the auth data of the successful ConnAck or Auth.
+        // It's the place to check the server's proof.
+        virtual bool finish(slice serverData)
+        {
+            return false;
+        }
+    };
+
+    enum authState
+    {
+        authIdle,
+        authInProgress,
+        authSucceeded,
+        authFailed,
+    };
+
+    // authExchange drives an authHandler through Connect, any number of Auth packets
+    // and the ConnAck.  dataBuffer is where the handler writes. It's reused every step.
+    struct authExchange
+    {
+        authHandler *handler;
+        sink dataBuffer;
+        authState state;
+
+        authExchange(authHandler *h, char *buffer, int size) : handler(h), dataBuffer(buffer, size)
+        {
+            state = authIdle;
+        }
+
+        // start puts the AuthMethod and AuthData into the options before outputConnect.
+        // AuthData points into dataBuffer so send the Connect before calling onPacket.
+        bool start(connectOptions &options);
+
+        // reauthenticate sends an Auth with reasonReAuth on a connection that's already up.
+        bool reauthenticate(sink assemblyBuffer, drain *destination);
+
+        // onPacket takes a parsed ConnAck or Auth from the server and writes our
+        // Auth reply, if there is one, to destination. Returns the new state.
+        authState onPacket(mqttPacketPieces &packet, sink assemblyBuffer, drain *destination);
+    };
+
+    // serverLimits are what the broker told us in the ConnAck.
+    // Until load is called they are the mqtt defaults.
+    struct serverLimits
+    {
+        unsigned short ReceiveMaximum;    // qos 1 and 2 publishes we may have unacked.
+        unsigned int MaximumPacketSize;   // 0 means no limit.
+        char MaximumQoS;                  // 0, 1 or 2
+        bool RetainAvailable;             // may we publish with retain.
+        unsigned short ServerKeepAlive;   // 0 means the server is fine with ours.
+        unsigned short TopicAliasMaximum; // 0 means no aliases.
+
+        serverLimits()
+        {
+            ReceiveMaximum = 65535;
+            MaximumPacketSize = 0;
+            MaximumQoS = 2;
+            RetainAvailable = true;
+            ServerKeepAlive = 0;
+            TopicAliasMaximum = 0;
+        }
+
+        // load reads the props of a parsed ConnAck. Returns true if failed.
+        bool load(mqttPacketPieces &connAck);
+
+        // keepAlive is the keep alive to use. The server's wins if it sent one.
+        unsigned short keepAlive(unsigned short ours)
+        {
+            return ServerKeepAlive ? ServerKeepAlive : ours;
+        }
+    };
+
+    // sendWindow holds back publishes that would overrun the broker.
+    // It's checked before anything is encoded so an oversize publish never leaves.
+    struct sendWindow
+    {
+        serverLimits limits;
+        unsigned short inFlight; // qos 1 and 2 publishes not acked yet.
+
+        sendWindow()
+        {
+            inFlight = 0;
+        }
+
+        // check returns reasonSuccess if the publish can go now or else why not.
+        // reasonQuotaExceeded means the window is full so wait for an ack and try again.
+        // reasonPacketTooLarge and reasonQoSNotSupported will never go and mqtt has no
+        // fragments so the caller has to split the payload or lower the qos.
+        // reasonRetainNotSupported is a retained publish to a server without retain.
+        unsigned char check(mqttPacketPieces &pub);
+
+        // publish does check, outputPubOrSub and then counts it.
+        // Returns the reason from check or reasonUnspecified if the write failed.
+        unsigned char publish(mqttPacketPieces &pub, sink assemblyBuffer, drain *destination);
+
+        // onPacket frees a slot for each PubAck, PubComp or failed PubRecv.
+        void onPacket(mqttPacketPieces &packet);
+    };
+
+    struct dedupeEntry
+    {
+        unsigned int client;
+        unsigned int fingerprint;
+        unsigned short packetID;
+        bool inUse;
+    };
+
+    // dedupeTable drops the qos 1 publishes that are sent again, eg. after a reconnect,
+    // when we already have them. It's keyed by (client, packet id), where client is
+    // whatever the caller uses, eg. a session index. Once the PubAck goes the client may
+    // use the id again for a new message, and that one may need a resend too, so an entry
+    // also keeps a fingerprint of the topic and payload and a resend is only dropped if
+    // that matches. A second message with the same id, topic and payload looks like a resend.
+    // Each key has one slot and a newer key takes it, so when there are lots of clients a
+    // duplicate may get through, which qos 1 allows. A new publish (no dup flag) is never dropped.
+    // The caller owns the entries. Their count must be a power of two.
+    struct dedupeTable
+    {
+        dedupeEntry *entries;
+        int mask;
+
+        dedupeTable(dedupeEntry *entries, int count);
+
+        // isDuplicate records a qos 1 publish and is true if it's a resend of one already recorded.
+        bool isDuplicate(unsigned int client, unsigned short packetID, bool dup, unsigned int fingerprint);
+        bool isDuplicate(unsigned int client, mqttPacketPieces &pub)
+        {
+            return isDuplicate(client, pub.PacketID, pub.Dup, fingerprint(pub.TopicName, pub.Payload));
+        }
+        // fingerprint is a hash of the topic and payload, for isDuplicate.
+        static unsigned int fingerprint(slice topic, slice payload);
+        // forget drops everything from client, eg. when its session ends and the index is reused.
+        void forget(unsigned int client);
+    };
+
+    // topicMatches is true if the topic matches the subscription filter.
+    // + matches one level and # matches the rest, including none, eg. a/# matches a.
+    // Wildcards at the start don't match topics that start with $.
+    bool topicMatches(slice filter, slice topic);
+
+    // hasWildcard is true if the filter has a + or #
+    bool hasWildcard(slice filter);
+
+    // frameResult is what getPacket returns.
+    enum frameResult
+    {
+        frameOk = 0,      // a whole packet was popped.
+        framePartial = 1, // not enough bytes yet. Read more and try again.
+        frameBad = 2,     // the remaining length is malformed or too big for a slice.
+    };
+
+    // getPacket pops one whole packet off the front of pos.
+    // firstByte gets the type and flags byte and body gets everything after the remaining length.
+    // Unless the result is frameOk pos is left as it was.
+    frameResult getPacket(slice &pos, unsigned char &firstByte, slice &body);
+
+    // parseBatch splits a receive buffer holding any number of packets and parses
+    // them into pieces[0] to pieces[maxPieces-1] in one pass.
+    // result.i is how many were parsed. result.error is non-zero if a packet was bad.
+    // remainder gets the bytes that were not parsed: a trailing partial packet, or the
+    // packets that didn't fit, or the bad packet. Keep them and put them in front of the next read.
+    // The pieces point into buffer so it must outlive them.
+    intResult parseBatch(slice buffer, mqttPacketPieces *pieces, int maxPieces, slice &remainder);
+
     /** These are really just for utility
      * mqttBuffer is much less usefull that I thought.
      * really thinking of dumping it. mqttBuffer1024 is just a buffer.
@@ -130,6 +531,27 @@ namespace knotfree
 
     unsigned char getPropertyLenCode(int i);
 
+    // reason codes for acks. Anything 0x80 and over is a failure.
+    const unsigned char reasonSuccess = 0x00;      // also granted qos 0
+    const unsigned char reasonGrantedQoS1 = 0x01;  // SubAck
+    const unsigned char reasonGrantedQoS2 = 0x02;  // SubAck
+    const unsigned char reasonNoSubExisted = 0x11; // UnSubAck
+    const unsigned char reasonContinueAuth = 0x18; // Auth
+    const unsigned char reasonReAuth = 0x19;       // Auth
+    const unsigned char reasonUnspecified = 0x80;
+    const unsigned char reasonMalformed = 0x81;
+    const unsigned char reasonProtocolError = 0x82;
+    const unsigned char reasonNotAuthorized = 0x87;
+    const unsigned char reasonBadAuthMethod = 0x8C;
+    const unsigned char reasonKeepAliveTimeout = 0x8D; // DisConn
+    const unsigned char reasonSessionTakenOver = 0x8E; // DisConn
+    const unsigned char reasonTopicFilterInvalid = 0x8F;
+    const unsigned char reasonPacketIDInUse = 0x91;
+    const unsigned char reasonPacketTooLarge = 0x95;
+    const unsigned char reasonQuotaExceeded = 0x97;
+    const unsigned char reasonRetainNotSupported = 0x9A;
+    const unsigned char reasonQoSNotSupported = 0x9B;
+
     enum PropKeyType
     {
         propKeyPayloadFormatIndicator = 1, // byte, Packet: Will, Publish
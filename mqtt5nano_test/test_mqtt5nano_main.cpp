@@ -0,0 +1,2620 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <new>
+
+#include "mqtt5nano.h"
+#include "sessionStore.h"
+#include "publishQueue.h"
+#include "miniBroker.h"
+#include "latencyHistogram.h"
+#include "constPackets.h"
+#include "socketIO.h"
+#include "shardedBroker.h"
+#include "mpscPublishQueue.h"
+#include "retainedCache.h"
+#include "payloadCodec.h"
+#include "packetStream.h"
+#include "capture.h"
+#include "rpc.h"
+#include "timerWheel.h"
+#include "metrics.h"
+#include "trace.h"
+#include "commandLine.h"
+#include "badjson.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#endif
+
+using namespace std;
+using namespace knotfree;
+
+char assembly[1024];
+char wire[4 * 1024];
+
+void testBatch(); // below
+void testSubscribe();
+void testConnect();
+void testAuth();
+void testFlowControl();
+void testSessionStore();
+void testPublishQueue();
+void testTopicMatches();
+void testHistogram();
+void testConstPackets();
+void testBroker();
+void testSocketIO();
+void testShards();
+void testMpscQueue();
+void testParseEdges();
+void testUserProps();
+void testPayloadCodec();
+void testPacketStream();
+void testCapture();
+void testRpc();
+void testTimerWheel();
+void testRetainedCache();
+void testDedupe();
+void testMetrics();
+void testTrace();
+
+int main()
+{
+    cout << "hello mqtt5nano tests\n";
+
+    testBatch();
+    testSubscribe();
+    testConnect();
+    testAuth();
+    testFlowControl();
+    testSessionStore();
+    testPublishQueue();
+    testTopicMatches();
+    testHistogram();
+    testConstPackets();
+    testParseEdges();
+    testUserProps();
+    testPayloadCodec();
+    testPacketStream();
+    testCapture();
+    testTimerWheel();
+    testRpc();
+    testRetainedCache();
+    testDedupe();
+    testMetrics();
+    testTrace();
+#if defined(__linux__)
+    testSocketIO();
+    testBroker();
+    testShards();
+    testMpscQueue();
+#endif
+
+    cout << "done\n";
+}
+
+string str(slice s)
+{
+    char tmp[1024];
+    tmp[0] = 0;
+    return string(s.getCstr(tmp, sizeof(tmp)));
+}
+
+string hexstr(slice s)
+{
+    char tmp[2048];
+    return string(s.gethexstr(tmp, sizeof(tmp)));
+}
+
+// write some publish packets back to back and then parse them all at once.
+void testBatch()
+{
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+
+    const char *topics[] = {"a/b", "c", "dddd/eeee/ffff"};
+    const char *payloads[] = {"payload one", "2", "the third payload"};
+    for (int i = 0; i < 3; i++)
+    {
+        mqttPacketPieces pub;
+        pub.reset();
+        pub.packetType = CtrlPublish;
+        pub.QoS = 1;
+        pub.PacketID = 300 + i;
+        pub.TopicName = slice(topics[i]);
+        pub.Payload = slice(payloads[i]);
+        bool fail = pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+        if (fail)
+        {
+            cout << "FAIL outputPubOrSub\n";
+        }
+    }
+    slice written = out.dest.getWritten();
+    int total = written.size();
+    // chop the last packet in half.
+    written.end -= 5;
+
+    mqttPacketPieces pieces[8];
+    slice remainder;
+    intResult res = parseBatch(written, pieces, 8, remainder);
+    if (res.error || res.i != 2)
+    {
+        cout << "FAIL parseBatch got " << res.i << " packets\n";
+    }
+    for (int i = 0; i < res.i; i++)
+    {
+        if (str(pieces[i].TopicName) != topics[i] || str(pieces[i].Payload) != payloads[i] || pieces[i].PacketID != 300 + i)
+        {
+            cout << "FAIL parseBatch packet " << i << " got " << str(pieces[i].TopicName) << " " << str(pieces[i].Payload) << "\n";
+        }
+    }
+    if (remainder.end != total - 5 || remainder.size() == 0)
+    {
+        cout << "FAIL parseBatch remainder size " << remainder.size() << "\n";
+    }
+
+    // now give it the rest of the bytes.
+    remainder.end += 5;
+    res = parseBatch(remainder, pieces, 8, remainder);
+    if (res.error || res.i != 1 || remainder.size() != 0)
+    {
+        cout << "FAIL parseBatch second read got " << res.i << "\n";
+    }
+    if (str(pieces[0].Payload) != payloads[2])
+    {
+        cout << "FAIL parseBatch payload " << str(pieces[0].Payload) << "\n";
+    }
+
+    // not enough room in pieces.
+    res = parseBatch(out.dest.getWritten(), pieces, 1, remainder);
+    if (res.i != 1 || remainder.size() == 0)
+    {
+        cout << "FAIL parseBatch maxPieces\n";
+    }
+
+    // a broken remaining length
+    const char bad[] = {char(0x30), char(0xFF), char(0xFF), char(0xFF), char(0x01), 0, 0};
+    res = parseBatch(slice(bad, 0, sizeof(bad)), pieces, 8, remainder);
+    if (res.error == 0 || res.i != 0 || remainder.size() != sizeof(bad))
+    {
+        cout << "FAIL parseBatch bad length\n";
+    }
+    // a remaining length past 64k is bad, not partial, or a reader waits forever.
+    const char huge[] = {char(0x30), char(0x80), char(0x80), char(0x04), 0, 0};
+    slice hugePos(huge, 0, sizeof(huge));
+    unsigned char hugeFirst;
+    slice hugeBody;
+    res = parseBatch(hugePos, pieces, 8, remainder);
+    if (getPacket(hugePos, hugeFirst, hugeBody) != frameBad || res.error == 0 || res.i != 0)
+    {
+        cout << "FAIL parseBatch huge length\n";
+    }
+
+    // the packet id is big endian and a qos 0 publish has none.
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.TopicName = "t";
+    pub.Payload = "p";
+    pub.QoS = 1;
+    pub.PacketID = 0x1234;
+    out.dest.reset();
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    if (hexstr(out.dest.getWritten()) != "3207000174123400" "70" || pub.outputSize() != 9)
+    {
+        cout << "FAIL publish packet id " << hexstr(out.dest.getWritten()) << "\n";
+    }
+    pub.QoS = 0;
+    out.dest.reset();
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    if (hexstr(out.dest.getWritten()) != "30050001740070" || pub.outputSize() != 7)
+    {
+        cout << "FAIL publish qos 0 " << hexstr(out.dest.getWritten()) << "\n";
+    }
+
+    // one made on dirty memory without a reset writes the same bytes.
+    alignas(mqttPacketPieces) char dirty[sizeof(mqttPacketPieces)];
+    memset(dirty, 0xFF, sizeof(dirty));
+    mqttPacketPieces *fresh = new (dirty) mqttPacketPieces;
+    fresh->packetType = CtrlPublish;
+    fresh->TopicName = "t";
+    fresh->Payload = "p";
+    out.dest.reset();
+    fresh->outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    if (hexstr(out.dest.getWritten()) != "30050001740070")
+    {
+        cout << "FAIL publish from a new packet " << hexstr(out.dest.getWritten()) << "\n";
+    }
+}
+
+void testSubscribe()
+{
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+
+    subscribeFilter filters[3];
+    filters[0] = subscribeFilter("a/+", 1);
+    filters[1] = subscribeFilter("b/#", 2);
+    filters[1].NoLocal = true;
+    filters[1].RetainHandling = 2;
+    filters[2] = subscribeFilter("c", 0);
+    filters[2].RetainAsPublished = true;
+
+    mqttPacketPieces sub;
+    sub.reset();
+    sub.PacketID = 0x1234;
+    bool fail = sub.outputSubscribe(sink(assembly, sizeof(assembly)), &out, filters, 3, 5);
+    string got = hexstr(out.dest.getWritten());
+    string want = "82151234020b050003612f2b010003622f232600016308";
+    if (fail || got != want)
+    {
+        cout << "FAIL outputSubscribe got " << got << " wanted " << want << "\n";
+    }
+
+    out.dest.reset();
+    fail = sub.outputUnsubscribe(sink(assembly, sizeof(assembly)), &out, filters, 3);
+    got = hexstr(out.dest.getWritten());
+    want = "a2101234000003612f2b0003622f23000163";
+    if (fail || got != want)
+    {
+        cout << "FAIL outputUnsubscribe got " << got << " wanted " << want << "\n";
+    }
+
+    // a SubAck granting 1, failing the second and granting 0.
+    mqttBuffer1024 buf;
+    slice ack = buf.loadHexString("9006123400018700");
+    unsigned char firstByte;
+    slice body;
+    mqttPacketPieces pieces;
+    if (getPacket(ack, firstByte, body) != frameOk || pieces.parse(body, firstByte, body.size()))
+    {
+        cout << "FAIL parse SubAck\n";
+    }
+    if (pieces.PacketID != 0x1234 || pieces.applySubAck(filters, 3))
+    {
+        cout << "FAIL applySubAck\n";
+    }
+    if (filters[0].ReasonCode != reasonGrantedQoS1 || filters[1].ReasonCode != reasonNotAuthorized || filters[2].ReasonCode != reasonSuccess)
+    {
+        cout << "FAIL applySubAck codes\n";
+    }
+}
+
+void testConnect()
+{
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+
+    // the original with the hardcoded flags and keep alive.
+    mqttPacketPieces conn;
+    bool fail = conn.outputConnect(sink(assembly, sizeof(assembly)), &out, "client1", "u", "pw");
+    string got = hexstr(out.dest.getWritten());
+    string want = "101b00044d51545405c2003c000007636c69656e743100017500027077";
+    if (fail || got != want)
+    {
+        cout << "FAIL outputConnect got " << got << " wanted " << want << "\n";
+    }
+
+    connectOptions options;
+    options.ClientID = "c";
+    options.KeepAlive = 30;
+    options.SessionExpiry = 300;
+    options.ReceiveMaximum = 10;
+    options.MaximumPacketSize = 1024;
+    options.AuthMethod = "m";
+    options.WillTopic = "w";
+    options.WillPayload = "x";
+    options.WillQoS = 1;
+    options.WillRetain = true;
+    options.WillDelay = 5;
+
+    out.dest.reset();
+    fail = conn.outputConnect(sink(assembly, sizeof(assembly)), &out, options);
+    got = hexstr(out.dest.getWritten());
+    want = "102b00044d515454052e001e"
+           "11110000012c21000a27000004001500016d"
+           "000163"
+           "051800000005"
+           "000177000178";
+    if (fail || got != want)
+    {
+        cout << "FAIL outputConnect options got " << got << " wanted " << want << "\n";
+    }
+}
+
+// toyProof is a stand in for a real hmac. Do not use this for anything.
+void toyProof(const char *key, slice a, slice b, sink &dest)
+{
+    unsigned int h = 2166136261u;
+    for (const char *cP = key; *cP; cP++)
+        h = (h ^ (unsigned char)*cP) * 16777619u;
+    for (int i = 0; i < a.size(); i++)
+        h = (h ^ (unsigned char)a.base[a.start + i]) * 16777619u;
+    for (int i = 0; i < b.size(); i++)
+        h = (h ^ (unsigned char)b.base[b.start + i]) * 16777619u;
+    for (int i = 0; i < 4; i++)
+        dest.writeByte(h >> (i * 8));
+}
+
+// the client proves it has the device key and then checks that the server has it too.
+struct toyScram : authHandler
+{
+    const char *key = "Device_private_key";
+    slice clientNonce = "cnonce";
+    char serverNonce[32];
+    int serverNonceLen = 0;
+
+    slice method() override
+    {
+        return "TOY-SCRAM";
+    }
+    bool initial(sink &data) override
+    {
+        return data.write(clientNonce);
+    }
+    bool challenge(slice serverData, sink &response) override
+    {
+        serverNonceLen = serverData.getCstr(serverNonce, sizeof(serverNonce)) ? serverData.size() : 0;
+        toyProof(key, clientNonce, serverData, response);
+        return false;
+    }
+    bool finish(slice serverData) override
+    {
+        char tmp[8];
+        sink want(tmp, sizeof(tmp));
+        toyProof(key, slice(serverNonce, 0, serverNonceLen), clientNonce, want);
+        return !serverData.equals(slice(want));
+    }
+};
+
+// the broker's end of toyScram.
+bool toyBroker(mqttPacketPieces &fromClient, slice clientNonce, drain *toClient)
+{
+    char tmp[8];
+    sink expect(tmp, sizeof(tmp));
+    toyProof("Device_private_key", clientNonce, "snonce", expect);
+    if (!fromClient.findProperty(propKeyAuthData).equals(slice(expect)))
+    {
+        return true;
+    }
+    sink proof(tmp, sizeof(tmp));
+    toyProof("Device_private_key", "snonce", clientNonce, proof);
+    mqttPacketPieces reply;
+    reply.reset();
+    return reply.outputAuth(sink(assembly, sizeof(assembly)), toClient, reasonSuccess, "TOY-SCRAM", slice(proof));
+}
+
+void testAuth()
+{
+    char authData[64];
+    toyScram handler;
+    authExchange exchange(&handler, authData, sizeof(authData));
+
+    connectOptions options;
+    options.ClientID = "dev1";
+    exchange.start(options);
+    if (!options.AuthMethod.equals("TOY-SCRAM") || !options.AuthData.equals("cnonce"))
+    {
+        cout << "FAIL authExchange start\n";
+    }
+
+    sinkDrain toBroker;
+    toBroker.dest = sink(wire, sizeof(wire));
+    sinkDrain toClient;
+    char wire2[1024];
+    toClient.dest = sink(wire2, sizeof(wire2));
+    mqttPacketPieces conn;
+    conn.outputConnect(sink(assembly, sizeof(assembly)), &toBroker, options);
+
+    // the broker asks to continue with its nonce.
+    mqttPacketPieces challenge;
+    challenge.reset();
+    challenge.outputAuth(sink(assembly, sizeof(assembly)), &toClient, reasonContinueAuth, "TOY-SCRAM", "snonce");
+
+    slice pos = toClient.dest.getWritten();
+    unsigned char firstByte;
+    slice body;
+    mqttPacketPieces fromBroker;
+    getPacket(pos, firstByte, body);
+    fromBroker.parse(body, firstByte, body.size());
+    if (fromBroker.packetType != CtrlAuth || fromBroker.ReasonCode != reasonContinueAuth)
+    {
+        cout << "FAIL parse Auth\n";
+    }
+    toBroker.dest.reset();
+    if (exchange.onPacket(fromBroker, sink(assembly, sizeof(assembly)), &toBroker) != authInProgress)
+    {
+        cout << "FAIL authExchange challenge\n";
+    }
+
+    // the broker checks the proof and sends its own.
+    pos = toBroker.dest.getWritten();
+    mqttPacketPieces fromClient;
+    getPacket(pos, firstByte, body);
+    fromClient.parse(body, firstByte, body.size());
+    toClient.dest.reset();
+    if (fromClient.ReasonCode != reasonContinueAuth || toyBroker(fromClient, handler.clientNonce, &toClient))
+    {
+        cout << "FAIL toyBroker rejected the proof\n";
+    }
+    pos = toClient.dest.getWritten();
+    getPacket(pos, firstByte, body);
+    fromBroker.parse(body, firstByte, body.size());
+    if (exchange.onPacket(fromBroker, sink(assembly, sizeof(assembly)), &toBroker) != authSucceeded)
+    {
+        cout << "FAIL authExchange finish\n";
+    }
+
+    // a ConnAck with the wrong method fails.
+    mqttBuffer1024 buf;
+    slice connack = buf.loadHexString("200700000515000178");
+    getPacket(connack, firstByte, body);
+    fromBroker.parse(body, firstByte, body.size());
+    exchange.state = authInProgress;
+    if (fromBroker.packetType != CtrlConnAck || exchange.onPacket(fromBroker, sink(assembly, sizeof(assembly)), &toBroker) != authFailed)
+    {
+        cout << "FAIL authExchange wrong method\n";
+    }
+}
+
+void testFlowControl()
+{
+    // ConnAck: receive max 2, max packet 64, max qos 1, no retain, keep alive 30.
+    mqttBuffer1024 buf;
+    slice connack = buf.loadHexString("20120000" "0f" "210002" "2700000040" "2401" "2500" "13001e");
+    unsigned char firstByte;
+    slice body;
+    mqttPacketPieces ack;
+    if (getPacket(connack, firstByte, body) != frameOk || ack.parse(body, firstByte, body.size()))
+    {
+        cout << "FAIL parse ConnAck\n";
+    }
+    sendWindow window;
+    if (window.limits.load(ack))
+    {
+        cout << "FAIL serverLimits load\n";
+    }
+    serverLimits &l = window.limits;
+    if (l.ReceiveMaximum != 2 || l.MaximumPacketSize != 64 || l.MaximumQoS != 1 || l.RetainAvailable || l.keepAlive(60) != 30)
+    {
+        cout << "FAIL serverLimits values\n";
+    }
+
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.TopicName = "t";
+    pub.Payload = "hello";
+    pub.UserKeyVal[0] = "k";
+    pub.UserKeyVal[1] = "v";
+    pub.QoS = 2;
+    if (window.publish(pub, sink(assembly, sizeof(assembly)), &out) != reasonQoSNotSupported)
+    {
+        cout << "FAIL sendWindow max qos\n";
+    }
+    pub.QoS = 1;
+    pub.Retain = true;
+    if (window.publish(pub, sink(assembly, sizeof(assembly)), &out) != reasonRetainNotSupported)
+    {
+        cout << "FAIL sendWindow retain not available\n";
+    }
+    pub.Retain = false;
+    for (int i = 0; i < 2; i++)
+    {
+        out.dest.reset();
+        if (window.publish(pub, sink(assembly, sizeof(assembly)), &out) != reasonSuccess)
+        {
+            cout << "FAIL sendWindow publish\n";
+        }
+        if (pub.outputSize() != out.dest.getWritten().size())
+        {
+            cout << "FAIL outputSize " << pub.outputSize() << " wrote " << out.dest.getWritten().size() << "\n";
+        }
+    }
+    if (window.publish(pub, sink(assembly, sizeof(assembly)), &out) != reasonQuotaExceeded)
+    {
+        cout << "FAIL sendWindow receive maximum\n";
+    }
+    slice puback = buf.loadHexString("40020001");
+    getPacket(puback, firstByte, body);
+    ack.parse(body, firstByte, body.size());
+    window.onPacket(ack);
+    if (ack.PacketID != 1 || window.inFlight != 1)
+    {
+        cout << "FAIL sendWindow PubAck\n";
+    }
+    pub.Payload = "this payload will make the packet bigger than the 64 bytes the server takes";
+    if (window.publish(pub, sink(assembly, sizeof(assembly)), &out) != reasonPacketTooLarge)
+    {
+        cout << "FAIL sendWindow max packet size\n";
+    }
+}
+
+// makePub encodes a qos 1 publish into dest and returns it.
+slice makePub(sink dest, unsigned short id, const char *payload)
+{
+    sinkDrain out;
+    out.dest = dest;
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.packetType = CtrlPublish;
+    pub.QoS = 1;
+    pub.PacketID = id;
+    pub.TopicName = "session/test";
+    pub.Payload = payload;
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    return out.dest.getWritten();
+}
+
+// checkReplay parses what the store replays and checks the ids and the dup flags.
+void checkReplay(sessionStore &store, const char *name, unsigned short *ids, int count)
+{
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    if (store.replay(&out))
+    {
+        cout << "FAIL " << name << " replay\n";
+    }
+    slice pos = out.dest.getWritten();
+    for (int i = 0; i < count; i++)
+    {
+        unsigned char firstByte;
+        slice body;
+        mqttPacketPieces pub;
+        if (getPacket(pos, firstByte, body) != frameOk || pub.parse(body, firstByte, body.size()))
+        {
+            cout << "FAIL " << name << " replay parse " << i << "\n";
+            return;
+        }
+        if (pub.PacketID != ids[i] || (firstByte & 0x08) == 0)
+        {
+            cout << "FAIL " << name << " replay got id " << pub.PacketID << " wanted " << ids[i] << "\n";
+        }
+    }
+    if (pos.size() != 0)
+    {
+        cout << "FAIL " << name << " replay has extra bytes\n";
+    }
+}
+
+void testSessionStore()
+{
+    char buf[256];
+    sessionEntry entries[8];
+    const char *path = "/tmp/mqtt5nano_session_test.log";
+    unlink(path);
+    {
+        fileSessionStore store(entries, 8);
+        store.open(path);
+        for (unsigned short id = 1; id <= 3; id++)
+        {
+            store.save(id, makePub(sink(buf, sizeof(buf)), id, "some payload"));
+        }
+        store.forget(2);
+    }
+    // like after a reboot
+    fileSessionStore store(entries, 8);
+    store.open(path);
+    unsigned short want[] = {1, 3};
+    if (store.pending() != 2)
+    {
+        cout << "FAIL fileSessionStore pending " << store.pending() << "\n";
+    }
+    checkReplay(store, "fileSessionStore", want, 2);
+
+    // a torn record at the end is dropped.
+    store.close();
+    FILE *f = fopen(path, "ab");
+    fwrite("P\0\0\x09\0\x40junk", 1, 10, f);
+    fclose(f);
+    store.open(path);
+    checkReplay(store, "fileSessionStore torn", want, 2);
+    store.save(4, makePub(sink(buf, sizeof(buf)), 4, "after the tear"));
+    unsigned short want2[] = {1, 3, 4};
+    checkReplay(store, "fileSessionStore after torn", want2, 3);
+
+    // compaction keeps just the live ones.
+    store.compactAfter = 0;
+    store.forget(1);
+    if (store.logSize != store.liveBytes)
+    {
+        cout << "FAIL fileSessionStore compact\n";
+    }
+    store.close();
+    store.open(path);
+    checkReplay(store, "fileSessionStore compact", want2 + 1, 2);
+    store.close();
+    unlink(path);
+
+    // the flash ring. 6 sectors of 256 bytes and one publish fills most of a sector so it wraps a lot.
+    string big(150, 'x');
+    const char *flashPath = "/tmp/mqtt5nano_flash_test.bin";
+    unlink(flashPath);
+    {
+        fileFlashRegion flash(6 * 256, 256);
+        flash.open(flashPath);
+        flashSessionStore ring(&flash, entries, 8);
+        ring.open();
+        for (unsigned short id = 1; id <= 14; id++)
+        {
+            if (ring.save(id, makePub(sink(buf, sizeof(buf)), id, big.c_str())))
+            {
+                cout << "FAIL flashSessionStore save " << id << "\n";
+            }
+            // keep 7 and the last two
+            if (id > 2 && id - 2 != 7)
+            {
+                ring.forget(id - 2);
+            }
+        }
+    }
+    fileFlashRegion flash(6 * 256, 256);
+    flash.open(flashPath);
+    flashSessionStore ring(&flash, entries, 8);
+    ring.open();
+    unsigned short want3[] = {7, 13, 14};
+    if (ring.pending() != 3)
+    {
+        cout << "FAIL flashSessionStore pending " << ring.pending() << "\n";
+    }
+    checkReplay(ring, "flashSessionStore", want3, 3);
+    unlink(flashPath);
+
+    // reclaim copies 1 forward past 5 and 6. It must still come back first after a reboot.
+    string mid(60, 'x');
+    {
+        fileFlashRegion small(4 * 256, 256);
+        small.open(flashPath);
+        flashSessionStore order(&small, entries, 8);
+        order.open();
+        unsigned short saves[] = {1, 2, 3, 0, 0, 4, 5, 6, 0, 7, 8};
+        unsigned short forgets[] = {0, 0, 0, 2, 3, 0, 0, 0, 4, 0, 0};
+        for (int i = 0; i < 11; i++)
+        {
+            if (saves[i] && order.save(saves[i], makePub(sink(buf, sizeof(buf)), saves[i], mid.c_str())))
+            {
+                cout << "FAIL flashSessionStore order save " << saves[i] << "\n";
+            }
+            if (forgets[i])
+            {
+                order.forget(forgets[i]);
+            }
+        }
+        unsigned short want4[] = {1, 5, 6, 7, 8};
+        checkReplay(order, "flashSessionStore order", want4, 5);
+        order.open();
+        checkReplay(order, "flashSessionStore order reopened", want4, 5);
+    }
+    unlink(flashPath);
+
+    // fill the ring without acks. Saves past two sectors less than the ring fail
+    // and what was taken comes back whole after a reboot.
+    unsigned short kept[9];
+    int took = 0;
+    {
+        fileFlashRegion small(4 * 256, 256);
+        small.open(flashPath);
+        flashSessionStore full(&small, entries, 8);
+        full.open();
+        for (unsigned short id = 1; id <= 8; id++)
+        {
+            if (full.save(id, makePub(sink(buf, sizeof(buf)), id, mid.c_str())) == false)
+            {
+                kept[took++] = id;
+            }
+        }
+        // a ring record is a 12 byte header and the packet padded to 4.
+        int record = 12 + ((makePub(sink(buf, sizeof(buf)), 1, mid.c_str()).size() + 3) & ~3);
+        if (took == 0 || took == 8 || took * record > 2 * (256 - 8))
+        {
+            cout << "FAIL flashSessionStore full took " << took << "\n";
+        }
+        // an ack makes room again.
+        full.forget(kept[0]);
+        if (full.save(100, makePub(sink(buf, sizeof(buf)), 100, mid.c_str())))
+        {
+            cout << "FAIL flashSessionStore save after forget\n";
+        }
+        kept[took] = 100;
+    }
+    {
+        fileFlashRegion small(4 * 256, 256);
+        small.open(flashPath);
+        flashSessionStore full(&small, entries, 8);
+        full.open();
+        checkReplay(full, "flashSessionStore full", kept + 1, took);
+    }
+    unlink(flashPath);
+
+    // a spare that isn't erased, like after a failed reclaim, is never written over.
+    {
+        fileFlashRegion small(4 * 256, 256);
+        small.open(flashPath);
+        flashSessionStore stuck(&small, entries, 8);
+        stuck.open();
+        const char header[8] = {'K', 'S', 'S', '1', 0, 0, 0, 99};
+        small.write(256, header, 8);
+        int saved = 0;
+        for (unsigned short id = 1; id <= 4; id++)
+        {
+            saved += stuck.save(id, makePub(sink(buf, sizeof(buf)), id, mid.c_str())) == false;
+        }
+        char sector1[256];
+        small.read(256, sector1, 256);
+        bool erased = true;
+        for (int i = 8; i < 256; i++)
+        {
+            erased &= (unsigned char)sector1[i] == 0xFF;
+        }
+        if (saved != 2 || !erased)
+        {
+            cout << "FAIL flashSessionStore wrote a sector that isn't erased\n";
+        }
+    }
+    unlink(flashPath);
+}
+
+// drainedTopics parses what came out of a queue and joins the topics and payloads.
+string drainedTopics(slice pos)
+{
+    string got;
+    unsigned char firstByte;
+    slice body;
+    while (getPacket(pos, firstByte, body) == frameOk)
+    {
+        mqttPacketPieces pub;
+        pub.parse(body, firstByte, body.size());
+        got += str(pub.TopicName) + "=" + str(pub.Payload).substr(0, 1);
+        if (pub.MessageExpiry)
+        {
+            got += "/" + std::to_string(pub.MessageExpiry);
+        }
+        got += " ";
+    }
+    return got;
+}
+
+void testPublishQueue()
+{
+    char qbuf[100];
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.QoS = 1;
+    pub.PacketID = 1;
+
+    // these are 29 bytes so only 3 fit.
+    publishQueue q(qbuf, sizeof(qbuf), dropOldest);
+    const char *topics[] = {"t1", "t2", "t1", "t3", "t2"};
+    string payloads[5];
+    for (int i = 0; i < 5; i++)
+    {
+        payloads[i] = string(20, 'a' + i);
+    }
+    for (int i = 0; i < 5; i++)
+    {
+        pub.TopicName = topics[i];
+        pub.Payload = payloads[i].c_str();
+        q.push(pub, sink(assembly, sizeof(assembly)));
+    }
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    int n = q.drainTo(&out, 1000);
+    string got = drainedTopics(out.dest.getWritten());
+    if (n != 3 || got != "t1=c t3=d t2=e " || q.dropped != 2 || !q.empty())
+    {
+        cout << "FAIL publishQueue dropOldest got " << got << "\n";
+    }
+
+    publishQueue q2(qbuf, sizeof(qbuf), dropNewest);
+    for (int i = 0; i < 5; i++)
+    {
+        pub.TopicName = topics[i];
+        pub.Payload = payloads[i].c_str();
+        bool dropped = q2.push(pub, sink(assembly, sizeof(assembly)));
+        if (dropped != (i >= 3))
+        {
+            cout << "FAIL publishQueue dropNewest " << i << "\n";
+        }
+    }
+    // just the first two fit the budget.
+    out.dest.reset();
+    n = q2.drainTo(&out, 60);
+    got = drainedTopics(out.dest.getWritten());
+    if (n != 2 || got != "t1=a t2=b ")
+    {
+        cout << "FAIL publishQueue drainTo budget got " << got << "\n";
+    }
+    // push more so it wraps.
+    pub.TopicName = "t4";
+    pub.Payload = "ffffffffffffffffffff";
+    q2.push(pub, sink(assembly, sizeof(assembly)));
+    out.dest.reset();
+    n = q2.drainTo(&out, 1000);
+    got = drainedTopics(out.dest.getWritten());
+    if (n != 2 || got != "t1=c t4=f ")
+    {
+        cout << "FAIL publishQueue wrapped got " << got << "\n";
+    }
+
+    publishQueue q3(qbuf, sizeof(qbuf), coalesceByTopic);
+    for (int i = 0; i < 5; i++)
+    {
+        pub.TopicName = topics[i];
+        pub.Payload = payloads[i].c_str();
+        q3.push(pub, sink(assembly, sizeof(assembly)));
+    }
+    out.dest.reset();
+    n = q3.drainTo(&out, 1000);
+    got = drainedTopics(out.dest.getWritten());
+    if (n != 3 || got != "t1=c t3=d t2=e ")
+    {
+        cout << "FAIL publishQueue coalesceByTopic got " << got << "\n";
+    }
+
+    // message expiry. 30 seconds later the first has run out and the next goes with what's left.
+    char ebuf[200];
+    publishQueue q4(ebuf, sizeof(ebuf), dropNewest);
+    const char *expiring[] = {"e1", "e2", "e3"};
+    unsigned int expiries[] = {10, 100, 0};
+    for (int i = 0; i < 3; i++)
+    {
+        pub.TopicName = expiring[i];
+        pub.Payload = payloads[i].c_str();
+        pub.MessageExpiry = expiries[i];
+        q4.push(pub, sink(assembly, sizeof(assembly)), 1000);
+    }
+    pub.MessageExpiry = 0;
+    // a write that fails leaves them as they were.
+    sinkDrain tiny;
+    tiny.dest = sink(wire, 10);
+    n = q4.drainTo(&tiny, 1000, 1030);
+    out.dest.reset();
+    n = q4.drainTo(&out, 1000, 1030);
+    got = drainedTopics(out.dest.getWritten());
+    if (n != 2 || got != "e2=b/70 e3=c " || q4.expired != 1 || !q4.empty())
+    {
+        cout << "FAIL publishQueue expiry got " << got << "\n";
+    }
+}
+
+void testTopicMatches()
+{
+    struct
+    {
+        const char *filter;
+        const char *topic;
+        bool want;
+    } cases[] = {
+        {"a/b", "a/b", true},
+        {"a/b", "a/bc", false},
+        {"a/+", "a/b", true},
+        {"a/+", "a/b/c", false},
+        {"a/+", "a/", true},
+        {"a/+/c", "a//c", true},
+        {"+/+", "/x", true},
+        {"a/#", "a", true},
+        {"a/#", "a/b/c", true},
+        {"#", "a/b", true},
+        {"#", "$SYS/x", false},
+        {"+/x", "$SYS/x", false},
+        {"$SYS/#", "$SYS/x", true},
+        {"a/b/+", "a/b", false},
+        {"a/b", "a", false},
+    };
+    for (auto &c : cases)
+    {
+        if (topicMatches(c.filter, c.topic) != c.want)
+        {
+            cout << "FAIL topicMatches " << c.filter << " " << c.topic << "\n";
+        }
+    }
+}
+
+void testHistogram()
+{
+    latencyHistogram h;
+    for (int i = 1; i <= 100000; i++)
+    {
+        h.record(i * 10ULL);
+    }
+    double want[] = {50, 99, 99.9};
+    for (double p : want)
+    {
+        double got = h.percentile(p);
+        double exact = p * 10000;
+        if (got < exact * 0.97 || got > exact * 1.03)
+        {
+            cout << "FAIL latencyHistogram p" << p << " got " << got << " wanted " << exact << "\n";
+        }
+    }
+    latencyHistogram other;
+    other.record(5);
+    h.merge(other);
+    if (h.min != 5 || h.max != 1000000 || h.total != 100001 || h.percentile(0) != 5)
+    {
+        cout << "FAIL latencyHistogram merge\n";
+    }
+}
+
+void testConstPackets()
+{
+    // they must be the same bytes that the run time encoders make.
+    static constexpr auto ping = pingReqPacket();
+    static constexpr auto bye = disconnectPacket();
+    static constexpr auto hello = connectPacket("dev1", 30);
+    static constexpr auto login = connectPacket("dev1", "u", "pw");
+    static constexpr auto sub = subscribePacket("a/b", 7, 1);
+    static constexpr auto online = publishPacket("dev1/status", "online", true);
+    static_assert(sizeof(hello) == 19 && hello.bytes[1] == 17, "connectPacket length");
+
+    sinkDrain out;
+    if (hexstr(ping.asSlice()) != "c000" || hexstr(bye.asSlice()) != "e000")
+    {
+        cout << "FAIL constPacket ping or disconnect\n";
+    }
+    mqttPacketPieces p;
+    connectOptions opts;
+    opts.ClientID = "dev1";
+    opts.KeepAlive = 30;
+    out.dest = sink(wire, sizeof(wire));
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    if (hexstr(out.dest.getWritten()) != hexstr(hello.asSlice()))
+    {
+        cout << "FAIL constPacket connect " << hexstr(hello.asSlice()) << "\n";
+    }
+    opts.KeepAlive = 60;
+    opts.UserName = "u";
+    opts.Password = "pw";
+    out.dest = sink(wire, sizeof(wire));
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    if (hexstr(out.dest.getWritten()) != hexstr(login.asSlice()))
+    {
+        cout << "FAIL constPacket connect with password " << hexstr(login.asSlice()) << "\n";
+    }
+    subscribeFilter filter("a/b", 1);
+    p.PacketID = 7;
+    out.dest = sink(wire, sizeof(wire));
+    p.outputSubscribe(sink(assembly, sizeof(assembly)), &out, &filter, 1, 0);
+    if (hexstr(out.dest.getWritten()) != hexstr(sub.asSlice()))
+    {
+        cout << "FAIL constPacket subscribe " << hexstr(sub.asSlice()) << "\n";
+    }
+    p.reset();
+    p.packetType = CtrlPublish;
+    p.TopicName = "dev1/status";
+    p.Payload = "online";
+    out.dest = sink(wire, sizeof(wire));
+    p.Retain = true;
+    p.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    if (hexstr(out.dest.getWritten()) != hexstr(online.asSlice()))
+    {
+        cout << "FAIL constPacket publish " << hexstr(online.asSlice()) << "\n";
+    }
+    // and they write like any other.
+    out.dest = sink(wire, sizeof(wire));
+    if (login.writeTo(&out) || out.dest.start != login.length())
+    {
+        cout << "FAIL constPacket writeTo\n";
+    }
+}
+
+// the holes the fuzzers found or were pointed at. fuzz/ has the rest.
+void testParseEdges()
+{
+    // props longer than 127 take two bytes of length, low 7 bits first.
+    string big(150, 'r');
+    mqttPacketPieces p;
+    p.reset();
+    p.packetType = CtrlPublish;
+    p.TopicName = "t";
+    p.RespTopic = slice(big.data(), 0, big.size());
+    p.Payload = "pay";
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    p.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    slice pos = out.dest.getWritten();
+    unsigned char firstByte;
+    slice body;
+    mqttPacketPieces q;
+    if (getPacket(pos, firstByte, body) != frameOk || q.parse(body, firstByte, body.size()) ||
+        q.RespTopic.size() != 150 || str(q.Payload) != "pay" || q.PacketID != 0)
+    {
+        cout << "FAIL parse of long props\n";
+    }
+    // a props length past the end of the packet.
+    const char bad[] = {0, 1, 't', 0x7F, 1};
+    if (q.parse(slice(bad, 0, sizeof(bad)), 0x30, sizeof(bad)) == false)
+    {
+        cout << "FAIL parse of props past the end\n";
+    }
+    // a 4 byte prop with 2 bytes left.
+    const char shortProp[] = {0, 1, 't', 3, 2, 0, 0};
+    if (q.parse(slice(shortProp, 0, sizeof(shortProp)), 0x30, sizeof(shortProp)) == false)
+    {
+        cout << "FAIL parse of a short prop\n";
+    }
+    if (getPropertyLenCode(42) != 0x01 || getPropertyLenCode(43) != 0xFF || getPropertyLenCode(-1) != 0xFF)
+    {
+        cout << "FAIL getPropertyLenCode bounds\n";
+    }
+    // writeFixedLenStr writes all or nothing and never moves the end.
+    char tiny[6];
+    sink s(tiny, sizeof(tiny));
+    if (s.writeFixedLenStr(slice("abcde")) == false || s.start != 0 || s.end != 6)
+    {
+        cout << "FAIL writeFixedLenStr that doesn't fit\n";
+    }
+    if (s.writeFixedLenStr(slice("abcd")) || s.start != 6 || s.end != 6 || tiny[1] != 4)
+    {
+        cout << "FAIL writeFixedLenStr\n";
+    }
+}
+
+// matchAll is the topics that match filter, sorted, like "a/b,a/c".
+string matchAll(retainedCache &cache, const char *filter)
+{
+    std::vector<string> got;
+    retainedMatch it = cache.match(slice(filter));
+    retainedMessage m;
+    while (it.next(m))
+    {
+        got.push_back(str(m.topic));
+    }
+    std::sort(got.begin(), got.end());
+    string all;
+    for (auto &t : got)
+    {
+        all += (all.empty() ? "" : ",") + t;
+    }
+    return all;
+}
+
+// a publish with 10 user props, more than UserKeyVal holds, and a repeated key.
+void testUserProps()
+{
+    char propBuf[512];
+    sink props(propBuf, sizeof(propBuf));
+    const char *keys[] = {"tenant", "trace", "a", "b", "c", "d", "e", "trace", "span", ""};
+    const char *vals[] = {"acme", "t1", "1", "2", "3", "4", "5", "t2", "s9", "empty"};
+    props.writeByte(propKeyRespTopic);
+    props.writeFixedLenStr("resp");
+    for (int i = 0; i < 10; i++)
+    {
+        props.writeByte(propKeyUserProps);
+        props.writeFixedLenStr(keys[i]);
+        props.writeFixedLenStr(vals[i]);
+    }
+    slice propsDone = slice(propBuf, 0, props.start);
+    sink b(wire, sizeof(wire));
+    b.writeFixedLenStr("t");
+    b.writeLittleEndianVarLenInt(propsDone.size());
+    b.write(propsDone);
+    b.write("pay");
+    slice body(wire, 0, b.start);
+
+    mqttPacketPieces p;
+    p.reset();
+    if (p.parse(body, CtrlPublish * 16, body.size()) || str(p.Payload) != "pay" || str(p.RespTopic) != "resp")
+    {
+        cout << "FAIL user props parse\n";
+        return;
+    }
+    // the first 4 are in UserKeyVal and findKey finds the rest in props.
+    if (str(p.findKey("tenant")) != "acme" || str(p.findKey("b")) != "2" || str(p.findKey("e")) != "5" ||
+        str(p.findKey("trace")) != "t1" || str(p.findKey("span")) != "s9" || str(p.findKey("")) != "empty" ||
+        p.findKey("nope").base != 0)
+    {
+        cout << "FAIL findKey " << str(p.findKey("tenant")) << " " << str(p.findKey("span")) << "\n";
+    }
+
+    slice pairs[2 * 16];
+    unsigned short index[32];
+    userPropertyView view(pairs, 16, index, 32);
+    if (view.load(p.props) || view.count != 10 || view.truncated)
+    {
+        cout << "FAIL userPropertyView load " << view.count << "\n";
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        if (str(view.key(i)) != keys[i] || str(view.value(i)) != vals[i])
+        {
+            cout << "FAIL userPropertyView pair " << i << "\n";
+        }
+    }
+    if (str(view.find("trace")) != "t1" || str(view.find("span")) != "s9" || str(view.find("")) != "empty" ||
+        view.find("tracer").base != 0 || view.findNext(1) != 7 || view.findNext(7) != -1)
+    {
+        cout << "FAIL userPropertyView find\n";
+    }
+
+    // a small view keeps what fits.
+    userPropertyView small(pairs, 3, index, 4);
+    if (small.load(p.props) || small.count != 3 || small.truncated == false ||
+        str(small.find("a")) != "1" || small.find("b").base != 0)
+    {
+        cout << "FAIL userPropertyView truncated\n";
+    }
+
+    // broken props fail.
+    if (view.load(slice(propBuf, 0, propsDone.size() - 1)) == false)
+    {
+        cout << "FAIL userPropertyView broken props\n";
+    }
+}
+
+// lz4 on its own and then a compressed publish there and back.
+void testPayloadCodec()
+{
+    // a block made by hand: a literal, a match 1 back 14 long and the last 5 literals.
+    char plain[2048];
+    sink d(plain, sizeof(plain));
+    if (lz4Decompress(slice("\x1a\x61\x01\x00\x50\x61\x61\x61\x61\x61", 0, 10), d) ||
+        str(slice(plain, 0, d.start)) != string(20, 'a'))
+    {
+        cout << "FAIL lz4Decompress " << d.start << "\n";
+    }
+    // the offset can't go back before the start.
+    d = sink(plain, sizeof(plain));
+    if (lz4Decompress(slice("\x1a\x61\x02\x00\x50\x61\x61\x61\x61\x61", 0, 10), d) == false)
+    {
+        cout << "FAIL lz4Decompress bad offset\n";
+    }
+
+    static unsigned short table[1 << 12];
+    char block[2048];
+    string json;
+    for (int i = 0; json.size() < 1000; i++)
+    {
+        json += "{\"device\":\"pump-7\",\"temp\":" + to_string(20 + i % 7) + ",\"rpm\":" + to_string(1400 + i % 13) + ",\"ok\":true}";
+    }
+    string samples[] = {"", "a", "abcdabcdabcdabcd", string(300, 'z'), json};
+    for (string &sample : samples)
+    {
+        for (int bits = 8; bits <= 12; bits += 4)
+        {
+            sink c(block, sizeof(block));
+            d = sink(plain, sizeof(plain));
+            slice src(sample.data(), 0, sample.size());
+            if (lz4Compress(src, c, table, bits) || lz4Decompress(slice(block, 0, c.start), d) ||
+                string(plain, d.start) != sample)
+            {
+                cout << "FAIL lz4 round trip " << sample.size() << " " << bits << "\n";
+            }
+            if (sample == json && c.start * 3 > int(sample.size()))
+            {
+                cout << "FAIL lz4 json only went from " << sample.size() << " to " << c.start << "\n";
+            }
+        }
+    }
+    // too small a dest fails.
+    sink tiny(block, 20);
+    if (lz4Compress(slice(json.data(), 0, json.size()), tiny, table, 8) == false)
+    {
+        cout << "FAIL lz4Compress into too small\n";
+    }
+
+    slice filters[] = {"telemetry/#"};
+    payloadCodec codec(table, 8, filters, 1);
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.TopicName = "telemetry/pump-7";
+    pub.Payload = slice(json.data(), 0, json.size());
+    pub.UserKeyVal[0] = "tenant";
+    pub.UserKeyVal[1] = "acme";
+    if (codec.encode(pub, sink(block, sizeof(block))) == false || pub.Payload.size() * 3 > int(json.size()) ||
+        str(pub.findKey(codecKey)) != codecLZ4)
+    {
+        cout << "FAIL payloadCodec encode " << pub.Payload.size() << "\n";
+    }
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    slice pos = out.dest.getWritten();
+    unsigned char firstByte;
+    slice body;
+    mqttPacketPieces q;
+    q.reset();
+    if (getPacket(pos, firstByte, body) != frameOk || q.parse(body, firstByte, body.size()))
+    {
+        cout << "FAIL payloadCodec parse\n";
+        return;
+    }
+    payloadView view(q, plain, sizeof(plain));
+    if (view.compressed == false || view.plainSize() != int(json.size()) || string(view.get().base + view.get().start, view.get().size()) != json ||
+        str(q.findKey("tenant")) != "acme")
+    {
+        cout << "FAIL payloadView\n";
+    }
+    // too small a buffer gives a null base.
+    payloadView small(q, plain, 100);
+    if (small.get().base != 0)
+    {
+        cout << "FAIL payloadView small buffer\n";
+    }
+
+    // other topics, small payloads and ones that don't shrink go as they are.
+    mqttPacketPieces other;
+    other.reset();
+    other.TopicName = "config/pump-7";
+    other.Payload = slice(json.data(), 0, json.size());
+    if (codec.encode(other, sink(block, sizeof(block))) || other.Payload.base != json.data())
+    {
+        cout << "FAIL payloadCodec other topic\n";
+    }
+    other.TopicName = "telemetry/x";
+    other.Payload = "small";
+    string noise;
+    unsigned int r = 12345;
+    for (int i = 0; i < 200; i++)
+    {
+        r = r * 1103515245 + 12345;
+        noise += char(r >> 16);
+    }
+    bool small1 = codec.encode(other, sink(block, sizeof(block)));
+    other.Payload = slice(noise.data(), 0, noise.size());
+    if (small1 || codec.encode(other, sink(block, sizeof(block))) || other.UserKeyVal[0].base != 0)
+    {
+        cout << "FAIL payloadCodec small or noise\n";
+    }
+    payloadView plainView(other, plain, sizeof(plain));
+    if (plainView.compressed || plainView.get().base != noise.data())
+    {
+        cout << "FAIL payloadView plain\n";
+    }
+}
+
+// countingFount makes len bytes that are easy to check, more than a slice can hold.
+struct countingFount : fount
+{
+    unsigned int pos;
+    unsigned int len;
+    countingFount(unsigned int len) : pos(0), len(len) {}
+    unsigned char readByte() override
+    {
+        return pos < len ? (pos++ * 31) % 251 : 0;
+    }
+    bool empty() override
+    {
+        return pos >= len;
+    }
+};
+
+// streamChecker checks what a packetStreamReader hands it against a countingFount.
+struct streamChecker : packetStreamHandler
+{
+    int packets = 0;
+    int starts = 0;
+    int ends = 0;
+    int chunks = 0;
+    unsigned int payloadLen = 0;
+    unsigned int got = 0;
+    bool bad = false;
+    string topic;
+    string key;
+
+    bool onPacket(unsigned char firstByte, slice body) override
+    {
+        packets++;
+        return false;
+    }
+    bool onPublishStart(mqttPacketPieces &pub, unsigned int len) override
+    {
+        starts++;
+        payloadLen = len;
+        got = 0;
+        topic = str(pub.TopicName);
+        key = str(pub.findKey("part"));
+        return false;
+    }
+    bool onPublishChunk(slice chunk) override
+    {
+        chunks++;
+        for (int i = chunk.start; i < chunk.end; i++)
+        {
+            bad |= (unsigned char)chunk.base[i] != (got++ * 31) % 251;
+        }
+        return false;
+    }
+    bool onPublishEnd() override
+    {
+        ends++;
+        return false;
+    }
+};
+
+// readerDrain feeds what's written to it into a reader, a few bytes at a time.
+struct readerDrain : drain
+{
+    packetStreamReader *reader;
+    int piece;
+    bool writeByte(char c) override
+    {
+        return reader->feed(slice(&c, 0, 1));
+    }
+    using drain::write;
+    bool write(slice s) override
+    {
+        bool fail = false;
+        while (s.empty() == false && fail == false)
+        {
+            slice part = s;
+            if (part.size() > piece)
+            {
+                part.end = part.start + piece;
+            }
+            fail = reader->feed(part);
+            s.start = part.end;
+        }
+        return fail;
+    }
+};
+
+// a 300k publish goes through a 256 byte buffer on both ends.
+void testPacketStream()
+{
+    char header[256];
+    streamChecker checker;
+    packetStreamReader reader(header, sizeof(header), &checker);
+    readerDrain d;
+    d.reader = &reader;
+    d.piece = 1000;
+
+    mqttPacketPieces ack;
+    ack.outputAck(sink(assembly, sizeof(assembly)), &d, CtrlPubAck, 7, 0);
+
+    unsigned int big = 300 * 1000;
+    countingFount f(big);
+    char chunk[200];
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.TopicName = "ota/pump-7";
+    pub.QoS = 1;
+    pub.PacketID = 8;
+    pub.UserKeyVal[0] = "part";
+    pub.UserKeyVal[1] = "1 of 1";
+    if (pub.outputPublishStream(sink(assembly, sizeof(assembly)), &d, f, big, sink(chunk, sizeof(chunk))) ||
+        checker.starts != 1 || checker.ends != 1 || checker.payloadLen != big || checker.got != big || checker.bad ||
+        checker.topic != "ota/pump-7" || checker.key != "1 of 1" || checker.packets != 1)
+    {
+        cout << "FAIL publish stream " << checker.starts << " " << checker.ends << " " << checker.got << " " << checker.bad << "\n";
+    }
+
+    // small ones come whole, even a byte at a time.
+    d.piece = 1;
+    pub.Payload = "small";
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &d);
+    ack.outputAck(sink(assembly, sizeof(assembly)), &d, CtrlPubAck, 9, 0);
+    if (checker.packets != 3 || checker.starts != 1)
+    {
+        cout << "FAIL packet stream small " << checker.packets << "\n";
+    }
+    // and a big one a byte at a time.
+    countingFount f2(1000);
+    if (pub.outputPublishStream(sink(assembly, sizeof(assembly)), &d, f2, 1000, sink(chunk, sizeof(chunk))) ||
+        checker.starts != 2 || checker.ends != 2 || checker.got != 1000 || checker.bad)
+    {
+        cout << "FAIL publish stream a byte at a time " << checker.got << "\n";
+    }
+
+    // a fount that runs dry fails.
+    countingFount shortFount(10);
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    if (pub.outputPublishStream(sink(assembly, sizeof(assembly)), &out, shortFount, 20, sink(chunk, sizeof(chunk))) == false)
+    {
+        cout << "FAIL publish stream short fount\n";
+    }
+
+    // headers that don't fit fail, and so does anything big that isn't a publish.
+    char tiny[8];
+    packetStreamReader small(tiny, sizeof(tiny), &checker);
+    d.reader = &small;
+    d.piece = 100;
+    countingFount f3(100);
+    if (pub.outputPublishStream(sink(assembly, sizeof(assembly)), &d, f3, 100, sink(chunk, sizeof(chunk))) == false)
+    {
+        cout << "FAIL packet stream headers too big\n";
+    }
+    small.reset();
+    if (small.feed(slice("\x90\x20", 0, 2)) == false)
+    {
+        cout << "FAIL packet stream big suback\n";
+    }
+}
+
+// packets written through a captureDrain come back out of a captureReader.
+void testCapture()
+{
+    const char *path = "/tmp/mqtt5nano_test.cap";
+    captureFile file;
+    if (file.open(path))
+    {
+        cout << "FAIL capture open\n";
+        return;
+    }
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    char pending[128];
+    captureDrain d(&out, &file, pending, sizeof(pending));
+    mqttPacketPieces p;
+    p.reset();
+    p.packetType = CtrlPublish;
+    p.TopicName = "a/b";
+    p.Payload = "{\"x\":1}";
+    p.outputPubOrSub(sink(assembly, sizeof(assembly)), &d);
+    p.outputAck(sink(assembly, sizeof(assembly)), &d, CtrlPubAck, 5, 0);
+    // too big for pending. It goes through but isn't recorded.
+    string big(300, 'b');
+    p.reset();
+    p.packetType = CtrlPublish;
+    p.TopicName = "big";
+    p.Payload = slice(big.data(), 0, big.size());
+    p.outputPubOrSub(sink(assembly, sizeof(assembly)), &d);
+    // a byte at a time.
+    slice ping("\xc0\x00", 0, 2);
+    d.writeByte(ping.base[0]);
+    d.writeByte(ping.base[1]);
+    file.record(slice("\xd0\x00", 0, 2), captureIn);
+    slice sent = out.dest.getWritten();
+    if (file.close() || file.packets != 4 || d.skipped != 1)
+    {
+        cout << "FAIL capture counts " << file.packets << " " << d.skipped << "\n";
+    }
+
+    FILE *f = fopen(path, "rb");
+    static char back[4096];
+    int n = f ? fread(back, 1, sizeof(back), f) : 0;
+    if (f)
+    {
+        fclose(f);
+    }
+    unlink(path);
+    captureReader reader;
+    if (reader.start(back, n))
+    {
+        cout << "FAIL captureReader start\n";
+        return;
+    }
+    slice packet;
+    unsigned long long ns;
+    unsigned char direction;
+    string got;
+    int count = 0;
+    while (reader.next(packet, ns, direction))
+    {
+        got += hexstr(packet) + (direction == captureIn ? "<" : ">");
+        count++;
+    }
+    // everything that was sent but the big one, in order, and the PingResp that came in.
+    slice first(sent.base, sent.start, sent.start + 1 + 1 + sent.base[sent.start + 1]);
+    string want = hexstr(first) + ">40020005>c000>d000<";
+    if (count != 4 || got != want || reader.pos != n || ns == 0)
+    {
+        cout << "FAIL captureReader " << got << " " << want << "\n";
+    }
+}
+
+// wheelChecker records when each timer fired and sometimes adds another from inside the handler.
+struct wheelChecker : timerHandler
+{
+    timerWheel *wheel;
+    unsigned long start;
+    vector<long long> firedAt; // ticks after start
+    int fired = 0;
+    void onTimer(timer &t) override
+    {
+        firedAt[t.id] = (long long)(wheel->now - 1 - start);
+        fired++;
+    }
+};
+
+// timers fire on their tick however far out they are, across the wrap, with cancels and moves.
+void testTimerWheel()
+{
+    const int n = 2000;
+    unsigned long start = (unsigned long)-5000; // so it wraps
+    timerWheel wheel(start);
+    wheelChecker checker;
+    checker.wheel = &wheel;
+    checker.start = start;
+    checker.firedAt.assign(n, -1);
+    vector<timer> timers(n);
+    vector<long long> want(n, -1); // ticks from start, -1 for cancelled
+    unsigned int r = 7;
+    auto rnd = [&r]() {
+        r = r * 1103515245 + 12345;
+        return r >> 8;
+    };
+    for (int i = 0; i < n; i++)
+    {
+        unsigned long delta = rnd() % 5000;
+        int kind = rnd() % 10;
+        if (kind == 0)
+        {
+            delta = rnd() % (1 << 20);
+        }
+        else if (kind == 1)
+        {
+            delta = (1 << 24) + rnd() % (1 << 22); // past the top level
+        }
+        timers[i].handler = &checker;
+        timers[i].id = i;
+        wheel.add(timers[i], start + delta);
+        want[i] = delta;
+    }
+    // move some and cancel some.
+    for (int i = 0; i < n; i += 7)
+    {
+        unsigned long delta = rnd() % 100000;
+        wheel.add(timers[i], start + delta);
+        want[i] = delta;
+    }
+    for (int i = 3; i < n; i += 11)
+    {
+        wheel.cancel(timers[i]);
+        want[i] = -1;
+    }
+    long long t = 0;
+    long long end = (1LL << 24) + (1LL << 22) + 10;
+    while (t < end)
+    {
+        t += 1 + rnd() % 3000;
+        wheel.advance(start + t);
+    }
+    int bad = 0;
+    for (int i = 0; i < n; i++)
+    {
+        long long got = checker.firedAt[i];
+        if (got != want[i])
+        {
+            if (bad++ < 5)
+            {
+                cout << "FAIL timerWheel timer " << i << " wanted " << want[i] << " got " << got << "\n";
+            }
+        }
+    }
+    if (wheel.count != 0)
+    {
+        cout << "FAIL timerWheel count " << wheel.count << "\n";
+    }
+
+    // one that's due already fires on the next advance, and so does one added from a handler.
+    timer late;
+    late.handler = &checker;
+    late.id = 0;
+    checker.fired = 0;
+    wheel.add(late, wheel.now - 10);
+    if (wheel.advance(wheel.now) != 1 || checker.fired != 1 || late.pending())
+    {
+        cout << "FAIL timerWheel late\n";
+    }
+}
+
+// pingCommand answers ping with pong and the rest of the line.
+struct pingCommand : Command
+{
+    pingCommand() : Command("ping", "ping [words] answers pong [words]") {}
+    void execute(badjson::Segment *words, drain &out) override
+    {
+        out.write("pong");
+        for (badjson::Segment *w = words->Next(); w; w = w->Next())
+        {
+            char tmp[64];
+            sink s(tmp, sizeof(tmp));
+            w->Raw(s);
+            out.write(" ");
+            out.write(slice(tmp, 0, s.start));
+        }
+    }
+} pingCmd;
+
+struct rpcRecorder : rpcHandler
+{
+    int responses = 0;
+    int timeouts = 0;
+    string last;
+    void onResponse(rpcCall &call, mqttPacketPieces &response) override
+    {
+        responses++;
+        last = str(response.Payload);
+    }
+    void onTimeout(rpcCall &call) override
+    {
+        timeouts++;
+    }
+};
+
+// takePacket parses the one packet in out and empties it.
+bool takePacket(sinkDrain &out, mqttPacketPieces &p)
+{
+    slice pos = out.dest.getWritten();
+    unsigned char firstByte;
+    slice body;
+    p.reset();
+    bool fail = getPacket(pos, firstByte, body) != frameOk || p.parse(body, firstByte, body.size());
+    out.dest.start = 0;
+    return fail;
+}
+
+// a call goes to a device, through process() and back.
+void testRpc()
+{
+    static char wireToDevice[1024];
+    static char wireToApp[1024];
+    rpcCall calls[2];
+    timerWheel wheel(1000);
+    rpcClient client(calls, 2, "app/replies", wheel);
+    rpcRecorder rec;
+    sinkDrain toDevice;
+    toDevice.dest = sink(wireToDevice, sizeof(wireToDevice));
+    sinkDrain toApp;
+    toApp.dest = sink(wireToApp, sizeof(wireToApp));
+    mqttPacketPieces req;
+    req.reset();
+    req.TopicName = "dev/7/cmd";
+    req.Payload = "ping a b";
+    int id = client.call(req, sink(assembly, sizeof(assembly)), &toDevice, 1000, 50, &rec, 0);
+    mqttPacketPieces got;
+    if (id < 0 || client.pending != 1 || takePacket(toDevice, got) || str(got.RespTopic) != "app/replies" ||
+        got.CorrelationData.size() != 4)
+    {
+        cout << "FAIL rpc call " << id << "\n";
+        return;
+    }
+    char reply[256];
+    mqttPacketPieces answer;
+    if (serveRequest(got, sink(assembly, sizeof(assembly)), &toApp, sink(reply, sizeof(reply))) ||
+        takePacket(toApp, answer) || str(answer.TopicName) != "app/replies" ||
+        str(answer.CorrelationData) != str(got.CorrelationData))
+    {
+        cout << "FAIL rpc serveRequest\n";
+        return;
+    }
+    if (client.onPublish(answer) == false || rec.responses != 1 || rec.last != "pong a b" || client.pending != 0)
+    {
+        cout << "FAIL rpc response " << rec.last << "\n";
+    }
+    // the same answer again is ours but does nothing.
+    if (client.onPublish(answer) == false || rec.responses != 1)
+    {
+        cout << "FAIL rpc answer twice\n";
+    }
+
+    // a call that times out and then its late answer.
+    req.Payload = "ping";
+    client.call(req, sink(assembly, sizeof(assembly)), &toDevice, 1000, 50, &rec, 0);
+    takePacket(toDevice, got);
+    serveRequest(got, sink(assembly, sizeof(assembly)), &toApp, sink(reply, sizeof(reply)));
+    int id2 = client.call(req, sink(assembly, sizeof(assembly)), &toDevice, 1000, 500, &rec, 0);
+    if (client.call(req, sink(assembly, sizeof(assembly)), &toDevice, 1000, 50, &rec, 0) != -1)
+    {
+        cout << "FAIL rpc table full\n";
+    }
+    if (wheel.advance(1049) != 0 || wheel.advance(1050) != 1 || rec.timeouts != 1 || client.pending != 1)
+    {
+        cout << "FAIL rpc expire " << rec.timeouts << "\n";
+    }
+    takePacket(toApp, answer);
+    if (client.onPublish(answer) == false || rec.responses != 1)
+    {
+        cout << "FAIL rpc late answer\n";
+    }
+    if (client.cancel(id2) || client.cancel(id2) == false || client.pending != 0 || wheel.advance(5000) != 0 || wheel.count != 0)
+    {
+        cout << "FAIL rpc cancel\n";
+    }
+
+    // a request with no response topic is run and not answered, and other publishes aren't ours.
+    got.RespTopic = slice();
+    if (serveRequest(got, sink(assembly, sizeof(assembly)), &toApp, sink(reply, sizeof(reply))) ||
+        toApp.dest.start != 0 || client.onPublish(req))
+    {
+        cout << "FAIL rpc no response topic\n";
+    }
+}
+
+void testRetainedCache()
+{
+    static retainedNode nodes[64];
+    static int buckets[16];
+    static char arena[4096];
+    retainedCache cache(nodes, 64, buckets, 16, arena, sizeof(arena));
+
+    const char *topics[] = {"a/b/c", "a/b", "a/x/c", "a", "b/b", "$SYS/up", "/lead", "a/b/c/d"};
+    for (const char *t : topics)
+    {
+        if (cache.put(slice(t), 1, slice(""), slice(t)))
+        {
+            cout << "FAIL retainedCache put " << t << "\n";
+        }
+    }
+    struct
+    {
+        const char *filter;
+        const char *want;
+    } cases[] = {
+        {"a/b/c", "a/b/c"},
+        {"a/+/c", "a/b/c,a/x/c"},
+        {"a/#", "a,a/b,a/b/c,a/b/c/d,a/x/c"},
+        {"+/b", "a/b,b/b"},
+        {"#", "/lead,a,a/b,a/b/c,a/b/c/d,a/x/c,b/b"},
+        {"$SYS/#", "$SYS/up"},
+        {"+/+", "/lead,a/b,b/b"},
+        {"a/b/+/#", "a/b/c,a/b/c/d"},
+        {"nope/#", ""},
+        {"a/#/c", ""},
+    };
+    for (auto &c : cases)
+    {
+        string got = matchAll(cache, c.filter);
+        if (got != c.want)
+        {
+            cout << "FAIL retainedCache match " << c.filter << " got " << got << "\n";
+        }
+    }
+    retainedMessage m;
+    if (cache.get(slice("a/b"), m) || str(m.payload) != "a/b" || m.qos != 1 || cache.get(slice("a/b/x"), m) == false)
+    {
+        cout << "FAIL retainedCache get\n";
+    }
+    // replace, then clear with an empty payload. The empty levels go.
+    cache.put(slice("a/b/c/d"), 0, slice("\x01\x00", 0, 2), slice("new"));
+    if (cache.get(slice("a/b/c/d"), m) || str(m.payload) != "new" || m.props.size() != 2 || cache.count != 8)
+    {
+        cout << "FAIL retainedCache replace\n";
+    }
+    cache.put(slice("a/b/c/d"), 0, slice(), slice());
+    cache.put(slice("a/x/c"), 0, slice(), slice());
+    if (cache.count != 6 || matchAll(cache, "a/#") != "a,a/b,a/b/c" || cache.findChild(cache.findChild(0, slice("a")), slice("x")) >= 0)
+    {
+        cout << "FAIL retainedCache remove\n";
+    }
+
+    // churn it so the arena has to compact, and check every match against topicMatches.
+    cache.clear();
+    const char *levels[] = {"a", "b", "c", "$x", ""};
+    unsigned int r = 12345;
+    for (int round = 0; round < 2000; round++)
+    {
+        r = r * 1103515245 + 12345;
+        string t = levels[(r >> 8) % 4];
+        for (int i = 0, n = (r >> 12) % 4; i < n; i++)
+        {
+            t += string("/") + levels[(r >> (14 + 2 * i)) % 5];
+        }
+        string payload((r >> 20) % 40, 'p');
+        cache.put(slice(t.data(), 0, t.size()), 0, slice(), slice(payload.data(), 0, payload.size()));
+    }
+    const char *filters[] = {"#", "+", "a/#", "+/+", "+/b/#", "a/+/+/+", "$x/#", "+/", "a//#"};
+    for (const char *f : filters)
+    {
+        std::vector<string> want;
+        retainedMatch all = cache.match(slice("#"));
+        retainedMatch sys = cache.match(slice("$x/#"));
+        retainedMessage m;
+        while (all.next(m) || sys.next(m))
+        {
+            if (topicMatches(slice(f), m.topic))
+            {
+                want.push_back(str(m.topic));
+            }
+        }
+        std::sort(want.begin(), want.end());
+        string w;
+        for (auto &t : want)
+        {
+            w += (w.empty() ? "" : ",") + t;
+        }
+        if (matchAll(cache, f) != w)
+        {
+            cout << "FAIL retainedCache " << f << " got " << matchAll(cache, f) << " wanted " << w << "\n";
+        }
+    }
+
+    // message expiry. 30 seconds on x/1 has run out and goes, level and all, and x/2 has 70 left.
+    cache.clear();
+    const char shortLived[] = {propKeyMessageExpiryInterval, 0, 0, 0, 10};
+    const char longLived[] = {propKeyPayloadFormatIndicator, 1, propKeyMessageExpiryInterval, 0, 0, 0, 100};
+    cache.put(slice("x/1"), 1, slice(shortLived, 0, 5), slice("old"), 1000);
+    cache.put(slice("x/2"), 1, slice(longLived, 0, 7), slice("new"), 1000);
+    cache.put(slice("x/3"), 1, slice(), slice("always"), 1000);
+    retainedMatch it = cache.match(slice("x/#"), 1030);
+    string got;
+    while (it.next(m))
+    {
+        slice left = findMessageExpiry(m.props);
+        got += str(m.payload) + "/" + std::to_string(m.expiry);
+        if (left.base)
+        {
+            got += "/" + std::to_string(propertyInt(propKeyMessageExpiryInterval, left));
+        }
+        got += " ";
+    }
+    int x = cache.findChild(0, slice("x"));
+    if (got != "always/0 new/70/70 " || cache.count != 2 || cache.findChild(x, slice("1")) >= 0)
+    {
+        cout << "FAIL retainedCache expiry got " << got << "\n";
+    }
+    if (cache.get(slice("x/2"), m, 1099) || m.expiry != 1 || cache.get(slice("x/2"), m, 1100) == false || cache.count != 1)
+    {
+        cout << "FAIL retainedCache expiry get\n";
+    }
+
+    // an arena past 64k, where the offsets don't fit in a slice.
+    static retainedNode bigNodes[2048];
+    static int bigBuckets[1024];
+    static char bigArena[256 * 1024];
+    retainedCache big(bigNodes, 2048, bigBuckets, 1024, bigArena, sizeof(bigArena));
+    for (int i = 0; i < 1000; i++)
+    {
+        string t = "big/" + std::to_string(i);
+        string payload = std::to_string(i) + string(200, 'p');
+        if (big.put(slice(t.data(), 0, t.size()), 0, slice(), slice(payload.data(), 0, payload.size())))
+        {
+            cout << "FAIL retainedCache big put " << i << "\n";
+            break;
+        }
+    }
+    int wrong = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        string t = "big/" + std::to_string(i);
+        if (big.get(slice(t.data(), 0, t.size()), m) || str(m.topic) != t ||
+            str(m.payload) != std::to_string(i) + string(200, 'p'))
+        {
+            wrong++;
+        }
+    }
+    if (big.arenaUsed <= 65536 || wrong || matchAll(big, "big/#").size() != matchAll(big, "+/#").size())
+    {
+        cout << "FAIL retainedCache past 64k, " << wrong << " wrong\n";
+    }
+}
+
+void testDedupe()
+{
+    dedupeEntry entries[16];
+    dedupeTable table(entries, 16);
+    unsigned int first = dedupeTable::fingerprint(slice("t"), slice("first"));
+    unsigned int second = dedupeTable::fingerprint(slice("t"), slice("second"));
+    if (table.isDuplicate(3, 7, false, first) || !table.isDuplicate(3, 7, true, first))
+    {
+        cout << "FAIL dedupeTable resend\n";
+    }
+    // it was acked so the client uses 7 again. That send is lost and it comes again with dup.
+    if (table.isDuplicate(3, 7, true, second) || !table.isDuplicate(3, 7, true, second))
+    {
+        cout << "FAIL dedupeTable reused id\n";
+    }
+    if (table.isDuplicate(4, 7, true, second) || first == dedupeTable::fingerprint(slice("tf"), slice("irst")))
+    {
+        cout << "FAIL dedupeTable other client\n";
+    }
+    table.forget(3);
+    if (table.isDuplicate(3, 7, true, second))
+    {
+        cout << "FAIL dedupeTable forget\n";
+    }
+}
+
+// testMetrics needs -DMQTT5NANO_METRICS. Without it there's nothing to test.
+void testMetrics()
+{
+#if defined(MQTT5NANO_METRICS)
+    resetMetrics();
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    mqttPacketPieces p;
+    p.reset();
+    p.packetType = CtrlPublish;
+    p.TopicName = "a/b";
+    p.Payload = "hello";
+    p.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    p.outputAck(sink(assembly, sizeof(assembly)), &out, CtrlPubAck, 5, reasonSuccess);
+    int written = out.dest.getWritten().size();
+
+    slice pos = out.dest.getWritten();
+    unsigned char firstByte;
+    slice body;
+    while (getPacket(pos, firstByte, body) == frameOk)
+    {
+        p.parse(body, firstByte, body.size());
+    }
+    const char bad[] = {0, 0, 0}; // type 0 is reserved
+    p.parse(slice(bad, 0, sizeof(bad)), bad[0], 3);
+
+    metricsSnapshot *snap = new metricsSnapshot;
+    snap->take();
+    if (snap->encoded < 2 || snap->bytesEncoded < (unsigned)written || snap->parsed[int(CtrlPublish)] < 1 ||
+        snap->parsed[int(CtrlPubAck)] < 1 || snap->parseFailures < 1 || snap->parseTime.total < 3)
+    {
+        cout << "FAIL metrics counts encoded " << snap->encoded << " parsed " << snap->parsed[int(CtrlPublish)] << "\n";
+    }
+    delete snap;
+
+    const char *cmd = "metrics";
+    badjson::ResultsTriplette res = badjson::Chop(cmd, strlen(cmd));
+    out.dest = sink(wire, sizeof(wire));
+    process(res.segment, out);
+    delete res.segment;
+    string json(wire, out.dest.getWritten().size());
+    if (json.find("\"Publish\":") == string::npos || json.find("\"parseNs\":{\"count\":") == string::npos ||
+        json[0] != '{' || json[json.size() - 1] != '}')
+    {
+        cout << "FAIL metrics json " << json << "\n";
+    }
+#endif
+}
+
+// testTrace needs -DMQTT5NANO_TRACE.
+void testTrace()
+{
+#if defined(MQTT5NANO_TRACE)
+    resetTrace();
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    mqttPacketPieces p;
+    p.reset();
+    p.packetType = CtrlPublish;
+    p.TopicName = "a/b";
+    p.Payload = "hello";
+    p.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    slice pos = out.dest.getWritten();
+    unsigned char firstByte;
+    slice body;
+    if (getPacket(pos, firstByte, body) != frameOk || p.parse(body, firstByte, body.size()))
+    {
+        cout << "FAIL trace parse\n";
+    }
+    const char *cmd = "nothing";
+    badjson::ResultsTriplette res = badjson::Chop(cmd, strlen(cmd));
+    process(res.segment, out);
+    delete res.segment;
+
+    static char json[16 * 1024];
+    out.dest = sink(json, sizeof(json));
+    if (writeTraceJson(out))
+    {
+        cout << "FAIL trace json too big\n";
+    }
+    string got(json, out.dest.getWritten().size());
+    size_t frame = got.find("\"name\":\"frame\",\"cat\":\"mqtt\",\"ph\":\"i\"");
+    size_t parseBegin = got.find("\"name\":\"parse\",\"cat\":\"mqtt\",\"ph\":\"B\"");
+    size_t parseEnd = got.find("\"name\":\"parse\",\"cat\":\"mqtt\",\"ph\":\"E\"");
+    size_t dispatch = got.find("\"name\":\"dispatch\"");
+    if (frame == string::npos || parseBegin < frame || parseEnd < parseBegin || dispatch < parseEnd ||
+        dispatch == string::npos || got.find("\"args\":{\"n\":48,") == string::npos)
+    {
+        cout << "FAIL trace json " << got << "\n";
+    }
+#endif
+}
+
+#if defined(__linux__)
+
+// testClient is a blocking socket that talks to the miniBroker.
+struct testClient
+{
+    int fd = -1;
+    char in[4096];
+    int inLen = 0;
+    int consumed = 0;
+
+    bool open(int port, const char *path)
+    {
+        if (path)
+        {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            struct sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strcpy(addr.sun_path, path);
+            return connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0;
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        struct timeval tv = {2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        return connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0;
+    }
+    void close()
+    {
+        ::close(fd);
+    }
+    void send(sinkDrain &out)
+    {
+        slice s = out.dest.getWritten();
+        ::send(fd, s.charPointer(), s.size(), 0);
+        out.dest.reset();
+    }
+    // next waits for a whole packet. The pieces are good until the next call.
+    bool next(mqttPacketPieces &p, unsigned char &firstByte)
+    {
+        memmove(in, in + consumed, inLen - consumed);
+        inLen -= consumed;
+        consumed = 0;
+        struct timeval tv = {2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        while (true)
+        {
+            slice pos(in, 0, inLen);
+            slice body;
+            if (getPacket(pos, firstByte, body) == frameOk)
+            {
+                consumed = pos.start;
+                return p.parse(body, firstByte, body.size());
+            }
+            int n = read(fd, in + inLen, sizeof(in) - inLen);
+            if (n <= 0)
+            {
+                return true;
+            }
+            inLen += n;
+        }
+    }
+    // expect fails unless the next packet is the type.
+    bool expect(mqttPacketPieces &p, int type)
+    {
+        unsigned char firstByte;
+        return next(p, firstByte) || p.packetType != type;
+    }
+};
+
+void testBroker()
+{
+    const char *path = "/tmp/mqtt5nano_broker_test.sock";
+    miniBroker *broker = new miniBroker;
+    if (broker->listenTCP(0) || broker->listenUnix(path))
+    {
+        cout << "FAIL miniBroker listen\n";
+        return;
+    }
+    std::thread loop([broker]() { broker->run(); });
+
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    mqttPacketPieces p;
+    unsigned char firstByte;
+
+    // a on tcp
+    testClient a;
+    a.open(broker->tcpPort, 0);
+    connectOptions opts;
+    opts.ClientID = "a";
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    a.send(out);
+    serverLimits limits;
+    if (a.expect(p, CtrlConnAck) || p.ReasonCode != reasonSuccess || limits.load(p) || limits.MaximumPacketSize != brokerInSize)
+    {
+        cout << "FAIL miniBroker ConnAck\n";
+    }
+
+    // a retained one, before anyone is listening.
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.TopicName = "r/1";
+    pub.Payload = "kept";
+    pub.QoS = 1;
+    pub.PacketID = 1;
+    pub.Retain = true;
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    a.send(out);
+    if (a.expect(p, CtrlPubAck) || p.PacketID != 1)
+    {
+        cout << "FAIL miniBroker PubAck\n";
+    }
+
+    // b on the unix socket with no client id
+    testClient b;
+    b.open(0, path);
+    opts.ClientID = "";
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    b.send(out);
+    if (b.expect(p, CtrlConnAck) || p.findProperty(propKeyAssignedClientID).empty())
+    {
+        cout << "FAIL miniBroker assigned client id\n";
+    }
+    subscribeFilter filters[2] = {subscribeFilter("r/+", 1), subscribeFilter("x/#", 2)};
+    p.PacketID = 7;
+    p.outputSubscribe(sink(assembly, sizeof(assembly)), &out, filters, 2, 0);
+    b.send(out);
+    if (b.expect(p, CtrlSubAck) || p.PacketID != 7 || hexstr(p.Payload) != "0102")
+    {
+        cout << "FAIL miniBroker SubAck\n";
+    }
+    if (b.next(p, firstByte) || p.packetType != CtrlPublish || !p.Retain || str(p.Payload) != "kept")
+    {
+        cout << "FAIL miniBroker retained\n";
+    }
+
+    // qos 2 with a user prop that has to go through.
+    pub.Retain = false;
+    pub.TopicName = "x/y";
+    pub.Payload = "two";
+    pub.QoS = 2;
+    pub.PacketID = 9;
+    pub.UserKeyVal[0] = "k";
+    pub.UserKeyVal[1] = "v";
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    a.send(out);
+    if (a.expect(p, CtrlPubRecv) || p.PacketID != 9)
+    {
+        cout << "FAIL miniBroker PubRec\n";
+    }
+    if (b.expect(p, CtrlPublish) || p.QoS != 2 || str(p.Payload) != "two" || str(p.UserKeyVal[1]) != "v")
+    {
+        cout << "FAIL miniBroker qos 2 delivery " << int(p.packetType) << " " << int(p.QoS) << " " << str(p.Payload) << " " << str(p.findKey("k")) << "\n";
+    }
+    p.outputAck(sink(assembly, sizeof(assembly)), &out, CtrlPubRecv, p.PacketID, reasonSuccess);
+    b.send(out);
+    if (b.expect(p, CtrlPubRel))
+    {
+        cout << "FAIL miniBroker PubRel\n";
+    }
+    // the same one again is acked but not sent on.
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    a.send(out);
+    p.outputAck(sink(assembly, sizeof(assembly)), &out, CtrlPubRel, 9, reasonSuccess);
+    a.send(out);
+    if (a.expect(p, CtrlPubRecv) || a.expect(p, CtrlPubComp) || p.PacketID != 9)
+    {
+        cout << "FAIL miniBroker qos 2 dedupe\n";
+    }
+
+    // qos 1 sent again with the dup flag is acked and dropped.
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.TopicName = "x/1";
+    pub.Payload = "once";
+    pub.QoS = 1;
+    pub.PacketID = 20;
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    a.send(out);
+    if (a.expect(p, CtrlPubAck) || b.expect(p, CtrlPublish) || str(p.Payload) != "once" || p.Dup)
+    {
+        cout << "FAIL miniBroker qos 1\n";
+    }
+    p.outputAck(sink(assembly, sizeof(assembly)), &out, CtrlPubAck, p.PacketID, reasonSuccess);
+    b.send(out);
+    pub.Dup = true;
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    a.send(out);
+    if (a.expect(p, CtrlPubAck) || p.PacketID != 20)
+    {
+        cout << "FAIL miniBroker qos 1 dedupe\n";
+    }
+
+    // qos 0 and a ping. b must not see the dup in between.
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.TopicName = "x";
+    pub.Payload = "zero";
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    a.send(out);
+    if (b.expect(p, CtrlPublish) || p.QoS != 0 || !p.TopicName.equals("x"))
+    {
+        cout << "FAIL miniBroker qos 0 delivery\n";
+    }
+    out.dest.writeByte(char(CtrlPingReq * 16));
+    out.dest.writeByte(0);
+    b.send(out);
+    if (b.expect(p, CtrlPingResp))
+    {
+        cout << "FAIL miniBroker ping\n";
+    }
+
+    // c has a session that outlives the connection.
+    testClient c;
+    c.open(broker->tcpPort, 0);
+    opts.ClientID = "c";
+    opts.CleanStart = false;
+    opts.SessionExpiry = 60;
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    c.send(out);
+    c.expect(p, CtrlConnAck);
+    filters[0] = subscribeFilter("q", 1);
+    p.PacketID = 1;
+    p.outputSubscribe(sink(assembly, sizeof(assembly)), &out, filters, 1, 0);
+    c.send(out);
+    c.expect(p, CtrlSubAck);
+    c.close();
+    usleep(50 * 1000);
+
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.TopicName = "q";
+    pub.Payload = "while you were out";
+    pub.QoS = 1;
+    pub.PacketID = 11;
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    a.send(out);
+    a.expect(p, CtrlPubAck);
+
+    testClient c2;
+    c2.open(broker->tcpPort, 0);
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    c2.send(out);
+    if (c2.expect(p, CtrlConnAck) || !p.SessionPresent)
+    {
+        cout << "FAIL miniBroker session present\n";
+    }
+    if (c2.expect(p, CtrlPublish) || str(p.Payload) != "while you were out")
+    {
+        cout << "FAIL miniBroker offline queue\n";
+    }
+    if (broker->stats.queued != 1 || broker->stats.bad != 0)
+    {
+        cout << "FAIL miniBroker stats queued " << broker->stats.queued << " bad " << broker->stats.bad << "\n";
+    }
+
+    // d goes quiet, so the keep alive closes it, and then its session expires.
+    testClient d;
+    d.open(broker->tcpPort, 0);
+    opts.ClientID = "d";
+    opts.KeepAlive = 1;
+    opts.SessionExpiry = 1;
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    d.send(out);
+    d.expect(p, CtrlConnAck);
+    if (d.expect(p, CtrlDisConn) || p.ReasonCode != reasonKeepAliveTimeout)
+    {
+        cout << "FAIL miniBroker keep alive\n";
+    }
+    d.close();
+    usleep(1100 * 1000);
+    testClient d2;
+    d2.open(broker->tcpPort, 0);
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    d2.send(out);
+    if (d2.expect(p, CtrlConnAck) || p.SessionPresent)
+    {
+        cout << "FAIL miniBroker session expiry\n";
+    }
+
+    // more filters than fit an array of 16 get a code each.
+    string names[30];
+    subscribeFilter many[30];
+    for (int i = 0; i < 30; i++)
+    {
+        names[i] = "many/" + std::to_string(i);
+        many[i] = subscribeFilter(slice(names[i].c_str()), 1);
+    }
+    p.PacketID = 40;
+    p.outputSubscribe(sink(assembly, sizeof(assembly)), &out, many, 30, 0);
+    d2.send(out);
+    if (d2.expect(p, CtrlSubAck) || p.PacketID != 40 || p.Payload.size() != 30 || p.applySubAck(many, 30) ||
+        many[29].ReasonCode != 1)
+    {
+        cout << "FAIL miniBroker 30 filter SubAck\n";
+    }
+    p.PacketID = 41;
+    p.outputUnsubscribe(sink(assembly, sizeof(assembly)), &out, many, 30);
+    d2.send(out);
+    if (d2.expect(p, CtrlUnSubAck) || p.PacketID != 41 || p.Payload.size() != 30 || hexstr(p.Payload) != string(60, '0'))
+    {
+        cout << "FAIL miniBroker 30 filter UnSubAck\n";
+    }
+
+    // a retained publish whose props length runs past the end is malformed and isn't kept.
+    const char brokenProps[] = {char(CtrlPublish * 16 + 1), 7, 0, 3, 'b', 'a', 'd', 0x10, 'x'};
+    out.dest.writeBytes(brokenProps, sizeof(brokenProps));
+    d2.send(out);
+    if (d2.expect(p, CtrlDisConn) || p.ReasonCode != reasonMalformed)
+    {
+        cout << "FAIL miniBroker broken props\n";
+    }
+    d2.close();
+
+    a.close();
+    b.close();
+    c2.close();
+    broker->stop();
+    loop.join();
+    delete broker;
+}
+
+// echoHandler sends back whatever comes in.
+struct echoHandler : ioHandler
+{
+    int drained = 0;
+    int closed = 0;
+    void onData(socketConn &c) override
+    {
+        c.out.write(c.in.buffered());
+        c.in.consume(c.in.buffered().size());
+    }
+    void onDrained(socketConn &c) override
+    {
+        drained++;
+    }
+    void onClose(socketConn &c) override
+    {
+        closed++;
+    }
+};
+
+void testEcho(ioLoop &loop, const char *name)
+{
+    echoHandler handler;
+    loop.handler = &handler;
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    char in[64];
+    char out[64];
+    socketConn conn(in, sizeof(in), out, sizeof(out));
+    conn.setFd(fds[0]);
+    loop.add(&conn);
+
+    const char *msg = "hello through the loop";
+    int len = strlen(msg);
+    write(fds[1], msg, len);
+    char got[64];
+    int have = 0;
+    for (int i = 0; i < 100 && have < len; i++)
+    {
+        loop.poll(10);
+        int n = recv(fds[1], got + have, sizeof(got) - have, MSG_DONTWAIT);
+        have += n > 0 ? n : 0;
+    }
+    if (have != len || memcmp(got, msg, len) != 0 || handler.drained == 0)
+    {
+        cout << "FAIL " << name << " echo\n";
+    }
+    ::close(fds[1]);
+    for (int i = 0; i < 100 && handler.closed == 0; i++)
+    {
+        loop.poll(10);
+    }
+    if (handler.closed != 1 || !conn.closing)
+    {
+        cout << "FAIL " << name << " close\n";
+    }
+}
+
+void testSocketIO()
+{
+    epollLoop e;
+    testEcho(e, "epollLoop");
+#if defined(MQTT5NANO_IO_URING)
+    static char arena[128];
+    uringLoop u;
+    if (u.setup(64, arena, sizeof(arena)))
+    {
+        cout << "FAIL uringLoop setup\n";
+        return;
+    }
+    testEcho(u, "uringLoop");
+#endif
+}
+
+void testShards()
+{
+    // the ring first. 64 bytes so the records wrap.
+    char ringBuffer[64];
+    spscRing ring(ringBuffer, sizeof(ringBuffer));
+    char got[64];
+    for (int i = 0; i < 20; i++)
+    {
+        char n = char('a' + i);
+        if (ring.push(slice("hdr"), slice(&n, 0, 1), slice("0123456789")) || !ring.idle())
+        {
+            cout << "FAIL spscRing push\n";
+        }
+        if (ring.pop(got, sizeof(got)) != 14 || got[3] != n || got[13] != '9' || ring.pop(got, sizeof(got)) != -1)
+        {
+            cout << "FAIL spscRing pop\n";
+        }
+    }
+    int pushed = 0;
+    while (!ring.push(slice("0123456789")))
+    {
+        pushed++;
+    }
+    if (pushed != 5 || ring.idle())
+    {
+        cout << "FAIL spscRing full " << pushed << "\n";
+    }
+
+    // two shards. The connections go to them in turn.
+    shardedBroker *broker = new shardedBroker(2);
+    if (broker->listenTCP(0))
+    {
+        cout << "FAIL shardedBroker listen\n";
+        return;
+    }
+    broker->start();
+
+    sinkDrain out;
+    out.dest = sink(wire, sizeof(wire));
+    mqttPacketPieces p;
+    connectOptions opts;
+    testClient a;
+    a.open(broker->tcpPort, 0);
+    opts.ClientID = "sa";
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    a.send(out);
+    testClient b;
+    b.open(broker->tcpPort, 0);
+    opts.ClientID = "sb";
+    p.outputConnect(sink(assembly, sizeof(assembly)), &out, opts);
+    b.send(out);
+    if (a.expect(p, CtrlConnAck) || b.expect(p, CtrlConnAck))
+    {
+        cout << "FAIL shardedBroker ConnAck\n";
+    }
+    subscribeFilter filter("s/+", 1);
+    p.PacketID = 1;
+    p.outputSubscribe(sink(assembly, sizeof(assembly)), &out, &filter, 1, 0);
+    a.send(out);
+    if (a.expect(p, CtrlSubAck))
+    {
+        cout << "FAIL shardedBroker SubAck\n";
+    }
+
+    // b is on the other shard.
+    mqttPacketPieces pub;
+    pub.reset();
+    pub.packetType = CtrlPublish;
+    pub.TopicName = "s/1";
+    pub.Payload = "across";
+    pub.QoS = 1;
+    pub.PacketID = 5;
+    pub.outputPubOrSub(sink(assembly, sizeof(assembly)), &out);
+    b.send(out);
+    if (b.expect(p, CtrlPubAck))
+    {
+        cout << "FAIL shardedBroker PubAck\n";
+    }
+    if (a.expect(p, CtrlPublish) || str(p.Payload) != "across")
+    {
+        cout << "FAIL shardedBroker cross shard publish\n";
+    }
+    a.close();
+    b.close();
+    broker->stop();
+    brokerStats totals = broker->totals();
+    if (broker->shards[1]->handedOff != 1 || totals.publishesIn != 1 || totals.publishesOut != 1 || totals.connects != 2)
+    {
+        cout << "FAIL shardedBroker stats\n";
+    }
+    delete broker;
+}
+
+struct countReleaser : publishReleaser
+{
+    int count = 0;
+    int expired = 0;
+    void released(publishDesc &desc, unsigned char reason) override
+    {
+        count++;
+        expired += reason == reasonExpired;
+    }
+};
+
+void testMpscQueue()
+{
+    // 4 threads publish into a small queue and this one encodes. Each thread's
+    // publishes must come out in order and none may be lost.
+    const int producers = 4;
+    const int each = 5000;
+    static int payloads[producers][each][2];
+    static mpscSlot slots[64];
+    mpscPublishQueue queue(slots, 64);
+    std::thread threads[producers];
+    for (int t = 0; t < producers; t++)
+    {
+        threads[t] = std::thread([&queue, t]() {
+            for (int i = 0; i < each; i++)
+            {
+                payloads[t][i][0] = t;
+                payloads[t][i][1] = i;
+                publishDesc desc;
+                desc.topic = "mpsc";
+                desc.payload = slice((char *)payloads[t][i], 0, 8);
+                desc.qos = 0;
+                desc.tag = 0;
+                while (queue.push(desc))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    sendWindow window;
+    countReleaser releaser;
+    int next[producers] = {0, 0, 0, 0};
+    int got = 0;
+    bool ok = true;
+    static char out[16 * 1024];
+    while (got < producers * each && ok)
+    {
+        sinkDrain d;
+        d.dest = sink(out, sizeof(out));
+        int n = queue.encodeBatch(&d, sink(assembly, sizeof(assembly)), window, 100, &releaser);
+        slice pos(d.dest);
+        pos.start = 0;
+        unsigned char firstByte;
+        slice body;
+        mqttPacketPieces p;
+        for (int i = 0; i < n; i++)
+        {
+            if (getPacket(pos, firstByte, body) != frameOk || p.parse(body, firstByte, body.size()) || p.Payload.size() != 8)
+            {
+                ok = false;
+                break;
+            }
+            int who;
+            int seq;
+            memcpy(&who, p.Payload.charPointer(), 4);
+            memcpy(&seq, p.Payload.charPointer() + 4, 4);
+            ok &= who >= 0 && who < producers && seq == next[who]++;
+            got++;
+        }
+        if (n == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+    for (int t = 0; t < producers; t++)
+    {
+        threads[t].join();
+    }
+    if (!ok || got != producers * each || releaser.count != got)
+    {
+        cout << "FAIL mpscPublishQueue got " << got << " released " << releaser.count << "\n";
+    }
+
+    // one that has waited past its expiry is released and not sent. The other goes with what's left.
+    publishDesc desc;
+    desc.topic = "mpsc";
+    desc.payload = "old";
+    desc.expiry = 5;
+    desc.since = 100;
+    queue.push(desc);
+    desc.payload = "new";
+    desc.expiry = 60;
+    desc.since = 103;
+    queue.push(desc);
+    sinkDrain d;
+    d.dest = sink(out, sizeof(out));
+    releaser.count = 0;
+    int n = queue.encodeBatch(&d, sink(assembly, sizeof(assembly)), window, 100, &releaser, 110);
+    string topics = drainedTopics(d.dest.getWritten());
+    if (n != 1 || topics != "mpsc=n/53 " || releaser.count != 2 || releaser.expired != 1)
+    {
+        cout << "FAIL mpscPublishQueue expiry got " << topics << "\n";
+    }
+}
+
+#endif
@@ -0,0 +1,175 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "packetStream.h"
+#include "trace.h"
+
+namespace knotfree
+{
+    enum
+    {
+        streamFirst,   // waiting for the first byte
+        streamLength,  // in the remaining length
+        streamWhole,   // filling the buffer with a packet that fits
+        streamHeaders, // filling the buffer with the front of a big publish
+        streamPayload, // passing the rest of the payload through
+    };
+
+    packetStreamReader::packetStreamReader(char *buffer, int size, packetStreamHandler *handler)
+        : buffer(buffer), size(size), handler(handler)
+    {
+        reset();
+    }
+
+    void packetStreamReader::reset()
+    {
+        state = streamFirst;
+        firstByte = 0;
+        have = 0;
+        headerLen = 0;
+        bodyLen = 0;
+        remaining = 0;
+    }
+
+    // startStream parses the headers at the front of the buffer and passes on the
+    // part of the payload that came with them.
+    bool packetStreamReader::startStream()
+    {
+        bool fail = false;
+        slice body(buffer, headerLen, have);
+        pub.reset();
+        if (pub.parse(body, firstByte, body.size()))
+        {
+            fail = true;
+            return fail;
+        }
+        slice first = pub.Payload;
+        pub.Payload = slice();
+        unsigned int headers = first.start - headerLen;
+        if (handler->onPublishStart(pub, bodyLen - headers))
+        {
+            fail = true;
+            return fail;
+        }
+        if (first.empty() == false && handler->onPublishChunk(first))
+        {
+            fail = true;
+            return fail;
+        }
+        remaining = bodyLen - (have - headerLen);
+        state = streamPayload;
+        return fail;
+    }
+
+    bool packetStreamReader::feed(slice data)
+    {
+        bool fail = false;
+        while (data.empty() == false)
+        {
+            if (state == streamFirst)
+            {
+                firstByte = data.readByte();
+                buffer[0] = firstByte;
+                have = 1;
+                bodyLen = 0;
+                state = streamLength;
+            }
+            else if (state == streamLength)
+            {
+                unsigned char c = data.readByte();
+                if (have == 5 || have >= size)
+                {
+                    fail = true; // more than 4 bytes of length
+                    return fail;
+                }
+                buffer[have] = c;
+                bodyLen |= (unsigned int)(c & 0x7F) << ((have - 1) * 7);
+                have++;
+                if (c >= 128)
+                {
+                    continue;
+                }
+                headerLen = have;
+                MQTT5NANO_TRACE_MARK(traceFrame, firstByte, -1);
+                if (bodyLen <= (unsigned int)(size - have))
+                {
+                    state = streamWhole;
+                }
+                else if ((firstByte >> 4) == CtrlPublish)
+                {
+                    state = streamHeaders;
+                }
+                else
+                {
+                    fail = true; // too big and not a publish
+                    return fail;
+                }
+            }
+            else if (state == streamWhole || state == streamHeaders)
+            {
+                int want = state == streamWhole ? headerLen + bodyLen - have : size - have;
+                int amt = data.size() < want ? data.size() : want;
+                for (int i = 0; i < amt; i++)
+                {
+                    buffer[have + i] = data.base[data.start + i];
+                }
+                data.start += amt;
+                have += amt;
+            }
+            else
+            {
+                int amt = data.size();
+                if ((unsigned int)amt > remaining)
+                {
+                    amt = remaining;
+                }
+                if (handler->onPublishChunk(slice(data.base, data.start, data.start + amt)))
+                {
+                    fail = true;
+                    return fail;
+                }
+                data.start += amt;
+                remaining -= amt;
+            }
+
+            // finish what's done. A packet with no body is done when its length is.
+            if (state == streamWhole && have == headerLen + int(bodyLen))
+            {
+                state = streamFirst;
+                if (handler->onPacket(firstByte, slice(buffer, headerLen, have)))
+                {
+                    fail = true;
+                    return fail;
+                }
+            }
+            else if (state == streamHeaders && have == size && startStream())
+            {
+                fail = true;
+                return fail;
+            }
+            if (state == streamPayload && remaining == 0)
+            {
+                state = streamFirst;
+                if (handler->onPublishEnd())
+                {
+                    fail = true;
+                    return fail;
+                }
+            }
+        }
+        return fail;
+    }
+
+} // namespace knotfree
@@ -0,0 +1,83 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "mqtt5nano.h"
+
+namespace knotfree
+{
+    // packetStreamHandler gets what a packetStreamReader takes off a connection.
+    // They all return true if failed, which breaks the reader.
+    struct packetStreamHandler
+    {
+        virtual ~packetStreamHandler()
+        {
+        }
+        // onPacket is a whole packet that fit in the reader's buffer, like getPacket gives.
+        // body is good until it returns.
+        virtual bool onPacket(unsigned char firstByte, slice body)
+        {
+            return false;
+        }
+        // onPublishStart is a publish too big for the buffer. pub has all but the payload and
+        // its slices are good until onPublishEnd returns. payloadLen bytes come next in onPublishChunk.
+        virtual bool onPublishStart(mqttPacketPieces &pub, unsigned int payloadLen)
+        {
+            return false;
+        }
+        // onPublishChunk is the next part of the payload. chunk is good until it returns.
+        virtual bool onPublishChunk(slice chunk)
+        {
+            return false;
+        }
+        virtual bool onPublishEnd()
+        {
+            return false;
+        }
+    };
+
+    // packetStreamReader frames packets from bytes that come in pieces of any size.
+    // A packet that fits in the buffer is handed over whole. A publish that doesn't has its
+    // headers parsed from the buffer and then the payload is passed through in chunks as it
+    // arrives, eg. to flash, so a 1 MB firmware image needs a buffer only as big as its headers.
+    // The buffer is the caller's and at most 64k. Any packet but a publish has to fit.
+    struct packetStreamReader
+    {
+        char *buffer;
+        int size;
+        packetStreamHandler *handler;
+        mqttPacketPieces pub; // the one being streamed
+
+        packetStreamReader(char *buffer, int size, packetStreamHandler *handler);
+
+        // feed takes all of data. Returns true if failed. The connection is broken then.
+        bool feed(slice data);
+
+        // reset drops the packet in progress.
+        void reset();
+
+    private:
+        char state;
+        unsigned char firstByte;
+        int have;      // bytes in buffer
+        int headerLen; // the first byte and the length bytes
+        unsigned int bodyLen;
+        unsigned int remaining; // payload bytes still to come when streaming
+
+        bool startStream();
+    };
+
+} // namespace knotfree
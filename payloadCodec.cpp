@@ -0,0 +1,345 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "payloadCodec.h"
+
+#include <string.h>
+
+namespace knotfree
+{
+    const char *codecKey = "content-encoding";
+    const char *codecLZ4 = "lz4";
+
+    // The lz4 block format is sequences of a token, literals and a match.
+    // The high 4 bits of the token are the literal count and the low 4 the match length less 4.
+    // 15 means more bytes of length follow, 255 each until one is less.
+    // The match is a 2 byte little endian offset back into what's been written.
+    // The last 5 bytes are always literals and the last match starts 12 or more from the end.
+    static const int lz4MinMatch = 4;
+    static const int lz4LastLiterals = 5;
+    static const int lz4MatchLimit = 12;
+
+    static unsigned int read32(const unsigned char *p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    }
+
+    static void putLength(unsigned char *&op, int len)
+    {
+        while (len >= 255)
+        {
+            *op++ = 255;
+            len -= 255;
+        }
+        *op++ = len;
+    }
+
+    // putSequence writes one sequence. matchLen 0 is the last one, literals only.
+    static bool putSequence(unsigned char *&op, unsigned char *oend, const unsigned char *lit, int litLen,
+                            int offset, int matchLen)
+    {
+        bool fail = false;
+        int need = 1 + litLen + litLen / 255 + 1;
+        int ml = matchLen - lz4MinMatch;
+        if (matchLen)
+        {
+            need += 2 + ml / 255 + 1;
+        }
+        if (oend - op < need)
+        {
+            fail = true;
+            return fail;
+        }
+        unsigned char *token = op++;
+        *token = (litLen >= 15 ? 15 : litLen) << 4;
+        if (litLen >= 15)
+        {
+            putLength(op, litLen - 15);
+        }
+        memcpy(op, lit, litLen);
+        op += litLen;
+        if (matchLen == 0)
+        {
+            return fail;
+        }
+        *token |= ml >= 15 ? 15 : ml;
+        *op++ = offset;
+        *op++ = offset >> 8;
+        if (ml >= 15)
+        {
+            putLength(op, ml - 15);
+        }
+        return fail;
+    }
+
+    bool lz4Compress(slice src, sink &dest, unsigned short *table, int tableBits)
+    {
+        bool fail = false;
+        int n = src.size();
+        const unsigned char *in = (const unsigned char *)src.base + src.start;
+        unsigned char *op = (unsigned char *)dest.base + dest.start;
+        unsigned char *oend = (unsigned char *)dest.base + dest.end;
+        // table has the position + 1 of the last place each hash of 4 bytes was seen.
+        for (int i = 0; i < (1 << tableBits); i++)
+        {
+            table[i] = 0;
+        }
+        int shift = 32 - tableBits;
+        int anchor = 0; // the start of the literals not written yet
+        int i = 0;
+        while (i < n - lz4MatchLimit)
+        {
+            unsigned int seq = read32(in + i);
+            unsigned int h = (seq * 2654435761u) >> shift;
+            int ref = table[h] - 1;
+            table[h] = i + 1;
+            if (ref < 0 || read32(in + ref) != seq)
+            {
+                i++;
+                continue;
+            }
+            // the match may start in the literals before it.
+            while (i > anchor && ref > 0 && in[i - 1] == in[ref - 1])
+            {
+                i--;
+                ref--;
+            }
+            int len = lz4MinMatch;
+            while (i + len < n - lz4LastLiterals && in[i + len] == in[ref + len])
+            {
+                len++;
+            }
+            if (putSequence(op, oend, in + anchor, i - anchor, i - ref, len))
+            {
+                fail = true;
+                return fail;
+            }
+            i += len;
+            anchor = i;
+        }
+        if (putSequence(op, oend, in + anchor, n - anchor, 0, 0))
+        {
+            fail = true;
+            return fail;
+        }
+        dest.start = op - (unsigned char *)dest.base;
+        return fail;
+    }
+
+    // getLength adds the 255 bytes of a length to len. Returns true if the block ends first.
+    static bool getLength(const unsigned char *&ip, const unsigned char *iend, int &len)
+    {
+        bool fail = false;
+        unsigned char b;
+        do
+        {
+            if (ip >= iend)
+            {
+                fail = true;
+                return fail;
+            }
+            b = *ip++;
+            len += b;
+        } while (b == 255);
+        return fail;
+    }
+
+    bool lz4Decompress(slice src, sink &dest)
+    {
+        bool fail = false;
+        if (src.empty())
+        {
+            fail = true;
+            return fail;
+        }
+        const unsigned char *ip = (const unsigned char *)src.base + src.start;
+        const unsigned char *iend = (const unsigned char *)src.base + src.end;
+        unsigned char *ostart = (unsigned char *)dest.base + dest.start;
+        unsigned char *op = ostart;
+        unsigned char *oend = (unsigned char *)dest.base + dest.end;
+        while (true)
+        {
+            if (ip >= iend)
+            {
+                fail = true;
+                return fail;
+            }
+            int token = *ip++;
+            int lit = token >> 4;
+            if (lit == 15 && getLength(ip, iend, lit))
+            {
+                fail = true;
+                return fail;
+            }
+            if (iend - ip < lit || oend - op < lit)
+            {
+                fail = true;
+                return fail;
+            }
+            memcpy(op, ip, lit);
+            op += lit;
+            ip += lit;
+            if (ip == iend)
+            {
+                break; // the last sequence has no match
+            }
+            if (iend - ip < 2)
+            {
+                fail = true;
+                return fail;
+            }
+            int offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > op - ostart)
+            {
+                fail = true;
+                return fail;
+            }
+            int len = token & 15;
+            if (len == 15 && getLength(ip, iend, len))
+            {
+                fail = true;
+                return fail;
+            }
+            len += lz4MinMatch;
+            if (oend - op < len)
+            {
+                fail = true;
+                return fail;
+            }
+            // byte at a time because the match can overlap what it's writing, eg. a run.
+            const unsigned char *m = op - offset;
+            while (len--)
+            {
+                *op++ = *m++;
+            }
+        }
+        dest.start = op - (unsigned char *)dest.base;
+        return fail;
+    }
+
+    payloadCodec::payloadCodec(unsigned short *table, int tableBits, slice *filters, int filterCount)
+        : table(table), tableBits(tableBits), filters(filters), filterCount(filterCount)
+    {
+        minSize = 64;
+    }
+
+    bool payloadCodec::wants(slice topic)
+    {
+        if (filters == 0)
+        {
+            return true;
+        }
+        for (int i = 0; i < filterCount; i++)
+        {
+            if (topicMatches(filters[i], topic))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool payloadCodec::encode(mqttPacketPieces &pub, sink buffer)
+    {
+        int n = pub.Payload.size();
+        if (n < minSize || wants(pub.TopicName) == false)
+        {
+            return false;
+        }
+        int slot = -1;
+        for (int i = 0; i < pub.UserKeyVal_len(); i += 2)
+        {
+            if (pub.UserKeyVal[i].empty())
+            {
+                slot = i;
+                break;
+            }
+        }
+        if (slot < 0)
+        {
+            return false;
+        }
+        sink out = buffer;
+        if (out.size() < 4)
+        {
+            return false;
+        }
+        out.writeLittleEndianVarLenInt(n);
+        // it has to save more than the prop costs.
+        int propCost = 1 + 2 + slice(codecKey).size() + 2 + slice(codecLZ4).size();
+        int room = n - propCost - (out.start - buffer.start);
+        if (room <= 0)
+        {
+            return false;
+        }
+        sink limit = out;
+        if (limit.size() > room)
+        {
+            limit.end = limit.start + room;
+        }
+        if (lz4Compress(pub.Payload, limit, table, tableBits))
+        {
+            return false;
+        }
+        pub.Payload = slice(buffer.base, buffer.start, limit.start);
+        pub.UserKeyVal[slot] = codecKey;
+        pub.UserKeyVal[slot + 1] = codecLZ4;
+        return true;
+    }
+
+    payloadView::payloadView(mqttPacketPieces &pub, char *buf, int size)
+    {
+        payload = pub.Payload;
+        compressed = pub.findKey(codecKey).equals(codecLZ4);
+        buffer = sink(buf, size);
+        plain = compressed ? slice() : payload;
+        done = compressed == false;
+    }
+
+    int payloadView::plainSize()
+    {
+        if (compressed == false)
+        {
+            return payload.size();
+        }
+        slice s = payload;
+        return s.getLittleEndianVarLenInt();
+    }
+
+    slice payloadView::get()
+    {
+        if (done)
+        {
+            return plain;
+        }
+        done = true;
+        slice s = payload;
+        int n = s.getLittleEndianVarLenInt();
+        sink out = buffer;
+        if (n < 0 || n > out.size())
+        {
+            return plain;
+        }
+        out.end = out.start + n;
+        if (lz4Decompress(s, out) || out.start != buffer.start + n)
+        {
+            return plain;
+        }
+        plain = slice(buffer.base, buffer.start, out.start);
+        return plain;
+    }
+
+} // namespace knotfree
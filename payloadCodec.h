@@ -0,0 +1,83 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "mqtt5nano.h"
+
+namespace knotfree
+{
+    // Payload compression for publishes. Telemetry json shrinks a lot and on a cellular
+    // link the bytes are the cost.
+    // A compressed payload is the plain size as a var len int, low 7 bits first like the
+    // packet lengths, and then an lz4 block. It's marked with the user prop
+    // content-encoding: lz4 so the content type stays what the publisher said it was.
+    // Nothing is allocated. The caller owns the hash table and the buffers so it's fine on
+    // the esp with a small table.
+
+    extern const char *codecKey; // content-encoding
+    extern const char *codecLZ4; // lz4
+
+    // lz4Compress writes src as an lz4 block into dest at dest.start and advances it.
+    // table is scratch for the match finder with 1 << tableBits entries. 8 bits is 512 bytes
+    // and finds most of the repeats in json. 12 finds more.
+    // Returns true if failed, eg. dest is too small.
+    bool lz4Compress(slice src, sink &dest, unsigned short *table, int tableBits);
+
+    // lz4Decompress writes what an lz4 block decodes to into dest at dest.start and advances it.
+    // Returns true if failed, eg. the block is malformed or dest is too small.
+    bool lz4Decompress(slice src, sink &dest);
+
+    // payloadCodec compresses the payloads of the publishes whose topic matches one of its filters.
+    struct payloadCodec
+    {
+        unsigned short *table;
+        int tableBits;
+        slice *filters; // the topics to compress. Wildcards are ok. 0 is every topic.
+        int filterCount;
+        int minSize; // smaller payloads go as they are. Default is 64.
+
+        payloadCodec(unsigned short *table, int tableBits, slice *filters, int filterCount);
+
+        // wants is true if topic matches a filter.
+        bool wants(slice topic);
+
+        // encode compresses pub.Payload into buffer, points pub.Payload at it and adds the
+        // content-encoding user prop. Returns true if it did. The publish is left as it was
+        // if the topic isn't wanted, the payload is small, it didn't get smaller
+        // or there's no room in UserKeyVal for the prop.
+        bool encode(mqttPacketPieces &pub, sink buffer);
+    };
+
+    // payloadView is the payload of a parsed publish. A compressed one is decompressed
+    // into the buffer the first time get is called. A plain one is never copied.
+    struct payloadView
+    {
+        slice payload; // as it came
+        bool compressed;
+        sink buffer;
+        slice plain;
+        bool done;
+
+        payloadView(mqttPacketPieces &pub, char *buffer, int size);
+
+        // plainSize is the size after decompression, or -1 if it's malformed. It doesn't decompress.
+        int plainSize();
+
+        // get returns the payload. It has a null base if it's malformed or doesn't fit the buffer.
+        slice get();
+    };
+
+} // namespace knotfree
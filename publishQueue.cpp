@@ -0,0 +1,377 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "publishQueue.h"
+
+namespace knotfree
+{
+    publishQueue::publishQueue(char *buffer, int size, overflowPolicy policy)
+        : buffer(buffer), size(size), policy(policy)
+    {
+        if (this->size > 0xFFFF)
+        {
+            this->size = 0xFFFF; // it's all slices in the end.
+        }
+        head = 0;
+        tail = 0;
+        limit = 0;
+        wrapped = false;
+        count = 0;
+        dropped = 0;
+        expired = 0;
+    }
+
+    // packetSize reads the remaining length of the packet at pos.
+    int publishQueue::packetSize(int pos)
+    {
+        slice s(buffer, pos + 1, size);
+        int len = s.getLittleEndianVarLenInt();
+        return s.start - pos + len;
+    }
+
+    static bool isDead(char first)
+    {
+        return (first & 0xF0) == 0;
+    }
+
+    static slice topicOf(slice packet)
+    {
+        packet.readByte();
+        packet.getLittleEndianVarLenInt();
+        return packet.getBigFixedLenString();
+    }
+
+    // writeFiller makes the len bytes at p into a dead packet.
+    static void writeFiller(char *p, int len)
+    {
+        for (int body = len - 2; body >= 0; body--)
+        {
+            sink s(p, len);
+            s.writeByte(0);
+            s.writeLittleEndianVarLenInt(body);
+            if (s.start + body == len)
+            {
+                return;
+            }
+        }
+    }
+
+    static unsigned int readFour(const char *p)
+    {
+        return (unsigned int)(unsigned char)p[0] << 24 | (unsigned char)p[1] << 16 | (unsigned char)p[2] << 8 | (unsigned char)p[3];
+    }
+
+    static void writeFour(char *p, unsigned int val)
+    {
+        p[0] = val >> 24;
+        p[1] = val >> 16;
+        p[2] = val >> 8;
+        p[3] = val;
+    }
+
+    // expiryAt is where the 4 bytes of the message expiry are in the packet at pos, or -1.
+    int publishQueue::expiryAt(int pos)
+    {
+        slice s(buffer, pos, pos + packetSize(pos));
+        char first = s.readByte();
+        s.getLittleEndianVarLenInt();
+        s.getBigFixedLenString();
+        if (first & 6)
+        {
+            s.start += 2; // the packet id
+        }
+        int propsLen = s.getLittleEndianVarLenInt();
+        if (propsLen <= 0 || propsLen > s.size())
+        {
+            return -1;
+        }
+        slice value = findMessageExpiry(slice(buffer, s.start, s.start + propsLen));
+        return value.base && value.size() == 4 ? value.start : -1;
+    }
+
+    // stampExpiry swaps the interval of a packet just pushed for when it runs out.
+    // 0 is forever so one that would run out at 0 runs out a second early.
+    // Over 68 years is cut to 68 years so the clock can wrap.
+    void publishQueue::stampExpiry(int pos, unsigned int now)
+    {
+        int at = expiryAt(pos);
+        unsigned int interval = at >= 0 ? readFour(buffer + at) : 0;
+        if (interval > 0x7FFFFFFF)
+        {
+            interval = 0x7FFFFFFF;
+        }
+        if (interval)
+        {
+            writeFour(buffer + at, now + interval ? now + interval : 1);
+        }
+    }
+
+    // unstampRun puts back when they run out, for a run that drainTo couldn't write.
+    void publishQueue::unstampRun(int from, int to, unsigned int now)
+    {
+        for (int pos = from; pos < to; pos += packetSize(pos))
+        {
+            int at = expiryAt(pos);
+            if (at >= 0 && readFour(buffer + at))
+            {
+                writeFour(buffer + at, readFour(buffer + at) + now);
+            }
+        }
+    }
+
+    int publishQueue::bytes()
+    {
+        if (wrapped)
+        {
+            return (limit - head) + tail;
+        }
+        return tail - head;
+    }
+
+    // settle fixes up head after it moves. Past the limit it wraps
+    // and when it catches the tail we are empty and start over at 0.
+    static void settle(publishQueue &q)
+    {
+        if (q.wrapped && q.head >= q.limit)
+        {
+            q.head = 0;
+            q.wrapped = false;
+        }
+        if (!q.wrapped && q.head >= q.tail)
+        {
+            q.head = 0;
+            q.tail = 0;
+        }
+    }
+
+    void publishQueue::popOldest()
+    {
+        if (bytes() == 0)
+        {
+            return;
+        }
+        if (!isDead(buffer[head]))
+        {
+            count--;
+            dropped++;
+        }
+        head += packetSize(head);
+        settle(*this);
+    }
+
+    char *publishQueue::reserve(int len)
+    {
+        if (!wrapped)
+        {
+            if (tail + len <= size)
+            {
+                tail += len;
+                return buffer + tail - len;
+            }
+            if (len <= head)
+            {
+                limit = tail;
+                wrapped = true;
+                tail = len;
+                return buffer;
+            }
+            return 0;
+        }
+        if (tail + len <= head)
+        {
+            tail += len;
+            return buffer + tail - len;
+        }
+        return 0;
+    }
+
+    void publishQueue::dropTopic(slice topic, unsigned int now)
+    {
+        int pos = head;
+        bool back = wrapped;
+        while (bytes() > 0)
+        {
+            int end = back ? limit : tail;
+            if (pos >= end)
+            {
+                if (!back)
+                {
+                    break;
+                }
+                back = false;
+                pos = 0;
+                continue;
+            }
+            int len = packetSize(pos);
+            if (isDead(buffer[pos]))
+            {
+                pos += len;
+                continue;
+            }
+            int at = expiryAt(pos);
+            unsigned int expires = at >= 0 ? readFour(buffer + at) : 0;
+            if (topicOf(slice(buffer, pos, pos + len)).equals(topic))
+            {
+                buffer[pos] &= 0x0F;
+                count--;
+                dropped++;
+            }
+            else if (expires && int(expires - now) <= 0)
+            {
+                buffer[pos] &= 0x0F;
+                count--;
+                expired++;
+            }
+            pos += len;
+        }
+        // don't leave dead ones at the front.
+        while (bytes() > 0 && isDead(buffer[head]))
+        {
+            popOldest();
+        }
+    }
+
+    bool publishQueue::push(mqttPacketPieces &pub, sink assemblyBuffer, unsigned int now)
+    {
+        bool fail = false;
+        pub.packetType = CtrlPublish;
+        int len = pub.outputSize();
+        if (policy == coalesceByTopic)
+        {
+            dropTopic(pub.TopicName, now);
+        }
+        char *where = reserve(len);
+        while (where == 0 && policy != dropNewest && bytes() > 0)
+        {
+            popOldest();
+            where = reserve(len);
+        }
+        if (where == 0)
+        {
+            dropped++;
+            fail = true;
+            return fail;
+        }
+        sinkDrain dest;
+        dest.dest = sink(where, len);
+        if (pub.outputPubOrSub(assemblyBuffer, &dest) || dest.dest.start != len)
+        {
+            writeFiller(where, len); // it can't come back out so skip it.
+            dropped++;
+            fail = true;
+            return fail;
+        }
+        if (pub.MessageExpiry)
+        {
+            stampExpiry(where - buffer, now);
+        }
+        count++;
+        return fail;
+    }
+
+    bool publishQueue::pushEncoded(slice packet, unsigned int now)
+    {
+        bool fail = false;
+        int len = packet.size();
+        if (len < 2)
+        {
+            fail = true;
+            return fail;
+        }
+        if (policy == coalesceByTopic)
+        {
+            dropTopic(topicOf(packet), now);
+        }
+        char *where = reserve(len);
+        while (where == 0 && policy != dropNewest && bytes() > 0)
+        {
+            popOldest();
+            where = reserve(len);
+        }
+        if (where == 0)
+        {
+            dropped++;
+            fail = true;
+            return fail;
+        }
+        const char *src = packet.charPointer();
+        for (int i = 0; i < len; i++)
+        {
+            where[i] = src[i];
+        }
+        stampExpiry(where - buffer, now);
+        count++;
+        return fail;
+    }
+
+    int publishQueue::drainTo(drain *destination, int maxBytes, unsigned int now)
+    {
+        int written = 0;
+        int budget = maxBytes;
+        while (count > 0)
+        {
+            while (bytes() > 0 && isDead(buffer[head]))
+            {
+                popOldest();
+            }
+            int end = wrapped ? limit : tail;
+            int runEnd = head;
+            int n = 0;
+            while (runEnd < end && !isDead(buffer[runEnd]))
+            {
+                int len = packetSize(runEnd);
+                int at = expiryAt(runEnd);
+                unsigned int expires = at >= 0 ? readFour(buffer + at) : 0;
+                if (expires && int(expires - now) <= 0)
+                {
+                    buffer[runEnd] &= 0x0F; // too late. It's skipped like a coalesced one.
+                    count--;
+                    expired++;
+                    break;
+                }
+                if (runEnd + len - head > budget)
+                {
+                    break;
+                }
+                if (expires)
+                {
+                    writeFour(buffer + at, expires - now);
+                }
+                runEnd += len;
+                n++;
+            }
+            if (n == 0 && bytes() > 0 && isDead(buffer[head]))
+            {
+                continue; // it ran out.
+            }
+            if (n == 0)
+            {
+                break; // the next one is over budget.
+            }
+            if (destination->write(slice(buffer, head, runEnd)))
+            {
+                unstampRun(head, runEnd, now);
+                break;
+            }
+            budget -= runEnd - head;
+            written += n;
+            count -= n;
+            head = runEnd;
+            settle(*this);
+        }
+        return written;
+    }
+
+} // namespace knotfree
@@ -0,0 +1,85 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "mqtt5nano.h"
+
+namespace knotfree
+{
+    // What a publishQueue does when a new publish doesn't fit.
+    enum overflowPolicy
+    {
+        dropOldest,      // make room by dropping from the front.
+        dropNewest,      // keep what we have and drop the new one.
+        coalesceByTopic, // drop any older one with the same topic and then like dropOldest.
+    };
+
+    // publishQueue is where publishes wait while the link is down.
+    // It's a ring in a buffer that the caller owns (64k max) and the packets are stored
+    // already encoded, back to back, with nothing in between. So they never get serialized
+    // twice and a whole run of them goes out in one write when we're connected again.
+    // A packet never wraps. If it doesn't fit at the end it goes at the front.
+    // A coalesced packet stays in place with its type set to 0 and is skipped.
+    // A publish with a message expiry has it swapped, in place, for when it runs out on the
+    // caller's clock, the now that push and drainTo get, in seconds. drainTo writes back what's
+    // left, as the spec wants when it's sent on, and drops the ones that have run out as it
+    // comes to them, and so does the coalescing scan. Leave now 0 and nothing runs out.
+    struct publishQueue
+    {
+        char *buffer;
+        int size;
+        int head;     // the oldest packet
+        int tail;     // where the next one goes
+        int limit;    // the end of the data at the back when we've wrapped
+        bool wrapped; // the data is [head,limit) and then [0,tail)
+        int count;    // live packets
+        int dropped;  // how many publishes were lost to the policy
+        int expired;  // how many ran out before they could go
+        overflowPolicy policy;
+
+        publishQueue(char *buffer, int size, overflowPolicy policy);
+
+        // push encodes the publish straight into the ring with outputPubOrSub.
+        // Returns true if it was dropped.
+        bool push(mqttPacketPieces &pub, sink assemblyBuffer, unsigned int now = 0);
+
+        // pushEncoded copies in a publish that is already encoded.
+        bool pushEncoded(slice packet, unsigned int now = 0);
+
+        // drainTo writes the oldest packets to destination, up to maxBytes of them,
+        // with one write for each contiguous run. The packets written are removed.
+        // Returns how many packets were written. It stops at the first failed write
+        // and leaves that run in the queue.
+        int drainTo(drain *destination, int maxBytes, unsigned int now = 0);
+
+        bool empty()
+        {
+            return count == 0;
+        }
+        // bytes is how much of the buffer is in use.
+        int bytes();
+
+    private:
+        char *reserve(int len);
+        int packetSize(int pos);
+        void popOldest();
+        void dropTopic(slice topic, unsigned int now);
+        int expiryAt(int pos);
+        void stampExpiry(int pos, unsigned int now);
+        void unstampRun(int from, int to, unsigned int now);
+    };
+
+} // namespace knotfree
@@ -0,0 +1,291 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// replay runs every packet of a capture through getPacket and mqttPacketPieces::parse, and
+// the publish payloads that look like json through badjson::Chop, as fast as it can.
+// It's for checking parser work against real traffic. Make a capture with the minibroker's
+// -capture option, or with a captureFile or captureDrain in your own program.
+//
+// g++ -O2 -std=c++17 -I.. ../*.cpp replay_main.cpp -o replay -lpthread
+// ./replay [-n loops] [-nojson] capture
+// ./replay -synth n capture   writes n packets of made up traffic to try it with.
+//
+// It prints the packets and bytes per second for all of it and then, for each packet
+// type, how many there were, how many failed to parse and the ns per parse.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "badjson.h"
+#include "capture.h"
+#include "mqtt5nano.h"
+
+using namespace knotfree;
+
+const char *typeNames[16] = {"0", "Connect", "ConnAck", "Publish", "PubAck", "PubRecv", "PubRel", "PubComp",
+                             "Subscribe", "SubAck", "Unsubscribe", "UnsubAck", "PingReq", "PingResp",
+                             "Disconnect", "Auth"};
+
+struct typeStats
+{
+    unsigned long long packets = 0;
+    unsigned long long bytes = 0;
+    unsigned long long parseFailures = 0;
+    unsigned long long json = 0;
+    unsigned long long jsonFailures = 0;
+    std::vector<slice> all; // the packets of this type, for timing them alone
+};
+
+typeStats stats[16];
+bool doJson = true;
+
+unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool looksLikeJson(slice s)
+{
+    return s.size() > 1 && (s.base[s.start] == '{' || s.base[s.start] == '[');
+}
+
+// replayOne frames and parses one packet. Returns true if failed.
+bool replayOne(slice packet, bool count)
+{
+    bool fail = false;
+    unsigned char firstByte;
+    slice body;
+    mqttPacketPieces p;
+    slice pos = packet;
+    if (getPacket(pos, firstByte, body) != frameOk)
+    {
+        fail = true;
+        return fail;
+    }
+    typeStats &t = stats[firstByte >> 4];
+    if (p.parse(body, firstByte, body.size()))
+    {
+        fail = true;
+        if (count)
+        {
+            t.parseFailures++;
+        }
+        return fail;
+    }
+    if (doJson && p.packetType == CtrlPublish && looksLikeJson(p.Payload))
+    {
+        badjson::ResultsTriplette res = badjson::Chop(p.Payload.base + p.Payload.start, p.Payload.size());
+        if (count)
+        {
+            t.json++;
+            t.jsonFailures += res.error != 0;
+        }
+        delete res.segment;
+    }
+    return fail;
+}
+
+// synth writes made up traffic: connects, subscribes, json publishes at all the qos and their acks.
+int synth(int n, const char *path)
+{
+    captureFile file;
+    if (file.open(path))
+    {
+        printf("can't write %s\n", path);
+        return 1;
+    }
+    sinkDrain nowhere;
+    char out[4096];
+    char pending[4096];
+    char assembly[1024];
+    captureDrain d(&nowhere, &file, pending, sizeof(pending));
+    unsigned int r = 1;
+    for (int i = 0; i < n; i++)
+    {
+        nowhere.dest = sink(out, sizeof(out));
+        r = r * 1103515245 + 12345;
+        int kind = (r >> 16) % 20;
+        mqttPacketPieces p;
+        p.reset();
+        char topic[64];
+        char payload[256];
+        snprintf(topic, sizeof(topic), "site/%u/pump/%u/telemetry", (r >> 8) % 16, (r >> 4) % 64);
+        if (kind == 0)
+        {
+            char id[32];
+            snprintf(id, sizeof(id), "device-%u", r % 10000);
+            p.outputConnect(sink(assembly, sizeof(assembly)), &d, slice(id), slice("user"), slice("pass"));
+        }
+        else if (kind == 1)
+        {
+            subscribeFilter filter(slice(topic), 1);
+            p.PacketID = i;
+            p.outputSubscribe(sink(assembly, sizeof(assembly)), &d, &filter, 1, 0);
+        }
+        else if (kind < 6)
+        {
+            p.outputAck(sink(assembly, sizeof(assembly)), &d, CtrlPubAck, i, 0);
+        }
+        else
+        {
+            int len = snprintf(payload, sizeof(payload),
+                               "{\"ts\":%d,\"temp\":%u.%u,\"rpm\":%u,\"state\":\"running\",\"tags\":[\"a\",\"b\"]}",
+                               i, 20 + r % 10, r % 10, 1000 + r % 500);
+            p.packetType = CtrlPublish;
+            p.QoS = kind % 3;
+            p.PacketID = p.QoS ? i : 0;
+            p.TopicName = slice(topic);
+            p.UserKeyVal[0] = "tenant";
+            p.UserKeyVal[1] = "acme";
+            p.Payload = slice(payload, 0, len);
+            p.outputPubOrSub(sink(assembly, sizeof(assembly)), &d);
+        }
+    }
+    printf("wrote %llu packets, %llu bytes to %s\n", file.packets, file.bytes, path);
+    return file.close();
+}
+
+void usage()
+{
+    printf("replay [-n loops] [-nojson] capture\nreplay -synth n capture\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int loops = 10;
+    int synthCount = 0;
+    const char *path = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            loops = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-synth") && i + 1 < argc)
+            synthCount = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-nojson"))
+            doJson = false;
+        else if (argv[i][0] != '-' && path == 0)
+            path = argv[i];
+        else
+            usage();
+    }
+    if (path == 0 || loops < 1)
+    {
+        usage();
+    }
+    if (synthCount)
+    {
+        return synth(synthCount, path);
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        printf("can't open %s\n", path);
+        return 1;
+    }
+    const char *data = (const char *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        printf("can't map %s\n", path);
+        return 1;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    captureReader reader;
+    if (reader.start(data, st.st_size))
+    {
+        printf("%s isn't a capture\n", path);
+        return 1;
+    }
+    // the first pass counts, the rest are timed.
+    std::vector<slice> packets;
+    unsigned long long bytes = 0;
+    unsigned long long first = 0;
+    unsigned long long last = 0;
+    slice packet;
+    unsigned long long ns;
+    unsigned char direction;
+    while (reader.next(packet, ns, direction))
+    {
+        first = first ? first : ns;
+        last = ns;
+        packets.push_back(packet);
+        bytes += packet.size();
+        typeStats &t = stats[(unsigned char)packet.base[packet.start] >> 4];
+        t.packets++;
+        t.bytes += packet.size();
+        t.all.push_back(packet);
+        replayOne(packet, true);
+    }
+    if (reader.pos != reader.size)
+    {
+        printf("the capture is cut off after %llu packets\n", (unsigned long long)packets.size());
+    }
+    if (packets.empty())
+    {
+        printf("no packets\n");
+        return 1;
+    }
+    printf("%llu packets, %llu bytes over %.1f s of capture\n", (unsigned long long)packets.size(), bytes,
+           (last - first) / 1e9);
+
+    unsigned long long start = nowNs();
+    for (int l = 0; l < loops; l++)
+    {
+        for (slice &p : packets)
+        {
+            replayOne(p, false);
+        }
+    }
+    double secs = (nowNs() - start) / 1e9;
+    printf("replayed %d times: %.0f packets/s %.1f MB/s\n", loops, packets.size() * loops / secs,
+           bytes * loops / secs / 1e6);
+
+    printf("%-12s %10s %12s %8s %8s %8s %8s\n", "type", "packets", "bytes", "bad", "json", "badjson", "ns each");
+    for (int i = 0; i < 16; i++)
+    {
+        typeStats &t = stats[i];
+        if (t.packets == 0)
+        {
+            continue;
+        }
+        unsigned long long tStart = nowNs();
+        for (int l = 0; l < loops; l++)
+        {
+            for (slice &p : t.all)
+            {
+                replayOne(p, false);
+            }
+        }
+        double each = double(nowNs() - tStart) / (t.all.size() * (double)loops);
+        printf("%-12s %10llu %12llu %8llu %8llu %8llu %8.1f\n", typeNames[i], t.packets, t.bytes,
+               t.parseFailures, t.json, t.jsonFailures, each);
+    }
+    munmap((void *)data, st.st_size);
+    close(fd);
+    return 0;
+}
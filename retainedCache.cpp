@@ -0,0 +1,480 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "retainedCache.h"
+#include "mqtt5nano.h" // hasWildcard
+
+#include <string.h>
+
+namespace knotfree
+{
+    // Every record in the arena starts with this header.
+    // owner node (2), kind (1), 0, length of the data (2). A dead record has owner 0xFFFF.
+    const int retainedRecordHeader = 6;
+    const char retainedKindName = 'n';
+    const char retainedKindMessage = 'm';
+    // A message starts with its qos (1), where the expiry is in it or 0 (2), and when it runs out (4).
+    const int retainedMessageHeader = 7;
+
+    retainedCache::retainedCache(retainedNode *nodes, int maxNodes, int *buckets, int bucketCount, char *arena, int arenaSize)
+        : nodes(nodes), maxNodes(maxNodes), buckets(buckets), bucketMask(bucketCount - 1), arena(arena), arenaSize(arenaSize)
+    {
+        clear();
+    }
+
+    void retainedCache::clear()
+    {
+        for (int i = 0; i <= bucketMask; i++)
+        {
+            buckets[i] = -1;
+        }
+        // node 0 is the root. The rest are free.
+        retainedNode &root = nodes[0];
+        root.parent = -1;
+        root.firstChild = -1;
+        root.nextSibling = -1;
+        root.nextInBucket = -1;
+        root.name = 0;
+        root.nameLen = 0;
+        root.message = -1;
+        root.childCount = 0;
+        freeNodes = -1;
+        for (int i = maxNodes - 1; i > 0; i--)
+        {
+            nodes[i].nextSibling = freeNodes;
+            freeNodes = i;
+        }
+        arenaUsed = 0;
+        deadBytes = 0;
+        count = 0;
+    }
+
+    unsigned int retainedCache::hash(int parent, slice name)
+    {
+        unsigned int h = 2166136261u ^ (unsigned int)parent;
+        for (int i = name.start; i < name.end; i++)
+        {
+            h = (h ^ (unsigned char)name.base[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    int retainedCache::findChild(int parent, slice name)
+    {
+        int n = buckets[hash(parent, name) & bucketMask];
+        while (n >= 0)
+        {
+            if (nodes[n].parent == parent && name.equals(nodeName(n)))
+            {
+                return n;
+            }
+            n = nodes[n].nextInBucket;
+        }
+        return -1;
+    }
+
+    // alloc makes room for a record and returns the offset of its data, or -1.
+    // It may compact so any other arena offsets must be read again after.
+    int retainedCache::alloc(int owner, char kind, int len)
+    {
+        if (len > 65535)
+        {
+            return -1;
+        }
+        if (arenaUsed + retainedRecordHeader + len > arenaSize)
+        {
+            compact();
+            if (arenaUsed + retainedRecordHeader + len > arenaSize)
+            {
+                return -1;
+            }
+        }
+        char *h = arena + arenaUsed;
+        h[0] = owner;
+        h[1] = owner >> 8;
+        h[2] = kind;
+        h[3] = 0;
+        h[4] = len;
+        h[5] = len >> 8;
+        arenaUsed += retainedRecordHeader + len;
+        return arenaUsed - len;
+    }
+
+    static int recordLength(const char *data)
+    {
+        return (unsigned char)data[-2] | ((unsigned char)data[-1] << 8);
+    }
+
+    void retainedCache::release(int offset)
+    {
+        char *h = arena + offset - retainedRecordHeader;
+        h[0] = char(0xFF);
+        h[1] = char(0xFF);
+        deadBytes += retainedRecordHeader + recordLength(arena + offset);
+    }
+
+    // compact slides the live records down over the dead ones and tells their nodes where they went.
+    void retainedCache::compact()
+    {
+        if (deadBytes == 0)
+        {
+            return;
+        }
+        int from = 0;
+        int to = 0;
+        while (from < arenaUsed)
+        {
+            char *h = arena + from;
+            int owner = (unsigned char)h[0] | ((unsigned char)h[1] << 8);
+            int size = retainedRecordHeader + ((unsigned char)h[4] | ((unsigned char)h[5] << 8));
+            if (owner != 0xFFFF)
+            {
+                if (h[2] == retainedKindName)
+                {
+                    nodes[owner].name = to + retainedRecordHeader;
+                }
+                else
+                {
+                    nodes[owner].message = to + retainedRecordHeader;
+                }
+                memmove(arena + to, h, size);
+                to += size;
+            }
+            from += size;
+        }
+        arenaUsed = to;
+        deadBytes = 0;
+    }
+
+    int retainedCache::addChild(int parent, slice name)
+    {
+        if (freeNodes < 0)
+        {
+            return -1;
+        }
+        int n = freeNodes;
+        int offset = alloc(n, retainedKindName, name.size());
+        if (offset < 0)
+        {
+            return -1;
+        }
+        freeNodes = nodes[n].nextSibling;
+        memcpy(arena + offset, name.base + name.start, name.size());
+        retainedNode &node = nodes[n];
+        node.parent = parent;
+        node.firstChild = -1;
+        node.message = -1;
+        node.name = offset;
+        node.nameLen = name.size();
+        node.childCount = 0;
+        node.nextSibling = nodes[parent].firstChild;
+        nodes[parent].firstChild = n;
+        nodes[parent].childCount++;
+        int &bucket = buckets[hash(parent, name) & bucketMask];
+        node.nextInBucket = bucket;
+        bucket = n;
+        return n;
+    }
+
+    void retainedCache::freeNode(int n)
+    {
+        retainedNode &node = nodes[n];
+        int *link = &nodes[node.parent].firstChild;
+        while (*link != n)
+        {
+            link = &nodes[*link].nextSibling;
+        }
+        *link = node.nextSibling;
+        nodes[node.parent].childCount--;
+        link = &buckets[hash(node.parent, nodeName(n)) & bucketMask];
+        while (*link != n)
+        {
+            link = &nodes[*link].nextInBucket;
+        }
+        *link = node.nextInBucket;
+        release(node.name);
+        node.nextSibling = freeNodes;
+        freeNodes = n;
+    }
+
+    // cutLevels splits a topic or filter at the /'s. Returns how many levels or -1 if there are too many.
+    static int cutLevels(slice s, slice *levels)
+    {
+        int n = 0;
+        int start = s.start;
+        for (int i = s.start; i <= s.end; i++)
+        {
+            if (i == s.end || s.base[i] == '/')
+            {
+                if (n == retainedMaxDepth)
+                {
+                    return -1;
+                }
+                levels[n++] = slice(s.base, start, i);
+                start = i + 1;
+            }
+        }
+        return n;
+    }
+
+    // trim takes away the levels from node up that have nothing under them.
+    void retainedCache::trim(int n)
+    {
+        while (n > 0 && nodes[n].message < 0 && nodes[n].firstChild < 0)
+        {
+            int parent = nodes[n].parent;
+            freeNode(n);
+            n = parent;
+        }
+    }
+
+    bool retainedCache::put(slice topic, char qos, slice props, slice payload, unsigned int now)
+    {
+        bool fail = false;
+        slice levels[retainedMaxDepth];
+        int levelCount = topic.empty() ? -1 : cutLevels(topic, levels);
+        if (levelCount < 0 || hasWildcard(topic))
+        {
+            fail = true;
+            return fail;
+        }
+        // find the node, making the levels that aren't there unless it's a delete.
+        int n = 0;
+        for (int i = 0; i < levelCount; i++)
+        {
+            int child = findChild(n, levels[i]);
+            if (child < 0 && payload.size() == 0)
+            {
+                return fail; // deleting one that isn't there.
+            }
+            if (child < 0)
+            {
+                child = addChild(n, levels[i]);
+            }
+            if (child < 0)
+            {
+                fail = true;
+                break;
+            }
+            n = child;
+        }
+        if (!fail && payload.size() != 0)
+        {
+            int propsLenSize = props.size() < 128 ? 1 : (props.size() < 128 * 128 ? 2 : 3);
+            int len = retainedMessageHeader + 2 + topic.size() + propsLenSize + props.size() + payload.size();
+            slice expiry = findMessageExpiry(props);
+            unsigned int interval = expiry.base ? propertyInt(propKeyMessageExpiryInterval, expiry) : 0;
+            if (interval > 0x7FFFFFFF)
+            {
+                interval = 0x7FFFFFFF; // 68 years, so the clock can wrap.
+            }
+            int field = interval ? len - payload.size() - props.size() + expiry.start - props.start : 0;
+            unsigned int expires = now + interval;
+            int offset = alloc(n, retainedKindMessage, len);
+            if (offset < 0 && nodes[n].message >= 0)
+            { // try again without the old one.
+                release(nodes[n].message);
+                nodes[n].message = -1;
+                count--;
+                offset = alloc(n, retainedKindMessage, len);
+            }
+            if (offset >= 0)
+            {
+                if (nodes[n].message >= 0)
+                {
+                    release(nodes[n].message);
+                    count--;
+                }
+                nodes[n].message = offset;
+                count++;
+                sink out(arena + offset, len);
+                out.writeByte(qos);
+                out.writeByte(field);
+                out.writeByte(field >> 8);
+                out.writeByte(expires >> 24);
+                out.writeByte(expires >> 16);
+                out.writeByte(expires >> 8);
+                out.writeByte(expires);
+                out.writeFixedLenStr(topic);
+                out.writeLittleEndianVarLenInt(props.size());
+                out.writeBytes(props.base + props.start, props.size());
+                out.writeBytes(payload.base + payload.start, payload.size());
+                return fail;
+            }
+            fail = true;
+        }
+        else if (!fail && nodes[n].message >= 0)
+        {
+            release(nodes[n].message);
+            nodes[n].message = -1;
+            count--;
+        }
+        trim(n);
+        return fail;
+    }
+
+    bool retainedCache::load(int n, retainedMessage &m, unsigned int now)
+    {
+        bool fail = false;
+        int offset = nodes[n].message;
+        unsigned char *h = (unsigned char *)arena + offset;
+        int field = h[1] | h[2] << 8;
+        m.expiry = 0;
+        if (field)
+        {
+            unsigned int expires = (unsigned int)h[3] << 24 | h[4] << 16 | h[5] << 8 | h[6];
+            int left = int(expires - now);
+            if (left <= 0)
+            {
+                release(offset);
+                nodes[n].message = -1;
+                count--;
+                trim(n);
+                fail = true;
+                return fail;
+            }
+            m.expiry = left;
+            h[field] = left >> 24;
+            h[field + 1] = left >> 16;
+            h[field + 2] = left >> 8;
+            h[field + 3] = left;
+        }
+        // the slices start at the record because an arena offset can be past what a slice can hold.
+        slice all(arena + offset, retainedMessageHeader, recordLength(arena + offset));
+        m.qos = h[0];
+        m.topicField = all;
+        m.topic = all.getBigFixedLenString();
+        m.topicField.end = all.start;
+        m.rest = all;
+        int propsLen = all.getLittleEndianVarLenInt();
+        m.props = slice(all.base, all.start, all.start + propsLen);
+        m.payload = slice(all.base, m.props.end, all.end);
+        return fail;
+    }
+
+    bool retainedCache::get(slice topic, retainedMessage &m, unsigned int now)
+    {
+        bool fail = false;
+        slice levels[retainedMaxDepth];
+        int levelCount = topic.empty() ? -1 : cutLevels(topic, levels);
+        int n = levelCount < 0 ? -1 : 0;
+        for (int i = 0; i < levelCount && n >= 0; i++)
+        {
+            n = findChild(n, levels[i]);
+        }
+        if (n <= 0 || nodes[n].message < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        fail = load(n, m, now);
+        return fail;
+    }
+
+    retainedMatch retainedCache::match(slice filter, unsigned int now)
+    {
+        retainedMatch it;
+        it.cache = this;
+        it.now = now;
+        it.depth = 0;
+        it.levelCount = filter.empty() ? -1 : cutLevels(filter, it.levels);
+        for (int i = 0; i < it.levelCount; i++)
+        {
+            slice lv = it.levels[i];
+            bool hash = lv.equals("#");
+            if ((hash && i != it.levelCount - 1) || (lv.size() > 1 && hasWildcard(lv)))
+            {
+                return it; // a bad filter matches nothing.
+            }
+        }
+        if (it.levelCount > 0)
+        {
+            it.stack[0].node = 0;
+            it.stack[0].level = 0;
+            it.stack[0].cursor = -2;
+            it.depth = 1;
+        }
+        return it;
+    }
+
+    bool retainedMatch::next(retainedMessage &m)
+    {
+        retainedNode *nodes = cache->nodes;
+        while (depth > 0)
+        {
+            frame &f = stack[depth - 1];
+            if (f.cursor == -2)
+            { // the first time here. Is it a match and which children could be.
+                f.cursor = -1;
+                bool has = f.node != 0 && nodes[f.node].message >= 0;
+                if (f.level == levelCount)
+                {
+                    depth--;
+                    if (has && !cache->load(f.node, m, now))
+                    {
+                        return true;
+                    }
+                    continue;
+                }
+                slice lv = f.level < 0 ? slice("#") : levels[f.level];
+                if (lv.equals("#"))
+                { // it and everything under it. a/# matches a too.
+                    f.level = -1;
+                    f.cursor = nodes[f.node].firstChild;
+                    // one that has run out may take its levels with it but the cursors
+                    // on the stack are already past them.
+                    if (has && !cache->load(f.node, m, now))
+                    {
+                        return true;
+                    }
+                }
+                else if (lv.equals("+"))
+                {
+                    f.cursor = nodes[f.node].firstChild;
+                }
+                else
+                {
+                    int child = cache->findChild(f.node, lv);
+                    if (child < 0)
+                    {
+                        depth--;
+                        continue;
+                    }
+                    f.node = child;
+                    f.level++;
+                    f.cursor = -2;
+                }
+                continue;
+            }
+            int child = f.cursor;
+            if (child < 0)
+            {
+                depth--;
+                continue;
+            }
+            f.cursor = nodes[child].nextSibling;
+            if (f.node == 0 && nodes[child].nameLen && cache->arena[nodes[child].name] == '$')
+            {
+                continue; // wildcards don't match $SYS and the like at the top.
+            }
+            frame &c = stack[depth++];
+            c.node = child;
+            c.level = f.level < 0 ? -1 : f.level + 1;
+            c.cursor = -2;
+        }
+        return false;
+    }
+
+} // namespace knotfree
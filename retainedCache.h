@@ -0,0 +1,129 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "slices.h"
+
+namespace knotfree
+{
+    // A retainedCache keeps the last retained publish of every topic so a subscribe
+    // can be answered from here, eg. by a bridge when a device boots, with no trip upstream.
+    // The topics are a trie of levels. Finding a child is a hash lookup so an exact level
+    // costs the same however many siblings it has, and a match walks the trie once for
+    // the whole filter, + and # included.
+    // The caller owns all the memory: the nodes, the hash buckets and an arena for the
+    // level names and the messages. Nothing is allocated so it's fine on the esp.
+    // A message with a message expiry is kept until it runs out on the caller's clock, the now
+    // in seconds that put, get and match get. When it's read the expiry in its props is made
+    // what's left, as the spec wants when it's sent on, and one that has run out is dropped
+    // then instead. Leave now 0 and nothing runs out.
+    // All return true if failed.
+
+    const int retainedMaxDepth = 16; // levels in a topic or filter
+
+    // retainedMessage is one that's kept. The slices point into the arena and are good until the next put.
+    struct retainedMessage
+    {
+        char qos;
+        unsigned int expiry; // seconds left, 0 is forever. It's in props too.
+        slice topic;
+        slice props;
+        slice payload;
+        slice topicField; // the topic with its 2 byte length, as in a publish.
+        slice rest;       // the props length, props and payload, as in a publish.
+    };
+
+    // retainedNode is one level of a topic. It may or may not have a message.
+    struct retainedNode
+    {
+        int parent;
+        int firstChild;
+        int nextSibling; // and the free list
+        int nextInBucket;
+        int name;    // arena offset of the level name
+        int message; // arena offset of the message or -1
+        unsigned short nameLen;
+        unsigned short childCount;
+    };
+
+    struct retainedCache;
+
+    // retainedMatch walks the messages that match a filter. Get one from retainedCache::match.
+    // Don't put while walking. The ones that have run out are dropped as it comes to them.
+    struct retainedMatch
+    {
+        retainedCache *cache;
+        unsigned int now;
+        // the filter cut into levels
+        slice levels[retainedMaxDepth];
+        int levelCount;
+        struct frame
+        {
+            int node;
+            int level;  // the next filter level to match. -1 is everything under node, for #.
+            int cursor; // the next child to try. -2 is before the node itself.
+        } stack[retainedMaxDepth + 2];
+        int depth;
+
+        // next gets the next match. Returns false when there are no more.
+        bool next(retainedMessage &m);
+    };
+
+    struct retainedCache
+    {
+        retainedNode *nodes;
+        int maxNodes;
+        int *buckets;
+        int bucketMask;
+        char *arena;
+        int arenaSize;
+        int arenaUsed;
+        int deadBytes; // in the arena, until compact
+        int freeNodes; // the head of the free list
+        int count;     // messages
+
+        // bucketCount must be a power of two. maxNodes must be under 65535.
+        // The arena can be bigger than 64k but a message can't.
+        retainedCache(retainedNode *nodes, int maxNodes, int *buckets, int bucketCount, char *arena, int arenaSize);
+
+        // put keeps the message for topic, replacing any before. An empty payload removes it.
+        // It fails for a topic with wildcards, too many levels, or if there's no room.
+        bool put(slice topic, char qos, slice props, slice payload, unsigned int now = 0);
+        // get is the message for exactly topic.
+        bool get(slice topic, retainedMessage &m, unsigned int now = 0);
+        retainedMatch match(slice filter, unsigned int now = 0);
+        void clear();
+
+        // these are for retainedMatch.
+        int findChild(int parent, slice name);
+        // load fails if the message has run out, and then it's gone.
+        bool load(int node, retainedMessage &m, unsigned int now);
+        slice nodeName(int node)
+        {
+            return slice(arena + nodes[node].name, 0, nodes[node].nameLen);
+        }
+
+    private:
+        int addChild(int parent, slice name);
+        void freeNode(int node);
+        void trim(int node);
+        int alloc(int owner, char kind, int len);
+        void release(int offset);
+        void compact();
+        unsigned int hash(int parent, slice name);
+    };
+
+} // namespace knotfree
@@ -0,0 +1,148 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "rpc.h"
+
+namespace knotfree
+{
+    rpcClient::rpcClient(rpcCall *calls, int count, slice responseTopic, timerWheel &wheel)
+        : calls(calls), count(count), responseTopic(responseTopic), wheel(wheel)
+    {
+        pending = 0;
+        freeHead = -1;
+        for (int i = count - 1; i >= 0; i--)
+        {
+            calls[i].inUse = false;
+            calls[i].generation = 0;
+            calls[i].deadline.handler = this;
+            calls[i].deadline.id = i;
+            calls[i].nextFree = freeHead;
+            freeHead = i;
+        }
+    }
+
+    void rpcClient::release(int slot)
+    {
+        wheel.cancel(calls[slot].deadline);
+        calls[slot].inUse = false;
+        calls[slot].nextFree = freeHead;
+        freeHead = slot;
+        pending--;
+    }
+
+    int rpcClient::call(mqttPacketPieces &request, sink assemblyBuffer, drain *destination,
+                        unsigned long now, unsigned long timeout, rpcHandler *handler, void *user)
+    {
+        if (freeHead < 0)
+        {
+            return -1;
+        }
+        int slot = freeHead;
+        rpcCall &c = calls[slot];
+        c.generation = (c.generation + 1) & 0x7FFF;
+        c.correlation[0] = slot >> 8;
+        c.correlation[1] = slot;
+        c.correlation[2] = c.generation >> 8;
+        c.correlation[3] = c.generation;
+        request.packetType = CtrlPublish;
+        request.RespTopic = responseTopic;
+        request.CorrelationData = slice(c.correlation, 0, sizeof(c.correlation));
+        if (request.outputPubOrSub(assemblyBuffer, destination))
+        {
+            return -1;
+        }
+        freeHead = c.nextFree;
+        c.inUse = true;
+        c.handler = handler;
+        c.user = user;
+        wheel.add(c.deadline, now + timeout);
+        pending++;
+        return (c.generation << 16) | slot;
+    }
+
+    bool rpcClient::onPublish(mqttPacketPieces &pub)
+    {
+        slice corr = pub.CorrelationData;
+        if (corr.size() != 4 || pub.TopicName.equals(responseTopic) == false)
+        {
+            return false;
+        }
+        const unsigned char *b = (const unsigned char *)corr.base + corr.start;
+        int slot = (b[0] << 8) | b[1];
+        unsigned short generation = (b[2] << 8) | b[3];
+        if (slot >= count || calls[slot].inUse == false || calls[slot].generation != generation)
+        {
+            return true; // ours but late, or not a call we know.
+        }
+        rpcCall &c = calls[slot];
+        release(slot);
+        c.handler->onResponse(c, pub);
+        return true;
+    }
+
+    void rpcClient::onTimer(timer &t)
+    {
+        rpcCall &c = calls[t.id];
+        release(t.id);
+        c.handler->onTimeout(c);
+    }
+
+    bool rpcClient::cancel(int id)
+    {
+        bool fail = false;
+        int slot = id & 0xFFFF;
+        if (id < 0 || slot >= count || calls[slot].inUse == false || calls[slot].generation != (id >> 16))
+        {
+            fail = true;
+            return fail;
+        }
+        release(slot);
+        return fail;
+    }
+
+    bool serveRequest(mqttPacketPieces &request, sink assemblyBuffer, drain *destination, sink replyBuffer)
+    {
+        bool fail = false;
+        sinkDrain reply;
+        reply.dest = replyBuffer;
+        slice line = request.Payload;
+        if (line.empty() == false)
+        {
+            badjson::ResultsTriplette res = badjson::Chop(line.base + line.start, line.size());
+            if (res.error)
+            {
+                reply.write(res.error);
+            }
+            else if (res.segment)
+            {
+                process(res.segment, reply);
+            }
+            delete res.segment;
+        }
+        if (request.RespTopic.empty())
+        {
+            return fail;
+        }
+        mqttPacketPieces answer;
+        answer.reset();
+        answer.packetType = CtrlPublish;
+        answer.TopicName = request.RespTopic;
+        answer.CorrelationData = request.CorrelationData;
+        answer.Payload = reply.dest.getWritten();
+        fail = answer.outputPubOrSub(assemblyBuffer, destination);
+        return fail;
+    }
+
+} // namespace knotfree
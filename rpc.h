@@ -0,0 +1,97 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "commandLine.h"
+#include "mqtt5nano.h"
+#include "timerWheel.h"
+
+namespace knotfree
+{
+    // Request and response over mqtt 5. A request is a publish with a ResponseTopic and
+    // CorrelationData. The answer is published to that topic with the same CorrelationData.
+    // rpcClient is the asking end and serveRequest is the answering end on a device.
+
+    struct rpcCall;
+
+    // rpcHandler is told how a call ended.
+    struct rpcHandler
+    {
+        virtual ~rpcHandler()
+        {
+        }
+        // onResponse is the answer. response is the parsed publish.
+        virtual void onResponse(rpcCall &call, mqttPacketPieces &response) = 0;
+        // onTimeout is when there was no answer in time.
+        virtual void onTimeout(rpcCall &call)
+        {
+        }
+    };
+
+    // rpcCall is a slot in the table of calls waiting for an answer.
+    struct rpcCall
+    {
+        rpcHandler *handler;
+        void *user; // for the handler
+        timer deadline;
+        unsigned short generation; // goes up each time the slot is used so a late answer to the last call is ignored
+        bool inUse;
+        int nextFree;
+        char correlation[4]; // the slot and the generation. It's the CorrelationData.
+    };
+
+    // rpcClient keeps the calls that are waiting in a table the caller owns. The CorrelationData
+    // is the slot and its generation so an answer goes straight to its call with no search.
+    // The timeouts are on a timerWheel, which can be shared with other timers. Advance it to time them out.
+    struct rpcClient : timerHandler
+    {
+        rpcCall *calls;
+        int count;
+        slice responseTopic; // where the answers come. Subscribe to it.
+        int pending;         // calls waiting
+        timerWheel &wheel;
+
+        rpcClient(rpcCall *calls, int count, slice responseTopic, timerWheel &wheel);
+
+        // call publishes request with the response topic and the correlation data set.
+        // now and timeout are in the wheel's ticks.
+        // Returns the call's id or -1 if the table is full or the write failed.
+        int call(mqttPacketPieces &request, sink assemblyBuffer, drain *destination,
+                 unsigned long now, unsigned long timeout, rpcHandler *handler, void *user);
+
+        // onPublish completes the call that pub answers.
+        // Returns true if it was an answer to one of ours, so nothing else should handle it.
+        bool onPublish(mqttPacketPieces &pub);
+
+        // cancel drops a call without telling its handler. Returns true if failed, eg. it's done already.
+        bool cancel(int id);
+
+        // onTimer is a call's deadline. It's the wheel that calls it.
+        void onTimer(timer &t) override;
+
+    private:
+        int freeHead;
+        void release(int slot);
+    };
+
+    // serveRequest answers a request on a device. The payload is a command line, eg. get time,
+    // and it goes through process() like one from anywhere else. What the command writes is
+    // published to the request's ResponseTopic with its CorrelationData at qos 0.
+    // A request with no ResponseTopic is run and not answered.
+    // replyBuffer holds the answer while it's sent. Returns true if failed.
+    bool serveRequest(mqttPacketPieces &request, sink assemblyBuffer, drain *destination, sink replyBuffer);
+
+} // namespace knotfree
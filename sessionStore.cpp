@@ -0,0 +1,1051 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "sessionStore.h"
+#include "mqtt5nano.h"
+
+#ifndef ARDUINO
+#include <fcntl.h>
+#include <stdio.h> // has rename
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#if defined(ARDUINO_ARCH_ESP8266)
+#include <Arduino.h>
+#endif
+
+namespace knotfree
+{
+    // fletcher is the fletcher16 checksum of the records.
+    struct fletcher
+    {
+        unsigned int a = 0;
+        unsigned int b = 0;
+        void add(const char *cP, int len)
+        {
+            for (int i = 0; i < len; i++)
+            {
+                a = (a + (unsigned char)cP[i]) % 255;
+                b = (b + a) % 255;
+            }
+        }
+        unsigned short get()
+        {
+            return (b << 8) | a;
+        }
+    };
+
+    // makeHeader fills in the 6 bytes of a record header before the check.
+    static void makeHeader(char *hdr, char type, unsigned short packetID, int length)
+    {
+        hdr[0] = type;
+        hdr[1] = 0;
+        hdr[2] = packetID >> 8;
+        hdr[3] = packetID;
+        hdr[4] = length >> 8;
+        hdr[5] = length;
+    }
+
+    static void putCheck(char *hdr, unsigned short check)
+    {
+        hdr[6] = check >> 8;
+        hdr[7] = check;
+    }
+
+    static unsigned short headerID(const char *hdr)
+    {
+        return ((unsigned char)hdr[2] << 8) | (unsigned char)hdr[3];
+    }
+    static unsigned short headerLength(const char *hdr)
+    {
+        return ((unsigned char)hdr[4] << 8) | (unsigned char)hdr[5];
+    }
+    static unsigned short headerCheck(const char *hdr)
+    {
+        return ((unsigned char)hdr[6] << 8) | (unsigned char)hdr[7];
+    }
+
+    // writeWithDup writes a stored packet. A qos 1 or 2 publish is marked as a duplicate
+    // which is what the spec wants for a resend.
+    static bool writeWithDup(drain *destination, char first, slice rest)
+    {
+        if (((first >> 4) & 0x0F) == CtrlPublish && (first & 0x06))
+        {
+            first |= 0x08;
+        }
+        bool fail = destination->writeByte(first);
+        fail |= destination->write(rest);
+        return fail;
+    }
+
+    sessionEntry *sessionIndex::find(unsigned short packetID)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (entries[i].packetID == packetID)
+            {
+                return &entries[i];
+            }
+        }
+        return 0;
+    }
+
+    bool sessionIndex::put(unsigned short packetID, unsigned int offset, unsigned short length)
+    {
+        bool fail = false;
+        sessionEntry *e = find(packetID);
+        if (e == 0)
+        {
+            if (count >= max)
+            {
+                fail = true;
+                return fail;
+            }
+            e = &entries[count++];
+            e->packetID = packetID;
+        }
+        e->offset = offset;
+        e->length = length;
+        return fail;
+    }
+
+    void sessionIndex::remove(unsigned short packetID)
+    {
+        sessionEntry *e = find(packetID);
+        if (e == 0)
+        {
+            return;
+        }
+        for (int i = e - entries; i < count - 1; i++)
+        {
+            entries[i] = entries[i + 1];
+        }
+        count--;
+    }
+
+#ifndef ARDUINO
+
+    fileSessionStore::fileSessionStore(sessionEntry *entries, int maxEntries) : index(entries, maxEntries)
+    {
+        fd = -1;
+        path[0] = 0;
+        logSize = 0;
+        liveBytes = 0;
+        compactAfter = 64 * 1024;
+        syncWrites = false;
+        map = 0;
+        mapSize = 0;
+    }
+
+    fileSessionStore::~fileSessionStore()
+    {
+        close();
+    }
+
+    void fileSessionStore::remap()
+    {
+#if defined(__linux__)
+        if (map && mapSize == logSize)
+        {
+            return;
+        }
+        if (map)
+        {
+            munmap((void *)map, mapSize);
+            map = 0;
+            mapSize = 0;
+        }
+        if (logSize)
+        {
+            void *m = mmap(0, logSize, PROT_READ, MAP_SHARED, fd, 0);
+            if (m != MAP_FAILED)
+            {
+                map = (const char *)m;
+                mapSize = logSize;
+            }
+        }
+#endif
+    }
+
+    bool fileSessionStore::readAt(unsigned int offset, char *dest, int len)
+    {
+        if (map && offset + len <= mapSize)
+        {
+            memcpy(dest, map + offset, len);
+            return false;
+        }
+        return pread(fd, dest, len, offset) != len;
+    }
+
+    bool fileSessionStore::open(const char *p)
+    {
+        bool fail = false;
+        close();
+        strncpy(path, p, sizeof(path) - 5);
+        path[sizeof(path) - 5] = 0;
+        fd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        logSize = st.st_size;
+        remap();
+
+        // scan the log and rebuild the index.
+        index.count = 0;
+        unsigned int pos = 0;
+        char hdr[sessionRecordHeader];
+        char chunk[256];
+        while (pos + sessionRecordHeader <= logSize)
+        {
+            if (readAt(pos, hdr, sessionRecordHeader))
+            {
+                break;
+            }
+            unsigned short len = headerLength(hdr);
+            if ((hdr[0] != sessionRecordPacket && hdr[0] != sessionRecordAck) ||
+                pos + sessionRecordHeader + len > logSize)
+            {
+                break;
+            }
+            fletcher f;
+            f.add(hdr, 6);
+            unsigned int dataPos = pos + sessionRecordHeader;
+            for (int done = 0; done < len;)
+            {
+                int amt = len - done < (int)sizeof(chunk) ? len - done : sizeof(chunk);
+                if (readAt(dataPos + done, chunk, amt))
+                {
+                    break;
+                }
+                f.add(chunk, amt);
+                done += amt;
+            }
+            if (f.get() != headerCheck(hdr))
+            {
+                break; // torn or corrupt. Everything after is gone.
+            }
+            if (hdr[0] == sessionRecordPacket)
+            {
+                index.put(headerID(hdr), dataPos, len);
+            }
+            else
+            {
+                index.remove(headerID(hdr));
+            }
+            pos = dataPos + len;
+        }
+        if (pos < logSize)
+        {
+            if (ftruncate(fd, pos))
+            {
+                fail = true;
+            }
+            logSize = pos;
+            remap();
+        }
+        liveBytes = 0;
+        for (int i = 0; i < index.count; i++)
+        {
+            liveBytes += sessionRecordHeader + index.entries[i].length;
+        }
+        return fail;
+    }
+
+    void fileSessionStore::close()
+    {
+#if defined(__linux__)
+        if (map)
+        {
+            munmap((void *)map, mapSize);
+        }
+#endif
+        map = 0;
+        mapSize = 0;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        fd = -1;
+    }
+
+    bool fileSessionStore::append(char type, unsigned short packetID, slice packet)
+    {
+        bool fail = false;
+        char hdr[sessionRecordHeader];
+        int len = packet.size();
+        makeHeader(hdr, type, packetID, len);
+        fletcher f;
+        f.add(hdr, 6);
+        f.add(packet.charPointer(), len);
+        putCheck(hdr, f.get());
+
+        // one write per record so a crash leaves at most one torn record at the end.
+        struct iovec iov[2];
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sessionRecordHeader;
+        iov[1].iov_base = (void *)packet.charPointer();
+        iov[1].iov_len = len;
+        if (lseek(fd, logSize, SEEK_SET) < 0 || writev(fd, iov, 2) != sessionRecordHeader + len)
+        {
+            if (ftruncate(fd, logSize))
+            {
+                // we're in trouble either way.
+            }
+            fail = true;
+            return fail;
+        }
+        if (syncWrites)
+        {
+#if defined(__linux__)
+            fdatasync(fd);
+#else
+            fsync(fd);
+#endif
+        }
+        logSize += sessionRecordHeader + len;
+        return fail;
+    }
+
+    bool fileSessionStore::save(unsigned short packetID, slice packet)
+    {
+        bool fail = false;
+        sessionEntry *old = index.find(packetID);
+        if (fd < 0 || (old == 0 && index.count >= index.max))
+        {
+            fail = true;
+            return fail;
+        }
+        unsigned int offset = logSize + sessionRecordHeader;
+        if (append(sessionRecordPacket, packetID, packet))
+        {
+            fail = true;
+            return fail;
+        }
+        if (old)
+        {
+            liveBytes -= sessionRecordHeader + old->length;
+        }
+        index.put(packetID, offset, packet.size());
+        liveBytes += sessionRecordHeader + packet.size();
+        return fail;
+    }
+
+    bool fileSessionStore::forget(unsigned short packetID)
+    {
+        bool fail = false;
+        sessionEntry *e = index.find(packetID);
+        if (fd < 0 || e == 0)
+        {
+            return fail;
+        }
+        if (append(sessionRecordAck, packetID, slice()))
+        {
+            fail = true;
+            return fail;
+        }
+        liveBytes -= sessionRecordHeader + e->length;
+        index.remove(packetID);
+        if (logSize - liveBytes > compactAfter)
+        {
+            fail = compact();
+        }
+        return fail;
+    }
+
+    bool fileSessionStore::replay(drain *destination)
+    {
+        bool fail = false;
+        remap();
+        char chunk[256];
+        for (int i = 0; i < index.count && !fail; i++)
+        {
+            sessionEntry &e = index.entries[i];
+            if (e.length == 0)
+            {
+                continue;
+            }
+            if (map && e.offset + e.length <= mapSize)
+            { // straight out of the map
+                slice rest(map + e.offset, 1, e.length);
+                fail |= writeWithDup(destination, map[e.offset], rest);
+                continue;
+            }
+            for (int done = 0; done < e.length && !fail;)
+            {
+                int amt = e.length - done < (int)sizeof(chunk) ? e.length - done : sizeof(chunk);
+                fail |= readAt(e.offset + done, chunk, amt);
+                if (done == 0)
+                {
+                    fail |= writeWithDup(destination, chunk[0], slice(chunk, 1, amt));
+                }
+                else
+                {
+                    fail |= destination->write(slice(chunk, 0, amt));
+                }
+                done += amt;
+            }
+        }
+        return fail;
+    }
+
+    bool fileSessionStore::compact()
+    {
+        bool fail = false;
+        char tmpPath[sizeof(path)];
+        strcpy(tmpPath, path);
+        strcat(tmpPath, ".tmp");
+        int tmp = ::open(tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (tmp < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        remap();
+        char hdr[sessionRecordHeader];
+        char chunk[256];
+        for (int i = 0; i < index.count && !fail; i++)
+        {
+            sessionEntry &e = index.entries[i];
+            makeHeader(hdr, sessionRecordPacket, e.packetID, e.length);
+            fletcher f;
+            f.add(hdr, 6);
+            for (int done = 0; done < e.length && !fail;)
+            {
+                int amt = e.length - done < (int)sizeof(chunk) ? e.length - done : sizeof(chunk);
+                fail |= readAt(e.offset + done, chunk, amt);
+                f.add(chunk, amt);
+                done += amt;
+            }
+            putCheck(hdr, f.get());
+            fail |= write(tmp, hdr, sessionRecordHeader) != sessionRecordHeader;
+            for (int done = 0; done < e.length && !fail;)
+            {
+                int amt = e.length - done < (int)sizeof(chunk) ? e.length - done : sizeof(chunk);
+                fail |= readAt(e.offset + done, chunk, amt);
+                fail |= write(tmp, chunk, amt) != amt;
+                done += amt;
+            }
+        }
+        if (fail || fsync(tmp) || rename(tmpPath, path))
+        {
+            ::close(tmp);
+            unlink(tmpPath);
+            fail = true;
+            return fail;
+        }
+        // the new file is in place. Point everything at it.
+#if defined(__linux__)
+        if (map)
+        {
+            munmap((void *)map, mapSize);
+        }
+#endif
+        map = 0;
+        mapSize = 0;
+        ::close(fd);
+        fd = tmp;
+        unsigned int pos = 0;
+        for (int i = 0; i < index.count; i++)
+        {
+            index.entries[i].offset = pos + sessionRecordHeader;
+            pos += sessionRecordHeader + index.entries[i].length;
+        }
+        logSize = pos;
+        liveBytes = pos;
+        remap();
+        return fail;
+    }
+
+    fileFlashRegion::fileFlashRegion(int size, int sectorSize)
+    {
+        fd = -1;
+        regionSize = size;
+        sectorBytes = sectorSize;
+    }
+
+    fileFlashRegion::~fileFlashRegion()
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+
+    bool fileFlashRegion::open(const char *path)
+    {
+        bool fail = false;
+        fd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        if (st.st_size < regionSize)
+        {
+            for (int s = 0; s < regionSize / sectorBytes; s++)
+            {
+                fail |= erase(s);
+            }
+        }
+        return fail;
+    }
+
+    bool fileFlashRegion::read(int offset, char *dest, int len)
+    {
+        return pread(fd, dest, len, offset) != len;
+    }
+
+    bool fileFlashRegion::write(int offset, const char *src, int len)
+    {
+        // like nor flash a write can only clear bits.
+        char chunk[256];
+        for (int done = 0; done < len;)
+        {
+            int amt = len - done < (int)sizeof(chunk) ? len - done : sizeof(chunk);
+            if (pread(fd, chunk, amt, offset + done) != amt)
+            {
+                return true;
+            }
+            for (int i = 0; i < amt; i++)
+            {
+                chunk[i] &= src[done + i];
+            }
+            if (pwrite(fd, chunk, amt, offset + done) != amt)
+            {
+                return true;
+            }
+            done += amt;
+        }
+        return false;
+    }
+
+    bool fileFlashRegion::erase(int sector)
+    {
+        char ff[256];
+        memset(ff, 0xFF, sizeof(ff));
+        for (int done = 0; done < sectorBytes; done += sizeof(ff))
+        {
+            if (pwrite(fd, ff, sizeof(ff), sector * sectorBytes + done) != sizeof(ff))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+#endif // ARDUINO
+
+#if defined(ARDUINO_ARCH_ESP8266)
+
+    // The esp wants 4 byte aligned buffers so we go through one.
+    bool espFlashRegion::read(int offset, char *dest, int len)
+    {
+        uint32_t chunk[16];
+        for (int done = 0; done < len;)
+        {
+            int amt = len - done < (int)sizeof(chunk) ? len - done : sizeof(chunk);
+            if (!ESP.flashRead(start + offset + done, chunk, (amt + 3) & ~3))
+            {
+                return true;
+            }
+            memcpy(dest + done, chunk, amt);
+            done += amt;
+        }
+        return false;
+    }
+
+    bool espFlashRegion::write(int offset, const char *src, int len)
+    {
+        uint32_t chunk[16];
+        for (int done = 0; done < len;)
+        {
+            int amt = len - done < (int)sizeof(chunk) ? len - done : sizeof(chunk);
+            memcpy(chunk, src + done, amt);
+            if (!ESP.flashWrite(start + offset + done, chunk, amt))
+            {
+                return true;
+            }
+            done += amt;
+        }
+        return false;
+    }
+
+    bool espFlashRegion::erase(int sector)
+    {
+        return !ESP.flashEraseSector(start / 4096 + sector);
+    }
+
+#endif
+
+    // The sectors of the ring start with this and then the sequence number.
+    static const char flashSectorMagic[4] = {'K', 'S', 'S', '1'};
+    static const int flashSectorHeader = 8;
+    // A ring record is the usual header and then the save order, big endian.
+    // It's covered by the check.
+    static const int flashRecordHeader = sessionRecordHeader + 4;
+
+    static int pad4(int len)
+    {
+        return (len + 3) & ~3;
+    }
+
+    flashSessionStore::flashSessionStore(flashRegion *flash, sessionEntry *entries, int maxEntries)
+        : flash(flash), index(entries, maxEntries)
+    {
+        current = 0;
+        writePos = 0;
+        sequence = 0;
+        saveOrder = 0;
+    }
+
+    // sectorSequence returns the sequence of a sector or 0 if it's erased or not ours.
+    static unsigned int sectorSequence(flashRegion *flash, int sector)
+    {
+        char hdr[flashSectorHeader];
+        if (flash->read(sector * flash->sectorSize(), hdr, flashSectorHeader))
+        {
+            return 0;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            if (hdr[i] != flashSectorMagic[i])
+            {
+                return 0;
+            }
+        }
+        unsigned int seq = 0;
+        for (int i = 4; i < 8; i++)
+        {
+            seq = (seq << 8) | (unsigned char)hdr[i];
+        }
+        return seq == 0xFFFFFFFF ? 0 : seq;
+    }
+
+    static bool writeSectorHeader(flashRegion *flash, int sector, unsigned int seq)
+    {
+        char hdr[flashSectorHeader];
+        for (int i = 0; i < 4; i++)
+        {
+            hdr[i] = flashSectorMagic[i];
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            hdr[4 + i] = seq >> (24 - i * 8);
+        }
+        return flash->write(sector * flash->sectorSize(), hdr, flashSectorHeader);
+    }
+
+    static void putOrder(char *hdr, unsigned int order)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            hdr[sessionRecordHeader + i] = order >> (24 - i * 8);
+        }
+    }
+
+    static unsigned int headerOrder(const char *hdr)
+    {
+        unsigned int order = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            order = (order << 8) | (unsigned char)hdr[sessionRecordHeader + i];
+        }
+        return order;
+    }
+
+    // recordOrder reads the save order of a live packet. It's just before the packet bytes.
+    unsigned int flashSessionStore::recordOrder(const sessionEntry &e)
+    {
+        char hdr[flashRecordHeader];
+        if (flash->read(e.offset - flashRecordHeader, hdr, flashRecordHeader))
+        {
+            return 0;
+        }
+        return headerOrder(hdr);
+    }
+
+    // recordBytes is how much of the ring the live packets in sector take. All of them if sector is -1.
+    int flashSessionStore::recordBytes(int sector)
+    {
+        int ss = flash->sectorSize();
+        int total = 0;
+        for (int i = 0; i < index.count; i++)
+        {
+            sessionEntry &e = index.entries[i];
+            if (sector < 0 || (int)e.offset / ss == sector)
+            {
+                total += flashRecordHeader + pad4(e.length);
+            }
+        }
+        return total;
+    }
+
+    // scanSector applies the records of a sector to the index.
+    // Returns the offset after the last good record. It's negative if
+    // we stopped at something that's not erased flash.
+    int flashSessionStore::scanSector(int sector)
+    {
+        int ss = flash->sectorSize();
+        int pos = sector * ss + flashSectorHeader;
+        int end = (sector + 1) * ss;
+        char hdr[flashRecordHeader];
+        char chunk[64];
+        while (pos + flashRecordHeader <= end)
+        {
+            if (flash->read(pos, hdr, flashRecordHeader))
+            {
+                return -pos;
+            }
+            if ((unsigned char)hdr[0] == 0xFF)
+            {
+                return pos; // erased. The end of the records.
+            }
+            unsigned short len = headerLength(hdr);
+            if ((hdr[0] != sessionRecordPacket && hdr[0] != sessionRecordAck) ||
+                pos + flashRecordHeader + pad4(len) > end)
+            {
+                return -pos;
+            }
+            fletcher f;
+            f.add(hdr, 6);
+            f.add(hdr + sessionRecordHeader, 4);
+            for (int done = 0; done < len;)
+            {
+                int amt = len - done < (int)sizeof(chunk) ? len - done : sizeof(chunk);
+                flash->read(pos + flashRecordHeader + done, chunk, amt);
+                f.add(chunk, amt);
+                done += amt;
+            }
+            if (f.get() != headerCheck(hdr))
+            {
+                return -pos; // a torn write.
+            }
+            if (hdr[0] == sessionRecordPacket)
+            {
+                index.put(headerID(hdr), pos + flashRecordHeader, len);
+                if (headerOrder(hdr) > saveOrder)
+                {
+                    saveOrder = headerOrder(hdr);
+                }
+            }
+            else
+            {
+                index.remove(headerID(hdr));
+            }
+            pos += flashRecordHeader + pad4(len);
+        }
+        return pos;
+    }
+
+    bool flashSessionStore::open()
+    {
+        bool fail = false;
+        int sectors = flash->size() / flash->sectorSize();
+        if (sectors < 3)
+        {
+            fail = true;
+            return fail;
+        }
+        index.count = 0;
+        saveOrder = 0;
+        // play the sectors back in sequence order.
+        unsigned int last = 0;
+        int newest = -1;
+        while (true)
+        {
+            int next = -1;
+            unsigned int nextSeq = 0;
+            for (int s = 0; s < sectors; s++)
+            {
+                unsigned int seq = sectorSequence(flash, s);
+                if (seq > last && (next < 0 || seq < nextSeq))
+                {
+                    next = s;
+                    nextSeq = seq;
+                }
+            }
+            if (next < 0)
+            {
+                break;
+            }
+            int end = scanSector(next);
+            newest = next;
+            last = nextSeq;
+            writePos = end < 0 ? (next + 1) * flash->sectorSize() : end; // never write after junk.
+        }
+        // reclaim copies old packets past newer ones so the log isn't in save order.
+        // Put the index back oldest first.
+        for (int i = 1; i < index.count; i++)
+        {
+            sessionEntry e = index.entries[i];
+            unsigned int order = recordOrder(e);
+            int j = i;
+            for (; j > 0 && recordOrder(index.entries[j - 1]) > order; j--)
+            {
+                index.entries[j] = index.entries[j - 1];
+            }
+            index.entries[j] = e;
+        }
+        if (newest < 0)
+        { // format
+            for (int s = 0; s < sectors; s++)
+            {
+                fail |= flash->erase(s);
+            }
+            current = 0;
+            sequence = 1;
+            writePos = flashSectorHeader;
+            fail |= writeSectorHeader(flash, current, sequence);
+            return fail;
+        }
+        current = newest;
+        sequence = last;
+        // if we crashed before the oldest sector was erased the spare isn't there yet.
+        int spare = (current + 1) % sectors;
+        if (sectorSequence(flash, spare) != 0)
+        {
+            fail |= reclaim(spare);
+        }
+        return fail;
+    }
+
+    // nextSector moves to the spare sector and then makes the oldest the new spare
+    // after copying its live records forward.
+    // If the spare isn't erased, eg. an earlier reclaim failed, it fails and nothing moves.
+    bool flashSessionStore::nextSector()
+    {
+        bool fail = false;
+        int ss = flash->sectorSize();
+        int sectors = flash->size() / ss;
+        int spare = (current + 1) % sectors;
+        if (sectorSequence(flash, spare) != 0)
+        {
+            fail = true; // never write over a sector that isn't erased.
+            return fail;
+        }
+        current = spare;
+        sequence++;
+        fail |= writeSectorHeader(flash, current, sequence);
+        writePos = current * ss + flashSectorHeader;
+
+        int oldest = (current + 1) % sectors;
+        if (sectorSequence(flash, oldest) == 0)
+        {
+            return fail; // already erased.
+        }
+        fail |= reclaim(oldest);
+        return fail;
+    }
+
+    // reclaim copies the live records of a sector to the write position and then erases it.
+    // If they don't all fit nothing is copied and the sector is left alone.
+    bool flashSessionStore::reclaim(int sector)
+    {
+        bool fail = false;
+        int lo = sector * flash->sectorSize();
+        int hi = lo + flash->sectorSize();
+        if (writePos + recordBytes(sector) > (current + 1) * flash->sectorSize())
+        {
+            fail = true;
+            return fail;
+        }
+        for (int i = 0; i < index.count && !fail; i++)
+        {
+            sessionEntry e = index.entries[i];
+            if ((int)e.offset >= lo && (int)e.offset < hi)
+            {
+                fail |= appendFromFlash(e.packetID, e.offset, e.length);
+            }
+        }
+        if (!fail)
+        {
+            fail |= flash->erase(sector);
+        }
+        return fail;
+    }
+
+    bool flashSessionStore::append(char type, unsigned short packetID, slice packet)
+    {
+        bool fail = false;
+        int ss = flash->sectorSize();
+        int len = packet.size();
+        int recLen = flashRecordHeader + pad4(len);
+        if (recLen > ss - flashSectorHeader)
+        {
+            fail = true;
+            return fail;
+        }
+        // moving on may copy live records into the new sector so we might have to move again.
+        int tries = 0;
+        while (writePos + recLen > (current + 1) * ss)
+        {
+            if (tries++ >= flash->size() / ss || nextSector())
+            {
+                fail = true; // the live records fill the ring.
+                return fail;
+            }
+        }
+        // a packet saved again keeps its place in line.
+        unsigned int order = saveOrder;
+        if (type == sessionRecordPacket)
+        {
+            sessionEntry *e = index.find(packetID);
+            order = e ? recordOrder(*e) : ++saveOrder;
+        }
+        char hdr[flashRecordHeader];
+        makeHeader(hdr, type, packetID, len);
+        putOrder(hdr, order);
+        fletcher f;
+        f.add(hdr, 6);
+        f.add(hdr + sessionRecordHeader, 4);
+        f.add(packet.charPointer(), len);
+        putCheck(hdr, f.get());
+
+        int pos = writePos;
+        writePos += recLen; // even if it fails. We can't write there again.
+        fail |= flash->write(pos, hdr, flashRecordHeader);
+        int whole = len & ~3;
+        if (whole)
+        {
+            fail |= flash->write(pos + flashRecordHeader, packet.charPointer(), whole);
+        }
+        if (len > whole)
+        {
+            char tail[4] = {0, 0, 0, 0};
+            for (int i = whole; i < len; i++)
+            {
+                tail[i - whole] = packet.charPointer()[i];
+            }
+            fail |= flash->write(pos + flashRecordHeader + whole, tail, 4);
+        }
+        if (!fail && type == sessionRecordPacket)
+        {
+            fail |= index.put(packetID, pos + flashRecordHeader, len);
+        }
+        return fail;
+    }
+
+    // appendFromFlash copies a live packet to the write position. It keeps its save order.
+    bool flashSessionStore::appendFromFlash(unsigned short packetID, int offset, int length)
+    {
+        bool fail = false;
+        if (writePos + flashRecordHeader + pad4(length) > (current + 1) * flash->sectorSize())
+        {
+            fail = true;
+            return fail;
+        }
+        char chunk[64];
+        char hdr[flashRecordHeader];
+        fail |= flash->read(offset - flashRecordHeader, hdr, flashRecordHeader);
+        makeHeader(hdr, sessionRecordPacket, packetID, length);
+        fletcher f;
+        f.add(hdr, 6);
+        f.add(hdr + sessionRecordHeader, 4);
+        for (int done = 0; done < length;)
+        {
+            int amt = length - done < (int)sizeof(chunk) ? length - done : sizeof(chunk);
+            fail |= flash->read(offset + done, chunk, amt);
+            f.add(chunk, amt);
+            done += amt;
+        }
+        putCheck(hdr, f.get());
+        int pos = writePos;
+        writePos += flashRecordHeader + pad4(length);
+        fail |= flash->write(pos, hdr, flashRecordHeader);
+        for (int done = 0; done < pad4(length);)
+        { // chunk is a multiple of 4 so all the writes are too.
+            int amt = pad4(length) - done < (int)sizeof(chunk) ? pad4(length) - done : sizeof(chunk);
+            fail |= flash->read(offset + done, chunk, amt);
+            fail |= flash->write(pos + flashRecordHeader + done, chunk, amt);
+            done += amt;
+        }
+        if (!fail)
+        {
+            index.put(packetID, pos + flashRecordHeader, length);
+        }
+        return fail;
+    }
+
+    bool flashSessionStore::save(unsigned short packetID, slice packet)
+    {
+        bool fail = false;
+        sessionEntry *e = index.find(packetID);
+        if (e == 0 && index.count >= index.max)
+        {
+            fail = true;
+            return fail;
+        }
+        // the live packets must fit in two sectors less than the ring.
+        int ss = flash->sectorSize();
+        int live = recordBytes(-1) - (e ? flashRecordHeader + pad4(e->length) : 0);
+        if (live + flashRecordHeader + pad4(packet.size()) > (flash->size() / ss - 2) * (ss - flashSectorHeader))
+        {
+            fail = true;
+            return fail;
+        }
+        return append(sessionRecordPacket, packetID, packet);
+    }
+
+    bool flashSessionStore::forget(unsigned short packetID)
+    {
+        bool fail = false;
+        if (index.find(packetID) == 0)
+        {
+            return fail;
+        }
+        fail = append(sessionRecordAck, packetID, slice());
+        index.remove(packetID);
+        return fail;
+    }
+
+    bool flashSessionStore::replay(drain *destination)
+    {
+        bool fail = false;
+        char chunk[64];
+        for (int i = 0; i < index.count && !fail; i++)
+        {
+            sessionEntry &e = index.entries[i];
+            for (int done = 0; done < e.length && !fail;)
+            {
+                int amt = e.length - done < (int)sizeof(chunk) ? e.length - done : sizeof(chunk);
+                fail |= flash->read(e.offset + done, chunk, amt);
+                if (done == 0)
+                {
+                    fail |= writeWithDup(destination, chunk[0], slice(chunk, 1, amt));
+                }
+                else
+                {
+                    fail |= destination->write(slice(chunk, 0, amt));
+                }
+                done += amt;
+            }
+        }
+        return fail;
+    }
+
+} // namespace knotfree
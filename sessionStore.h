@@ -0,0 +1,222 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "slices.h"
+
+namespace knotfree
+{
+    // A sessionStore keeps the encoded qos 1 and 2 packets we sent until they are acked
+    // so that the session can pick up after a reconnect or a reboot.
+    // The backends are logs. A save appends the packet and a forget appends a tombstone.
+    // On open the log is scanned and anything after a torn or corrupt record is dropped.
+    // All return true if failed.
+    struct sessionStore
+    {
+        // save an encoded outbound packet under its packet id.
+        virtual bool save(unsigned short packetID, slice packet) = 0;
+        // forget the packet. It was acked.
+        virtual bool forget(unsigned short packetID) = 0;
+        // replay writes every packet that's not acked, oldest first, to destination.
+        // Publishes get the dup flag set as they go.
+        virtual bool replay(drain *destination) = 0;
+        // pending is how many packets are not acked.
+        virtual int pending() = 0;
+    };
+
+    // sessionEntry is where a packet is in the log.
+    struct sessionEntry
+    {
+        unsigned short packetID;
+        unsigned short length;
+        unsigned int offset; // of the packet bytes. After the record header.
+    };
+
+    // sessionIndex is the map from packet id to sessionEntry that we keep in RAM.
+    // The caller owns the entries so nothing is allocated. They stay in the order they were saved.
+    struct sessionIndex
+    {
+        sessionEntry *entries;
+        int max;
+        int count;
+
+        sessionIndex(sessionEntry *entries, int max) : entries(entries), max(max)
+        {
+            count = 0;
+        }
+        sessionEntry *find(unsigned short packetID);
+        // put replaces the entry for packetID or adds it at the end.
+        bool put(unsigned short packetID, unsigned int offset, unsigned short length);
+        void remove(unsigned short packetID);
+    };
+
+    // Every record in a log starts with this header.
+    // type, 0, packet id (2), length (2), fletcher16 of all the rest (2)
+    const int sessionRecordHeader = 8;
+    const char sessionRecordPacket = 'P';
+    const char sessionRecordAck = 'A';
+
+#ifndef ARDUINO
+
+    // fileSessionStore is an append only log in a file, for hosts.
+    // On linux the log is read through mmap.
+    // When the dead bytes pass compactAfter the live records are copied
+    // to a new file which is renamed over the old one.
+    struct fileSessionStore : sessionStore
+    {
+        sessionIndex index;
+        int fd;
+        char path[256];
+        unsigned int logSize;
+        unsigned int liveBytes;
+        unsigned int compactAfter;
+        bool syncWrites; // fdatasync after every record.
+
+        const char *map; // the mmap of the file
+        unsigned int mapSize;
+
+        fileSessionStore(sessionEntry *entries, int maxEntries);
+        ~fileSessionStore();
+
+        // open the log and rebuild the index from it.
+        bool open(const char *path);
+        void close();
+
+        bool save(unsigned short packetID, slice packet) override;
+        bool forget(unsigned short packetID) override;
+        bool replay(drain *destination) override;
+        int pending() override
+        {
+            return index.count;
+        }
+
+        // compact rewrites the log with only the live records.
+        bool compact();
+
+    private:
+        bool append(char type, unsigned short packetID, slice packet);
+        bool readAt(unsigned int offset, char *dest, int len);
+        void remap();
+    };
+
+#endif
+
+    // flashRegion is raw flash made of equal sectors. Erased flash reads as 0xFF.
+    // Writes and offsets are multiples of 4 which is what the esp needs.
+    struct flashRegion
+    {
+        virtual int size() = 0;
+        virtual int sectorSize() = 0;
+        virtual bool read(int offset, char *dest, int len) = 0;
+        virtual bool write(int offset, const char *src, int len) = 0;
+        virtual bool erase(int sector) = 0;
+    };
+
+#ifndef ARDUINO
+
+    // fileFlashRegion is a flashRegion in a file so the ring can be tested on a host.
+    struct fileFlashRegion : flashRegion
+    {
+        int fd;
+        int regionSize;
+        int sectorBytes;
+
+        fileFlashRegion(int size, int sectorSize);
+        ~fileFlashRegion();
+        bool open(const char *path); // a new file is made all erased.
+
+        int size() override
+        {
+            return regionSize;
+        }
+        int sectorSize() override
+        {
+            return sectorBytes;
+        }
+        bool read(int offset, char *dest, int len) override;
+        bool write(int offset, const char *src, int len) override;
+        bool erase(int sector) override;
+    };
+
+#endif
+
+#if defined(ARDUINO_ARCH_ESP8266)
+
+    // espFlashRegion is the flash between start and start + size.
+    // Get them from the linker script, eg. after the sketch and before the file system.
+    struct espFlashRegion : flashRegion
+    {
+        unsigned int start;
+        int regionSize;
+
+        espFlashRegion(unsigned int start, int size) : start(start), regionSize(size) {}
+
+        int size() override
+        {
+            return regionSize;
+        }
+        int sectorSize() override
+        {
+            return 4096;
+        }
+        bool read(int offset, char *dest, int len) override;
+        bool write(int offset, const char *src, int len) override;
+        bool erase(int sector) override;
+    };
+
+#endif
+
+    // flashSessionStore is a fixed size ring of sectors for the esp builds.
+    // Each sector starts with a sequence number. One sector is always kept erased.
+    // When the writing sector fills up we move to the erased one, copy the live
+    // records out of the oldest sector and then erase that. So the live packets
+    // must fit in two sectors less than the whole region and a save past that fails.
+    // We never move on to a spare that isn't erased.
+    // Packet records carry a save order so open can put them back oldest first
+    // after reclaim has copied some of them forward.
+    struct flashSessionStore : sessionStore
+    {
+        flashRegion *flash;
+        sessionIndex index;
+        int current;            // the sector we write in.
+        int writePos;           // offset in the region of the next record.
+        unsigned int sequence;  // of the current sector
+        unsigned int saveOrder; // of the newest packet saved
+
+        flashSessionStore(flashRegion *flash, sessionEntry *entries, int maxEntries);
+
+        // open scans the ring and rebuilds the index. An all erased region is formatted.
+        bool open();
+
+        bool save(unsigned short packetID, slice packet) override;
+        bool forget(unsigned short packetID) override;
+        bool replay(drain *destination) override;
+        int pending() override
+        {
+            return index.count;
+        }
+
+    private:
+        bool append(char type, unsigned short packetID, slice packet);
+        bool appendFromFlash(unsigned short packetID, int offset, int length);
+        bool nextSector();
+        bool reclaim(int sector);
+        int scanSector(int sector);
+        unsigned int recordOrder(const sessionEntry &e);
+        int recordBytes(int sector);
+    };
+
+} // namespace knotfree
@@ -0,0 +1,286 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "shardedBroker.h"
+
+#if defined(__linux__)
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace knotfree
+{
+    // The first byte of a record in a ring says what it is.
+    // A publish is the kind, the qos with the retain bit above it, the topicField and the rest.
+    // A connection is the kind and the fd.
+    const char shardPublish = 'p';
+    const char shardConnection = 'c';
+
+    brokerShard::brokerShard(shardedBroker *owner, int index)
+        : index(index), owner(owner), waker(wakeIn, sizeof(wakeIn), wakeOut, sizeof(wakeOut))
+    {
+        broker = new miniBroker(&loop);
+        broker->forwarder = this;
+        loop.handler = this; // we pass the sockets through to the broker.
+        for (int i = 0; i < maxShards; i++)
+        {
+            inbox[i] = 0;
+        }
+        handedOff = 0;
+        dropped = 0;
+        nextShard = 0;
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        waker.setFd(wakeFd);
+        loop.add(&waker);
+    }
+
+    brokerShard::~brokerShard()
+    {
+        delete broker;
+        ::close(wakeFd);
+        for (int i = 0; i < maxShards; i++)
+        {
+            delete inbox[i];
+        }
+    }
+
+    void brokerShard::wake()
+    {
+        unsigned long long one = 1;
+        if (::write(wakeFd, &one, sizeof(one)) < 0)
+        {
+            // it's already been woken as many times as an eventfd can count.
+        }
+    }
+
+    void brokerShard::onAccept(int listenFd, int fd)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails on a unix socket, which is fine.
+        int to = nextShard;
+        nextShard = (nextShard + 1) % owner->count;
+        if (to == index)
+        {
+            broker->adopt(fd);
+            return;
+        }
+        char head[1] = {shardConnection};
+        brokerShard *there = owner->shards[to];
+        if (there->inbox[index]->push(slice(head, 0, 1), slice((char *)&fd, 0, sizeof(fd))))
+        {
+            ::close(fd);
+            return;
+        }
+        if (there->inbox[index]->idle())
+        {
+            there->wake();
+        }
+    }
+
+    void brokerShard::onData(socketConn &c)
+    {
+        if (&c == &waker)
+        {
+            c.in.consume(c.in.buffered().size());
+            readInbox();
+            return;
+        }
+        broker->onData(c);
+    }
+
+    void brokerShard::onDrained(socketConn &c)
+    {
+        if (&c != &waker)
+        {
+            broker->onDrained(c);
+        }
+    }
+
+    void brokerShard::onClose(socketConn &c)
+    {
+        if (&c != &waker)
+        {
+            broker->onClose(c);
+        }
+    }
+
+    void brokerShard::forward(char qos, bool retain, slice topicField, slice rest)
+    {
+        char head[2] = {shardPublish, char(qos | (retain ? 4 : 0))};
+        for (int to = 0; to < owner->count; to++)
+        {
+            if (to == index)
+            {
+                continue;
+            }
+            spscRing *ring = owner->shards[to]->inbox[index];
+            if (ring->push(slice(head, 0, 2), topicField, rest))
+            {
+                dropped++;
+                continue;
+            }
+            if (ring->idle())
+            {
+                owner->shards[to]->wake();
+            }
+        }
+    }
+
+    void brokerShard::readInbox()
+    {
+        for (int from = 0; from < owner->count; from++)
+        {
+            spscRing *ring = inbox[from];
+            if (ring == 0)
+            {
+                continue;
+            }
+            int len;
+            while ((len = ring->pop(record, sizeof(record))) >= 0)
+            {
+                if (len >= 1 + int(sizeof(int)) && record[0] == shardConnection)
+                {
+                    int fd;
+                    memcpy(&fd, record + 1, sizeof(fd));
+                    handedOff++;
+                    broker->adopt(fd);
+                    continue;
+                }
+                if (len < 4 || record[0] != shardPublish)
+                {
+                    continue;
+                }
+                slice topicField(record, 2, len);
+                int topicLen = ((unsigned char)record[2] << 8) | (unsigned char)record[3];
+                topicField.end = 4 + topicLen;
+                if (topicField.end > len)
+                {
+                    continue;
+                }
+                broker->inject(record[1] & 3, record[1] & 4, topicField, slice(record, topicField.end, len));
+            }
+        }
+    }
+
+    shardedBroker::shardedBroker(int n)
+    {
+        if (n <= 0)
+        {
+            n = std::thread::hardware_concurrency();
+        }
+        count = n < 1 ? 1 : n > maxShards ? maxShards : n;
+        tcpPort = 0;
+        running = false;
+        ringMemory = new char[count * count * shardRingSize];
+        for (int i = 0; i < count; i++)
+        {
+            shards[i] = new brokerShard(this, i);
+        }
+        for (int to = 0; to < count; to++)
+        {
+            for (int from = 0; from < count; from++)
+            {
+                if (from != to)
+                {
+                    char *where = ringMemory + (to * count + from) * (long)shardRingSize;
+                    shards[to]->inbox[from] = new spscRing(where, shardRingSize);
+                }
+            }
+        }
+    }
+
+    shardedBroker::~shardedBroker()
+    {
+        stop();
+        for (int i = 0; i < count; i++)
+        {
+            delete shards[i];
+        }
+        delete[] ringMemory;
+    }
+
+    bool shardedBroker::listenTCP(int port)
+    {
+        bool fail = shards[0]->broker->listenTCP(port);
+        tcpPort = shards[0]->broker->tcpPort;
+        return fail;
+    }
+
+    bool shardedBroker::listenUnix(const char *path)
+    {
+        return shards[0]->broker->listenUnix(path);
+    }
+
+    void shardedBroker::start()
+    {
+        if (running)
+        {
+            return;
+        }
+        running = true;
+        for (int i = 0; i < count; i++)
+        {
+            miniBroker *b = shards[i]->broker;
+            b->stopping = false;
+            threads[i] = std::thread([b]() { b->run(); });
+        }
+    }
+
+    void shardedBroker::stop()
+    {
+        if (!running)
+        {
+            return;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            shards[i]->broker->stop();
+            shards[i]->wake();
+        }
+        for (int i = 0; i < count; i++)
+        {
+            threads[i].join();
+        }
+        running = false;
+    }
+
+    brokerStats shardedBroker::totals()
+    {
+        brokerStats sum;
+        memset(&sum, 0, sizeof(sum));
+        for (int i = 0; i < count; i++)
+        {
+            brokerStats &s = shards[i]->broker->stats;
+            sum.connects += s.connects;
+            sum.disconnects += s.disconnects;
+            sum.packetsIn += s.packetsIn;
+            sum.publishesIn += s.publishesIn;
+            sum.publishesOut += s.publishesOut;
+            sum.bytesIn += s.bytesIn;
+            sum.bytesOut += s.bytesOut;
+            sum.queued += s.queued;
+            sum.dropped += s.dropped + shards[i]->dropped;
+            sum.bad += s.bad;
+        }
+        return sum;
+    }
+
+} // namespace knotfree
+
+#endif
@@ -0,0 +1,102 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "miniBroker.h"
+#include "spscRing.h"
+
+#if defined(__linux__)
+
+#include <thread>
+
+namespace knotfree
+{
+    // shardedBroker runs a miniBroker on each of several threads, one per core, so a broker
+    // isn't stuck on one core. Each shard has its own loop, connections, buffers, sessions and
+    // parsing so the shards share nothing and take no locks.
+    // Shard 0 listens and deals the new connections out in turn. A publish is delivered in the
+    // shard it came in on and handed to every other shard through an spscRing, one ring for
+    // each pair, and an eventfd wakes the shard if it was idle. Every shard keeps the retained ones.
+    // Sessions live in the shard the connection landed on, so one that reconnects to another
+    // shard starts over. A publish that doesn't fit in a ring is dropped and counted.
+
+    const int maxShards = 16;
+    const int shardRingSize = 256 * 1024; // for each pair of shards, a power of 2.
+
+    struct shardedBroker;
+
+    struct brokerShard : ioHandler, brokerForwarder
+    {
+        int index;
+        shardedBroker *owner;
+        epollLoop loop;
+        miniBroker *broker;
+        spscRing *inbox[maxShards]; // from each of the others. inbox[index] is 0.
+        int wakeFd;                 // an eventfd
+        unsigned long long handedOff; // connections given to us
+        unsigned long long dropped;   // publishes that didn't fit in a ring
+
+        brokerShard(shardedBroker *owner, int index);
+        ~brokerShard();
+        void wake();
+
+        void onAccept(int listenFd, int fd) override;
+        void onData(socketConn &c) override;
+        void onDrained(socketConn &c) override;
+        void onClose(socketConn &c) override;
+        void forward(char qos, bool retain, slice topicField, slice rest) override;
+
+    private:
+        socketConn waker;
+        char wakeIn[64];
+        char wakeOut[8];
+        char record[brokerInSize + 16];
+        int nextShard; // for dealing out connections
+        void readInbox();
+        void push(int to, slice a, slice b, slice c);
+    };
+
+    struct shardedBroker
+    {
+        int count;
+        brokerShard *shards[maxShards];
+        int tcpPort;
+
+        // count is how many threads. 0 is one for each core, up to maxShards.
+        shardedBroker(int count = 0);
+        ~shardedBroker();
+
+        // listenTCP and listenUnix are like miniBroker's. They go on shard 0.
+        bool listenTCP(int port);
+        bool listenUnix(const char *path);
+
+        // start runs every shard on its own thread.
+        void start();
+        // stop stops them and waits for them.
+        void stop();
+
+        // totals adds up the shards' stats. While they run it's only roughly right.
+        brokerStats totals();
+
+    private:
+        std::thread threads[maxShards];
+        bool running;
+        char *ringMemory;
+    };
+
+} // namespace knotfree
+
+#endif
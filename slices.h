@@ -240,6 +240,24 @@ namespace knotfree
             return true;
         }
 
+        // return true if this slice has the same bytes as the other.
+        bool equals(slice other)
+        {
+            int len = size();
+            if (len != other.size())
+            {
+                return false;
+            }
+            for (int i = 0; i < len; i++)
+            {
+                if (base[start + i] != other.base[other.start + i])
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
         // for debugging.
         // Copy out the slice into the buffer.
         char *getCstr(char *buffer, int max); // in the cpp
@@ -334,22 +352,23 @@ namespace knotfree
             return write(slice(s));
         };
 
+        // writeFixedLenStr writes a 2 byte length big endian and then the string bytes.
+        // If they don't all fit it writes nothing and fails.
         bool writeFixedLenStr(slice s)
         {
             bool fail = false;
             int len = s.size();
-            if (len + 2 > end)
+            if (len + 2 > size() || base == 0)
             {
                 fail = true;
                 return fail;
             }
-            writeByte(len >> 8);
-            writeByte(len);
+            base[start++] = len >> 8;
+            base[start++] = len;
             for (int i = 0; i < len; i++)
             {
-                writeByte(s.base[s.start + i]);
+                base[start++] = s.base[s.start + i];
             }
-            end += len;
             return fail;
         }
 
@@ -414,6 +433,19 @@ namespace knotfree
         {
             return true;
         }
+        // read fills dest from its start with what there is and advances start.
+        // Returns how many bytes. Founts with a buffer or a file behind them
+        // should override this and copy a block at once.
+        virtual int read(sink &dest)
+        {
+            int amt = 0;
+            while (dest.empty() == false && empty() == false)
+            {
+                dest.writeByte(readByte());
+                amt++;
+            }
+            return amt;
+        }
         int getBigEndianVarLenInt()
         {
             int val = 0;
@@ -459,7 +491,8 @@ namespace knotfree
         virtual bool writeByte(char c) = 0;
 
         // write the bytes of s down the drain.
-        bool write(slice s)
+        // Drains with a buffer should override this and copy the whole slice at once.
+        virtual bool write(slice s)
         {
             if (s.empty())
             {
@@ -486,20 +519,8 @@ namespace knotfree
         }
 
         bool write(sink s)
-        { // is this tested?
-            if (s.empty())
-            {
-                return false;
-            }
-            for (int i = 0; i < s.size(); i++)
-            {
-                bool fail = writeByte(s.base[s.start + i]);
-                if (fail)
-                {
-                    return fail;
-                }
-            }
-            return false;
+        { // the bytes from start to end
+            return write(slice(s.base, s.start, s.end));
         }
 
         // writeFixedLenStr writes a 2 byte length big endian
@@ -543,6 +564,21 @@ namespace knotfree
         {
             return src.empty();
         }
+        int read(sink &dest) override
+        {
+            int amt = src.size();
+            if (amt > dest.size())
+            {
+                amt = dest.size();
+            }
+            for (int i = 0; i < amt; i++)
+            {
+                dest.base[dest.start + i] = src.base[src.start + i];
+            }
+            dest.start += amt;
+            src.start += amt;
+            return amt;
+        }
     };
 
     // a drain that is a sink.
@@ -554,6 +590,25 @@ namespace knotfree
         {
             return dest.writeByte(c);
         };
+        using drain::write;
+        bool write(slice s) override
+        {
+            bool fail = false;
+            int amt = s.size();
+            if (amt > dest.size())
+            {
+                amt = dest.size(); // as much as fits, like writeByte would.
+                fail = true;
+            }
+            char *dP = dest.base + dest.start;
+            const char *sP = s.base + s.start;
+            for (int i = 0; i < amt; i++)
+            {
+                dP[i] = sP[i];
+            }
+            dest.start += amt;
+            return fail;
+        }
     };
 
     // sliceResult is for when we want to return slice,char
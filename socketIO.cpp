@@ -0,0 +1,708 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "socketIO.h"
+#include "trace.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(MQTT5NANO_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+namespace knotfree
+{
+    int socketFount::fill()
+    {
+        if (start == end)
+        {
+            start = 0;
+            end = 0;
+        }
+        else if (end == size)
+        {
+            compact();
+        }
+        if (end == size)
+        {
+            return 0;
+        }
+        int n = ::read(fd, buffer + end, size - end);
+        if (n > 0)
+        {
+            end += n;
+            MQTT5NANO_TRACE_MARK(traceRecv, n, fd);
+            return n;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return 0;
+        }
+        return -1;
+    }
+
+    void socketFount::compact()
+    {
+        if (start == 0)
+        {
+            return;
+        }
+        memmove(buffer, buffer + start, end - start);
+        end -= start;
+        start = 0;
+    }
+
+    bool socketDrain::makeRoom(int amt)
+    {
+        bool fail = false;
+        if (size - len >= amt)
+        {
+            return fail;
+        }
+        if (flush() || size - len < amt)
+        {
+            fail = true;
+        }
+        return fail;
+    }
+
+    bool socketDrain::writeByte(char c)
+    {
+        bool fail = false;
+        if (makeRoom(1))
+        {
+            fail = true;
+            return fail;
+        }
+        buffer[len++] = c;
+        if (loop && !owner->queued)
+        {
+            loop->queue(owner);
+        }
+        return fail;
+    }
+
+    bool socketDrain::write(slice s)
+    {
+        bool fail = false;
+        int amt = s.size();
+        if (amt <= 0)
+        {
+            return fail;
+        }
+        if (makeRoom(amt))
+        {
+            fail = true;
+            return fail;
+        }
+        memcpy(buffer + len, s.base + s.start, amt);
+        len += amt;
+        MQTT5NANO_TRACE_MARK(traceWrite, amt, fd);
+        if (loop && !owner->queued)
+        {
+            loop->queue(owner);
+        }
+        return fail;
+    }
+
+    bool socketDrain::flush()
+    {
+        bool fail = false;
+        if (inFlight)
+        {
+            return fail; // the kernel has the front of the buffer. Wait for it.
+        }
+        int done = 0;
+        while (done < len)
+        {
+            int n = send(fd, buffer + done, len - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0)
+            {
+                done += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN)
+            {
+                break;
+            }
+            fail = true;
+            break;
+        }
+        sent(done);
+        return fail;
+    }
+
+    void socketDrain::sent(int amt)
+    {
+        totalSent += amt;
+        MQTT5NANO_TRACE_MARK(traceSend, amt, fd);
+        if (amt >= len)
+        {
+            len = 0;
+            return;
+        }
+        memmove(buffer, buffer + amt, len - amt);
+        len -= amt;
+    }
+
+    void ioLoop::queue(socketConn *c)
+    {
+        if (c->queued || c->closing)
+        {
+            return;
+        }
+        c->queued = true;
+        c->next = flushList;
+        flushList = c;
+    }
+
+    // epoll data for a listener is the fd shifted with the low bit set.
+    // For a connection it's the pointer, which is even.
+
+    epollLoop::epollLoop()
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    epollLoop::~epollLoop()
+    {
+        ::close(epfd);
+    }
+
+    bool epollLoop::listen(int fd)
+    {
+        bool fail = false;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = ((unsigned long long)fd << 1) | 1;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            fail = true;
+        }
+        return fail;
+    }
+
+    bool epollLoop::add(socketConn *c)
+    {
+        bool fail = false;
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        c->out.loop = this;
+        c->out.owner = c;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        {
+            fail = true;
+        }
+        return fail;
+    }
+
+    void epollLoop::remove(socketConn *c)
+    {
+        if (c->closing)
+        {
+            return;
+        }
+        c->closing = true;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, 0);
+        ::close(c->fd);
+        c->nextClosed = closeList;
+        closeList = c;
+    }
+
+    void epollLoop::readable(socketConn *c)
+    {
+        while (!c->closing)
+        {
+            int n = c->in.fill();
+            if (n < 0)
+            {
+                remove(c);
+                return;
+            }
+            if (n == 0)
+            {
+                return;
+            }
+            handler->onData(*c);
+        }
+    }
+
+    void epollLoop::flushAll()
+    {
+        while (flushList)
+        {
+            socketConn *c = flushList;
+            flushList = c->next;
+            c->queued = false;
+            if (c->closing)
+            {
+                continue;
+            }
+            if (c->out.flush())
+            {
+                remove(c);
+                continue;
+            }
+            if (c->out.len == 0)
+            {
+                handler->onDrained(*c); // it might write more and be queued again.
+            }
+            bool want = c->out.len > 0;
+            if (want != c->watchingOut && !c->closing)
+            {
+                struct epoll_event ev;
+                ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->watchingOut = want;
+            }
+        }
+    }
+
+    void epollLoop::closeAll()
+    {
+        while (closeList)
+        {
+            socketConn *c = closeList;
+            closeList = c->nextClosed;
+            handler->onClose(*c);
+        }
+    }
+
+    bool epollLoop::poll(int timeoutMs)
+    {
+        bool fail = false;
+        flushAll();
+        struct epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, flushList || closeList ? 0 : timeoutMs);
+        if (n < 0 && errno != EINTR)
+        {
+            fail = true;
+            return fail;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            unsigned long long tag = events[i].data.u64;
+            if (tag & 1)
+            {
+                int listenFd = int(tag >> 1);
+                int fd;
+                while ((fd = accept4(listenFd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    handler->onAccept(listenFd, fd);
+                }
+                continue;
+            }
+            socketConn *c = (socketConn *)events[i].data.ptr;
+            if (c->closing)
+            {
+                continue; // removed earlier in this batch
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                readable(c);
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                queue(c);
+            }
+        }
+        flushAll();
+        closeAll();
+        return fail;
+    }
+
+#if defined(MQTT5NANO_IO_URING)
+
+    // the low 2 bits of user_data say what finished.
+    const unsigned long long uringRead = 0;
+    const unsigned long long uringWrite = 1;
+    const unsigned long long uringAccept = 2;
+    const unsigned long long uringTimeout = 3;
+
+    static int uringEnter(int fd, unsigned submit, unsigned wait, unsigned flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, 0, 0);
+    }
+
+    uringLoop::uringLoop()
+    {
+        ringFd = -1;
+        sqRing = 0;
+        cqRing = 0;
+        sqes = 0;
+        toSubmit = 0;
+        arena = 0;
+        arenaSize = 0;
+        outstanding = 0;
+    }
+
+    uringLoop::~uringLoop()
+    {
+        if (ringFd < 0)
+        {
+            return;
+        }
+        munmap(sqes, (sqMask + 1) * sizeof(struct io_uring_sqe));
+        if (cqRing != sqRing)
+        {
+            munmap(cqRing, cqRingSize);
+        }
+        munmap(sqRing, sqRingSize);
+        ::close(ringFd);
+    }
+
+    bool uringLoop::setup(int entries, char *arenaBuffer, int size)
+    {
+        bool fail = false;
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ringFd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (ringFd < 0)
+        {
+            fail = true;
+            return fail;
+        }
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single && cqRingSize > sqRingSize)
+        {
+            sqRingSize = cqRingSize;
+        }
+        sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing : mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            ::close(ringFd);
+            ringFd = -1;
+            fail = true;
+            return fail;
+        }
+        char *sq = (char *)sqRing;
+        sqHead = (unsigned *)(sq + p.sq_off.head);
+        sqTail = (unsigned *)(sq + p.sq_off.tail);
+        sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + p.sq_off.array);
+        char *cq = (char *)cqRing;
+        cqHead = (unsigned *)(cq + p.cq_off.head);
+        cqTail = (unsigned *)(cq + p.cq_off.tail);
+        cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+        cqes = cq + p.cq_off.cqes;
+
+        if (arenaBuffer)
+        {
+            struct iovec iov;
+            iov.iov_base = arenaBuffer;
+            iov.iov_len = size;
+            if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, &iov, 1) == 0)
+            {
+                arena = arenaBuffer;
+                arenaSize = size;
+            }
+            // else the plain ops still work.
+        }
+        return fail;
+    }
+
+    void *uringLoop::getSqe()
+    {
+        unsigned tail = *sqTail;
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (tail - head > sqMask)
+        {
+            // full. Give the kernel what we have and carry on.
+            uringEnter(ringFd, toSubmit, 0, 0);
+            toSubmit = 0;
+            head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (tail - head > sqMask)
+            {
+                return 0;
+            }
+        }
+        unsigned i = tail & sqMask;
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes + i;
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[i] = i;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        toSubmit++;
+        return sqe;
+    }
+
+    void uringLoop::prepRead(socketConn *c)
+    {
+        if (c->reading || c->closing)
+        {
+            return;
+        }
+        c->in.compact();
+        if (c->in.start == c->in.end)
+        {
+            c->in.start = c->in.end = 0;
+        }
+        int room = c->in.size - c->in.end;
+        if (room == 0)
+        {
+            return;
+        }
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)getSqe();
+        if (sqe == 0)
+        {
+            return;
+        }
+        char *where = c->in.buffer + c->in.end;
+        bool fixed = arena && where >= arena && where + room <= arena + arenaSize;
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+        sqe->fd = c->fd;
+        sqe->addr = (unsigned long long)where;
+        sqe->len = room;
+        sqe->buf_index = 0;
+        sqe->user_data = (unsigned long long)c | uringRead;
+        c->reading = true;
+        outstanding++;
+    }
+
+    void uringLoop::prepWrite(socketConn *c)
+    {
+        if (c->out.inFlight || c->out.len == 0 || c->closing)
+        {
+            return;
+        }
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)getSqe();
+        if (sqe == 0)
+        {
+            queue(c); // next time
+            return;
+        }
+        char *from = c->out.buffer;
+        int amt = c->out.len;
+        bool fixed = arena && from >= arena && from + amt <= arena + arenaSize;
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (unsigned long long)from;
+        sqe->len = amt;
+        sqe->msg_flags = fixed ? 0 : MSG_NOSIGNAL;
+        sqe->buf_index = 0;
+        sqe->user_data = (unsigned long long)c | uringWrite;
+        c->out.inFlight = amt;
+        outstanding++;
+    }
+
+    void uringLoop::prepAccept(int fd)
+    {
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)getSqe();
+        if (sqe == 0)
+        {
+            return;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = ((unsigned long long)fd << 2) | uringAccept;
+    }
+
+    // io_uring gives back EAGAIN on a non blocking socket rather than waiting for it
+    // so the sockets are made blocking. Our own sends use MSG_DONTWAIT.
+
+    bool uringLoop::listen(int fd)
+    {
+        bool fail = false;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        prepAccept(fd);
+        return fail;
+    }
+
+    bool uringLoop::add(socketConn *c)
+    {
+        bool fail = false;
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+        c->out.loop = this;
+        c->out.owner = c;
+        prepRead(c);
+        return fail;
+    }
+
+    void uringLoop::remove(socketConn *c)
+    {
+        if (c->closing)
+        {
+            return;
+        }
+        c->closing = true;
+        shutdown(c->fd, SHUT_RDWR); // so the read that's out comes back.
+        finish(c);
+    }
+
+    // finish puts a closing connection on the close list when the kernel is done with it.
+    void uringLoop::finish(socketConn *c)
+    {
+        if (c->closing && !c->reading && c->out.inFlight == 0)
+        {
+            c->nextClosed = closeList;
+            closeList = c;
+        }
+    }
+
+    bool uringLoop::poll(int timeoutMs)
+    {
+        bool fail = false;
+        while (flushList)
+        {
+            socketConn *c = flushList;
+            flushList = c->next;
+            c->queued = false;
+            prepWrite(c);
+        }
+        bool ready = *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned wait = 0;
+        if (!ready && timeoutMs > 0)
+        {
+            struct io_uring_sqe *sqe = (struct io_uring_sqe *)getSqe();
+            if (sqe)
+            {
+                timeout.sec = timeoutMs / 1000;
+                timeout.nsec = (timeoutMs % 1000) * 1000000LL;
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->addr = (unsigned long long)&timeout;
+                sqe->len = 1;
+                sqe->off = 1; // or when anything else finishes.
+                sqe->user_data = uringTimeout;
+                wait = 1;
+            }
+        }
+        // everything queued since the last poll goes in with the wait.
+        int r = uringEnter(ringFd, toSubmit, wait, IORING_ENTER_GETEVENTS);
+        if (r < 0 && errno != EINTR)
+        {
+            fail = true;
+            return fail;
+        }
+        if (r > 0)
+        {
+            toSubmit -= r < (int)toSubmit ? r : toSubmit;
+        }
+
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)cqes + (head & cqMask);
+            unsigned long long ud = cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+            unsigned long long kind = ud & 3;
+            if (kind == uringTimeout)
+            {
+                continue;
+            }
+            if (kind == uringAccept)
+            {
+                int listenFd = int(ud >> 2);
+                if (res >= 0)
+                {
+                    handler->onAccept(listenFd, res);
+                }
+                if (res != -EBADF && res != -EINVAL)
+                {
+                    prepAccept(listenFd);
+                }
+                continue;
+            }
+            socketConn *c = (socketConn *)(ud & ~3ULL);
+            outstanding--;
+            // a remove below does its own finish. Only one may put c on the close list.
+            bool wasClosing = c->closing;
+            if (kind == uringRead)
+            {
+                c->reading = false;
+                if (res > 0 && !c->closing)
+                {
+                    c->in.end += res;
+                    MQTT5NANO_TRACE_MARK(traceRecv, res, c->fd);
+                    handler->onData(*c);
+                    prepRead(c);
+                }
+                else if (res == -EAGAIN || res == -EINTR)
+                {
+                    prepRead(c);
+                }
+                else
+                {
+                    remove(c);
+                }
+                if (wasClosing)
+                {
+                    finish(c);
+                }
+                continue;
+            }
+            // a write
+            c->out.inFlight = 0;
+            if (res < 0 && res != -EAGAIN && res != -EINTR)
+            {
+                remove(c);
+            }
+            else if (!c->closing)
+            {
+                c->out.sent(res > 0 ? res : 0);
+                if (c->out.len == 0)
+                {
+                    handler->onDrained(*c);
+                }
+                if (c->out.len)
+                {
+                    queue(c);
+                }
+            }
+            if (wasClosing)
+            {
+                finish(c);
+            }
+        }
+        while (closeList)
+        {
+            socketConn *c = closeList;
+            closeList = c->nextClosed;
+            ::close(c->fd);
+            handler->onClose(*c);
+        }
+        return fail;
+    }
+
+#endif
+
+} // namespace knotfree
+
+#endif
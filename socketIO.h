@@ -0,0 +1,295 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "slices.h"
+
+#if defined(__linux__)
+
+namespace knotfree
+{
+    struct ioLoop;
+    struct socketConn;
+
+    // socketFount is the reading end of a non blocking socket.
+    // The bytes are read into a buffer the caller owns. Parse them in place with
+    // buffered() and then consume() what was used, or read them a byte at a time.
+    struct socketFount : fount
+    {
+        char *buffer;
+        int size;
+        int start; // the next unread byte
+        int end;   // the end of what was read
+        int fd;
+
+        socketFount(char *buffer, int size) : buffer(buffer), size(size)
+        {
+            start = 0;
+            end = 0;
+            fd = -1;
+        }
+
+        unsigned char readByte() override
+        {
+            return start < end ? buffer[start++] : 0;
+        }
+        bool empty() override
+        {
+            return start >= end;
+        }
+
+        // fill reads what the socket has into the free space.
+        // Returns how many bytes, 0 if there's nothing or no room, and -1 if the socket is closed or broken.
+        int fill();
+
+        slice buffered()
+        {
+            return slice(buffer, start, end);
+        }
+        void consume(int amt)
+        {
+            start += amt;
+        }
+        // compact moves the unread bytes to the front.
+        void compact();
+        // room is how much can be read before the buffer is full.
+        int room()
+        {
+            return size - end + start;
+        }
+    };
+
+    // socketDrain is the writing end of a non blocking socket.
+    // Writes go into a buffer the caller owns and the loop sends them, all of them
+    // for a connection in one syscall, after the handlers have run.
+    // Without a loop call flush() to send.
+    // A write that doesn't fit tries a flush first and then fails.
+    struct socketDrain : drain
+    {
+        char *buffer;
+        int size;
+        int len;      // what's waiting to go
+        int inFlight; // the front part that the kernel has. io_uring only.
+        unsigned long long totalSent;
+        int fd;
+        ioLoop *loop;
+        socketConn *owner;
+
+        socketDrain(char *buffer, int size) : buffer(buffer), size(size)
+        {
+            len = 0;
+            inFlight = 0;
+            totalSent = 0;
+            fd = -1;
+            loop = 0;
+            owner = 0;
+        }
+
+        using drain::write;
+        bool writeByte(char c) override;
+        bool write(slice s) override;
+
+        // flush sends what it can right now. Returns true if the socket is broken.
+        bool flush();
+        // sent is called when amt bytes from the front are gone.
+        void sent(int amt);
+
+        int pending()
+        {
+            return len;
+        }
+        int room()
+        {
+            return size - len;
+        }
+
+    private:
+        bool makeRoom(int amt);
+    };
+
+    // socketConn is one connection. The caller owns it and the buffers.
+    // Give it to a loop with add and don't free it until the loop's handler gets onClose.
+    struct socketConn
+    {
+        int fd;
+        socketFount in;
+        socketDrain out;
+        void *user; // for the handler
+
+        // for the loops
+        bool closing;
+        bool queued;     // on the flush list
+        bool reading;    // io_uring has a read out
+        bool watchingOut; // epoll is waiting for room to write
+        socketConn *next;       // on the flush list
+        socketConn *nextClosed; // on the close list
+
+        socketConn(char *inBuffer, int inSize, char *outBuffer, int outSize)
+            : in(inBuffer, inSize), out(outBuffer, outSize)
+        {
+            fd = -1;
+            user = 0;
+            closing = false;
+            queued = false;
+            reading = false;
+            watchingOut = false;
+            next = 0;
+            nextClosed = 0;
+        }
+        // setFd is for before add.
+        void setFd(int f)
+        {
+            fd = f;
+            in.fd = f;
+            out.fd = f;
+            in.start = in.end = 0;
+            out.len = out.inFlight = 0;
+            closing = false;
+            queued = false;
+            reading = false;
+            watchingOut = false;
+        }
+    };
+
+    // ioHandler is what a loop calls.
+    struct ioHandler
+    {
+        virtual ~ioHandler()
+        {
+        }
+        // onAccept is a new connection on a listening socket. The handler should add it or close it.
+        virtual void onAccept(int listenFd, int fd)
+        {
+        }
+        // onData is when there are new bytes in c.in.
+        virtual void onData(socketConn &c) = 0;
+        // onDrained is when everything in c.out has been sent.
+        virtual void onDrained(socketConn &c)
+        {
+        }
+        // onClose is when the connection is closed and the loop is done with it.
+        virtual void onClose(socketConn &c)
+        {
+        }
+    };
+
+    // ioLoop drives many connections from one thread.
+    // All return true if failed.
+    struct ioLoop
+    {
+        ioHandler *handler;
+
+        ioLoop()
+        {
+            handler = 0;
+            flushList = 0;
+            closeList = 0;
+        }
+        virtual ~ioLoop()
+        {
+        }
+        // listen takes a socket that is bound and listening.
+        virtual bool listen(int fd) = 0;
+        virtual bool add(socketConn *c) = 0;
+        // remove closes the connection. onClose comes later from poll.
+        virtual void remove(socketConn *c) = 0;
+        // poll sends what was written, waits up to timeoutMs for events, runs the handlers and sends what they wrote.
+        // A handler must consume from c.in or close c. A full buffer that isn't read stalls the connection.
+        virtual bool poll(int timeoutMs) = 0;
+        // queue puts c on the list to flush at the end of poll.
+        void queue(socketConn *c);
+
+    protected:
+        socketConn *flushList;
+        socketConn *closeList;
+    };
+
+    // epollLoop is an ioLoop with epoll and plain send and recv.
+    struct epollLoop : ioLoop
+    {
+        int epfd;
+
+        epollLoop();
+        ~epollLoop();
+        bool listen(int fd) override;
+        bool add(socketConn *c) override;
+        void remove(socketConn *c) override;
+        bool poll(int timeoutMs) override;
+
+    private:
+        void readable(socketConn *c);
+        void flushAll();
+        void closeAll();
+    };
+
+#if defined(MQTT5NANO_IO_URING)
+
+    // uringLoop is an ioLoop on io_uring, with the raw syscalls so there's nothing to link.
+    // Every read, write and accept is queued and they all go to the kernel together with
+    // the wait in one io_uring_enter per poll.
+    // If arena is given it's registered and the reads and writes into buffers
+    // that are inside it use the fixed buffer ops, which saves mapping the pages every time.
+    // Build with -DMQTT5NANO_IO_URING. The kernel needs to be 5.6 or newer.
+    struct uringLoop : ioLoop
+    {
+        int ringFd;
+
+        uringLoop();
+        ~uringLoop();
+        // setup makes the ring with room for entries submissions.
+        bool setup(int entries, char *arena, int arenaSize);
+        bool listen(int fd) override;
+        bool add(socketConn *c) override;
+        void remove(socketConn *c) override;
+        bool poll(int timeoutMs) override;
+
+    private:
+        unsigned *sqHead;
+        unsigned *sqTail;
+        unsigned sqMask;
+        unsigned *sqArray;
+        unsigned *cqHead;
+        unsigned *cqTail;
+        unsigned cqMask;
+        void *sqes;
+        void *cqes;
+        void *sqRing;
+        int sqRingSize;
+        void *cqRing;
+        int cqRingSize;
+        int sqeSize;
+        unsigned toSubmit;
+        char *arena;
+        int arenaSize;
+        int outstanding; // ops the kernel has
+        struct
+        {
+            long long sec;
+            long long nsec;
+        } timeout;
+
+        void *getSqe();
+        void prepRead(socketConn *c);
+        void prepWrite(socketConn *c);
+        void prepAccept(int fd);
+        void finish(socketConn *c);
+    };
+
+#endif
+
+} // namespace knotfree
+
+#endif
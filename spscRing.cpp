@@ -0,0 +1,99 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "spscRing.h"
+
+#ifndef ARDUINO
+
+#include <string.h>
+
+namespace knotfree
+{
+    spscRing::spscRing(char *buffer, int size) : buffer(buffer), size(size), mask(size - 1)
+    {
+        head.store(0);
+        tail.store(0);
+        lastPush = 0;
+    }
+
+    void spscRing::copyIn(unsigned at, slice s)
+    {
+        int len = s.size();
+        if (len <= 0)
+        {
+            return;
+        }
+        unsigned pos = at & mask;
+        int first = size - pos < unsigned(len) ? size - pos : len;
+        memcpy(buffer + pos, s.base + s.start, first);
+        memcpy(buffer, s.base + s.start + first, len - first);
+    }
+
+    void spscRing::copyOut(unsigned at, char *dest, int len)
+    {
+        unsigned pos = at & mask;
+        int first = size - pos < unsigned(len) ? size - pos : len;
+        memcpy(dest, buffer + pos, first);
+        memcpy(dest + first, buffer, len - first);
+    }
+
+    bool spscRing::push(slice a, slice b, slice c)
+    {
+        bool fail = false;
+        int len = a.size() + b.size() + c.size();
+        unsigned t = tail.load(std::memory_order_relaxed);
+        unsigned h = head.load(std::memory_order_acquire);
+        if (len > 0xFFFF || size - (t - h) < unsigned(len + 2))
+        {
+            fail = true;
+            return fail;
+        }
+        char lenBytes[2] = {char(len >> 8), char(len)};
+        copyIn(t, slice(lenBytes, 0, 2));
+        copyIn(t + 2, a);
+        copyIn(t + 2 + a.size(), b);
+        copyIn(t + 2 + a.size() + b.size(), c);
+        lastPush = t;
+        // seq_cst so that either idle sees the consumer caught up or the consumer sees this.
+        tail.store(t + 2 + len, std::memory_order_seq_cst);
+        return fail;
+    }
+
+    bool spscRing::idle()
+    {
+        return head.load(std::memory_order_seq_cst) == lastPush;
+    }
+
+    int spscRing::pop(char *dest, int max)
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_seq_cst))
+        {
+            return -1;
+        }
+        unsigned char lenBytes[2];
+        copyOut(h, (char *)lenBytes, 2);
+        int len = (lenBytes[0] << 8) | lenBytes[1];
+        if (len <= max)
+        {
+            copyOut(h + 2, dest, len);
+        }
+        head.store(h + 2 + len, std::memory_order_seq_cst);
+        return len <= max ? len : 0;
+    }
+
+} // namespace knotfree
+
+#endif
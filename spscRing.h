@@ -0,0 +1,67 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "slices.h"
+
+#ifndef ARDUINO
+
+#include <atomic>
+
+namespace knotfree
+{
+    // spscRing passes variable length records from one thread to one other thread
+    // without a lock. The buffer is the caller's and the size must be a power of 2.
+    // Each record is a 2 byte length and then the bytes and it may wrap around the end.
+    // Only the producer calls push and idle. Only the consumer calls pop.
+    struct spscRing
+    {
+        char *buffer;
+        unsigned size;
+        unsigned mask;
+
+        spscRing(char *buffer, int size);
+
+        // push copies in one record made of up to three parts, so a header and a
+        // packet don't have to be put together first. Returns true if it didn't fit.
+        bool push(slice a, slice b = slice(), slice c = slice());
+
+        // idle is true when the consumer had read everything before the last push,
+        // so it might be asleep and need a wake up. Anything else it will get to on its own.
+        bool idle();
+
+        // pop copies the oldest record into dest and removes it.
+        // Returns the length, or -1 if there's nothing. A record bigger than max is skipped and returns 0.
+        int pop(char *dest, int max);
+
+        bool empty()
+        {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+    private:
+        // the two ends are on their own cache lines so the threads don't fight over them.
+        alignas(64) std::atomic<unsigned> head; // the consumer's next byte
+        alignas(64) std::atomic<unsigned> tail; // the producer's next byte
+        unsigned lastPush;                      // where the last record went. The producer's.
+
+        void copyIn(unsigned at, slice s);
+        void copyOut(unsigned at, char *dest, int len);
+    };
+
+} // namespace knotfree
+
+#endif
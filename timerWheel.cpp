@@ -0,0 +1,154 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "timerWheel.h"
+
+namespace knotfree
+{
+    static void unlinkTimer(timerLink &t)
+    {
+        t.prev->next = t.next;
+        t.next->prev = t.prev;
+        t.next = 0;
+        t.prev = 0;
+    }
+
+    static void pushBack(timerLink &head, timerLink &t)
+    {
+        t.prev = head.prev;
+        t.next = &head;
+        head.prev->next = &t;
+        head.prev = &t;
+    }
+
+    timerWheel::timerWheel(unsigned long start)
+    {
+        now = start;
+        count = 0;
+        for (int l = 0; l < timerLevels; l++)
+        {
+            for (int s = 0; s < timerSlots; s++)
+            {
+                slots[l][s].next = &slots[l][s];
+                slots[l][s].prev = &slots[l][s];
+            }
+        }
+    }
+
+    // place picks the slot by how far off it is. Past the top level it's put as far
+    // out as the top goes and placed again when that slot comes down.
+    void timerWheel::place(timer &t)
+    {
+        unsigned long delta = t.expires - now;
+        if (long(delta) < 0)
+        {
+            pushBack(slots[0][now & (timerSlots - 1)], t);
+            return;
+        }
+        int level = 0;
+        while (level < timerLevels - 1 && delta >= 1UL << ((level + 1) * timerLevelBits))
+        {
+            level++;
+        }
+        unsigned long at = t.expires;
+        unsigned long max = (1UL << (timerLevels * timerLevelBits)) - 1;
+        if (delta > max)
+        {
+            at = now + max;
+        }
+        pushBack(slots[level][(at >> (level * timerLevelBits)) & (timerSlots - 1)], t);
+    }
+
+    void timerWheel::add(timer &t, unsigned long expires)
+    {
+        if (t.pending())
+        {
+            unlinkTimer(t);
+            count--;
+        }
+        t.expires = expires;
+        place(t);
+        count++;
+    }
+
+    void timerWheel::cancel(timer &t)
+    {
+        if (t.pending())
+        {
+            unlinkTimer(t);
+            count--;
+        }
+    }
+
+    // cascade pours the slot of level that's now current down into the levels below.
+    void timerWheel::cascade(int level)
+    {
+        timerLink &head = slots[level][(now >> (level * timerLevelBits)) & (timerSlots - 1)];
+        while (head.next != &head)
+        {
+            timer &t = *(timer *)head.next;
+            unlinkTimer(t);
+            place(t);
+        }
+    }
+
+    int timerWheel::advance(unsigned long to)
+    {
+        int fired = 0;
+        while (long(to - now) >= 0)
+        {
+            if (count == 0)
+            {
+                now = to + 1; // nothing to run, so skip ahead.
+                break;
+            }
+            // when a level goes round pour the next one down, the highest first.
+            int level = 1;
+            while (level < timerLevels && ((now >> ((level - 1) * timerLevelBits)) & (timerSlots - 1)) == 0)
+            {
+                level++;
+            }
+            for (int l = level - 1; l >= 1; l--)
+            {
+                cascade(l);
+            }
+            // take the slot's list first so what the handlers add goes on the wheel and not here.
+            timerLink due;
+            timerLink &head = slots[0][now & (timerSlots - 1)];
+            due.next = &due;
+            due.prev = &due;
+            if (head.next != &head)
+            {
+                due.next = head.next;
+                due.prev = head.prev;
+                due.next->prev = &due;
+                due.prev->next = &due;
+                head.next = &head;
+                head.prev = &head;
+            }
+            now++;
+            while (due.next != &due)
+            {
+                timer &t = *(timer *)due.next;
+                unlinkTimer(t);
+                count--;
+                fired++;
+                t.handler->onTimer(t);
+            }
+        }
+        return fired;
+    }
+
+} // namespace knotfree
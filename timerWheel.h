@@ -0,0 +1,96 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+namespace knotfree
+{
+    // timerWheel runs timers for keep alives, retransmits, expiry and rpc timeouts.
+    // It's the hashed hierarchical wheel: 4 levels of 64 slots, each level 64 times coarser
+    // than the one below. Adding and cancelling a timer is O(1). When the finest level goes
+    // round, the next slot up is poured down into it, so each timer is moved at most 3 times.
+    // Time is whatever ticks the caller counts in, eg. millis() on Arduino or ms from
+    // clock_gettime on Linux. Wrapping is fine. There is no thread and nothing is allocated:
+    // the timers are the caller's, usually a member of what they time.
+    // 64 * 64 * 64 * 64 ticks is 4.6 hours of ms. A timer further out than that goes round
+    // the top level again and still fires on time.
+
+    struct timer;
+
+    // timerHandler is told when a timer is due. The timer is already off the wheel so it can be added again.
+    struct timerHandler
+    {
+        virtual ~timerHandler()
+        {
+        }
+        virtual void onTimer(timer &t) = 0;
+    };
+
+    struct timerLink
+    {
+        timerLink *next; // 0 when the timer isn't on the wheel
+        timerLink *prev;
+    };
+
+    struct timer : timerLink
+    {
+        unsigned long expires;
+        timerHandler *handler;
+        int id; // for the handler, eg. the index of what's being timed
+
+        timer()
+        {
+            next = 0;
+            prev = 0;
+            expires = 0;
+            handler = 0;
+            id = 0;
+        }
+        bool pending()
+        {
+            return next != 0;
+        }
+    };
+
+    const int timerLevelBits = 6;
+    const int timerSlots = 1 << timerLevelBits; // per level
+    const int timerLevels = 4;
+
+    struct timerWheel
+    {
+        unsigned long now; // the next tick to run
+        int count;         // timers on the wheel
+
+        timerWheel(unsigned long now);
+
+        // add puts t on the wheel to fire at expires. If it's on already it's moved.
+        // One that's due already fires on the next advance.
+        void add(timer &t, unsigned long expires);
+
+        // cancel takes t off the wheel. It's fine if it isn't on.
+        void cancel(timer &t);
+
+        // advance runs every timer that's due up to and including the tick now.
+        // Returns how many fired.
+        int advance(unsigned long now);
+
+    private:
+        timerLink slots[timerLevels][timerSlots];
+
+        void place(timer &t);
+        void cascade(int level);
+    };
+
+} // namespace knotfree
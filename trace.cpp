@@ -0,0 +1,138 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "trace.h"
+
+#if defined(MQTT5NANO_TRACE) && !defined(ARDUINO)
+
+#include <stdio.h>
+#include <unistd.h>
+
+namespace knotfree
+{
+    static std::atomic<traceRing *> traceList(0);
+    static std::atomic<int> traceThreads(0);
+
+    // the ticks and the time when the first ring was made. dump compares them with now
+    // to find how fast the ticks go.
+    static unsigned long long startTicks;
+    static unsigned long long startNs;
+
+    static unsigned long long monotonicNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    traceRing *addTraceRing()
+    {
+        int tid = traceThreads.fetch_add(1) + 1;
+        if (tid == 1)
+        {
+            startNs = monotonicNs();
+            startTicks = traceTicks();
+        }
+        traceRing *r = new traceRing;
+        r->head.store(0);
+        r->tid = tid;
+        r->next = traceList.load();
+        while (!traceList.compare_exchange_weak(r->next, r))
+        {
+        }
+        return r;
+    }
+
+    void resetTrace()
+    {
+        myTraceRing().head.store(0);
+    }
+
+    static const char *traceNames[traceEventCount] = {"recv", "frame", "parse", "dispatch", "write", "send"};
+
+    bool writeTraceJson(drain &out)
+    {
+        bool fail = false;
+        // let at least 10ms go by so the rate is good to a few parts in a million.
+        unsigned long long ns = monotonicNs();
+        while (ns - startNs < 10000000)
+        {
+            usleep(1000);
+            ns = monotonicNs();
+        }
+        double ticksPerUs = double(traceTicks() - startTicks) * 1000.0 / double(ns - startNs);
+
+        char tmp[256];
+        fail |= out.write(slice("{\"traceEvents\":["));
+        bool first = true;
+        for (traceRing *r = traceList.load(); r && !fail; r = r->next)
+        {
+            unsigned head = r->head.load(std::memory_order_acquire);
+            unsigned from = head > traceRingSize ? head - traceRingSize : 0;
+            for (unsigned h = from; h < head && !fail; h++)
+            {
+                traceRecord &t = r->records[h & (traceRingSize - 1)];
+                if (t.event >= traceEventCount)
+                {
+                    continue;
+                }
+                double us = double((long long)(t.ticks - startTicks)) / ticksPerUs;
+                snprintf(tmp, sizeof(tmp),
+                         "%s\n{\"name\":\"%s\",\"cat\":\"mqtt\",\"ph\":\"%c\",%s\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"n\":%u,\"fd\":%d}}",
+                         first ? "" : ",", traceNames[t.event], t.phase, t.phase == 'i' ? "\"s\":\"t\"," : "", us, r->tid,
+                         (unsigned)t.arg, t.fd);
+                fail |= out.write(slice(tmp));
+                first = false;
+            }
+        }
+        fail |= out.write(slice("\n]}\n"));
+        return fail;
+    }
+
+    // fileDrain writes to a FILE.
+    struct fileDrain : drain
+    {
+        FILE *f;
+
+        bool writeByte(char c) override
+        {
+            return fputc(c, f) == EOF;
+        }
+        using drain::write;
+        bool write(slice s) override
+        {
+            int amt = s.size();
+            return (int)fwrite(s.base + s.start, 1, amt, f) != amt;
+        }
+    };
+
+    bool dumpTrace(const char *path)
+    {
+        bool fail = false;
+        fileDrain out;
+        out.f = fopen(path, "w");
+        if (out.f == 0)
+        {
+            fail = true;
+            return fail;
+        }
+        fail |= writeTraceJson(out);
+        fail |= fclose(out.f) != 0;
+        return fail;
+    }
+
+} // namespace knotfree
+
+#endif
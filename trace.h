@@ -0,0 +1,144 @@
+// Copyright 2022 Alan Tracey Wootton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "slices.h"
+
+// Build with -DMQTT5NANO_TRACE to record a timeline of every packet: when the bytes came in,
+// when it was framed, parsed and dispatched, and when the answer was written and sent.
+// Each thread writes 16 byte records into its own ring with the cpu's tick counter.
+// A record is a few stores and no lock. Without the flag the MQTT5NANO_TRACE_ macros are empty.
+// dumpTrace writes the rings as Chrome trace json for chrome://tracing or ui.perfetto.dev.
+
+#if defined(MQTT5NANO_TRACE) && !defined(ARDUINO)
+
+#include <atomic>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace knotfree
+{
+    // the trace events.
+    enum traceEventID : unsigned char
+    {
+        traceRecv = 0,  // bytes arrived. arg is how many.
+        traceFrame,     // getPacket found a packet. arg is the first byte.
+        traceParse,     // mqttPacketPieces::parse. arg is the body length.
+        traceDispatch,  // process() running a command.
+        traceWrite,     // a write into a socketDrain. arg is how many bytes.
+        traceSend,      // the kernel took bytes from a socketDrain. arg is how many.
+        traceEventCount
+    };
+
+    // traceRecord is 16 bytes so four fit in a cache line.
+    struct traceRecord
+    {
+        unsigned long long ticks;
+        int fd;             // the connection, or -1
+        unsigned short arg; // it stops at 65535
+        unsigned char event;
+        char phase; // the Chrome phase: 'B' begin, 'E' end or 'i' instant
+    };
+
+    const int traceRingSize = 1 << 14; // records per thread. It's a power of two.
+
+    // traceRing is one thread's records. When it's full the oldest are written over.
+    struct traceRing
+    {
+        traceRecord records[traceRingSize];
+        std::atomic<unsigned> head; // records written ever. Only the owner writes it.
+        int tid;
+        traceRing *next;
+    };
+
+    traceRing *addTraceRing();
+
+    inline traceRing &myTraceRing()
+    {
+        thread_local traceRing *mine = 0;
+        if (mine == 0)
+        {
+            mine = addTraceRing();
+        }
+        return *mine;
+    }
+
+    inline unsigned long long traceTicks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#elif defined(__aarch64__)
+        unsigned long long t;
+        asm volatile("mrs %0, cntvct_el0" : "=r"(t));
+        return t;
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+    inline void traceEvent(unsigned char event, char phase, unsigned int arg, int fd)
+    {
+        traceRing &r = myTraceRing();
+        unsigned h = r.head.load(std::memory_order_relaxed);
+        traceRecord &t = r.records[h & (traceRingSize - 1)];
+        t.ticks = traceTicks();
+        t.fd = fd;
+        t.arg = arg > 65535 ? 65535 : arg;
+        t.event = event;
+        t.phase = phase;
+        r.head.store(h + 1, std::memory_order_release);
+    }
+
+    // traceScope is a begin record now and an end record when it goes.
+    struct traceScope
+    {
+        unsigned char event;
+        unsigned int arg;
+
+        traceScope(unsigned char event, unsigned int arg) : event(event), arg(arg)
+        {
+            traceEvent(event, 'B', arg, -1);
+        }
+        ~traceScope()
+        {
+            traceEvent(event, 'E', arg, -1);
+        }
+    };
+
+    // writeTraceJson writes every thread's ring as a Chrome trace. Call it when the threads are
+    // quiet, eg. after they've stopped. A record being written while it reads may come out torn.
+    bool writeTraceJson(drain &out);
+    // dumpTrace writes the json to a file. Returns true if failed.
+    bool dumpTrace(const char *path);
+    // resetTrace empties the calling thread's ring. It's for tests.
+    void resetTrace();
+
+} // namespace knotfree
+
+#define MQTT5NANO_TRACE_SCOPE(event, arg) knotfree::traceScope traceScope##event(knotfree::event, arg)
+#define MQTT5NANO_TRACE_MARK(event, arg, fd) knotfree::traceEvent(knotfree::event, 'i', arg, fd)
+
+#else
+
+#define MQTT5NANO_TRACE_SCOPE(event, arg)
+#define MQTT5NANO_TRACE_MARK(event, arg, fd)
+
+#endif